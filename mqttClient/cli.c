@@ -92,6 +92,20 @@ void printUint8InDecimal(uint8_t n)
     }
 }
 
+void printUint32InDecimal(uint32_t n)
+{
+    // Largest power of 10 that fits in 32 bits
+    uint32_t divider = 1000000000;
+    while(divider > 1 && n / divider == 0)
+        divider /= 10;
+
+    while(divider)
+    {
+        putcUart0(((n / divider) % 10) + '0');
+        divider /= 10;
+    }
+}
+
 void printUint8InHex(uint8_t n)
 {
     // Print 4 bits at a time
@@ -0,0 +1,428 @@
+/*
+ * dhcp.c
+ * Gets the IP address, subnet mask and gateway from a DHCP server and keeps the lease up to date
+ * The last lease is stored in the EEPROM, so after a reset the address is asked for again with a
+ * single REQUEST (INIT-REBOOT) instead of a full DISCOVER, OFFER, REQUEST, ACK exchange
+ *
+ *  Created on: Apr 20, 2021
+ *      Author: Sarker Nadir Afridi Azmi
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "eth0.h"
+#include "dhcp.h"
+#include "eeprom.h"
+#include "utils.h"
+#include "timer0.h"
+#include "udp.h"
+
+dhcpState dhcpCurrentState = DHCP_DISABLED;
+// The lease in use, or the offer or stored lease being requested
+dhcpLease lease;
+// Transaction ID, replies that do not carry it are ignored
+uint32_t xid = 0;
+// Retransmissions of the current message
+uint32_t retryTime = 0;
+uint32_t retryTimeout = DHCP_INITIAL_RETRY;
+uint8_t retries = 0;
+// T1, T2 and the end of the lease are counted from here
+uint32_t boundTime = 0;
+
+uint32_t dhcpGetUint32(uint8_t* field)
+{
+    return ((uint32_t)field[0] << 24) | ((uint32_t)field[1] << 16) | ((uint32_t)field[2] << 8) | field[3];
+}
+
+bool dhcpIsZeroIp(uint8_t ip[])
+{
+    return !(ip[0] || ip[1] || ip[2] || ip[3]);
+}
+
+// Every exchange gets its own ID, so replies meant for another board or an old exchange are not taken
+void dhcpNewXid()
+{
+    uint8_t mac[6];
+    etherGetMacAddress(mac);
+    xid = (xid * 1103515245 + 12345) ^ getMilliseconds() ^ ((uint32_t)mac[4] << 8) ^ mac[5];
+}
+
+// Sets when the message is sent again, randomized by up to a second either way (RFC 2131 4.1)
+void dhcpStartRetry(uint32_t timeout)
+{
+    retryTime = getMilliseconds() + timeout - 1000 + (xid ^ getMilliseconds()) % 2001;
+}
+
+// Doubles the timeout for the next retransmission
+void dhcpBackOff()
+{
+    retryTimeout = (retryTimeout << 1 > DHCP_MAX_RETRY) ? DHCP_MAX_RETRY : retryTimeout << 1;
+}
+
+// While renewing or rebinding, half of what is left until deadline is waited, but at least a minute
+void dhcpStartRenewRetry(uint32_t deadline)
+{
+    uint32_t timeout = (deadline - getMilliseconds()) / 2;
+    retryTime = getMilliseconds() + ((timeout < DHCP_MIN_RENEW_RETRY) ? DHCP_MIN_RENEW_RETRY : timeout);
+}
+
+bool dhcpIsTime(uint32_t time)
+{
+    return (int32_t)(getMilliseconds() - time) >= 0;
+}
+
+uint8_t* dhcpAddIpOption(uint8_t* option, uint8_t code, uint8_t ip[])
+{
+    *(option++) = code;
+    *(option++) = 4;
+    copyUint8Array(ip, option, 4);
+    return option + 4;
+}
+
+// Builds a message in ether and sends it
+// It is broadcast from 0.0.0.0 unless the lease is being renewed, which goes to the server that gave it
+void dhcpSendMessage(etherHeader* ether, uint8_t type)
+{
+    ipHeader* ip = (ipHeader*)ether->data;
+    udpHeader* udp = (udpHeader*)ip->data;
+    dhcpFrame* dhcp = (dhcpFrame*)udp->data;
+    uint8_t* option = dhcp->options;
+    bool hasAddress = dhcpCurrentState == DHCP_RENEWING || dhcpCurrentState == DHCP_REBINDING;
+    uint8_t destIp[4];
+    uint16_t dhcpLength = 0, i = 0;
+
+    for(i = 0; i < sizeof(dhcpFrame); i++)
+        ((uint8_t*)dhcp)[i] = 0;
+    dhcp->op = 1;
+    dhcp->htype = 1;
+    dhcp->hlen = 6;
+    dhcp->xid = htonl(xid);
+    if(hasAddress)
+        etherGetIpAddress(dhcp->ciaddr);
+    etherGetMacAddress(dhcp->chaddr);
+    dhcp->magicCookie = htonl(DHCP_MAGIC_COOKIE);
+
+    *(option++) = DHCP_OPTION_MESSAGE_TYPE;
+    *(option++) = 1;
+    *(option++) = type;
+    // The address is named when answering an offer and in INIT-REBOOT, but not when renewing (RFC 2131 4.3.2)
+    if(dhcpCurrentState == DHCP_REQUESTING || dhcpCurrentState == DHCP_REBOOTING)
+        option = dhcpAddIpOption(option, DHCP_OPTION_REQUESTED_IP, lease.ip);
+    // Only the REQUEST that answers an offer names the server, the others do not pick one
+    if(dhcpCurrentState == DHCP_REQUESTING)
+        option = dhcpAddIpOption(option, DHCP_OPTION_SERVER_ID, lease.serverId);
+    *(option++) = DHCP_OPTION_PARAMETER_LIST;
+    *(option++) = 3;
+    *(option++) = DHCP_OPTION_SUBNET_MASK;
+    *(option++) = DHCP_OPTION_ROUTER;
+    *(option++) = DHCP_OPTION_DNS_SERVER;
+    *(option++) = DHCP_OPTION_END;
+    // Some relay agents drop anything shorter than a BOOTP message (RFC 1542 3.3)
+    dhcpLength = option - (uint8_t*)dhcp;
+    while(dhcpLength < 300)
+        ((uint8_t*)dhcp)[dhcpLength++] = DHCP_OPTION_PAD;
+
+    // Our IP is 0.0.0.0 until the first ACK and again after a restart, which is the source DHCP asks for
+    for(i = 0; i < 4; i++)
+        destIp[i] = 0xFF;
+    if(dhcpCurrentState == DHCP_RENEWING)
+        copyUint8Array(lease.serverId, destIp, 4);
+    etherPutUdpPacket(ether, destIp, DHCP_CLIENT_PORT, DHCP_SERVER_PORT, dhcpLength);
+}
+
+// Reads the options of an OFFER, ACK or NAK into offer
+// Returns the message type, or 0 if the message has none
+uint8_t dhcpParseOptions(dhcpFrame* dhcp, uint16_t length, dhcpLease* offer)
+{
+    uint8_t* option = dhcp->options;
+    uint8_t* end = (uint8_t*)dhcp + length;
+    uint8_t type = 0, code = 0, size = 0;
+    while(option < end && *option != DHCP_OPTION_END)
+    {
+        code = *(option++);
+        if(code == DHCP_OPTION_PAD)
+            continue;
+        if(option >= end)
+            break;
+        size = *(option++);
+        if(option + size > end)
+            break;
+        // Addresses and times are 4 bytes, the first router and DNS server are used
+        if(code == DHCP_OPTION_MESSAGE_TYPE && size >= 1)
+            type = option[0];
+        else if(size >= 4)
+        {
+            switch(code)
+            {
+            case DHCP_OPTION_SUBNET_MASK:
+                copyUint8Array(option, offer->subnetMask, 4);
+                break;
+            case DHCP_OPTION_ROUTER:
+                copyUint8Array(option, offer->router, 4);
+                break;
+            case DHCP_OPTION_DNS_SERVER:
+                copyUint8Array(option, offer->dnsServer, 4);
+                break;
+            case DHCP_OPTION_SERVER_ID:
+                copyUint8Array(option, offer->serverId, 4);
+                break;
+            case DHCP_OPTION_LEASE_TIME:
+                offer->leaseTime = dhcpGetUint32(option);
+                break;
+            case DHCP_OPTION_RENEWAL_TIME:
+                offer->renewalTime = dhcpGetUint32(option);
+                break;
+            case DHCP_OPTION_REBINDING_TIME:
+                offer->rebindingTime = dhcpGetUint32(option);
+                break;
+            }
+        }
+        option += size;
+    }
+    return type;
+}
+
+void dhcpSaveAddress(uint8_t offset, uint8_t ip[])
+{
+    uint32_t encodedIp = convertArrayToEncodedIpv4(ip);
+    // Only words that changed are written, renewing the same lease does not wear the EEPROM
+    if(readEeprom(DHCP_EEPROM_LEASE + offset) != encodedIp)
+        writeEeprom(DHCP_EEPROM_LEASE + offset, encodedIp);
+}
+
+void dhcpSaveLease()
+{
+    dhcpSaveAddress(0, lease.ip);
+    dhcpSaveAddress(1, lease.subnetMask);
+    dhcpSaveAddress(2, lease.router);
+    dhcpSaveAddress(3, lease.dnsServer);
+    dhcpSaveAddress(4, lease.serverId);
+}
+
+// Returns false if no lease was stored
+bool dhcpLoadLease()
+{
+    if(readEeprom(DHCP_EEPROM_LEASE) == 0xFFFFFFFF)
+        return false;
+    convertEncodedIpv4ToArray(lease.ip, readEeprom(DHCP_EEPROM_LEASE));
+    convertEncodedIpv4ToArray(lease.subnetMask, readEeprom(DHCP_EEPROM_LEASE + 1));
+    convertEncodedIpv4ToArray(lease.router, readEeprom(DHCP_EEPROM_LEASE + 2));
+    convertEncodedIpv4ToArray(lease.dnsServer, readEeprom(DHCP_EEPROM_LEASE + 3));
+    convertEncodedIpv4ToArray(lease.serverId, readEeprom(DHCP_EEPROM_LEASE + 4));
+    return true;
+}
+
+// A server said no, so the stored lease is no good either
+void dhcpForgetLease()
+{
+    writeEeprom(DHCP_EEPROM_LEASE, 0xFFFFFFFF);
+    etherSetIpAddress(0, 0, 0, 0);
+    dhcpCurrentState = DHCP_INIT;
+}
+
+// Starts using the address in an ACK
+// An ACK to a renewal may leave out what has not changed, so only what it carries replaces the lease
+void dhcpBind(dhcpLease* ack)
+{
+    copyUint8Array(ack->ip, lease.ip, 4);
+    if(!dhcpIsZeroIp(ack->subnetMask))
+        copyUint8Array(ack->subnetMask, lease.subnetMask, 4);
+    if(!dhcpIsZeroIp(ack->router))
+        copyUint8Array(ack->router, lease.router, 4);
+    if(!dhcpIsZeroIp(ack->dnsServer))
+        copyUint8Array(ack->dnsServer, lease.dnsServer, 4);
+    if(!dhcpIsZeroIp(ack->serverId))
+        copyUint8Array(ack->serverId, lease.serverId, 4);
+
+    lease.leaseTime = (ack->leaseTime == 0 || ack->leaseTime > DHCP_MAX_LEASE_TIME) ? DHCP_MAX_LEASE_TIME : ack->leaseTime;
+    // RFC 2131 4.4.5: T1 defaults to half the lease and T2 to 7/8 of it
+    lease.renewalTime = (ack->renewalTime == 0 || ack->renewalTime >= lease.leaseTime) ? lease.leaseTime / 2 : ack->renewalTime;
+    lease.rebindingTime = (ack->rebindingTime == 0 || ack->rebindingTime >= lease.leaseTime) ? lease.leaseTime * 7 / 8 : ack->rebindingTime;
+    if(lease.rebindingTime < lease.renewalTime)
+        lease.rebindingTime = lease.renewalTime;
+
+    etherSetIpAddress(lease.ip[0], lease.ip[1], lease.ip[2], lease.ip[3]);
+    etherSetIpSubnetMask(lease.subnetMask[0], lease.subnetMask[1], lease.subnetMask[2], lease.subnetMask[3]);
+    etherSetIpGatewayAddress(lease.router[0], lease.router[1], lease.router[2], lease.router[3]);
+    boundTime = getMilliseconds();
+    dhcpCurrentState = DHCP_BOUND;
+    dhcpSaveLease();
+}
+
+// Starts asking for an address, with the stored lease if there is one
+void dhcpStart()
+{
+    udpBind(DHCP_CLIENT_PORT, dhcpReceive);
+    etherEnableDhcpMode();
+    etherSetIpAddress(0, 0, 0, 0);
+    dhcpCurrentState = dhcpLoadLease() ? DHCP_INIT_REBOOT : DHCP_INIT;
+}
+
+// Goes back to a static address, the lease is left to run out on the server
+void dhcpStop()
+{
+    udpUnbind(DHCP_CLIENT_PORT);
+    etherDisableDhcpMode();
+    dhcpCurrentState = DHCP_DISABLED;
+}
+
+// The link came back and the board may be on another network, so the address is checked again (RFC 2131 3.7)
+void dhcpRestart()
+{
+    if(dhcpCurrentState == DHCP_DISABLED)
+        return;
+    etherSetIpAddress(0, 0, 0, 0);
+    dhcpCurrentState = dhcpIsZeroIp(lease.ip) ? DHCP_INIT : DHCP_INIT_REBOOT;
+}
+
+bool dhcpIsBound()
+{
+    return dhcpCurrentState == DHCP_BOUND || dhcpCurrentState == DHCP_RENEWING || dhcpCurrentState == DHCP_REBINDING;
+}
+
+dhcpState dhcpGetState()
+{
+    return dhcpCurrentState;
+}
+
+// The DNS server from the lease, 0.0.0.0 if the server did not give one
+void dhcpGetDnsServer(uint8_t ip[4])
+{
+    copyUint8Array(lease.dnsServer, ip, 4);
+}
+
+// Receive callback of the client port, anything that is not a reply to our current exchange is ignored
+// Replies are sent in the received frame
+void dhcpReceive(etherHeader* ether, uint8_t sourceIp[], uint16_t sourcePort, uint8_t data[], uint16_t length)
+{
+    dhcpFrame* dhcp = (dhcpFrame*)data;
+    dhcpLease offer = {0};
+    uint8_t mac[6];
+    uint8_t type = 0, i = 0;
+    // The server is known from its identifier option, not from who sent the reply
+    (void)sourceIp;
+
+    if(dhcpCurrentState == DHCP_DISABLED || sourcePort != DHCP_SERVER_PORT || length < sizeof(dhcpFrame))
+        return;
+    if(dhcp->op != 2 || ntohl(dhcp->xid) != xid || dhcp->magicCookie != htonl(DHCP_MAGIC_COOKIE))
+        return;
+    etherGetMacAddress(mac);
+    for(i = 0; i < 6; i++)
+        if(dhcp->chaddr[i] != mac[i])
+            return;
+
+    type = dhcpParseOptions(dhcp, length, &offer);
+    copyUint8Array(dhcp->yiaddr, offer.ip, 4);
+
+    switch(dhcpCurrentState)
+    {
+    case DHCP_SELECTING:
+        // The first offer is taken
+        if(type != DHCPOFFER || dhcpIsZeroIp(offer.serverId) || dhcpIsZeroIp(offer.ip))
+            break;
+        lease = offer;
+        dhcpCurrentState = DHCP_REQUESTING;
+        retries = 0;
+        retryTimeout = DHCP_INITIAL_RETRY;
+        dhcpSendMessage(ether, DHCPREQUEST);
+        dhcpStartRetry(retryTimeout);
+        break;
+    case DHCP_REQUESTING:
+    case DHCP_REBOOTING:
+    case DHCP_RENEWING:
+    case DHCP_REBINDING:
+        if(type == DHCPACK && !dhcpIsZeroIp(offer.ip))
+            dhcpBind(&offer);
+        else if(type == DHCPNAK)
+            dhcpForgetLease();
+        break;
+    default:
+        break;
+    }
+}
+
+// Sends the messages the current state needs and follows the lease timers
+// Call this on every pass of the main loop, the frame is only used to build messages
+void dhcpTick(etherHeader* ether)
+{
+    uint32_t elapsed = getMilliseconds() - boundTime;
+    switch(dhcpCurrentState)
+    {
+    case DHCP_INIT:
+        dhcpNewXid();
+        retryTimeout = DHCP_INITIAL_RETRY;
+        dhcpCurrentState = DHCP_SELECTING;
+        dhcpSendMessage(ether, DHCPDISCOVER);
+        dhcpStartRetry(retryTimeout);
+        break;
+    case DHCP_INIT_REBOOT:
+        dhcpNewXid();
+        retries = 0;
+        retryTimeout = DHCP_INITIAL_RETRY;
+        dhcpCurrentState = DHCP_REBOOTING;
+        dhcpSendMessage(ether, DHCPREQUEST);
+        dhcpStartRetry(retryTimeout);
+        break;
+    case DHCP_SELECTING:
+        if(!dhcpIsTime(retryTime))
+            break;
+        dhcpBackOff();
+        dhcpSendMessage(ether, DHCPDISCOVER);
+        dhcpStartRetry(retryTimeout);
+        break;
+    case DHCP_REQUESTING:
+    case DHCP_REBOOTING:
+        if(!dhcpIsTime(retryTime))
+            break;
+        // Nobody answers for the stored lease or the offer, start over
+        if(retries == DHCP_REQUEST_RETRIES)
+        {
+            dhcpCurrentState = DHCP_INIT;
+            break;
+        }
+        retries++;
+        dhcpBackOff();
+        dhcpSendMessage(ether, DHCPREQUEST);
+        dhcpStartRetry(retryTimeout);
+        break;
+    case DHCP_BOUND:
+        // T1, ask the server that gave the lease for more time
+        if(elapsed >= lease.renewalTime * 1000)
+        {
+            dhcpNewXid();
+            dhcpCurrentState = DHCP_RENEWING;
+            dhcpSendMessage(ether, DHCPREQUEST);
+            dhcpStartRenewRetry(boundTime + lease.rebindingTime * 1000);
+        }
+        break;
+    case DHCP_RENEWING:
+        // T2, the server is not answering so ask any server
+        if(elapsed >= lease.rebindingTime * 1000)
+        {
+            dhcpCurrentState = DHCP_REBINDING;
+            dhcpSendMessage(ether, DHCPREQUEST);
+            dhcpStartRenewRetry(boundTime + lease.leaseTime * 1000);
+        }
+        else if(dhcpIsTime(retryTime))
+        {
+            dhcpSendMessage(ether, DHCPREQUEST);
+            dhcpStartRenewRetry(boundTime + lease.rebindingTime * 1000);
+        }
+        break;
+    case DHCP_REBINDING:
+        // The lease ran out, the address can not be used any more
+        if(elapsed >= lease.leaseTime * 1000)
+        {
+            etherSetIpAddress(0, 0, 0, 0);
+            dhcpCurrentState = DHCP_INIT;
+        }
+        else if(dhcpIsTime(retryTime))
+        {
+            dhcpSendMessage(ether, DHCPREQUEST);
+            dhcpStartRenewRetry(boundTime + lease.leaseTime * 1000);
+        }
+        break;
+    default:
+        break;
+    }
+}
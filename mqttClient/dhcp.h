@@ -0,0 +1,95 @@
+/*
+ * dhcp.h
+ * DHCP client (RFC 2131)
+ *
+ *  Created on: Apr 20, 2021
+ *      Author: Sarker Nadir Afridi Azmi
+ */
+
+#ifndef DHCP_H_
+#define DHCP_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "eth0.h"
+#include "eeprom.h"
+
+#define DHCP_SERVER_PORT        67
+#define DHCP_CLIENT_PORT        68
+
+// First retransmission timeout in milliseconds, it doubles up to the maximum (RFC 2131 4.1)
+#define DHCP_INITIAL_RETRY      4000
+#define DHCP_MAX_RETRY          64000
+// Requests sent for a stored lease or an offer before starting over with a DISCOVER
+#define DHCP_REQUEST_RETRIES    2
+// Renewing and rebinding are not retried more often than this (RFC 2131 4.4.5)
+#define DHCP_MIN_RENEW_RETRY    60000
+// Longer leases are treated as this many seconds so the timers fit getMilliseconds()
+#define DHCP_MAX_LEASE_TIME     2000000
+
+// The last lease is kept in these EEPROM words, after the addresses saved by the set command
+#define DHCP_EEPROM_LEASE       (PROJECT_META_DATA + 8)
+
+// Message types (RFC 2132 9.6)
+#define DHCPDISCOVER            1
+#define DHCPOFFER               2
+#define DHCPREQUEST             3
+#define DHCPDECLINE             4
+#define DHCPACK                 5
+#define DHCPNAK                 6
+#define DHCPRELEASE             7
+
+// Options (RFC 2132)
+#define DHCP_OPTION_PAD             0
+#define DHCP_OPTION_SUBNET_MASK     1
+#define DHCP_OPTION_ROUTER          3
+#define DHCP_OPTION_DNS_SERVER      6
+#define DHCP_OPTION_REQUESTED_IP    50
+#define DHCP_OPTION_LEASE_TIME      51
+#define DHCP_OPTION_MESSAGE_TYPE    53
+#define DHCP_OPTION_SERVER_ID       54
+#define DHCP_OPTION_PARAMETER_LIST  55
+#define DHCP_OPTION_RENEWAL_TIME    58
+#define DHCP_OPTION_REBINDING_TIME  59
+#define DHCP_OPTION_END             255
+
+#define DHCP_MAGIC_COOKIE       0x63825363
+
+// Client states (RFC 2131 figure 5)
+typedef enum _dhcpState
+{
+    DHCP_DISABLED = 0,
+    DHCP_INIT,
+    DHCP_SELECTING,
+    DHCP_REQUESTING,
+    DHCP_INIT_REBOOT,
+    DHCP_REBOOTING,
+    DHCP_BOUND,
+    DHCP_RENEWING,
+    DHCP_REBINDING
+} dhcpState;
+
+// What an OFFER or ACK carried
+typedef struct _dhcpLease
+{
+    uint8_t ip[4];
+    uint8_t subnetMask[4];
+    uint8_t router[4];
+    uint8_t dnsServer[4];
+    uint8_t serverId[4];
+    // In seconds, T1 and T2 default to half and 7/8 of the lease
+    uint32_t leaseTime;
+    uint32_t renewalTime;
+    uint32_t rebindingTime;
+} dhcpLease;
+
+void dhcpStart();
+void dhcpStop();
+void dhcpRestart();
+bool dhcpIsBound();
+dhcpState dhcpGetState();
+void dhcpGetDnsServer(uint8_t ip[4]);
+void dhcpReceive(etherHeader* ether, uint8_t sourceIp[], uint16_t sourcePort, uint8_t data[], uint16_t length);
+void dhcpTick(etherHeader* ether);
+
+#endif /* DHCP_H_ */
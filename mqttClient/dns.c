@@ -0,0 +1,324 @@
+/*
+ * dns.c
+ * Looks up the IPv4 address of a name by asking a recursive DNS server
+ * Answers are cached for their TTL, so a name that was looked up recently costs no round trip
+ * Nothing here waits, dnsResolve is called again until the lookup has finished
+ *
+ *  Created on: Apr 20, 2021
+ *      Author: Sarker Nadir Afridi Azmi
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "eth0.h"
+#include "dns.h"
+#include "dhcp.h"
+#include "cli.h"
+#include "utils.h"
+#include "timer0.h"
+#include "udp.h"
+
+// Set with dnsSetServer, otherwise the one from the DHCP lease is used
+uint8_t dnsServer[4] = {0,0,0,0};
+dnsCacheEntry dnsCache[DNS_CACHE_SIZE];
+dnsQuery query;
+
+void dnsSetServer(uint8_t ip[4])
+{
+    copyUint8Array(ip, dnsServer, 4);
+}
+
+void dnsGetServer(uint8_t ip[4])
+{
+    if(dnsServer[0] || dnsServer[1] || dnsServer[2] || dnsServer[3])
+        copyUint8Array(dnsServer, ip, 4);
+    else
+        dhcpGetDnsServer(ip);
+}
+
+// Names are compared without case (RFC 4343)
+char dnsToLower(char c)
+{
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+bool dnsIsSameName(char name1[], char name2[])
+{
+    uint8_t i = 0;
+    for(i = 0; name1[i] != '\0' && name2[i] != '\0'; i++)
+        if(dnsToLower(name1[i]) != dnsToLower(name2[i]))
+            return false;
+    return name1[i] == name2[i];
+}
+
+dnsCacheEntry* dnsCacheFind(char name[])
+{
+    uint8_t i = 0;
+    for(i = 0; i < DNS_CACHE_SIZE; i++)
+    {
+        if(!dnsCache[i].inUse || !dnsIsSameName(dnsCache[i].name, name))
+            continue;
+        // Expired answers are dropped as they are found
+        if((int32_t)(getMilliseconds() - dnsCache[i].expireTime) >= 0)
+        {
+            dnsCache[i].inUse = false;
+            return 0;
+        }
+        return &dnsCache[i];
+    }
+    return 0;
+}
+
+void dnsCacheAdd(char name[], uint8_t ip[], uint32_t ttl)
+{
+    dnsCacheEntry* entry = 0;
+    uint8_t i = 0;
+    if(ttl == 0)
+        return;
+    if(ttl > DNS_MAX_TTL)
+        ttl = DNS_MAX_TTL;
+    // The name again, a free slot or the least recently used one
+    for(i = 0; i < DNS_CACHE_SIZE && entry == 0; i++)
+        if(dnsCache[i].inUse && dnsIsSameName(dnsCache[i].name, name))
+            entry = &dnsCache[i];
+    for(i = 0; i < DNS_CACHE_SIZE && entry == 0; i++)
+        if(!dnsCache[i].inUse)
+            entry = &dnsCache[i];
+    if(entry == 0)
+    {
+        entry = &dnsCache[0];
+        for(i = 1; i < DNS_CACHE_SIZE; i++)
+            if((int32_t)(dnsCache[i].usedTime - entry->usedTime) < 0)
+                entry = &dnsCache[i];
+    }
+    entry->inUse = true;
+    strCpy(name, entry->name);
+    copyUint8Array(ip, entry->ip, 4);
+    entry->expireTime = getMilliseconds() + ttl * 1000;
+    entry->usedTime = getMilliseconds();
+}
+
+// The query's port is only bound while an answer can come
+void dnsEndQuery(dnsResult result)
+{
+    udpUnbind(query.port);
+    query.result = result;
+    query.retryTime = getMilliseconds();
+}
+
+// Forgets every cached answer, for when the server or the network changed
+void dnsFlush()
+{
+    uint8_t i = 0;
+    for(i = 0; i < DNS_CACHE_SIZE; i++)
+        dnsCache[i].inUse = false;
+    if(query.active && query.result == DNS_PENDING)
+        udpUnbind(query.port);
+    query.active = false;
+}
+
+// Writes name as length prefixed labels, "a.bc" becomes 1 a 2 b c 0
+// Returns the encoded length, or 0 if a label is empty or too long
+uint8_t dnsEncodeName(char name[], uint8_t out[])
+{
+    uint8_t length = 0, labelStart = 0, i = 0;
+    for(i = 0; ; i++)
+    {
+        if(name[i] == '.' || name[i] == '\0')
+        {
+            if(i == labelStart || i - labelStart > 63)
+                return 0;
+            out[length++] = i - labelStart;
+            copyUint8Array((uint8_t*)name + labelStart, out + length, i - labelStart);
+            length += i - labelStart;
+            labelStart = i + 1;
+            if(name[i] == '\0')
+                break;
+        }
+    }
+    out[length++] = 0;
+    return length;
+}
+
+// Returns the offset just past the name at offset, or 0 if it runs past size
+// A compression pointer ends the name, so it is not followed
+uint16_t dnsSkipName(uint8_t data[], uint16_t offset, uint16_t size)
+{
+    while(offset < size)
+    {
+        if((data[offset] & 0xC0) == 0xC0)
+            return (offset + 2 <= size) ? offset + 2 : 0;
+        if(data[offset] == 0)
+            return offset + 1;
+        offset += data[offset] + 1;
+    }
+    return 0;
+}
+
+uint16_t dnsGetUint16(uint8_t* field)
+{
+    return ((uint16_t)field[0] << 8) | field[1];
+}
+
+void dnsSendQuery(etherHeader* ether)
+{
+    ipHeader* ip = (ipHeader*)ether->data;
+    udpHeader* udp = (udpHeader*)ip->data;
+    uint8_t* dns = udp->data;
+    uint8_t server[4];
+    uint16_t length = DNS_HEADER_SIZE;
+
+    dnsGetServer(server);
+    dns[0] = query.id >> 8;
+    dns[1] = query.id & 0xFF;
+    dns[2] = DNS_FLAG_RD >> 8;
+    dns[3] = 0;
+    // One question, no answer, authority or additional records
+    dns[4] = 0;
+    dns[5] = 1;
+    dns[6] = dns[7] = dns[8] = dns[9] = dns[10] = dns[11] = 0;
+    length += dnsEncodeName(query.name, dns + length);
+    dns[length++] = 0;
+    dns[length++] = DNS_TYPE_A;
+    dns[length++] = 0;
+    dns[length++] = DNS_CLASS_IN;
+    etherPutUdpPacket(ether, server, query.port, DNS_SERVER_PORT, length);
+}
+
+// Returns DNS_RESOLVED with the address in ip, DNS_PENDING while the server is asked
+// or DNS_FAILED if the name does not exist or no server answered
+// A lookup that is pending keeps going until it is asked for again, another name replaces it
+dnsResult dnsResolve(char name[], uint8_t ip[4])
+{
+    dnsCacheEntry* entry = dnsCacheFind(name);
+    uint8_t encoded[DNS_MAX_NAME_LENGTH + 1];
+    uint8_t server[4];
+    uint8_t mac[6];
+    uint8_t i = 0;
+    dnsResult result;
+
+    if(entry != 0)
+    {
+        entry->usedTime = getMilliseconds();
+        copyUint8Array(entry->ip, ip, 4);
+        return DNS_RESOLVED;
+    }
+    // An answer that was not picked up soon after it came is not trusted any more
+    if(query.active && query.result != DNS_PENDING && (int32_t)(getMilliseconds() - query.retryTime) > DNS_RETRY_TIME)
+        query.active = false;
+    if(query.active && dnsIsSameName(query.name, name))
+    {
+        if(query.result == DNS_PENDING)
+            return DNS_PENDING;
+        query.active = false;
+        result = query.result;
+        if(result == DNS_RESOLVED)
+            copyUint8Array(query.ip, ip, 4);
+        return result;
+    }
+
+    dnsGetServer(server);
+    if(strLen(name) >= DNS_MAX_NAME_LENGTH || dnsEncodeName(name, encoded) == 0 || !(server[0] || server[1] || server[2] || server[3]))
+        return DNS_FAILED;
+    // Another name replaces the query in progress
+    if(query.active && query.result == DNS_PENDING)
+        udpUnbind(query.port);
+    query.active = false;
+    // A random ID and port make it hard for anyone off path to slip in a fake answer (RFC 5452)
+    etherGetMacAddress(mac);
+    query.id = (query.id * 31 + mac[5]) ^ getMilliseconds() ^ (query.port << 3);
+    // A port the application has bound is skipped
+    for(i = 0; i < DNS_RETRIES; i++)
+    {
+        query.port = 49152 + (((uint32_t)query.port * 1103515245u + getMilliseconds() + i) & 0x3FFF);
+        if(udpBind(query.port, dnsReceive))
+            break;
+    }
+    if(i == DNS_RETRIES)
+        return DNS_FAILED;
+    strCpy(name, query.name);
+    query.active = true;
+    query.result = DNS_PENDING;
+    query.sent = 0;
+    query.retryTime = getMilliseconds();
+    return DNS_PENDING;
+}
+
+// Receive callback of the query's port, anything that is not the answer to the pending query is ignored
+void dnsReceive(etherHeader* ether, uint8_t sourceIp[], uint16_t sourcePort, uint8_t data[], uint16_t size)
+{
+    uint8_t* dns = data;
+    uint8_t name[DNS_MAX_NAME_LENGTH + 1];
+    uint8_t server[4];
+    uint16_t offset = DNS_HEADER_SIZE, flags = 0, count = 0, nameLength = 0, i = 0;
+    uint32_t ttl = 0;
+    // The answer is read from data, the frame is not needed
+    (void)ether;
+
+    if(!query.active || query.result != DNS_PENDING)
+        return;
+    dnsGetServer(server);
+    for(i = 0; i < 4; i++)
+        if(sourceIp[i] != server[i])
+            return;
+    if(sourcePort != DNS_SERVER_PORT || size < DNS_HEADER_SIZE)
+        return;
+    flags = dnsGetUint16(dns + 2);
+    if(dnsGetUint16(dns) != query.id || !(flags & DNS_FLAG_QR) || dnsGetUint16(dns + 4) != 1)
+        return;
+    // The question has to be ours as well
+    nameLength = dnsEncodeName(query.name, name);
+    if(offset + nameLength + 4 > size)
+        return;
+    for(i = 0; i < nameLength; i++)
+        if(dnsToLower(dns[offset + i]) != dnsToLower(name[i]))
+            return;
+    offset += nameLength + 4;
+
+    // The name does not exist or the server could not find out
+    if(flags & DNS_RCODE_MASK)
+    {
+        dnsEndQuery(DNS_FAILED);
+        return;
+    }
+    // A CNAME comes before the A record of the name it points to, so the first A record is the answer
+    count = dnsGetUint16(dns + 6);
+    for(i = 0; i < count; i++)
+    {
+        offset = dnsSkipName(dns, offset, size);
+        if(offset == 0 || offset + 10 > size)
+            break;
+        if(dnsGetUint16(dns + offset) == DNS_TYPE_A && dnsGetUint16(dns + offset + 2) == DNS_CLASS_IN && dnsGetUint16(dns + offset + 8) == 4 && offset + 14 <= size)
+        {
+            ttl = ((uint32_t)dns[offset + 4] << 24) | ((uint32_t)dns[offset + 5] << 16) | ((uint32_t)dns[offset + 6] << 8) | dns[offset + 7];
+            // The top bit set is read as a TTL of zero (RFC 2181 8)
+            if(ttl & 0x80000000)
+                ttl = 0;
+            copyUint8Array(dns + offset + 10, query.ip, 4);
+            dnsCacheAdd(query.name, query.ip, ttl);
+            dnsEndQuery(DNS_RESOLVED);
+            // From now on dnsResolve finds it in the cache
+            if(ttl != 0)
+                query.active = false;
+            return;
+        }
+        offset += 10 + dnsGetUint16(dns + offset + 8);
+    }
+    dnsEndQuery(DNS_FAILED);
+}
+
+// Sends the pending query and repeats it until it is answered
+// Call this on every pass of the main loop, the frame is only used to build the query
+void dnsTick(etherHeader* ether)
+{
+    if(!query.active || query.result != DNS_PENDING || (int32_t)(getMilliseconds() - query.retryTime) < 0)
+        return;
+    if(query.sent == DNS_RETRIES)
+    {
+        dnsEndQuery(DNS_FAILED);
+        return;
+    }
+    query.sent++;
+    query.retryTime = getMilliseconds() + DNS_RETRY_TIME;
+    dnsSendQuery(ether);
+}
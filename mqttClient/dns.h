@@ -0,0 +1,77 @@
+/*
+ * dns.h
+ * DNS stub resolver with a cache (RFC 1034 & RFC 1035)
+ *
+ *  Created on: Apr 20, 2021
+ *      Author: Sarker Nadir Afridi Azmi
+ */
+
+#ifndef DNS_H_
+#define DNS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "eth0.h"
+
+#define DNS_SERVER_PORT         53
+
+// Longest name that can be looked up, with the null terminator
+#define DNS_MAX_NAME_LENGTH     64
+// Names remembered, the least recently used one is replaced
+#define DNS_CACHE_SIZE          4
+// Answers are kept for their TTL, but no longer than this many seconds
+#define DNS_MAX_TTL             86400
+// A query is sent this many times, this many milliseconds apart, before the lookup fails
+#define DNS_RETRIES             3
+#define DNS_RETRY_TIME          2000
+
+#define DNS_HEADER_SIZE         12
+#define DNS_TYPE_A              1
+#define DNS_CLASS_IN            1
+// Flags: response, recursion desired and the response code
+#define DNS_FLAG_QR             0x8000
+#define DNS_FLAG_RD             0x0100
+#define DNS_RCODE_MASK          0x000F
+
+typedef enum _dnsResult
+{
+    DNS_FAILED = 0,
+    DNS_PENDING,
+    DNS_RESOLVED
+} dnsResult;
+
+typedef struct _dnsCacheEntry
+{
+    bool inUse;
+    char name[DNS_MAX_NAME_LENGTH];
+    uint8_t ip[4];
+    // When the TTL runs out, in milliseconds from getMilliseconds()
+    uint32_t expireTime;
+    // For replacing the least recently used name
+    uint32_t usedTime;
+} dnsCacheEntry;
+
+// The one lookup in progress, kept until dnsResolve has picked up how it ended
+typedef struct _dnsQuery
+{
+    bool active;
+    dnsResult result;
+    char name[DNS_MAX_NAME_LENGTH];
+    // The answer, also when its TTL of zero kept it out of the cache
+    uint8_t ip[4];
+    uint16_t id;
+    uint16_t port;
+    // Zero until the query is sent the first time
+    uint8_t sent;
+    // When the query is sent again, once it has ended when it did
+    uint32_t retryTime;
+} dnsQuery;
+
+void dnsSetServer(uint8_t ip[4]);
+void dnsGetServer(uint8_t ip[4]);
+dnsResult dnsResolve(char name[], uint8_t ip[4]);
+void dnsFlush();
+void dnsReceive(etherHeader* ether, uint8_t sourceIp[], uint16_t sourcePort, uint8_t data[], uint16_t size);
+void dnsTick(etherHeader* ether);
+
+#endif /* DNS_H_ */
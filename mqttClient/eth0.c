@@ -29,6 +29,7 @@
 #include "wait.h"
 #include "gpio.h"
 #include "spi0.h"
+#include "timer0.h"
 
 // Pins
 #define CS PORTA,3
@@ -66,6 +67,7 @@
 #define ECON1       0x1F
 #define RXEN    0x04
 #define TXRTS   0x08
+#define EHT0        0x20
 #define ERXFCON     0x38
 #define EPKTCNT     0x39
 #define MACON1      0x40
@@ -129,6 +131,9 @@ uint8_t ipAddress[IP_ADD_LENGTH] = {0,0,0,0};
 uint8_t ipSubnetMask[IP_ADD_LENGTH] = {255,255,255,0};
 uint8_t ipGwAddress[IP_ADD_LENGTH] = {0,0,0,0};
 bool    dhcpEnabled = true;
+arpEntry arpCache[ARP_CACHE_SIZE];
+arpQueuedFrame arpQueue[ARP_QUEUE_SIZE];
+uint8_t arpQueueSequence = 0;
 
 //-----------------------------------------------------------------------------
 // Subroutines
@@ -616,6 +621,55 @@ void etherSendPingResponse(etherHeader *ether)
     etherPutPacket(ether, sizeof(etherHeader) + ntohs(ip->length));
 }
 
+// Determines whether packet is an echo reply, with a good checksum
+// Must be an IP packet
+bool etherIsPingReply(etherHeader *ether)
+{
+    ipHeader *ip = (ipHeader*)ether->data;
+    uint8_t ipHeaderLength = (ip->revSize & 0xF) * 4;
+    icmpHeader *icmp = (icmpHeader*)((uint8_t*)ip + ipHeaderLength);
+    uint32_t sum = 0;
+    if (ip->protocol != 0x01 || icmp->type != 0 || ntohs(ip->length) < ipHeaderLength + sizeof(icmpHeader))
+        return false;
+    etherSumWords(icmp, ntohs(ip->length) - ipHeaderLength, &sum);
+    return getEtherChecksum(sum) == 0;
+}
+
+// Sends an echo request with dataSize bytes of pattern to ip
+// Returns false if the frame was dropped
+bool etherSendPingRequest(etherHeader *ether, uint8_t ip[], uint16_t id, uint16_t seq, uint16_t dataSize)
+{
+    ipHeader *ipHdr = (ipHeader*)ether->data;
+    icmpHeader *icmp = (icmpHeader*)ipHdr->data;
+    uint16_t icmpSize = sizeof(icmpHeader) + dataSize;
+    uint32_t sum = 0;
+    uint16_t i;
+    ether->frameType = htons(0x0800);
+    ipHdr->revSize = 0x45;
+    ipHdr->typeOfService = 0;
+    ipHdr->length = htons(sizeof(ipHeader) + icmpSize);
+    ipHdr->id = 0;
+    ipHdr->flagsAndOffset = 0;
+    ipHdr->ttl = 64;
+    ipHdr->protocol = 0x01;
+    for (i = 0; i < IP_ADD_LENGTH; i++)
+    {
+        ipHdr->sourceIp[i] = ipAddress[i];
+        ipHdr->destIp[i] = ip[i];
+    }
+    etherCalcIpChecksum(ipHdr);
+    icmp->type = 8;
+    icmp->code = 0;
+    icmp->id = htons(id);
+    icmp->seq_no = htons(seq);
+    for (i = 0; i < dataSize; i++)
+        icmp->data[i] = i;
+    icmp->check = 0;
+    etherSumWords(icmp, icmpSize, &sum);
+    icmp->check = getEtherChecksum(sum);
+    return etherPutIpPacket(ether, sizeof(etherHeader) + sizeof(ipHeader) + icmpSize);
+}
+
 // Determines whether packet is ARP
 bool etherIsArpRequest(etherHeader *ether)
 {
@@ -674,15 +728,15 @@ void etherSendArpResponse(etherHeader *ether)
     etherPutPacket(ether, sizeof(etherHeader) + sizeof(arpPacket));
 }
 
-// Sends an ARP request
-void etherSendArpRequest(etherHeader *ether, uint8_t ip[])
+// Sends an ARP request to mac, which is the broadcast address unless an entry is being confirmed
+void etherSendArpRequestTo(etherHeader *ether, uint8_t ip[], uint8_t mac[])
 {
     arpPacket *arp = (arpPacket*)ether->data;
     uint8_t i;
     // fill ethernet frame
     for (i = 0; i < HW_ADD_LENGTH; i++)
     {
-        ether->destAddress[i] = 0xFF;
+        ether->destAddress[i] = mac[i];
         ether->sourceAddress[i] = macAddress[i];
     }
     ether->frameType = 0x0608;
@@ -695,7 +749,7 @@ void etherSendArpRequest(etherHeader *ether, uint8_t ip[])
     for (i = 0; i < HW_ADD_LENGTH; i++)
     {
         arp->sourceAddress[i] = macAddress[i];
-        arp->destAddress[i] = 0xFF;
+        arp->destAddress[i] = mac[i];
     }
     for (i = 0; i < IP_ADD_LENGTH; i++)
     {
@@ -706,6 +760,324 @@ void etherSendArpRequest(etherHeader *ether, uint8_t ip[])
     etherPutPacket(ether, sizeof(etherHeader) + sizeof(arpPacket));
 }
 
+// Sends an ARP request
+void etherSendArpRequest(etherHeader *ether, uint8_t ip[])
+{
+    uint8_t broadcast[HW_ADD_LENGTH] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+    etherSendArpRequestTo(ether, ip, broadcast);
+}
+
+bool arpIsSameIp(uint8_t ip1[], uint8_t ip2[])
+{
+    uint8_t i;
+    for (i = 0; i < IP_ADD_LENGTH; i++)
+        if (ip1[i] != ip2[i])
+            return false;
+    return true;
+}
+
+// Builds the request in its own small frame, so callers can keep the one they are working on
+void arpSendRequest(uint8_t ip[], uint8_t mac[])
+{
+    uint8_t frame[sizeof(etherHeader) + sizeof(arpPacket)];
+    if (mac == 0)
+        etherSendArpRequest((etherHeader*)frame, ip);
+    else
+        etherSendArpRequestTo((etherHeader*)frame, ip, mac);
+}
+
+arpEntry* arpFind(uint8_t ip[])
+{
+    uint8_t i;
+    for (i = 0; i < ARP_CACHE_SIZE; i++)
+        if (arpCache[i].state != ARP_FREE && arpIsSameIp(arpCache[i].ip, ip))
+            return &arpCache[i];
+    return 0;
+}
+
+// Drops the frames waiting on ip
+void arpDropQueued(uint8_t ip[])
+{
+    uint8_t i;
+    for (i = 0; i < ARP_QUEUE_SIZE; i++)
+        if (arpQueue[i].inUse && arpIsSameIp(arpQueue[i].ip, ip))
+            arpQueue[i].inUse = false;
+}
+
+// Takes a free entry, or the one closest to expiring when the cache is full
+arpEntry* arpAllocate(uint8_t ip[])
+{
+    arpEntry *entry = &arpCache[0];
+    arpEntry *candidate;
+    uint8_t i;
+    for (i = 0; i < ARP_CACHE_SIZE && entry->state != ARP_FREE; i++)
+    {
+        candidate = &arpCache[i];
+        // Lookups in progress are kept over resolved entries
+        if (candidate->state == ARP_FREE ||
+            (candidate->state == ARP_RESOLVED && (entry->state == ARP_PENDING || (int32_t)(candidate->time - entry->time) < 0)))
+            entry = candidate;
+    }
+    if (entry->state == ARP_PENDING)
+        arpDropQueued(entry->ip);
+    for (i = 0; i < IP_ADD_LENGTH; i++)
+        entry->ip[i] = ip[i];
+    entry->state = ARP_FREE;
+    entry->used = false;
+    entry->refreshSent = false;
+    entry->retries = 0;
+    return entry;
+}
+
+// Stores the answer and sends what was waiting for it
+void arpUpdate(arpEntry *entry, uint8_t mac[])
+{
+    arpQueuedFrame *queued;
+    uint8_t i, j;
+    for (i = 0; i < HW_ADD_LENGTH; i++)
+        entry->mac[i] = mac[i];
+    entry->state = ARP_RESOLVED;
+    entry->time = getMilliseconds() + ARP_ENTRY_LIFETIME;
+    entry->retries = 0;
+    entry->used = false;
+    entry->refreshSent = false;
+    // Oldest first
+    do
+    {
+        queued = 0;
+        for (i = 0; i < ARP_QUEUE_SIZE; i++)
+        {
+            if (arpQueue[i].inUse && arpIsSameIp(arpQueue[i].ip, entry->ip) &&
+                (queued == 0 || (int8_t)(arpQueue[i].sequence - queued->sequence) < 0))
+                queued = &arpQueue[i];
+        }
+        if (queued != 0)
+        {
+            for (j = 0; j < HW_ADD_LENGTH; j++)
+                ((etherHeader*)queued->frame)->destAddress[j] = mac[j];
+            etherPutPacket((etherHeader*)queued->frame, queued->size);
+            queued->inUse = false;
+        }
+    }
+    while (queued != 0);
+}
+
+// Learns from every ARP packet (RFC 826 packet reception) and answers requests for our IP
+// Hosts that are not talking to us only have their entries kept up to date
+void etherHandleArp(etherHeader *ether)
+{
+    arpPacket *arp = (arpPacket*)ether->data;
+    arpEntry *entry;
+    bool forUs;
+    if (ether->frameType != htons(0x0806) || arp->hardwareType != htons(1) || arp->protocolType != htons(0x0800))
+        return;
+    forUs = arpIsSameIp(arp->destIp, ipAddress);
+    // A probe (RFC 5227) has no sender address to learn
+    if (arp->sourceIp[0] || arp->sourceIp[1] || arp->sourceIp[2] || arp->sourceIp[3])
+    {
+        entry = arpFind(arp->sourceIp);
+        if (entry == 0 && forUs)
+            entry = arpAllocate(arp->sourceIp);
+        if (entry != 0)
+            arpUpdate(entry, arp->sourceAddress);
+    }
+    if (forUs && arp->op == htons(1))
+        etherSendArpResponse(ether);
+}
+
+// Gets the MAC address of ip if it is in the cache
+bool etherArpLookup(uint8_t ip[], uint8_t mac[])
+{
+    arpEntry *entry = arpFind(ip);
+    uint8_t i;
+    if (entry == 0 || entry->state != ARP_RESOLVED)
+        return false;
+    for (i = 0; i < HW_ADD_LENGTH; i++)
+        mac[i] = entry->mac[i];
+    return true;
+}
+
+// Determines whether ip is on our subnet
+bool etherIsLocalIp(uint8_t ip[])
+{
+    uint8_t i;
+    for (i = 0; i < IP_ADD_LENGTH; i++)
+        if (((ip[i] ^ ipAddress[i]) & ipSubnetMask[i]) != 0)
+            return false;
+    return true;
+}
+
+// Determines whether ip is the limited broadcast address or the broadcast address of our subnet
+bool etherIsBroadcastIp(uint8_t ip[])
+{
+    uint8_t i;
+    bool limited = true, directed = etherIsLocalIp(ip);
+    for (i = 0; i < IP_ADD_LENGTH; i++)
+    {
+        limited = limited && ip[i] == 0xFF;
+        directed = directed && (ip[i] | ipSubnetMask[i]) == 0xFF;
+    }
+    return limited || directed;
+}
+
+// Picks the host on this link a packet for ip is handed to (RFC 1122 3.3.1.1)
+// Destinations on our subnet are sent to directly, the rest go to the gateway
+// Returns false if ip is not on our subnet and no gateway is set
+bool etherGetNextHop(uint8_t ip[], uint8_t nextHop[])
+{
+    uint8_t i;
+    bool local = etherIsLocalIp(ip);
+    for (i = 0; i < IP_ADD_LENGTH; i++)
+        nextHop[i] = local ? ip[i] : ipGwAddress[i];
+    return local || ipGwAddress[0] || ipGwAddress[1] || ipGwAddress[2] || ipGwAddress[3];
+}
+
+// Class D, 224.0.0.0 to 239.255.255.255
+bool etherIsMulticastIp(uint8_t ip[])
+{
+    return (ip[0] & 0xF0) == 0xE0;
+}
+
+// RFC 1112 6.4: 01:00:5E followed by the low 23 bits of the group
+void etherGetMulticastMac(uint8_t ip[], uint8_t mac[])
+{
+    mac[0] = 0x01;
+    mac[1] = 0x00;
+    mac[2] = 0x5E;
+    mac[3] = ip[1] & 0x7F;
+    mac[4] = ip[2];
+    mac[5] = ip[3];
+}
+
+// Bit of the hash table filter a destination MAC falls on
+// This is bits 28:23 of the frame CRC over the address, the bytes go in least significant bit first
+uint8_t etherGetHashIndex(uint8_t mac[])
+{
+    uint32_t crc = 0xFFFFFFFF;
+    uint8_t i, j, data;
+    for (i = 0; i < HW_ADD_LENGTH; i++)
+    {
+        data = mac[i];
+        for (j = 0; j < 8; j++)
+        {
+            if (((crc >> 31) ^ data) & 1)
+                crc = (crc << 1) ^ 0x04C11DB7;
+            else
+                crc <<= 1;
+            data >>= 1;
+        }
+    }
+    return (crc >> 23) & 0x3F;
+}
+
+// Loads EHT0-EHT7, bit i of the 64 is table[i >> 3] bit (i & 7)
+// Frames whose destination hashes to a set bit pass the filter, so more get in than were asked for
+void etherSetHashTable(uint8_t table[])
+{
+    uint8_t i;
+    etherSetBank(EHT0);
+    for (i = 0; i < 8; i++)
+        etherWriteReg(EHT0 + i, table[i]);
+}
+
+// Sends an IP packet to the MAC address the ARP cache has for its next hop
+// An unknown next hop is looked up and the frame is held until the answer comes, so this never waits
+// Off subnet destinations share the gateway's entry
+// Returns false if the frame was dropped
+bool etherPutIpPacket(etherHeader *ether, uint16_t size)
+{
+    ipHeader *ip = (ipHeader*)ether->data;
+    uint8_t nextHop[IP_ADD_LENGTH];
+    arpEntry *entry;
+    arpQueuedFrame *queued;
+    uint8_t i;
+    uint16_t j;
+    for (i = 0; i < HW_ADD_LENGTH; i++)
+        ether->sourceAddress[i] = macAddress[i];
+    // Multicasts and broadcasts need no lookup
+    if (etherIsMulticastIp(ip->destIp))
+    {
+        etherGetMulticastMac(ip->destIp, ether->destAddress);
+        return etherPutPacket(ether, size);
+    }
+    if (etherIsBroadcastIp(ip->destIp))
+    {
+        for (i = 0; i < HW_ADD_LENGTH; i++)
+            ether->destAddress[i] = 0xFF;
+        return etherPutPacket(ether, size);
+    }
+    if (!etherGetNextHop(ip->destIp, nextHop))
+        return false;
+    entry = arpFind(nextHop);
+    if (entry != 0 && entry->state == ARP_RESOLVED)
+    {
+        entry->used = true;
+        for (i = 0; i < HW_ADD_LENGTH; i++)
+            ether->destAddress[i] = entry->mac[i];
+        return etherPutPacket(ether, size);
+    }
+    if (size > ARP_MAX_FRAME_SIZE)
+        return false;
+    if (entry == 0)
+    {
+        entry = arpAllocate(nextHop);
+        entry->state = ARP_PENDING;
+        entry->time = getMilliseconds() + ARP_RETRY_TIME;
+        arpSendRequest(nextHop, 0);
+    }
+    // RFC 1122 2.3.2.2: keep the latest frame, so the oldest is dropped when the queue is full
+    queued = 0;
+    for (i = 0; i < ARP_QUEUE_SIZE && (queued == 0 || queued->inUse); i++)
+    {
+        if (queued == 0 || !arpQueue[i].inUse || (int8_t)(arpQueue[i].sequence - queued->sequence) < 0)
+            queued = &arpQueue[i];
+    }
+    queued->sequence = arpQueueSequence++;
+    for (i = 0; i < IP_ADD_LENGTH; i++)
+        queued->ip[i] = nextHop[i];
+    for (j = 0; j < size; j++)
+        queued->frame[j] = ((uint8_t*)ether)[j];
+    queued->size = size;
+    queued->inUse = true;
+    return true;
+}
+
+// Sends unanswered requests again, confirms entries in use before they expire and forgets the rest
+// Call this on every pass of the main loop
+void etherArpTick()
+{
+    arpEntry *entry;
+    uint32_t now = getMilliseconds();
+    uint8_t i;
+    for (i = 0; i < ARP_CACHE_SIZE; i++)
+    {
+        entry = &arpCache[i];
+        if (entry->state == ARP_PENDING && (int32_t)(now - entry->time) >= 0)
+        {
+            if (entry->retries == ARP_MAX_RETRIES)
+            {
+                arpDropQueued(entry->ip);
+                entry->state = ARP_FREE;
+                continue;
+            }
+            entry->retries++;
+            entry->time = now + ARP_RETRY_TIME;
+            arpSendRequest(entry->ip, 0);
+        }
+        else if (entry->state == ARP_RESOLVED)
+        {
+            if ((int32_t)(now - entry->time) >= 0)
+                entry->state = ARP_FREE;
+            else if (entry->used && !entry->refreshSent && (int32_t)(now - (entry->time - ARP_REFRESH_TIME)) >= 0)
+            {
+                // Unicast, so the hosts that do not need it are not bothered
+                arpSendRequest(entry->ip, entry->mac);
+                entry->refreshSent = true;
+            }
+        }
+    }
+}
+
 // Determines whether packet is UDP datagram
 // Must be an IP packet
 bool etherIsUdp(etherHeader *ether)
@@ -743,13 +1115,14 @@ uint8_t * etherGetUdpData(etherHeader *ether)
 // Send responses to a udp datagram 
 // destination port, ip, and hardware address are extracted from provided data
 // uses destination port of received packet as destination of this packet
-void etherSendUdpResponse(etherHeader *ether, uint8_t *udpData, uint8_t udpSize)
+void etherSendUdpResponse(etherHeader *ether, uint8_t *udpData, uint16_t udpSize)
 {
     ipHeader *ip = (ipHeader*)ether->data;
     uint8_t ipHeaderLength = (ip->revSize & 0xF) * 4;
     udpHeader *udp = (udpHeader*)((uint8_t*)ip + ipHeaderLength);
     uint8_t *copyData;
-    uint8_t i, tmp8;
+    uint8_t tmp8;
+    uint16_t i;
     uint16_t tmp16;
     uint16_t udpLength;
     uint32_t sum = 0;
@@ -797,6 +1170,47 @@ void etherSendUdpResponse(etherHeader *ether, uint8_t *udpData, uint8_t udpSize)
     etherPutPacket(ether, sizeof(etherHeader) + ipHeaderLength + udpLength);
 }
 
+// Sends the dataSize bytes already at udp->data of a 20 byte IP header to destIp
+// The source is our IP, which is 0.0.0.0 while DHCP has no lease
+// Returns false if the frame was dropped
+bool etherPutUdpPacket(etherHeader *ether, uint8_t destIp[], uint16_t sourcePort, uint16_t destPort, uint16_t dataSize)
+{
+    ipHeader *ip = (ipHeader*)ether->data;
+    udpHeader *udp = (udpHeader*)ip->data;
+    uint16_t tmp16;
+    uint16_t udpLength = sizeof(udpHeader) + dataSize;
+    uint32_t sum = 0;
+    uint8_t i;
+
+    ether->frameType = htons(0x0800);
+    ip->revSize = 0x45;
+    ip->typeOfService = 0;
+    ip->length = htons(sizeof(ipHeader) + udpLength);
+    ip->id = 0;
+    ip->flagsAndOffset = 0;
+    ip->ttl = 64;
+    ip->protocol = 0x11;
+    for (i = 0; i < IP_ADD_LENGTH; i++)
+    {
+        ip->sourceIp[i] = ipAddress[i];
+        ip->destIp[i] = destIp[i];
+    }
+    etherCalcIpChecksum(ip);
+    udp->sourcePort = htons(sourcePort);
+    udp->destPort = htons(destPort);
+    udp->length = htons(udpLength);
+    // 32-bit sum over pseudo-header
+    etherSumWords(ip->sourceIp, 8, &sum);
+    tmp16 = ip->protocol;
+    sum += (tmp16 & 0xff) << 8;
+    etherSumWords(&udp->length, 2, &sum);
+    // add udp header and data
+    udp->check = 0;
+    etherSumWords(udp, udpLength, &sum);
+    udp->check = getEtherChecksum(sum);
+    return etherPutIpPacket(ether, sizeof(etherHeader) + sizeof(ipHeader) + udpLength);
+}
+
 uint16_t etherGetId()
 {
     return htons(sequenceId);
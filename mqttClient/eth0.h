@@ -137,6 +137,50 @@ typedef struct _tcpHeader // 20 or more bytes
 #define ETHER_HALFDUPLEX     0x00
 #define ETHER_FULLDUPLEX     0x100
 
+// ARP cache (RFC 826), entries are looked up by IP address
+#define ARP_CACHE_SIZE       8
+// How long (ms) a resolved entry is used before it has to be confirmed again
+#define ARP_ENTRY_LIFETIME   120000
+// Entries in use are confirmed with a unicast request this long (ms) before they expire (RFC 1122 2.3.2.1)
+#define ARP_REFRESH_TIME     10000
+// Unanswered requests are sent again every ARP_RETRY_TIME ms, after ARP_MAX_RETRIES the entry is dropped
+#define ARP_RETRY_TIME       500
+#define ARP_MAX_RETRIES      3
+// Outbound frames held while their destination is resolved, the oldest is dropped when more come
+#define ARP_QUEUE_SIZE       2
+// Ether frame header (14) + Max MTU (1500)
+#define ARP_MAX_FRAME_SIZE   1514
+
+typedef enum _arpState
+{
+    ARP_FREE = 0,
+    ARP_PENDING,
+    ARP_RESOLVED
+} arpState;
+
+typedef struct _arpEntry
+{
+    arpState state;
+    uint8_t ip[4];
+    uint8_t mac[6];
+    // When a resolved entry expires, or when a pending request is sent again
+    uint32_t time;
+    uint8_t retries;
+    // Used since it was last confirmed, entries nobody uses are left to expire
+    bool used;
+    bool refreshSent;
+} arpEntry;
+
+typedef struct _arpQueuedFrame
+{
+    bool inUse;
+    // Frames are sent in the order they were queued
+    uint8_t sequence;
+    uint8_t ip[4];
+    uint16_t size;
+    uint8_t frame[ARP_MAX_FRAME_SIZE];
+} arpQueuedFrame;
+
 #define LOBYTE(x) ((x) & 0xFF)
 #define HIBYTE(x) (((x) >> 8) & 0xFF)
 
@@ -161,15 +205,30 @@ bool etherIsIpUnicast(etherHeader *ether);
 
 bool etherIsPingRequest(etherHeader *ether);
 void etherSendPingResponse(etherHeader *ether);
+bool etherIsPingReply(etherHeader *ether);
+bool etherSendPingRequest(etherHeader *ether, uint8_t ip[], uint16_t id, uint16_t seq, uint16_t dataSize);
 
 bool etherIsArpRequest(etherHeader *ether);
 bool etherIsArpResponse(etherHeader* ether);
 void etherSendArpResponse(etherHeader *ether);
 void etherSendArpRequest(etherHeader *ether, uint8_t ip[]);
+void etherSendArpRequestTo(etherHeader *ether, uint8_t ip[], uint8_t mac[]);
+void etherHandleArp(etherHeader *ether);
+bool etherArpLookup(uint8_t ip[], uint8_t mac[]);
+bool etherIsLocalIp(uint8_t ip[]);
+bool etherIsBroadcastIp(uint8_t ip[]);
+bool etherGetNextHop(uint8_t ip[], uint8_t nextHop[]);
+bool etherIsMulticastIp(uint8_t ip[]);
+void etherGetMulticastMac(uint8_t ip[], uint8_t mac[]);
+uint8_t etherGetHashIndex(uint8_t mac[]);
+void etherSetHashTable(uint8_t table[]);
+bool etherPutIpPacket(etherHeader *ether, uint16_t size);
+void etherArpTick();
 
 bool etherIsUdp(etherHeader *ether);
 uint8_t* etherGetUdpData(etherHeader *ether);
-void etherSendUdpResponse(etherHeader *ether, uint8_t* udpData, uint8_t udpSize);
+void etherSendUdpResponse(etherHeader *ether, uint8_t* udpData, uint16_t udpSize);
+bool etherPutUdpPacket(etherHeader *ether, uint8_t destIp[], uint16_t sourcePort, uint16_t destPort, uint16_t dataSize);
 
 void etherEnableDhcpMode();
 void etherDisableDhcpMode();
@@ -0,0 +1,223 @@
+/*
+ * igmp.c
+ * Joins multicast groups and answers the router's membership queries (IGMPv2, RFC 2236)
+ * The ENC28J60 hash table is loaded with the groups so their frames get past the receive filter
+ *
+ *  Created on: Apr 20, 2021
+ *      Author: Sarker Nadir Afridi Azmi
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "eth0.h"
+#include "igmp.h"
+#include "utils.h"
+#include "timer0.h"
+
+igmpGroup groups[IGMP_MAX_GROUPS];
+uint32_t igmpSeed = 0;
+
+uint8_t allHostsGroup[4] = {224, 0, 0, 1};
+uint8_t allRoutersGroup[4] = {224, 0, 0, 2};
+
+bool igmpIsSameIp(uint8_t ip1[], uint8_t ip2[])
+{
+    return ip1[0] == ip2[0] && ip1[1] == ip2[1] && ip1[2] == ip2[2] && ip1[3] == ip2[3];
+}
+
+igmpGroup* igmpFindGroup(uint8_t ip[])
+{
+    uint8_t i = 0;
+    for(i = 0; i < IGMP_MAX_GROUPS; i++)
+        if(groups[i].state != IGMP_FREE && igmpIsSameIp(groups[i].ip, ip))
+            return &groups[i];
+    return 0;
+}
+
+// Random delay below maxDelay milliseconds, so members answering the same query spread out
+uint32_t igmpRandomDelay(uint32_t maxDelay)
+{
+    uint8_t mac[6];
+    etherGetMacAddress(mac);
+    igmpSeed = igmpSeed * 1103515245 + 12345 + mac[5] + getMicroseconds();
+    return maxDelay ? (igmpSeed >> 8) % maxDelay : 0;
+}
+
+// A report is sent at the earlier of the time it is already due and delay from now
+void igmpScheduleReport(igmpGroup* group, uint32_t delay)
+{
+    uint32_t time = getMilliseconds() + delay;
+    if(!group->reportPending || (int32_t)(time - group->reportTime) < 0)
+        group->reportTime = time;
+    group->reportPending = true;
+}
+
+// Sets the hash table bits of every group we are in and of 224.0.0.1, where the queries go
+void igmpUpdateFilter()
+{
+    uint8_t table[8] = {0};
+    uint8_t mac[6];
+    uint8_t i = 0, index = 0;
+    etherGetMulticastMac(allHostsGroup, mac);
+    index = etherGetHashIndex(mac);
+    table[index >> 3] |= 1 << (index & 7);
+    for(i = 0; i < IGMP_MAX_GROUPS; i++)
+    {
+        if(groups[i].state != IGMP_MEMBER)
+            continue;
+        etherGetMulticastMac(groups[i].ip, mac);
+        index = etherGetHashIndex(mac);
+        table[index >> 3] |= 1 << (index & 7);
+    }
+    etherSetHashTable(table);
+}
+
+// The report goes to the group itself and the leave to all routers
+// Both carry the router alert option (RFC 2236 2) and a TTL of 1
+void igmpSendMessage(etherHeader* ether, uint8_t type, uint8_t group[], uint8_t destIp[])
+{
+    ipHeader* ip = (ipHeader*)ether->data;
+    uint8_t* options = ip->data;
+    igmpHeader* igmp = (igmpHeader*)(options + 4);
+    uint32_t sum = 0;
+
+    ether->frameType = htons(0x0800);
+    // 24 byte header with the 4 byte router alert option
+    ip->revSize = 0x46;
+    ip->typeOfService = 0;
+    ip->length = htons(sizeof(ipHeader) + 4 + sizeof(igmpHeader));
+    ip->id = 0;
+    ip->flagsAndOffset = 0;
+    ip->ttl = 1;
+    ip->protocol = 0x02;
+    etherGetIpAddress(ip->sourceIp);
+    copyUint8Array(destIp, ip->destIp, 4);
+    options[0] = 0x94;
+    options[1] = 0x04;
+    options[2] = 0;
+    options[3] = 0;
+    etherCalcIpChecksum(ip);
+
+    igmp->type = type;
+    igmp->maxResponseTime = 0;
+    igmp->check = 0;
+    copyUint8Array(group, igmp->group, 4);
+    etherSumWords(igmp, sizeof(igmpHeader), &sum);
+    igmp->check = getEtherChecksum(sum);
+    etherPutIpPacket(ether, sizeof(etherHeader) + sizeof(ipHeader) + 4 + sizeof(igmpHeader));
+}
+
+// Starts receiving frames for group and tells the routers
+// Returns false if group is not a multicast address or there is no free slot
+bool igmpJoin(uint8_t group[4])
+{
+    igmpGroup* entry = igmpFindGroup(group);
+    uint8_t i = 0;
+    // 224.0.0.1 is joined from the start and is never reported
+    if(!etherIsMulticastIp(group) || igmpIsSameIp(group, allHostsGroup))
+        return false;
+    for(i = 0; i < IGMP_MAX_GROUPS && entry == 0; i++)
+        if(groups[i].state == IGMP_FREE)
+            entry = &groups[i];
+    if(entry == 0)
+        return false;
+    if(entry->state == IGMP_MEMBER)
+        return true;
+    copyUint8Array(group, entry->ip, 4);
+    entry->state = IGMP_MEMBER;
+    entry->lastReporter = false;
+    entry->unsolicitedLeft = IGMP_UNSOLICITED_REPORTS;
+    entry->reportPending = false;
+    igmpScheduleReport(entry, 0);
+    igmpUpdateFilter();
+    return true;
+}
+
+// Stops receiving frames for group, the leave message goes out from igmpTick
+void igmpLeave(uint8_t group[4])
+{
+    igmpGroup* entry = igmpFindGroup(group);
+    if(entry == 0 || entry->state != IGMP_MEMBER)
+        return;
+    entry->state = IGMP_LEAVING;
+    entry->reportPending = false;
+    igmpUpdateFilter();
+}
+
+// Whether datagrams sent to ip are for us
+bool igmpIsMember(uint8_t ip[4])
+{
+    igmpGroup* entry = igmpFindGroup(ip);
+    return igmpIsSameIp(ip, allHostsGroup) || (entry != 0 && entry->state == IGMP_MEMBER);
+}
+
+// Determines whether packet is IGMP with a good checksum
+// Must be an IP packet
+bool etherIsIgmp(etherHeader* ether)
+{
+    ipHeader* ip = (ipHeader*)ether->data;
+    uint8_t ipHeaderLength = (ip->revSize & 0xF) << 2;
+    uint32_t sum = 0;
+    if(ip->protocol != 0x02 || ntohs(ip->length) < ipHeaderLength + sizeof(igmpHeader))
+        return false;
+    etherSumWords((uint8_t*)ip + ipHeaderLength, ntohs(ip->length) - ipHeaderLength, &sum);
+    return getEtherChecksum(sum) == 0;
+}
+
+// Answers queries after a random delay and stays quiet when another member answers first
+void igmpInput(etherHeader* ether)
+{
+    ipHeader* ip = (ipHeader*)ether->data;
+    igmpHeader* igmp = (igmpHeader*)((uint8_t*)ip + ((ip->revSize & 0xF) << 2));
+    igmpGroup* entry = 0;
+    uint32_t maxDelay = 0;
+    uint8_t i = 0;
+    bool generalQuery = !(igmp->group[0] || igmp->group[1] || igmp->group[2] || igmp->group[3]);
+
+    switch(igmp->type)
+    {
+    case IGMP_MEMBERSHIP_QUERY:
+        maxDelay = (igmp->maxResponseTime ? igmp->maxResponseTime : IGMP_DEFAULT_MAX_RESPONSE) * 100;
+        for(i = 0; i < IGMP_MAX_GROUPS; i++)
+            if(groups[i].state == IGMP_MEMBER && (generalQuery || igmpIsSameIp(groups[i].ip, igmp->group)))
+                igmpScheduleReport(&groups[i], igmpRandomDelay(maxDelay));
+        break;
+    case IGMP_V1_REPORT:
+    case IGMP_V2_REPORT:
+        entry = igmpFindGroup(igmp->group);
+        if(entry != 0 && entry->state == IGMP_MEMBER)
+        {
+            entry->reportPending = false;
+            entry->unsolicitedLeft = 0;
+            entry->lastReporter = false;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+// Sends the reports and leaves that are due
+// Call this on every pass of the main loop, the frame is only used to build messages
+void igmpTick(etherHeader* ether)
+{
+    uint8_t i = 0;
+    for(i = 0; i < IGMP_MAX_GROUPS; i++)
+    {
+        if(groups[i].state == IGMP_LEAVING)
+        {
+            if(groups[i].lastReporter)
+                igmpSendMessage(ether, IGMP_LEAVE_GROUP, groups[i].ip, allRoutersGroup);
+            groups[i].state = IGMP_FREE;
+            continue;
+        }
+        if(groups[i].state != IGMP_MEMBER || !groups[i].reportPending || (int32_t)(getMilliseconds() - groups[i].reportTime) < 0)
+            continue;
+        groups[i].reportPending = false;
+        groups[i].lastReporter = true;
+        igmpSendMessage(ether, IGMP_V2_REPORT, groups[i].ip, groups[i].ip);
+        // The first report of a join may be lost, so it is repeated (RFC 2236 3)
+        if(groups[i].unsolicitedLeft > 0 && --groups[i].unsolicitedLeft > 0)
+            igmpScheduleReport(&groups[i], igmpRandomDelay(IGMP_UNSOLICITED_REPORT_INTERVAL));
+    }
+}
@@ -0,0 +1,65 @@
+/*
+ * igmp.h
+ * IGMPv2 group membership (RFC 2236)
+ *
+ *  Created on: Apr 20, 2021
+ *      Author: Sarker Nadir Afridi Azmi
+ */
+
+#ifndef IGMP_H_
+#define IGMP_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "eth0.h"
+
+// Groups that can be joined at once, 224.0.0.1 is always on top of these
+#define IGMP_MAX_GROUPS         4
+// A join is reported this many times, this many milliseconds apart at most (RFC 2236 8.10)
+#define IGMP_UNSOLICITED_REPORTS            2
+#define IGMP_UNSOLICITED_REPORT_INTERVAL    10000
+// Used when a query leaves the maximum response time at zero, which is what IGMPv1 routers do
+#define IGMP_DEFAULT_MAX_RESPONSE           100
+
+// Message types
+#define IGMP_MEMBERSHIP_QUERY   0x11
+#define IGMP_V1_REPORT          0x12
+#define IGMP_V2_REPORT          0x16
+#define IGMP_LEAVE_GROUP        0x17
+
+typedef struct _igmpHeader // 8 bytes
+{
+    uint8_t type;
+    // In tenths of a second, only used in queries
+    uint8_t maxResponseTime;
+    uint16_t check;
+    uint8_t group[4];
+} igmpHeader;
+
+typedef enum _igmpGroupState
+{
+    IGMP_FREE = 0,
+    IGMP_MEMBER,
+    IGMP_LEAVING
+} igmpGroupState;
+
+typedef struct _igmpGroup
+{
+    igmpGroupState state;
+    uint8_t ip[4];
+    // A report is due at reportTime, a report from another member cancels it
+    bool reportPending;
+    uint32_t reportTime;
+    uint8_t unsolicitedLeft;
+    // Only the member that sent the last report has to say it is leaving
+    bool lastReporter;
+} igmpGroup;
+
+bool igmpJoin(uint8_t group[4]);
+void igmpLeave(uint8_t group[4]);
+bool igmpIsMember(uint8_t ip[4]);
+bool etherIsIgmp(etherHeader* ether);
+void igmpInput(etherHeader* ether);
+void igmpTick(etherHeader* ether);
+
+#endif /* IGMP_H_ */
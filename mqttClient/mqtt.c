@@ -11,73 +11,270 @@
 #include "utils.h"
 #include "mqtt.h"
 #include "cli.h"
+#include "timer0.h"
 
-// The offset determines how many byte we have encoded
-uint32_t encodeMqttRemainingLength(uint32_t X, uint8_t* offset)
+// Subscription registry, a trie of topic levels
+mqttTopicNode topicNodes[MQTT_MAX_TOPIC_NODES];
+// Nodes are found from their parent and name through these, 0 is an empty bucket
+uint8_t topicBuckets[MQTT_TOPIC_BUCKETS];
+uint8_t topicNames[MQTT_TOPIC_NAMES_SIZE];
+uint16_t topicNamesSize = 0;
+
+// QoS 1 and 2 publishes waiting for the broker
+mqttInFlight inFlight[MQTT_MAX_IN_FLIGHT];
+uint8_t inFlightBuffer[MQTT_IN_FLIGHT_BUFFER_SIZE];
+uint16_t inFlightSize = 0;
+uint32_t inFlightSequence = 0;
+uint16_t lastPacketIdentifier = 0;
+// Where mqttGetDuePublish builds a PUBREL
+uint8_t pubrelPacket[MQTT_PUBLISH_ACK_SIZE];
+
+// PROTOCOL_LEVEL_V311 or PROTOCOL_LEVEL_V5, packets are built and read for this one
+uint8_t protocolLevel = PROTOCOL_LEVEL_V311;
+// Publishes the broker takes before it has acknowledged them, from its CONNACK (MQTT 5 3.2.2.3.3)
+uint16_t inFlightLimit = MQTT_MAX_IN_FLIGHT;
+// Topic aliases of this connection, the broker's CONNACK says how many of ours it takes
+mqttTopicAlias outboundAliases[MQTT_MAX_TOPIC_ALIASES];
+uint16_t outboundAliasLimit = 0;
+mqttTopicAlias inboundAliases[MQTT_MAX_INBOUND_ALIASES];
+
+// Identifiers of the QoS 2 publishes received, 0 is a free slot as no publish uses it
+uint16_t receivedIdentifiers[MQTT_MAX_RECEIVED];
+// The last QoS 1 publishes received, recentNext is the oldest
+uint16_t recentIdentifiers[MQTT_RECENT_WINDOW];
+uint8_t recentNext = 0;
+
+void mqttSetProtocolLevel(uint8_t level)
+{
+    protocolLevel = level;
+}
+
+uint8_t mqttGetProtocolLevel()
+{
+    return protocolLevel;
+}
+
+// Remaining lengths and property lengths are 7 bits to a byte, least significant first,
+// the top bit says another one follows (MQTT 2.2.3)
+// Returns the bytes written
+uint8_t mqttPutVariableInteger(uint8_t* data, uint32_t value)
 {
-    uint32_t encodedByte = 0;
     uint8_t i = 0;
     do
     {
-        encodedByte |= (X & 127) << (i << 3);
-        X = X / 128;
-        if(X > 0)
-            encodedByte |= (128 << (i << 3));
-        else
-        {
-            *offset = i + 1;
-            return encodedByte;
-        }
+        data[i] = value & 127;
+        value >>= 7;
+        if(value > 0)
+            data[i] |= 128;
         i++;
     }
-    while(X > 0);
-    return encodedByte;
+    while(value > 0);
+    return i;
 }
 
-uint32_t decodeMqttRemainingLength(uint32_t X)
+// Returns the bytes read, 0 if there are more than 4 or they run past length
+uint8_t mqttGetVariableInteger(uint8_t* data, uint32_t length, uint32_t* value)
 {
-    uint32_t size = 0;
     uint8_t i = 0;
-    while(X)
+    *value = 0;
+    do
+    {
+        if(i == 4 || i >= length)
+            return 0;
+        *value |= (uint32_t)(data[i] & 127) << (7 * i);
+    }
+    while(data[i++] & 128);
+    return i;
+}
+
+// Where the variable header of a whole packet in a buffer starts, and its remaining length
+uint8_t* mqttGetVariableHeader(uint8_t* packet, uint32_t* remainingLength)
+{
+    return packet + 1 + mqttGetVariableInteger(packet + 1, 4, remainingLength);
+}
+
+// MQTT 5 2.2.2.2
+mqttPropertyType mqttGetPropertyType(uint8_t id)
+{
+    switch(id)
+    {
+    case 0x01: case 0x17: case 0x19: case 0x24: case 0x25: case 0x28: case 0x29: case 0x2A:
+        return MQTT_PROPERTY_BYTE;
+    case 0x13: case 0x21: case 0x22: case 0x23:
+        return MQTT_PROPERTY_TWO_BYTES;
+    case 0x02: case 0x11: case 0x18: case 0x27:
+        return MQTT_PROPERTY_FOUR_BYTES;
+    case 0x0B:
+        return MQTT_PROPERTY_VARIABLE;
+    case 0x03: case 0x08: case 0x09: case 0x12: case 0x15: case 0x16: case 0x1A: case 0x1C: case 0x1F:
+        return MQTT_PROPERTY_STRING;
+    case 0x26:
+        return MQTT_PROPERTY_STRING_PAIR;
+    default:
+        return MQTT_PROPERTY_UNKNOWN;
+    }
+}
+
+// Writes a property that has a number for its value
+// Returns the bytes written, 0 for a property that is not a number
+uint8_t mqttPutProperty(uint8_t* data, uint8_t id, uint32_t value)
+{
+    data[0] = id;
+    switch(mqttGetPropertyType(id))
+    {
+    case MQTT_PROPERTY_BYTE:
+        data[1] = value;
+        return 2;
+    case MQTT_PROPERTY_TWO_BYTES:
+        data[1] = value >> 8;
+        data[2] = value & 0xFF;
+        return 3;
+    case MQTT_PROPERTY_FOUR_BYTES:
+        data[1] = value >> 24;
+        data[2] = (value >> 16) & 0xFF;
+        data[3] = (value >> 8) & 0xFF;
+        data[4] = value & 0xFF;
+        return 5;
+    case MQTT_PROPERTY_VARIABLE:
+        return 1 + mqttPutVariableInteger(data + 1, value);
+    default:
+        return 0;
+    }
+}
+
+// Bytes the property at the start of data takes, 0 if it is not known or runs past length
+uint32_t mqttGetPropertySize(uint8_t* data, uint32_t length)
+{
+    uint32_t size = 0, value = 0;
+    switch(mqttGetPropertyType(data[0]))
+    {
+    case MQTT_PROPERTY_BYTE:
+        size = 2;
+        break;
+    case MQTT_PROPERTY_TWO_BYTES:
+        size = 3;
+        break;
+    case MQTT_PROPERTY_FOUR_BYTES:
+        size = 5;
+        break;
+    case MQTT_PROPERTY_VARIABLE:
+        size = mqttGetVariableInteger(data + 1, length - 1, &value);
+        if(size == 0)
+            return 0;
+        size++;
+        break;
+    case MQTT_PROPERTY_STRING:
+        if(length < 3)
+            return 0;
+        size = 3 + (((uint16_t)data[1] << 8) | data[2]);
+        break;
+    case MQTT_PROPERTY_STRING_PAIR:
+        if(length < 3)
+            return 0;
+        size = 3 + (((uint16_t)data[1] << 8) | data[2]);
+        if(size + 2 > length)
+            return 0;
+        size += 2 + (((uint16_t)data[size] << 8) | data[size + 1]);
+        break;
+    default:
+        return 0;
+    }
+    return (size <= length) ? size : 0;
+}
+
+// Reads the length in front of a property list and checks every property in it
+// Returns where the first property is, or 0 if the list is malformed or runs past length
+uint8_t* mqttGetProperties(uint8_t* data, uint32_t length, uint32_t* propertiesLength)
+{
+    uint8_t lengthBytes = mqttGetVariableInteger(data, length, propertiesLength);
+    uint32_t offset = 0, size = 0;
+    if(lengthBytes == 0 || *propertiesLength > length - lengthBytes)
+        return 0;
+    data += lengthBytes;
+    while(offset < *propertiesLength)
     {
-        size |= (X & 0x0000007F) << (i++ * 7);
-        if(X & 128)
-            X >>= 8;
-        else
+        size = mqttGetPropertySize(data + offset, *propertiesLength - offset);
+        if(size == 0)
+            return 0;
+        offset += size;
+    }
+    return data;
+}
+
+// Gets a property that has a number for its value from a list mqttGetProperties checked
+// Returns false if the list does not have it
+bool mqttGetProperty(uint8_t* properties, uint32_t length, uint8_t id, uint32_t* value)
+{
+    uint32_t offset = 0;
+    uint8_t* data = 0;
+    while(offset < length)
+    {
+        data = properties + offset;
+        if(data[0] != id)
         {
-            return size;
+            offset += mqttGetPropertySize(data, length - offset);
+            continue;
+        }
+        switch(mqttGetPropertyType(id))
+        {
+        case MQTT_PROPERTY_BYTE:
+            *value = data[1];
+            return true;
+        case MQTT_PROPERTY_TWO_BYTES:
+            *value = ((uint16_t)data[1] << 8) | data[2];
+            return true;
+        case MQTT_PROPERTY_FOUR_BYTES:
+            *value = ((uint32_t)data[1] << 24) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 8) | data[4];
+            return true;
+        case MQTT_PROPERTY_VARIABLE:
+            mqttGetVariableInteger(data + 1, length - offset - 1, value);
+            return true;
+        default:
+            return false;
         }
     }
-    return size;
+    return false;
 }
 
 void assembleMqttConnectPacket(uint8_t* packet, uint8_t flags, uint16_t keepAlive, char* clientId, uint16_t cliendIdLength, uint16_t* packetLength)
 {
     fixedHeader* mqttFixedHeader = (fixedHeader*)packet;
+    uint8_t properties[16];
+    uint8_t propertiesLength = 0;
+
+    // MQTT 5 says how long the broker keeps the session and how much we take from it (MQTT 5 3.1.2.11)
+    if(protocolLevel == PROTOCOL_LEVEL_V5)
+    {
+        propertiesLength += mqttPutProperty(properties, MQTT_PROPERTY_SESSION_EXPIRY, MQTT_SESSION_EXPIRY);
+        propertiesLength += mqttPutProperty(properties + propertiesLength, MQTT_PROPERTY_RECEIVE_MAXIMUM, MQTT_MAX_RECEIVED);
+        propertiesLength += mqttPutProperty(properties + propertiesLength, MQTT_PROPERTY_TOPIC_ALIAS_MAXIMUM, MQTT_MAX_INBOUND_ALIASES);
+    }
 
-    uint8_t offset = 0;
-    uint32_t remainingLength = encodeMqttRemainingLength((sizeof(connectVariableHeader) + sizeof(cliendIdLength) + cliendIdLength), &offset);
+    uint32_t remainingLength = sizeof(connectVariableHeader) + ((protocolLevel == PROTOCOL_LEVEL_V5) ? 1 + propertiesLength : 0) + sizeof(cliendIdLength) + cliendIdLength;
+    uint8_t offset = mqttPutVariableInteger(mqttFixedHeader->remainingLength, remainingLength);
 
-    connectVariableHeader* variableHeader = (connectVariableHeader*)(mqttFixedHeader->remainingLength + offset);
+    // Counted from packet, the remaining length can take more bytes than the fixed header has room for
+    connectVariableHeader* variableHeader = (connectVariableHeader*)(packet + 1 + offset);
     uint8_t* payload = (uint8_t*)variableHeader->data;
 
     mqttFixedHeader->controlHeader = (uint8_t)MQTT_CONNECT;
-    uint8_t i = 0;
-    for(i = 0; i < offset; i++)
-        mqttFixedHeader->remainingLength[i] = (remainingLength >> (i << 3)) & 0xFF;
-    *(packetLength) = 2 + remainingLength;
-    // As a test, let's only fill up the connect message
+    *(packetLength) = 1 + offset + remainingLength;
     // The length and protocol name are fixed
     variableHeader->length = htons(4);
     variableHeader->connectMessage[0] = 'M';
     variableHeader->connectMessage[1] = 'Q';
     variableHeader->connectMessage[2] = 'T';
     variableHeader->connectMessage[3] = 'T';
-    // v3.1.1
-    variableHeader->protocolLevel = PROTOCOL_LEVEL_V311;
+    variableHeader->protocolLevel = protocolLevel;
     variableHeader->connectFlags = flags;
     variableHeader->keepAlive = htons(keepAlive);
 
+    if(protocolLevel == PROTOCOL_LEVEL_V5)
+    {
+        *(payload++) = propertiesLength;
+        copyUint8Array(properties, payload, propertiesLength);
+        payload += propertiesLength;
+    }
     encodeUtf8(payload, cliendIdLength, clientId);
 }
 
@@ -90,65 +287,196 @@ void assembleMqttPacket(uint8_t* packet, packetType type, uint16_t* packetLength
     *(packetLength) = 2 + mqttFixedHeader->remainingLength[0];
 }
 
-void assembleMqttPublishPacket(uint8_t* packet, char* topicName, uint16_t packetIdentifier, uint8_t qos, char* payload, uint16_t* packetLength)
+// PUBACK, PUBREC, PUBREL and PUBCOMP only carry the packet identifier
+// MQTT 5 leaves the reason code out when it is 0 (MQTT 5 3.4.2.1)
+void assembleMqttPublishAckPacket(uint8_t* packet, packetType type, uint16_t packetIdentifier, uint16_t* packetLength)
+{
+    // Written a byte at a time, the packet is MQTT_PUBLISH_ACK_SIZE bytes and shorter than fixedHeader
+    packet[0] = (uint8_t)type;
+    packet[1] = 2;
+    packet[2] = packetIdentifier >> 8;
+    packet[3] = packetIdentifier & 0xFF;
+    *(packetLength) = MQTT_PUBLISH_ACK_SIZE;
+}
+
+// Writes a PUBLISH up to where its payload starts, with the remaining length of the whole packet
+// In MQTT 5 alias goes in the properties unless it is 0 and the topic is left out when sendTopic is false
+void mqttPutPublishHeader(uint8_t* packet, char* topicName, uint16_t packetIdentifier, uint8_t qos, uint32_t payloadLength, uint16_t alias, bool sendTopic, uint16_t* headerLength)
 {
-    // For me, a packet identifier of 0 is invalid
-    if(packetIdentifier > 0 && qos < 1)
+    uint16_t topicLength = sendTopic ? strLen(topicName) : 0;
+    uint8_t properties[3];
+    uint8_t propertiesLength = 0;
+    uint32_t remainingLength = 0;
+    uint8_t* data = packet + 1;
+    uint8_t i = 0;
+
+    if(alias > 0)
+        propertiesLength = mqttPutProperty(properties, MQTT_PROPERTY_TOPIC_ALIAS, alias);
+    // Only QoS 1 and 2 carry a packet identifier
+    remainingLength = sizeof(uint16_t) + topicLength + ((qos != QOS0) ? sizeof(uint16_t) : 0)
+                      + ((protocolLevel == PROTOCOL_LEVEL_V5) ? 1 + propertiesLength : 0) + payloadLength;
+    packet[0] = (uint8_t)PUBLISH | qos;
+    data += mqttPutVariableInteger(data, remainingLength);
+    encodeUtf8(data, topicLength, topicName);
+    data += sizeof(uint16_t) + topicLength;
+    if(qos != QOS0)
     {
-        // Insert some error handling function
-        return;
+        encodeUtf8(data, packetIdentifier, 0);
+        data += sizeof(uint16_t);
+    }
+    if(protocolLevel == PROTOCOL_LEVEL_V5)
+    {
+        *(data++) = propertiesLength;
+        for(i = 0; i < propertiesLength; i++)
+            *(data++) = properties[i];
     }
+    *headerLength = data - packet;
+}
 
-    fixedHeader* mqttFixedHeader = (fixedHeader*)packet;
-    mqttFixedHeader->controlHeader = (uint8_t)PUBLISH | qos;
+// The payload goes after the variable header as it is, it has no length in front (MQTT 3.3.3)
+void mqttPutPublish(uint8_t* packet, char* topicName, uint16_t packetIdentifier, uint8_t qos, char* payload, uint16_t alias, bool sendTopic, uint16_t* packetLength)
+{
+    uint16_t payloadLength = strLen(payload);
+    uint16_t i = 0;
+    mqttPutPublishHeader(packet, topicName, packetIdentifier, qos, payloadLength, alias, sendTopic, packetLength);
+    for(i = 0; i < payloadLength; i++)
+        packet[*packetLength + i] = payload[i];
+    *packetLength += payloadLength;
+}
 
-    uint8_t offset = 0;
-    // Since we are using utf-8 encoding for the payload, we need to add the size of the uint16_t for the length
-    uint32_t remainingLength = (sizeof(uint16_t) + strLen(topicName) + sizeof(uint16_t) + strLen(payload)) + ((packetIdentifier > 0) ? sizeof(uint16_t) : 0);
-    remainingLength = encodeMqttRemainingLength(remainingLength, &offset);
+void assembleMqttPublishPacket(uint8_t* packet, char* topicName, uint16_t packetIdentifier, uint8_t qos, char* payload, uint16_t* packetLength)
+{
+    mqttPutPublish(packet, topicName, packetIdentifier, qos, payload, 0, true, packetLength);
+}
 
-    uint8_t i = 0;
-    for(i = 0; i < offset; i++)
-        mqttFixedHeader->remainingLength[i] = (remainingLength >> (i << 3)) & 0xFF;
+// Writes everything of a PUBLISH but its payload, which can be larger than a frame
+// The payloadLength bytes of it are sent right after with mqttGetStreamChunk
+void assembleMqttPublishHeader(uint8_t* packet, char* topicName, uint16_t packetIdentifier, uint8_t qos, uint32_t payloadLength, uint16_t* packetLength)
+{
+    mqttPutPublishHeader(packet, topicName, packetIdentifier, qos, payloadLength, 0, true, packetLength);
+}
+
+// The payload is read where it is from source, in flash or RAM, or written a piece at a time by producer when it is not 0
+void mqttStartStream(mqttStream* stream, const uint8_t* source, mqttPayloadProducer producer, uint32_t length)
+{
+    stream->active = length > 0;
+    stream->length = length;
+    stream->sent = 0;
+    stream->source = source;
+    stream->producer = producer;
+}
 
-    // The size of the fixed header plus the remaining length
-    *(packetLength) = 2 + remainingLength;
-    encodeUtf8((mqttFixedHeader->remainingLength + offset), strLen(topicName), topicName);
+// Gets the next piece of a streamed payload, no longer than space, the caller has to send all of it
+// A producer writes its pieces to buffer, which takes MQTT_STREAM_CHUNK_SIZE bytes
+// Returns 0 when there is no room, the producer has nothing yet or the payload is all out
+uint8_t* mqttGetStreamChunk(mqttStream* stream, uint8_t buffer[], uint32_t space, uint16_t* length)
+{
+    uint32_t left = stream->length - stream->sent;
+    uint8_t* chunk = buffer;
+    if(!stream->active)
+        return 0;
+    if(left > space)
+        left = space;
+    if(stream->producer != 0)
+    {
+        if(left > MQTT_STREAM_CHUNK_SIZE)
+            left = MQTT_STREAM_CHUNK_SIZE;
+        left = stream->producer(stream->sent, buffer, left);
+    }
+    else
+    {
+        // length only holds 16 bits, the send buffer is smaller than that anyway
+        if(left > 0xFFFF)
+            left = 0xFFFF;
+        chunk = (uint8_t*)stream->source + stream->sent;
+    }
+    stream->sent += left;
+    if(stream->sent == stream->length)
+        stream->active = false;
+    *length = left;
+    return (left > 0) ? chunk : 0;
+}
 
-    uint8_t* tmp = 0;
-    if(packetIdentifier > 0)
+// Gets the alias of topic for this connection, or the free one it gets the first time, known tells which
+// Nothing is recorded, the broker only learns the alias once the packet with it is sent (mqttCommitTopicAlias)
+// Returns 0 if there is no room for it or it is too short to be worth the 3 bytes of the property
+uint16_t mqttFindTopicAlias(char* topic, bool* known)
+{
+    uint16_t length = strLen(topic);
+    uint16_t i = 0, j = 0, slot = 0;
+    *known = false;
+    if(length <= 3 || length > MQTT_ALIAS_TOPIC_SIZE)
+        return 0;
+    for(i = 0; i < outboundAliasLimit; i++)
     {
-        // Get the offset to the packet identifier field
-        tmp = (mqttFixedHeader->remainingLength + offset) + sizeof(uint16_t) + strLen(topicName);
-        encodeUtf8(tmp, packetIdentifier, 0);
+        if(outboundAliases[i].length == 0)
+        {
+            if(slot == 0)
+                slot = i + 1;
+            continue;
+        }
+        if(outboundAliases[i].length != length)
+            continue;
+        for(j = 0; j < length && outboundAliases[i].topic[j] == topic[j]; j++);
+        if(j == length)
+        {
+            *known = true;
+            return i + 1;
+        }
     }
+    return slot;
+}
+
+// The publish assembleMqttAliasedPublishPacket built for topic was sent whole, so the broker now knows its alias
+void mqttCommitTopicAlias(char* topic)
+{
+    bool known = false;
+    uint16_t alias = 0, j = 0;
+    if(protocolLevel != PROTOCOL_LEVEL_V5)
+        return;
+    alias = mqttFindTopicAlias(topic, &known);
+    if(alias == 0 || known)
+        return;
+    for(j = 0; j < strLen(topic); j++)
+        outboundAliases[alias - 1].topic[j] = topic[j];
+    outboundAliases[alias - 1].length = strLen(topic);
+}
 
-    // This is the payload section
-    tmp = (mqttFixedHeader->remainingLength + offset) + (sizeof(uint16_t) + strLen(topicName)) + ((packetIdentifier > 0) ? sizeof(uint16_t) : 0);
-    encodeUtf8(tmp, strLen(payload), payload);
+// In MQTT 5 a topic the broker knows by its alias is left out and a new one is sent with the alias it gets
+// A new alias adds 3 bytes, so the room in the send buffer is checked against this packet, and it is only
+// kept with mqttCommitTopicAlias once the packet is sent
+// Aliases are gone with the connection, so the copy kept to send a publish again is built by assembleMqttPublishPacket
+void assembleMqttAliasedPublishPacket(uint8_t* packet, char* topicName, uint16_t packetIdentifier, uint8_t qos, char* payload, uint16_t* packetLength)
+{
+    uint16_t alias = 0;
+    bool known = false;
+    if(protocolLevel == PROTOCOL_LEVEL_V5)
+        alias = mqttFindTopicAlias(topicName, &known);
+    mqttPutPublish(packet, topicName, packetIdentifier, qos, payload, alias, !known, packetLength);
 }
 
-void assembleMqttSubscribeUnsubscribePacket(uint8_t* packet, packetType type, uint16_t packetIdentifier, char* topic, uint32_t totalLength, uint8_t numberOfTopics, uint8_t qos, uint16_t* packetLength)
+// A SUBSCRIBE asks for qos[i] on the i-th topic, an UNSUBSCRIBE has no QoS and qos is not read
+void assembleMqttSubscribeUnsubscribePacket(uint8_t* packet, packetType type, uint16_t packetIdentifier, char* topic, uint32_t totalLength, uint8_t numberOfTopics, uint8_t qos[], uint16_t* packetLength)
 {
     fixedHeader* mqttFixedHeader = (fixedHeader*)packet;
     mqttFixedHeader->controlHeader = (uint8_t)type;
 
-    uint8_t offset = 0;
     // Since we are using utf-8 encoding for the payload, we need to add the size of the uint16_t for the length
-    uint32_t remainingLength = sizeof(packetIdentifier) + (sizeof(uint16_t) * numberOfTopics + totalLength) + ((type == SUBSCRIBE) ? sizeof(qos) * numberOfTopics : 0);
-    *packetLength = 2 + remainingLength;
-    remainingLength = encodeMqttRemainingLength(remainingLength, &offset);
-
-    uint8_t i = 0;
-    for(i = 0; i < offset; i++)
-        mqttFixedHeader->remainingLength[i] = (remainingLength >> (i << 3)) & 0xFF;
+    // MQTT 5 has an empty property list after the packet identifier
+    uint32_t remainingLength = sizeof(packetIdentifier) + ((protocolLevel == PROTOCOL_LEVEL_V5) ? 1 : 0)
+                               + (sizeof(uint16_t) * numberOfTopics + totalLength) + ((type == SUBSCRIBE) ? numberOfTopics : 0);
+    uint8_t offset = mqttPutVariableInteger(mqttFixedHeader->remainingLength, remainingLength);
+    *packetLength = 1 + offset + remainingLength;
 
     // Variable header only has the packet identifier
     uint8_t* tmp = mqttFixedHeader->remainingLength + offset;
     encodeUtf8(tmp, packetIdentifier, 0);
     tmp += sizeof(uint16_t);
+    if(protocolLevel == PROTOCOL_LEVEL_V5)
+        *(tmp++) = 0;
 
     // Add the payload
+    uint8_t i = 0;
     for(i = 0; i < numberOfTopics; i++)
     {
         encodeUtf8(tmp, strLen(topic), topic);
@@ -157,39 +485,662 @@ void assembleMqttSubscribeUnsubscribePacket(uint8_t* packet, packetType type, ui
         // An offset of 1 represents the null terminator
         topic += strLen(topic) + 1;
         if(type == SUBSCRIBE)
-            *(tmp++) = qos;
+            *(tmp++) = qos[i];
     }
 }
 
-void getTopicData(uint8_t* packet, subscription* data)
+// Starts over at a packet boundary, a new connection needs this as well
+void mqttParserInit(mqttParser* parser, uint32_t capacity)
 {
-    fixedHeader* mqttFixedHeader = (fixedHeader*)packet;
-    data->remainingLength = decodeMqttRemainingLength(mqttFixedHeader->remainingLength[0]);
-    uint8_t* tmp = mqttFixedHeader->remainingLength + 1;
-    uint16_t topicNameLength = *tmp | *(tmp + 1);
-    tmp += 2;
+    parser->state = MQTT_PARSE_TYPE;
+    parser->capacity = capacity;
+    parser->controlHeader = 0;
+    parser->lengthBytes = 0;
+    parser->remainingLength = 0;
+    parser->headerLength = 0;
+    parser->offset = 0;
+    parser->skipLeft = 0;
+    parser->skipQos = 0;
+    parser->skipTopicLength = 0;
+    parser->skipIdentifier = 0;
+    parser->consumed = 0;
+}
+
+// Throws away what is there of an oversized packet, data starts at the first byte not thrown away yet
+// The topic length and packet identifier of a QoS 1 or 2 PUBLISH are picked out on the way
+mqttParseResult mqttSkip(mqttParser* parser, uint8_t data[], uint32_t length)
+{
+    uint32_t consumed = (length < parser->skipLeft) ? length : parser->skipLeft;
+    uint32_t position = parser->headerLength + parser->remainingLength - parser->skipLeft;
+    // The topic follows its 2 byte length
+    uint32_t topicStart = parser->headerLength + 2;
+    uint32_t identifierEnd = 0, i = 0;
+    for(i = 0; i < consumed && parser->skipQos != 0; i++, position++)
+    {
+        identifierEnd = topicStart + parser->skipTopicLength + 2;
+        if(position >= identifierEnd)
+            break;
+        if(position >= parser->headerLength && position < topicStart)
+            parser->skipTopicLength = (parser->skipTopicLength << 8) | data[i];
+        else if(position >= identifierEnd - 2)
+            parser->skipIdentifier = (parser->skipIdentifier << 8) | data[i];
+    }
+    parser->skipLeft -= consumed;
+    // The next call starts on a new packet
+    if(parser->skipLeft == 0)
+        parser->state = MQTT_PARSE_DONE;
+    parser->consumed = consumed;
+    return MQTT_PARSE_SKIPPED;
+}
+
+// A QoS 1 or 2 publish too large for the buffer is never delivered, but it has to be acknowledged
+// or the broker sends it again for ever (MQTT 4.3.2 & 4.3.3)
+// Returns true after the call to mqttParse that threw away the last of one
+bool mqttGetSkippedPublish(mqttParser* parser, uint8_t* qos, uint16_t* packetIdentifier)
+{
+    if(parser->state != MQTT_PARSE_DONE || parser->skipQos == 0 || (uint32_t)parser->skipTopicLength + 4 > parser->remainingLength)
+        return false;
+    *qos = parser->skipQos;
+    *packetIdentifier = parser->skipIdentifier;
+    return true;
+}
+
+// Looks at the bytes after the ones seen by the last call, data has to start at the same place
+// every time until a packet or a skip is returned, then parser->consumed bytes are taken out of it
+// Only the fixed header is read, the rest of the packet is left where it is
+mqttParseResult mqttParse(mqttParser* parser, uint8_t data[], uint32_t length)
+{
+    uint32_t packetLength = 0;
+    uint8_t byte = 0;
+    if(parser->state == MQTT_PARSE_DONE)
+        mqttParserInit(parser, parser->capacity);
+    if(parser->state == MQTT_PARSE_SKIP)
+        return mqttSkip(parser, data, length);
+
+    while(parser->offset < length && parser->state != MQTT_PARSE_BODY)
+    {
+        byte = data[parser->offset++];
+        if(parser->state == MQTT_PARSE_TYPE)
+        {
+            parser->controlHeader = byte;
+            parser->state = MQTT_PARSE_LENGTH;
+            continue;
+        }
+        // 7 bits to a byte, least significant first, the top bit says another one follows (MQTT 2.2.3)
+        parser->remainingLength |= (uint32_t)(byte & 127) << (7 * parser->lengthBytes++);
+        if(!(byte & 128))
+        {
+            parser->headerLength = 1 + parser->lengthBytes;
+            parser->state = MQTT_PARSE_BODY;
+        }
+        else if(parser->lengthBytes == 4)
+            return MQTT_PARSE_ERROR;
+    }
+    if(parser->state != MQTT_PARSE_BODY)
+        return MQTT_PARSE_MORE;
+
+    packetLength = parser->headerLength + parser->remainingLength;
+    if(packetLength > parser->capacity)
+    {
+        parser->state = MQTT_PARSE_SKIP;
+        parser->skipLeft = packetLength;
+        if((parser->controlHeader & 0xF0) == PUBLISH)
+            parser->skipQos = parser->controlHeader & (QOS1 | QOS2);
+        return mqttSkip(parser, data, length);
+    }
+    if(length < packetLength)
+        return MQTT_PARSE_MORE;
+    parser->state = MQTT_PARSE_DONE;
+    parser->consumed = packetLength;
+    return MQTT_PARSE_PACKET;
+}
+
+// A publish with a topic and an alias sets the alias, one with only the alias gets the topic set before (MQTT 5 3.3.2.3.4)
+// Returns false for an alias we did not allow or one that was never set
+bool mqttResolveTopicAlias(mqttPublish* publish, uint32_t alias)
+{
+    mqttTopicAlias* entry = 0;
     uint8_t i = 0;
-    for(i = 0; i < topicNameLength; i++)
-        data->topicName[i] = *(tmp++);
-    data->topicName[i] = '\0';
-    // The message would be at an offset of 2 bytes + length of topic name
-    uint8_t messageLength = data->remainingLength - (sizeof(uint16_t) + topicNameLength);
-    for(i = 0; i <  messageLength; i++)
-        data->message[i] = *(tmp++);
-    data->message[i] = '\0';
+    if(alias == 0 || alias > MQTT_MAX_INBOUND_ALIASES)
+        return false;
+    entry = &inboundAliases[alias - 1];
+    if(publish->topic.length == 0)
+    {
+        if(entry->length == 0)
+            return false;
+        publish->topic.data = (uint8_t*)entry->topic;
+        publish->topic.length = entry->length;
+        return true;
+    }
+    // A topic too long to keep is delivered, the publishes that only give its alias are not
+    entry->length = 0;
+    if(publish->topic.length > MQTT_ALIAS_TOPIC_SIZE)
+        return true;
+    for(i = 0; i < publish->topic.length; i++)
+        entry->topic[i] = publish->topic.data[i];
+    entry->length = publish->topic.length;
+    return true;
+}
+
+// Points publish at the topic and payload of the packet mqttParse found at packet
+// They stay valid until the packet is taken out of the buffer
+// Returns false if it is not a PUBLISH or its lengths do not add up
+bool mqttGetPublish(mqttParser* parser, uint8_t packet[], mqttPublish* publish)
+{
+    uint8_t* variableHeader = packet + parser->headerLength;
+    uint32_t length = parser->remainingLength;
+    uint32_t offset = 2;
+    uint8_t* properties = 0;
+    uint32_t propertiesLength = 0, alias = 0;
+
+    if(parser->state != MQTT_PARSE_DONE || (parser->controlHeader & 0xF0) != (uint8_t)PUBLISH || length < 2)
+        return false;
+    publish->qos = parser->controlHeader & 6;
+    publish->dup = (parser->controlHeader & 8) != 0;
+    publish->retain = (parser->controlHeader & 1) != 0;
+    // Both QoS bits set is not allowed (MQTT 3.3.1.2)
+    if(publish->qos == 6)
+        return false;
+    publish->topic.data = variableHeader + 2;
+    publish->topic.length = ((uint16_t)variableHeader[0] << 8) | variableHeader[1];
+    offset += publish->topic.length;
+    publish->packetIdentifier = 0;
+    if(publish->qos != QOS0)
+    {
+        if(offset + 2 > length)
+            return false;
+        publish->packetIdentifier = ((uint16_t)variableHeader[offset] << 8) | variableHeader[offset + 1];
+        offset += 2;
+    }
+    if(offset > length)
+        return false;
+    if(protocolLevel == PROTOCOL_LEVEL_V5)
+    {
+        properties = mqttGetProperties(variableHeader + offset, length - offset, &propertiesLength);
+        if(properties == 0)
+            return false;
+        if(mqttGetProperty(properties, propertiesLength, MQTT_PROPERTY_TOPIC_ALIAS, &alias) && !mqttResolveTopicAlias(publish, alias))
+            return false;
+        offset = (properties - variableHeader) + propertiesLength;
+    }
+    publish->payload.data = variableHeader + offset;
+    publish->payload.length = length - offset;
+    return true;
 }
 
+// Filters are levels split by '/', + takes up a whole level and # has to be the whole last one (MQTT 4.7.1)
+bool mqttIsValidFilter(char* filter)
+{
+    uint16_t i = 0;
+    if(filter[0] == '\0')
+        return false;
+    for(i = 0; filter[i] != '\0'; i++)
+    {
+        if(filter[i] != '+' && filter[i] != '#')
+            continue;
+        if(i > 0 && filter[i - 1] != '/')
+            return false;
+        if(filter[i] == '#' && filter[i + 1] != '\0')
+            return false;
+        if(filter[i] == '+' && filter[i + 1] != '\0' && filter[i + 1] != '/')
+            return false;
+    }
+    return true;
+}
+
+// FNV-1a over the parent and the level name
+uint8_t mqttHashLevel(uint8_t parent, uint8_t* level, uint16_t length)
+{
+    uint32_t hash = 2166136261 ^ parent;
+    uint16_t i = 0;
+    for(i = 0; i < length; i++)
+        hash = (hash ^ level[i]) * 16777619;
+    return hash & (MQTT_TOPIC_BUCKETS - 1);
+}
+
+// Returns the child of parent called level, or 0 if there is none
+uint8_t mqttFindNode(uint8_t parent, uint8_t* level, uint16_t length)
+{
+    uint8_t index = topicBuckets[mqttHashLevel(parent, level, length)];
+    uint16_t i = 0;
+    for(; index != 0; index = topicNodes[index].next)
+    {
+        mqttTopicNode* node = &topicNodes[index];
+        if(node->parent != parent || node->nameLength != length)
+            continue;
+        for(i = 0; i < length && topicNames[node->name + i] == level[i]; i++);
+        if(i == length)
+            return index;
+    }
+    return 0;
+}
+
+// Returns the new child of parent, or 0 if the nodes or the name buffer are used up
+uint8_t mqttNewNode(uint8_t parent, uint8_t* level, uint16_t length)
+{
+    uint8_t index = 0, bucket = 0;
+    mqttTopicNode* node = 0;
+    if(length > 255 || topicNamesSize + length > MQTT_TOPIC_NAMES_SIZE)
+        return 0;
+    for(index = 1; index < MQTT_MAX_TOPIC_NODES && topicNodes[index].inUse; index++);
+    if(index == MQTT_MAX_TOPIC_NODES)
+        return 0;
+    node = &topicNodes[index];
+    node->inUse = true;
+    node->parent = parent;
+    node->children = 0;
+    node->handler = 0;
+    node->name = topicNamesSize;
+    node->nameLength = length;
+    copyUint8Array(level, topicNames + topicNamesSize, length);
+    topicNamesSize += length;
+    bucket = mqttHashLevel(parent, level, length);
+    node->next = topicBuckets[bucket];
+    topicBuckets[bucket] = index;
+    topicNodes[parent].children++;
+    return index;
+}
+
+// Takes the node out of its bucket and its name out of the name buffer
+void mqttFreeNode(uint8_t index)
+{
+    mqttTopicNode* node = &topicNodes[index];
+    uint8_t* link = &topicBuckets[mqttHashLevel(node->parent, topicNames + node->name, node->nameLength)];
+    uint16_t i = 0;
+    while(*link != index)
+        link = &topicNodes[*link].next;
+    *link = node->next;
+    // The names after it move down
+    for(i = node->name; i + node->nameLength < topicNamesSize; i++)
+        topicNames[i] = topicNames[i + node->nameLength];
+    topicNamesSize -= node->nameLength;
+    for(i = 1; i < MQTT_MAX_TOPIC_NODES; i++)
+        if(topicNodes[i].inUse && topicNodes[i].name > node->name)
+            topicNodes[i].name -= node->nameLength;
+    topicNodes[node->parent].children--;
+    node->inUse = false;
+}
+
+// Frees index and the levels above it that no other filter uses
+void mqttPruneNode(uint8_t index)
+{
+    uint8_t parent = 0;
+    while(index != 0 && topicNodes[index].handler == 0 && topicNodes[index].children == 0)
+    {
+        parent = topicNodes[index].parent;
+        mqttFreeNode(index);
+        index = parent;
+    }
+}
+
+// Calls handler for every PUBLISH whose topic matches filter, a filter added again gets the new handler
+// Returns false if the filter is not valid or does not fit
+bool mqttAddSubscription(char* filter, mqttHandler handler)
+{
+    uint8_t parent = 0, node = 0;
+    uint16_t start = 0, end = 0, length = strLen(filter);
+    if(!mqttIsValidFilter(filter))
+        return false;
+    for(start = 0; ; start = end + 1)
+    {
+        for(end = start; end < length && filter[end] != '/'; end++);
+        node = mqttFindNode(parent, (uint8_t*)filter + start, end - start);
+        if(node == 0)
+            node = mqttNewNode(parent, (uint8_t*)filter + start, end - start);
+        if(node == 0)
+        {
+            // The levels added for this filter go again
+            mqttPruneNode(parent);
+            return false;
+        }
+        parent = node;
+        if(end == length)
+            break;
+    }
+    topicNodes[node].handler = handler;
+    return true;
+}
+
+void mqttRemoveSubscription(char* filter)
+{
+    uint8_t node = 0;
+    uint16_t start = 0, end = 0, length = strLen(filter);
+    for(start = 0; ; start = end + 1)
+    {
+        for(end = start; end < length && filter[end] != '/'; end++);
+        node = mqttFindNode(node, (uint8_t*)filter + start, end - start);
+        if(node == 0)
+            return;
+        if(end == length)
+            break;
+    }
+    topicNodes[node].handler = 0;
+    mqttPruneNode(node);
+}
+
+uint8_t mqttMatchLevel(uint8_t parent, uint8_t* level, uint32_t length, bool first, mqttPublish* publish);
+
+// Carries on below node with what is left of the topic after the level it matched
+uint8_t mqttMatchRest(uint8_t node, uint8_t* rest, uint32_t length, mqttPublish* publish)
+{
+    uint8_t wildcard = 0, count = 0;
+    // Skip the '/'
+    if(length > 0)
+        return mqttMatchLevel(node, rest + 1, length - 1, false, publish);
+    if(topicNodes[node].handler != 0)
+    {
+        topicNodes[node].handler(publish);
+        count++;
+    }
+    // The topic ended here, a/# matches a as well (MQTT 4.7.1.2)
+    wildcard = mqttFindNode(node, (uint8_t*)"#", 1);
+    if(wildcard != 0 && topicNodes[wildcard].handler != 0)
+    {
+        topicNodes[wildcard].handler(publish);
+        count++;
+    }
+    return count;
+}
+
+// Looks at the children of parent for the level at the start of the topic that is left
+// There are at most three of them to follow, the level itself, + and #, so the time taken
+// goes with the depth of the topic and not the number of filters
+uint8_t mqttMatchLevel(uint8_t parent, uint8_t* level, uint32_t length, bool first, mqttPublish* publish)
+{
+    uint32_t end = 0;
+    uint8_t node = 0, count = 0;
+    // Wildcards at the first level do not match topics starting with $ (MQTT 4.7.2)
+    bool system = first && length > 0 && level[0] == '$';
+    for(end = 0; end < length && level[end] != '/'; end++);
+    if(!system)
+    {
+        node = mqttFindNode(parent, (uint8_t*)"#", 1);
+        if(node != 0 && topicNodes[node].handler != 0)
+        {
+            topicNodes[node].handler(publish);
+            count++;
+        }
+        node = mqttFindNode(parent, (uint8_t*)"+", 1);
+        if(node != 0)
+            count += mqttMatchRest(node, level + end, length - end, publish);
+    }
+    node = mqttFindNode(parent, level, end);
+    if(node != 0)
+        count += mqttMatchRest(node, level + end, length - end, publish);
+    return count;
+}
+
+// Hands publish to the handler of every filter its topic matches
+// Returns how many there were
+uint8_t mqttDispatch(mqttPublish* publish)
+{
+    if(publish->topic.length == 0)
+        return 0;
+    return mqttMatchLevel(0, publish->topic.data, publish->topic.length, true, publish);
+}
+
+mqttInFlight* mqttFindInFlight(uint16_t packetIdentifier)
+{
+    uint8_t i = 0;
+    for(i = 0; i < MQTT_MAX_IN_FLIGHT; i++)
+        if(inFlight[i].inUse && inFlight[i].packetIdentifier == packetIdentifier)
+            return &inFlight[i];
+    return 0;
+}
+
+// Hands out 1 to 65535 in turn, skipping the identifiers still waiting for an acknowledgement
+uint16_t mqttGetPacketIdentifier()
+{
+    do
+    {
+        if(++lastPacketIdentifier == 0)
+            lastPacketIdentifier = 1;
+    }
+    while(mqttFindInFlight(lastPacketIdentifier) != 0);
+    return lastPacketIdentifier;
+}
+
+// An MQTT 5 broker may take fewer than MQTT_MAX_IN_FLIGHT
+bool mqttIsInFlightFull()
+{
+    uint8_t i = 0, count = 0;
+    for(i = 0; i < MQTT_MAX_IN_FLIGHT; i++)
+        if(inFlight[i].inUse)
+            count++;
+    return count >= inFlightLimit;
+}
+
+// Returns true if mqttTrackPublish has room for a copy of length bytes
+bool mqttCanTrackPublish(uint16_t length)
+{
+    uint16_t i = 0;
+    if(inFlightSize + length > MQTT_IN_FLIGHT_BUFFER_SIZE)
+        return false;
+    for(i = 0; i < MQTT_MAX_IN_FLIGHT && inFlight[i].inUse; i++);
+    return i < MQTT_MAX_IN_FLIGHT;
+}
+
+// Keeps a copy of a publish that was just sent until the broker has acknowledged it
+// Returns false if the table or the buffer is full, the publish is then not sent again
+bool mqttTrackPublish(uint16_t packetIdentifier, uint8_t qos, uint8_t packet[], uint16_t length)
+{
+    uint16_t i = 0;
+    if(!mqttCanTrackPublish(length))
+        return false;
+    for(i = 0; inFlight[i].inUse; i++);
+    inFlight[i].inUse = true;
+    inFlight[i].packetIdentifier = packetIdentifier;
+    inFlight[i].qos = qos;
+    inFlight[i].released = false;
+    inFlight[i].sequence = inFlightSequence++;
+    inFlight[i].offset = inFlightSize;
+    inFlight[i].length = length;
+    inFlight[i].retryTime = getMilliseconds() + MQTT_RETRY_TIME;
+    inFlight[i].due = false;
+    for(i = 0; i < length; i++)
+        inFlightBuffer[inFlightSize + i] = packet[i];
+    inFlightSize += length;
+    return true;
+}
+
+// Drops the copy of the packet, the ones after it move down
+void mqttDropCopy(mqttInFlight* entry)
+{
+    uint16_t i = 0;
+    for(i = entry->offset; i + entry->length < inFlightSize; i++)
+        inFlightBuffer[i] = inFlightBuffer[i + entry->length];
+    inFlightSize -= entry->length;
+    for(i = 0; i < MQTT_MAX_IN_FLIGHT; i++)
+        if(inFlight[i].inUse && inFlight[i].offset > entry->offset)
+            inFlight[i].offset -= entry->length;
+    entry->length = 0;
+}
+
+// Moves a publish along when the broker answers, the answers can come in any order
+// PUBACK ends QoS 1, PUBREC has the PUBREL sent and PUBCOMP ends QoS 2
+// A PUBREC with a failure reason code ends QoS 2 as well (MQTT 5 4.3.3)
+// Returns false if nothing was waiting for this answer
+bool mqttAcknowledgePublish(packetType type, uint16_t packetIdentifier, uint8_t reasonCode)
+{
+    mqttInFlight* entry = mqttFindInFlight(packetIdentifier);
+    if(entry == 0)
+        return false;
+    switch(type)
+    {
+    case PUBACK:
+        if(entry->qos != QOS1)
+            return false;
+        break;
+    case PUBREC:
+        if(entry->qos != QOS2)
+            return false;
+        if(reasonCode >= MQTT_REASON_FAILURE)
+            break;
+        // The broker has the message, from now on only the PUBREL is sent again
+        // A PUBREC that came again is answered with another PUBREL
+        if(!entry->released)
+            mqttDropCopy(entry);
+        entry->released = true;
+        entry->due = true;
+        return true;
+    case PUBCOMP:
+        if(entry->qos != QOS2 || !entry->released)
+            return false;
+        break;
+    default:
+        return false;
+    }
+    mqttDropCopy(entry);
+    entry->inUse = false;
+    return true;
+}
+
+// After a reconnect every publish and PUBREL still in flight goes again (MQTT 4.4)
+void mqttRetryPublishes()
+{
+    uint8_t i = 0;
+    for(i = 0; i < MQTT_MAX_IN_FLIGHT; i++)
+        inFlight[i].due = true;
+}
+
+// Returns the first publish or PUBREL that is due to be sent again and its length, or 0 if there is none
+// Publishes get DUP set, the PUBREL is only good until the next call
+// They go in the order they were first sent, so one that does not fit in space holds up the rest
+// MQTT 5 only sends them again after a reconnect (MQTT 5 4.4)
+uint8_t* mqttGetDuePublish(uint32_t space, uint16_t* length)
+{
+    mqttInFlight* entry = 0;
+    uint16_t pubrelLength = 0;
+    uint8_t i = 0;
+    for(i = 0; i < MQTT_MAX_IN_FLIGHT; i++)
+    {
+        if(!inFlight[i].inUse || !(inFlight[i].due || (protocolLevel == PROTOCOL_LEVEL_V311 && (int32_t)(getMilliseconds() - inFlight[i].retryTime) >= 0)))
+            continue;
+        if(entry == 0 || (int32_t)(inFlight[i].sequence - entry->sequence) < 0)
+            entry = &inFlight[i];
+    }
+    if(entry == 0 || (entry->released ? MQTT_PUBLISH_ACK_SIZE : entry->length) > space)
+        return 0;
+    entry->due = false;
+    entry->retryTime = getMilliseconds() + MQTT_RETRY_TIME;
+    if(entry->released)
+    {
+        assembleMqttPublishAckPacket(pubrelPacket, PUBREL, entry->packetIdentifier, &pubrelLength);
+        *length = pubrelLength;
+        return pubrelPacket;
+    }
+    inFlightBuffer[entry->offset] |= MQTT_DUP_FLAG;
+    *length = entry->length;
+    return inFlightBuffer + entry->offset;
+}
+
+// Remembers a received QoS 2 publish until its PUBREL, so one sent again is not delivered twice
+// This is method B of MQTT 4.3.3, the message is handed on as soon as it arrives
+mqttReceiveResult mqttStoreReceived(uint16_t packetIdentifier)
+{
+    uint8_t i = 0, slot = MQTT_MAX_RECEIVED;
+    for(i = 0; i < MQTT_MAX_RECEIVED; i++)
+    {
+        if(receivedIdentifiers[i] == packetIdentifier)
+            return MQTT_RECEIVED_DUPLICATE;
+        if(receivedIdentifiers[i] == 0 && slot == MQTT_MAX_RECEIVED)
+            slot = i;
+    }
+    if(slot == MQTT_MAX_RECEIVED)
+        return MQTT_RECEIVED_FULL;
+    receivedIdentifiers[slot] = packetIdentifier;
+    return MQTT_RECEIVED_NEW;
+}
+
+// The broker will not send the publish again, the identifier can be used for a new one
+void mqttReleaseReceived(uint16_t packetIdentifier)
+{
+    uint8_t i = 0;
+    for(i = 0; i < MQTT_MAX_RECEIVED; i++)
+        if(receivedIdentifiers[i] == packetIdentifier)
+            receivedIdentifiers[i] = 0;
+}
+
+// QoS 1 has no PUBREL to say when an identifier is done with, so the last few are remembered
+// Returns true for a publish with DUP set that was delivered already, it only needs its PUBACK
+// The broker may use an identifier again once it has the PUBACK, so without DUP it is a new message
+bool mqttIsRedelivery(mqttPublish* publish)
+{
+    uint8_t i = 0;
+    for(i = 0; i < MQTT_RECENT_WINDOW; i++)
+        if(recentIdentifiers[i] == publish->packetIdentifier)
+            return publish->dup;
+    recentIdentifiers[recentNext] = publish->packetIdentifier;
+    recentNext = (recentNext + 1) % MQTT_RECENT_WINDOW;
+    return false;
+}
+
+// A clean session starts the broker's identifiers over
+void mqttClearReceived()
+{
+    uint8_t i = 0;
+    for(i = 0; i < MQTT_MAX_RECEIVED; i++)
+        receivedIdentifiers[i] = 0;
+    for(i = 0; i < MQTT_RECENT_WINDOW; i++)
+        recentIdentifiers[i] = 0;
+}
+
+// MQTT 5 has properties after the return code, which it calls the reason code
 bool mqttIsConnack(uint8_t* packet)
 {
-    fixedHeader* mqttFixedHeader = (fixedHeader*)packet;
-    connackVariableHeader* variableHeader = (connackVariableHeader*)(mqttFixedHeader->remainingLength + 1);
-    if(mqttFixedHeader->controlHeader != (uint8_t)CONNACK || mqttFixedHeader->remainingLength[0] != 2)
+    uint32_t length = 0;
+    connackVariableHeader* variableHeader = (connackVariableHeader*)mqttGetVariableHeader(packet, &length);
+    if(packet[0] != (uint8_t)CONNACK || length < 2 || (protocolLevel == PROTOCOL_LEVEL_V311 && length != 2))
         return false;
-    if(variableHeader->connectAcknowledgementFlags != 0 || variableHeader->connectReturnCode != 0)
+    // Only the session present bit may be set in the flags
+    if((variableHeader->connectAcknowledgementFlags & 0xFE) != 0 || variableHeader->connectReturnCode != 0)
         return false;
     return true;
 }
 
+// Whether the broker kept the session of a connect without CLEAN_SESSION, packet must be a CONNACK
+bool mqttIsSessionPresent(uint8_t* packet)
+{
+    uint32_t length = 0;
+    connackVariableHeader* variableHeader = (connackVariableHeader*)mqttGetVariableHeader(packet, &length);
+    return variableHeader->connectAcknowledgementFlags & 1;
+}
+
+// Why the broker refused the connection, packet must be a CONNACK
+uint8_t mqttGetConnackReturnCode(uint8_t* packet)
+{
+    uint32_t length = 0;
+    connackVariableHeader* variableHeader = (connackVariableHeader*)mqttGetVariableHeader(packet, &length);
+    return variableHeader->connectReturnCode;
+}
+
+// Starts a connection with the limits from the broker's CONNACK, the topic aliases of the last one are gone
+// MQTT 3.1.1 has no limits and no aliases
+void mqttReadConnack(uint8_t* packet)
+{
+    uint32_t length = 0, propertiesLength = 0, value = 0;
+    uint8_t* variableHeader = mqttGetVariableHeader(packet, &length);
+    uint8_t* properties = 0;
+    uint8_t i = 0;
+    for(i = 0; i < MQTT_MAX_TOPIC_ALIASES; i++)
+        outboundAliases[i].length = 0;
+    for(i = 0; i < MQTT_MAX_INBOUND_ALIASES; i++)
+        inboundAliases[i].length = 0;
+    inFlightLimit = MQTT_MAX_IN_FLIGHT;
+    outboundAliasLimit = 0;
+    if(protocolLevel != PROTOCOL_LEVEL_V5 || length <= 2)
+        return;
+    properties = mqttGetProperties(variableHeader + 2, length - 2, &propertiesLength);
+    if(properties == 0)
+        return;
+    // Left out it is 65535 (MQTT 5 3.2.2.3.3)
+    if(mqttGetProperty(properties, propertiesLength, MQTT_PROPERTY_RECEIVE_MAXIMUM, &value) && value > 0 && value < MQTT_MAX_IN_FLIGHT)
+        inFlightLimit = value;
+    // Left out the broker takes no aliases (MQTT 5 3.2.2.3.8)
+    if(mqttGetProperty(properties, propertiesLength, MQTT_PROPERTY_TOPIC_ALIAS_MAXIMUM, &value))
+        outboundAliasLimit = (value < MQTT_MAX_TOPIC_ALIASES) ? value : MQTT_MAX_TOPIC_ALIASES;
+}
+
 bool mqttIsPublishPacket(uint8_t* packet)
 {
     fixedHeader* mqttFixedHeader = (fixedHeader*)packet;
@@ -198,33 +1149,65 @@ bool mqttIsPublishPacket(uint8_t* packet)
     return false;
 }
 
-bool mqttIsPuback(uint8_t* packet, uint16_t packetIdentifier)
+// Checks for a PUBACK, PUBREC, PUBREL or PUBCOMP and gets the identifier of the publish it is about
+// In MQTT 5 a reason code and properties may follow the identifier
+bool mqttIsPublishAck(uint8_t* packet, packetType type, uint16_t* packetIdentifier)
 {
-    fixedHeader* mqttFixedHeader = (fixedHeader*)packet;
-    if(mqttFixedHeader->controlHeader != (uint8_t)PUBACK || mqttFixedHeader->remainingLength[0] != 2)
-        return false;
-    uint16_t receivedPacketIdentifier = *(mqttFixedHeader->remainingLength + 1) | *(mqttFixedHeader->remainingLength + 2);
-    if(packetIdentifier != receivedPacketIdentifier)
+    uint32_t length = 0;
+    uint8_t* variableHeader = mqttGetVariableHeader(packet, &length);
+    if(packet[0] != (uint8_t)type || length < 2 || (protocolLevel == PROTOCOL_LEVEL_V311 && length != 2))
         return false;
+    *packetIdentifier = ((uint16_t)variableHeader[0] << 8) | variableHeader[1];
     return true;
 }
 
-uint8_t getSubackPayload(uint8_t* packet)
+// Reason code of an MQTT 5 PUBACK, PUBREC, PUBREL, PUBCOMP or DISCONNECT, it is 0 when it is left out
+uint8_t mqttGetReasonCode(uint8_t* packet)
 {
-    fixedHeader* mqttFixedHeader = (fixedHeader*)packet;
+    uint32_t length = 0;
+    uint8_t* variableHeader = mqttGetVariableHeader(packet, &length);
+    // Only DISCONNECT has no packet identifier in front of it
+    uint8_t offset = ((packet[0] & 0xF0) == (uint8_t)DISCONNECT) ? 0 : 2;
+    return (length > offset) ? variableHeader[offset] : 0;
+}
+
+// Gets the return code for one of the topics of a SUBACK, or in MQTT 5 of an UNSUBACK, mqttIsAck must have checked it
+// MQTT 3.1.1 has the QoS granted or SUBACK_FAILURE, in MQTT 5 every code from MQTT_REASON_FAILURE up is a failure
+uint8_t getSubackPayload(uint8_t* packet, uint8_t topic)
+{
+    uint32_t length = 0, propertiesLength = 0;
     // Payload offset = sizeof(uint8_t) + sizeof(uint16_t)
-    uint8_t* payload = (mqttFixedHeader->remainingLength + 1) + sizeof(uint16_t);
+    uint8_t* payload = mqttGetVariableHeader(packet, &length) + sizeof(uint16_t);
+    if(protocolLevel == PROTOCOL_LEVEL_V5)
+    {
+        payload = mqttGetProperties(payload, length - sizeof(uint16_t), &propertiesLength) + propertiesLength;
+        return payload[topic];
+    }
     // Format: X 0 0 0 0 0 X X
-    return (((*payload) >> 2) & 31);
+    return payload[topic] & 0x83;
 }
 
+// numberOfTopics is how many topics the SUBSCRIBE or UNSUBSCRIBE had, an MQTT 3.1.1 UNSUBACK has no codes for them
 bool mqttIsAck(uint8_t* packet, packetType type, uint16_t packetIdentifier, uint8_t numberOfTopics)
 {
-    fixedHeader* mqttFixedHeader = (fixedHeader*)packet;
+    uint32_t length = 0, propertiesLength = 0;
+    uint8_t* variableHeader = mqttGetVariableHeader(packet, &length);
+    uint8_t* properties = 0;
+    if(type == UNSUBACK && protocolLevel == PROTOCOL_LEVEL_V311)
+        numberOfTopics = 0;
+    if(packet[0] != (uint8_t)type || length < 2)
+        return false;
+    if(protocolLevel == PROTOCOL_LEVEL_V5)
+    {
+        properties = mqttGetProperties(variableHeader + 2, length - 2, &propertiesLength);
+        if(properties == 0)
+            return false;
+        length -= (properties - variableHeader - 2) + propertiesLength;
+    }
     // Remaining length = variable header length (2 bytes) + payload length (numberOfTopics)
-    if(mqttFixedHeader->controlHeader != (uint8_t)type || mqttFixedHeader->remainingLength[0] != 2 + numberOfTopics)
+    if(length != 2 + (uint32_t)numberOfTopics)
         return false;
-    uint16_t receivedPacketIdentifier = *(mqttFixedHeader->remainingLength + 1) | *(mqttFixedHeader->remainingLength + 2);
+    uint16_t receivedPacketIdentifier = ((uint16_t)variableHeader[0] << 8) | variableHeader[1];
     if(packetIdentifier != receivedPacketIdentifier)
         return false;
     return true;
@@ -12,9 +12,7 @@
 #include <stdbool.h>
 
 #define PROTOCOL_LEVEL_V311     0x04
-
-#define MAX_TOPIC_NAME_SIZE     10
-#define MAX_MESSAGE_SIZE        60
+#define PROTOCOL_LEVEL_V5       0x05
 
 #define DEFAULT_KEEP_ALIVE      100
 
@@ -30,6 +28,34 @@
 #define QOS2                    4
 
 #define SUBACK_FAILURE          0x80
+// MQTT 5 reason codes below this are successes (MQTT 5 2.4)
+#define MQTT_REASON_FAILURE     0x80
+
+// MQTT 5 properties used here (MQTT 5 2.2.2.2)
+#define MQTT_PROPERTY_SESSION_EXPIRY        0x11
+#define MQTT_PROPERTY_REASON_STRING         0x1F
+#define MQTT_PROPERTY_RECEIVE_MAXIMUM       0x21
+#define MQTT_PROPERTY_TOPIC_ALIAS_MAXIMUM   0x22
+#define MQTT_PROPERTY_TOPIC_ALIAS           0x23
+
+// Seconds the broker keeps our session after the connection is lost, MQTT 5 ends it at once without this
+#define MQTT_SESSION_EXPIRY         3600
+// Topics we give an alias to, the broker may allow fewer in its CONNACK
+#define MQTT_MAX_TOPIC_ALIASES      8
+// Aliases the broker may use in the publishes it sends us
+#define MQTT_MAX_INBOUND_ALIASES    4
+// Longest topic that gets an alias
+#define MQTT_ALIAS_TOPIC_SIZE       64
+// Largest piece of a streamed payload a producer is asked for
+#define MQTT_STREAM_CHUNK_SIZE      256
+
+// Topic filters are kept a level to a node, filters that start the same way share their first nodes
+// Node 0 is the root, so one less than this is left for the levels
+#define MQTT_MAX_TOPIC_NODES    128
+// Level names of all the nodes together
+#define MQTT_TOPIC_NAMES_SIZE   1024
+// Children are found by hashing the parent and the level name, this has to be a power of 2
+#define MQTT_TOPIC_BUCKETS      64
 
 typedef enum _packetType
 {
@@ -41,6 +67,10 @@ typedef enum _packetType
     UNSUBSCRIBE = 0xA2,
     UNSUBACK = 0xB0,
     PUBACK = 0x40,
+    PUBREC = 0x50,
+    // The reserved flags of PUBREL are 0010 (MQTT 3.6.1)
+    PUBREL = 0x62,
+    PUBCOMP = 0x70,
     PINGERQ = 0xC0,
     PINGRESP = 0xD0,
     DISCONNECT = 0xE0
@@ -70,22 +100,211 @@ typedef struct _connackVariableHeader
 } connackVariableHeader;
 
 
-typedef struct _subscription
+// How long the value of a property is
+typedef enum _mqttPropertyType
+{
+    MQTT_PROPERTY_BYTE = 0,
+    MQTT_PROPERTY_TWO_BYTES,
+    MQTT_PROPERTY_FOUR_BYTES,
+    MQTT_PROPERTY_VARIABLE,
+    // UTF-8 strings and binary data both start with a 2 byte length
+    MQTT_PROPERTY_STRING,
+    MQTT_PROPERTY_STRING_PAIR,
+    MQTT_PROPERTY_UNKNOWN
+} mqttPropertyType;
+
+// A topic that stands in for a 2 byte alias on this connection
+typedef struct _mqttTopicAlias
+{
+    // 0 is an alias that is not in use
+    uint8_t length;
+    char topic[MQTT_ALIAS_TOPIC_SIZE];
+} mqttTopicAlias;
+
+// Writes up to length bytes of a streamed payload, from offset on, to data and returns how many it wrote
+// It may write fewer when it has nothing more yet, it is asked again on the next pass of the main loop
+typedef uint16_t (*mqttPayloadProducer)(uint32_t offset, uint8_t data[], uint16_t length);
+
+// A PUBLISH whose payload follows its header a piece at a time as the send buffer empties
+// Nothing else can be sent on the connection until it is all out, it would land inside the payload
+typedef struct _mqttStream
+{
+    bool active;
+    uint32_t length;
+    uint32_t sent;
+    const uint8_t* source;
+    mqttPayloadProducer producer;
+} mqttStream;
+
+// Bytes of a packet in the receive buffer, nothing is copied out of it
+typedef struct _mqttSlice
+{
+    uint8_t* data;
+    uint32_t length;
+} mqttSlice;
+
+typedef struct _mqttPublish
+{
+    // QOS0, QOS1 or QOS2, as they sit in the fixed header
+    uint8_t qos;
+    bool dup;
+    bool retain;
+    mqttSlice topic;
+    // Only QoS 1 and 2 carry one
+    uint16_t packetIdentifier;
+    mqttSlice payload;
+} mqttPublish;
+
+// QoS 1 and 2 publishes that can be waiting for the broker at once
+#define MQTT_MAX_IN_FLIGHT          8
+// Copies of the publishes in flight, kept to send them again
+#define MQTT_IN_FLIGHT_BUFFER_SIZE  1024
+// A publish that was not acknowledged in this many milliseconds is sent again with DUP set
+// and so is a PUBREL that got no PUBCOMP
+#define MQTT_RETRY_TIME             10000
+// QoS 2 publishes received and waiting for their PUBREL
+#define MQTT_MAX_RECEIVED           8
+// Identifiers of the last QoS 1 publishes received, one of them sent again with DUP set is not delivered twice
+#define MQTT_RECENT_WINDOW          16
+// PUBACK, PUBREC, PUBREL and PUBCOMP are all this long
+#define MQTT_PUBLISH_ACK_SIZE       4
+
+// Fixed header flags of a PUBLISH
+#define MQTT_DUP_FLAG               8
+
+typedef struct _mqttInFlight
+{
+    bool inUse;
+    uint16_t packetIdentifier;
+    uint8_t qos;
+    // Set once a QoS 2 publish got its PUBREC, the copy is dropped and the PUBREL is what gets sent again
+    bool released;
+    // Resends go out in the order the publishes were first sent (MQTT 4.6)
+    uint32_t sequence;
+    // Where the copy of the packet is in the buffer
+    uint16_t offset;
+    uint16_t length;
+    uint32_t retryTime;
+    // Set when the connection came back or a PUBREC came, it goes out right away
+    bool due;
+} mqttInFlight;
+
+typedef enum _mqttReceiveResult
+{
+    MQTT_RECEIVED_NEW = 0,
+    // Delivered already, only the PUBREC is sent again
+    MQTT_RECEIVED_DUPLICATE,
+    // No room to remember it, nothing is sent so the broker tries again later
+    MQTT_RECEIVED_FULL
+} mqttReceiveResult;
+
+// Called for every subscription whose filter matches the topic of a received PUBLISH
+typedef void (*mqttHandler)(mqttPublish* publish);
+
+typedef struct _mqttTopicNode
 {
-    char topicName[MAX_TOPIC_NAME_SIZE];
-    char message[MAX_MESSAGE_SIZE];
+    bool inUse;
+    uint8_t parent;
+    // Next node in the same hash bucket, 0 ends the chain
+    uint8_t next;
+    uint8_t children;
+    // Where the level name is in the name buffer
+    uint16_t name;
+    uint8_t nameLength;
+    // Set on the last level of a filter
+    mqttHandler handler;
+} mqttTopicNode;
+
+typedef enum _mqttParseState
+{
+    MQTT_PARSE_TYPE = 0,
+    MQTT_PARSE_LENGTH,
+    MQTT_PARSE_BODY,
+    MQTT_PARSE_SKIP,
+    MQTT_PARSE_DONE
+} mqttParseState;
+
+typedef enum _mqttParseResult
+{
+    // Nothing to take out of the buffer yet, call again when more bytes came in
+    MQTT_PARSE_MORE = 0,
+    // A whole packet is at the start of the buffer
+    MQTT_PARSE_PACKET,
+    // Part of a packet too large for the buffer was thrown away
+    MQTT_PARSE_SKIPPED,
+    // The remaining length is longer than 4 bytes, the connection has to be closed (MQTT 4.8)
+    MQTT_PARSE_ERROR
+} mqttParseResult;
+
+// Finds where packets start and end in the stream from the broker
+// The fixed header is read a byte at a time and the parser carries on from where it stopped
+// when the rest of the packet comes in another segment
+typedef struct _mqttParser
+{
+    mqttParseState state;
+    // Size of the buffer the packets are parsed in, larger packets can never be looked at whole
+    uint32_t capacity;
+    uint8_t controlHeader;
+    uint8_t lengthBytes;
     uint32_t remainingLength;
-} subscription;
+    // Bytes of the fixed header, the variable header starts here
+    uint8_t headerLength;
+    // Bytes already looked at, from the start of the buffer
+    uint32_t offset;
+    // Bytes of an oversized packet still to be thrown away
+    uint32_t skipLeft;
+    // QoS of an oversized PUBLISH, its topic length and packet identifier are read as it goes by
+    uint8_t skipQos;
+    uint16_t skipTopicLength;
+    uint16_t skipIdentifier;
+    // What the caller takes out of the buffer after a packet or a skip
+    uint32_t consumed;
+} mqttParser;
 
 void assembleMqttConnectPacket(uint8_t* packet, uint8_t flags, uint16_t keepAlive, char* clientId, uint16_t cliendIdLength, uint16_t* packetLength);
 void assembleMqttPacket(uint8_t* packet, packetType type, uint16_t* packetLength);
+void assembleMqttPublishAckPacket(uint8_t* packet, packetType type, uint16_t packetIdentifier, uint16_t* packetLength);
 void assembleMqttPublishPacket(uint8_t* packet, char* topicName, uint16_t packetIdentifier, uint8_t qos, char* payload, uint16_t* packetLength);
-void assembleMqttSubscribeUnsubscribePacket(uint8_t* packet, packetType type, uint16_t packetIdentifier, char* topic, uint32_t totalLength, uint8_t numberOfTopics, uint8_t qos, uint16_t* packetLength);
-void getTopicData(uint8_t* packet, subscription* data);
+void assembleMqttPublishHeader(uint8_t* packet, char* topicName, uint16_t packetIdentifier, uint8_t qos, uint32_t payloadLength, uint16_t* packetLength);
+void mqttStartStream(mqttStream* stream, const uint8_t* source, mqttPayloadProducer producer, uint32_t length);
+uint8_t* mqttGetStreamChunk(mqttStream* stream, uint8_t buffer[], uint32_t space, uint16_t* length);
+void assembleMqttAliasedPublishPacket(uint8_t* packet, char* topicName, uint16_t packetIdentifier, uint8_t qos, char* payload, uint16_t* packetLength);
+void mqttCommitTopicAlias(char* topic);
+void assembleMqttSubscribeUnsubscribePacket(uint8_t* packet, packetType type, uint16_t packetIdentifier, char* topic, uint32_t totalLength, uint8_t numberOfTopics, uint8_t qos[], uint16_t* packetLength);
+void mqttSetProtocolLevel(uint8_t level);
+uint8_t mqttGetProtocolLevel();
+uint8_t mqttPutVariableInteger(uint8_t* data, uint32_t value);
+uint8_t mqttGetVariableInteger(uint8_t* data, uint32_t length, uint32_t* value);
+uint8_t mqttPutProperty(uint8_t* data, uint8_t id, uint32_t value);
+uint8_t* mqttGetProperties(uint8_t* data, uint32_t length, uint32_t* propertiesLength);
+bool mqttGetProperty(uint8_t* properties, uint32_t length, uint8_t id, uint32_t* value);
+void mqttParserInit(mqttParser* parser, uint32_t capacity);
+mqttParseResult mqttParse(mqttParser* parser, uint8_t data[], uint32_t length);
+bool mqttGetSkippedPublish(mqttParser* parser, uint8_t* qos, uint16_t* packetIdentifier);
+bool mqttGetPublish(mqttParser* parser, uint8_t packet[], mqttPublish* publish);
+bool mqttIsValidFilter(char* filter);
+bool mqttAddSubscription(char* filter, mqttHandler handler);
+void mqttRemoveSubscription(char* filter);
+uint8_t mqttDispatch(mqttPublish* publish);
 bool mqttIsConnack(uint8_t* packet);
+bool mqttIsSessionPresent(uint8_t* packet);
+uint8_t mqttGetConnackReturnCode(uint8_t* packet);
+void mqttReadConnack(uint8_t* packet);
 bool mqttIsPublishPacket(uint8_t* packet);
-bool mqttIsPuback(uint8_t* packet, uint16_t packetIdentifier);
-uint8_t getSubackPayload(uint8_t* packet);
+uint16_t mqttGetPacketIdentifier();
+bool mqttIsInFlightFull();
+bool mqttCanTrackPublish(uint16_t length);
+bool mqttTrackPublish(uint16_t packetIdentifier, uint8_t qos, uint8_t packet[], uint16_t length);
+bool mqttAcknowledgePublish(packetType type, uint16_t packetIdentifier, uint8_t reasonCode);
+void mqttRetryPublishes();
+uint8_t* mqttGetDuePublish(uint32_t space, uint16_t* length);
+mqttReceiveResult mqttStoreReceived(uint16_t packetIdentifier);
+void mqttReleaseReceived(uint16_t packetIdentifier);
+bool mqttIsRedelivery(mqttPublish* publish);
+void mqttClearReceived();
+bool mqttIsPublishAck(uint8_t* packet, packetType type, uint16_t* packetIdentifier);
+uint8_t mqttGetReasonCode(uint8_t* packet);
+uint8_t getSubackPayload(uint8_t* packet, uint8_t topic);
 bool mqttIsAck(uint8_t* packet, packetType type, uint16_t packetIdentifier, uint8_t numberOfTopics);
 bool mqttIsPingResponse(uint8_t* packet);
 
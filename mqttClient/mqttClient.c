@@ -43,7 +43,15 @@
 #include "cli.h"
 #include "utils.h"
 #include "tcp.h"
+#include "sock.h"
+#include "dhcp.h"
+#include "dns.h"
+#include "ping.h"
+#include "udp.h"
+#include "igmp.h"
 #include "mqtt.h"
+#include "mqttQueue.h"
+#include "timer0.h"
 
 // Pins
 #define RED_LED PORTF,1
@@ -54,35 +62,51 @@
 // Ether frame header (18) + Max MTU (1500) + CRC (4)
 #define MAX_PACKET_SIZE         1522
 
+// EEPROM slots past PROJECT_META_DATA
 #define SERVER_IP               1
 #define CLIENT_IP               2
+#define GATEWAY_IP              3
+#define SUBNET_MASK             4
+#define DNS_SERVER              5
+// The broker's hostname, 4 characters to a word, after the DHCP lease
+#define BROKER_HOSTNAME         16
 
 #define MQTT_PORT               1883
+// Anyone connecting here gets the status text and the connection is closed
+#define STATUS_PORT             23
+
+// Reconnect delays in milliseconds, the delay doubles after every failed attempt up to the cap
+// and the attempt is made at a random point before it so boards that lost the broker together spread out
+#define RECONNECT_BASE_DELAY    500
+#define RECONNECT_MAX_DELAY     32000
+// Reading the link status goes over SPI, so it is only done this often (ms)
+#define LINK_CHECK_INTERVAL     500
+// The connection is taken as dead when a PINGRESP takes longer than this (ms) or the keep alive time if that is shorter
+#define PINGRESP_TIMEOUT        10000
+
+// The snapshot command publishes the whole EEPROM, 512 words
+#define EEPROM_SNAPSHOT_SIZE    2048
+
+// Topics subscribed to again after a reconnect
+#define MAX_SUBSCRIPTIONS       8
+#define SUBSCRIPTIONS_SIZE      128
 
 typedef enum _state
 {
     IDLE,
-    SEND_ARP,
-    RECV_ARP,
-    SEND_SYN,
-    RECV_SYN_ACK,
-    FIN_WAIT_1,
-    FIN_WAIT_2,
-    CLOSE_WAIT,
-    LAST_ACK,
+    RESOLVE_DNS,
+    CONNECT_TCP,
+    CONNECTING_TCP,
+    CLOSING_TCP,
     CLOSED,
     // MQTT states
     CONNECT_MQTT,
     CONNACK_MQTT,
+    RESUBSCRIBE_MQTT,
     PUBLISH_MQTT,
-    PUBLISH_QOS0_MQTT,
-    PUBLISH_QOS1_MQTT,
+    SNAPSHOT_MQTT,
     SUBSCRIBE_MQTT,
-    SUBACK_MQTT,
     UNSUBSCRIBE_MQTT,
-    UNSUBACK_MQTT,
-    PINGREQ_MQTT,
-    PINGRESP_MQTT,
     DISCONNECT_MQTT
 } state;
 
@@ -90,25 +114,80 @@ typedef enum _state
 extern bool isCarriageReturn;
 
 // Stores information about the connection
-uint32_t seqNum = 200;
-uint32_t ackNum = 0;
 bool connect = false;
 bool established = false;
-// Stores the size of the data payload sent
+// Length of the packet the current state assembled
 uint16_t size = 0;
 
 // Buffers used by the client to store information
 uint8_t clientIp[] = {0,0,0,0};
 uint8_t serverIp[] = {0,0,0,0};
-uint8_t serverMacLocalCopy[] = {0,0,0,0,0,0};
+// When set, serverIp is looked up from it before every connect
+char brokerHostname[DNS_MAX_NAME_LENGTH];
+bool hasBrokerHostname = false;
+
+// Holds the sockets, negotiated parameters and receive buffer of the broker connection
+tcpConnection conn;
+// Set by the socket callbacks and handled in the main loop
+bool brokerReadable = false;
+bool brokerClosed = false;
+
+// Reconnect supervisor, on from the first connect until the user disconnects
+bool autoReconnect = false;
+bool reconnectPending = false;
+uint8_t reconnectAttempts = 0;
+uint32_t reconnectTime = 0;
+// When the broker has to have answered what the current state is waiting for
+uint32_t responseDeadline = 0;
+bool linkUp = true;
+uint32_t linkCheckTime = 0;
+
+// Topics restored after a reconnect, null separated the way copySubscribeArguments lays them out
+char subscriptions[SUBSCRIPTIONS_SIZE];
+uint16_t subscriptionsSize = 0;
+uint8_t subscriptionCount = 0;
+// The QoS each of them was asked for with, in the same order
+uint8_t subscriptionQos[MAX_SUBSCRIPTIONS];
+// The SUBSCRIBE and UNSUBSCRIBE waiting for their acknowledgements, the identifier is 0 when there is none
+// Their topics are copied out of the command line, which the next command overwrites, and the
+// acknowledgements are matched whatever command runs in the meantime
+char subscribeTopics[SUBSCRIPTIONS_SIZE];
+uint32_t subscribeTopicsLength = 0;
+uint8_t subscribeTopicCount = 0;
+// The QoS asked for on each topic, a command has fewer than MAX_FIELDS of them and there are fewer subscriptions still
+uint8_t subscribeQos[MAX_FIELDS];
+uint16_t subscribeIdentifier = 0;
+uint32_t subscribeDeadline = 0;
+// The SUBSCRIBE restores the subscriptions above instead of adding new ones
+bool resubscribing = false;
+char unsubscribeTopics[SUBSCRIPTIONS_SIZE];
+uint32_t unsubscribeTopicsLength = 0;
+uint8_t unsubscribeTopicCount = 0;
+uint16_t unsubscribeIdentifier = 0;
+uint32_t unsubscribeDeadline = 0;
 
 // Variables used specifically for MQTT
+// Asked for on subscriptions and used by publishes that do not give one, set with the qos command
 uint8_t qos = QOS1;
-uint16_t packetIdentifier = 18;
 uint16_t keepAliveTime = DEFAULT_KEEP_ALIVE;
+// When the last packet was queued for the broker, the ping command or an idle keep alive time sends a PINGREQ
+uint32_t lastSendTime = 0;
+bool pingRequested = false;
+bool pingOutstanding = false;
+uint32_t pingDeadline = 0;
+// Picks the packets out of the broker's stream, whatever way it was split into segments
+mqttParser parser;
+// A QoS 1 or 2 publish too large for the receive buffer is thrown away, its acknowledgement waits here for room
+packetType skippedAckType = PUBACK;
+uint16_t skippedAckIdentifier = 0;
+// A publish larger than a frame, its payload goes out in pieces as the send buffer empties
+mqttStream publishStream;
+// The first connect after a reset starts a clean session, the in-flight publishes and the received
+// QoS 2 identifiers were lost with the RAM, reconnects ask the broker to keep the session
+bool sessionStarted = false;
 
 // Used by the custom rand function
-uint8_t seed = 153;
+uint32_t seed = 153;
 
 //-----------------------------------------------------------------------------
 // Subroutines                
@@ -119,27 +198,31 @@ void rebootSystem()
     NVIC_APINT_R = (0x05FA0000 | NVIC_APINT_SYSRESETREQ);
 }
 
-// This function should not be used on release software
-// Uses the middle square method
-uint16_t generateRandomNumber()
+// This function should not be used for anything that has to be unpredictable
+// Uses Marsaglia's xorshift, the middle square method used before got stuck on short cycles
+uint32_t generateRandomNumber()
 {
-    uint16_t n = seed * seed;
-    uint8_t i = 0, start = 0, end = 0;
-    uint8_t tmp[8];
-    for(i = 0; i < 8; i++)
-    {
-        tmp[(8 - 1) - i] = n % 10;
-        n /= 10;
-    }
-    start = 2;
-    end = start + 4;
-    for(; start <= end; start++)
-    {
-        n = n * 10 + tmp[start];
-    }
-    // Set the seed value here
-    seed = n;
-    return n;
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+// Boards running the same image must not pick the same reconnect delays
+// The MAC and IP differ between boards and the boot time differs a little
+void seedRandomNumber()
+{
+    uint8_t mac[6];
+    uint8_t i = 0;
+    etherGetMacAddress(mac);
+    for(i = 0; i < 6; i++)
+        seed = seed * 31 + mac[i];
+    for(i = 0; i < 4; i++)
+        seed = seed * 31 + clientIp[i];
+    seed ^= getMilliseconds();
+    // Zero would stay zero
+    if(seed == 0)
+        seed = 153;
 }
 
 // Initialize Hardware
@@ -152,6 +235,9 @@ void initHw()
     enablePort(PORTF);
     _delay_cycles(3);
 
+    // 1 ms time base for the TCP timers
+    initTimer0(TIMER0_1KHZ);
+
     // Configure LED and pushbutton pins
     selectPinPushPullOutput(RED_LED);
     selectPinPushPullOutput(GREEN_LED);
@@ -164,49 +250,404 @@ void showHelp()
     putsUart0("\thelp\t\t\t\t\tShows help menu\n\n");
     putsUart0("\treboot\t\t\t\t\tRestarts the system\n\n");
     putsUart0("\tstatus\t\t\t\t\tShows the Client IP, Server IP and MAC\n\n");
+    putsUart0("\tset <MQTT|IP|GW|SN|DNS> <w.x.y.z>\tSets the broker, our IP, the gateway, the subnet mask or the DNS server\n\n");
+    putsUart0("\tset MQTT <hostname>\t\t\tLooks the broker up by name on every connect\n\n");
+    putsUart0("\tdhcp <on|off>\t\t\t\tGets our IP from a DHCP server, set IP turns it off\n\n");
     putsUart0("\tconnect <Keep Alive Time>\t\tConnects to Mosquitto server\n\n");
-    putsUart0("\tpublish <TOPIC NAME> <MESSAGE>\t\tPublishes a topic\n\n");
+    putsUart0("\tpublish <TOPIC NAME> <MESSAGE> <QoS>\tPublishes a topic, QoS 1 if it is left out\n");
+    putsUart0("\t\t\t\t\t\tQoS 1 and 2 are queued while the broker can not be reached\n\n");
+    putsUart0("\tsnapshot <TOPIC NAME>\t\t\tPublishes the EEPROM contents at QoS 0\n\n");
+    putsUart0("\tqueue <oldest|newest>\t\t\tShows the queued publishes, or drops the oldest or newest when full\n\n");
     putsUart0("\tsubscribe <TOPIC1> <TOPIC2> ...\t\tSubscribe to topic(s)\n\n");
+    putsUart0("\tqos <0|1|2>\t\t\t\tQoS asked for on subscriptions and used by publish\n\n");
+    putsUart0("\tmqtt5 <on|off>\t\t\t\tConnects with MQTT 5 and topic aliases instead of 3.1.1\n\n");
     putsUart0("\tunsubscribe <TOPIC1> <TOPIC2> ...\tUnsubscribes from topic(s)\n\n");
+    putsUart0("\tping\t\t\t\t\tSends a PINGREQ to the broker\n\n");
+    putsUart0("\tping <w.x.y.z> <count>\t\t\tSends echo requests and shows the round trip times\n\n");
+    putsUart0("\tjoin <w.x.y.z>\t\t\t\tJoins a multicast group\n\n");
+    putsUart0("\tleave <w.x.y.z>\t\t\t\tLeaves a multicast group\n\n");
+    putsUart0("\tdisconnect\t\t\t\tDisconnects without reconnecting\n\n");
 }
 
 void displayInfo()
 {
+    uint8_t ipv4[4];
+    uint8_t nextHopMac[6];
+    etherGetIpAddress(ipv4);
     putsUart0("Client IP: ");
-    printIpv4(clientIp);
+    printIpv4(ipv4);
+    putsUart0(etherIsDhcpEnabled() ? (dhcpIsBound() ? " (DHCP)\n" : " (DHCP, no lease)\n") : "\n");
+    etherGetIpGatewayAddress(ipv4);
+    putsUart0("Gateway: ");
+    printIpv4(ipv4);
     putcUart0('\n');
+    etherGetIpSubnetMask(ipv4);
+    putsUart0("Subnet Mask: ");
+    printIpv4(ipv4);
+    putcUart0('\n');
+    if(hasBrokerHostname)
+    {
+        putsUart0("MQTT Server: ");
+        putsUart0(brokerHostname);
+        putcUart0('\n');
+    }
     putsUart0("MQTT Server IP: ");
     printIpv4(serverIp);
     putcUart0('\n');
-    putsUart0("MQTT Broker MAC: ");
-    printMac(serverMacLocalCopy);
+    dnsGetServer(ipv4);
+    putsUart0("DNS Server: ");
+    printIpv4(ipv4);
+    putcUart0('\n');
+    // A broker on another subnet is reached through the gateway's MAC
+    if(etherGetNextHop(serverIp, ipv4) && etherArpLookup(ipv4, nextHopMac))
+    {
+        putsUart0(etherIsLocalIp(serverIp) ? "MQTT Broker MAC: " : "MQTT Gateway MAC: ");
+        printMac(nextHopMac);
+        putcUart0('\n');
+    }
+    putsUart0(mqttGetProtocolLevel() == PROTOCOL_LEVEL_V5 ? "MQTT Version: 5\n" : "MQTT Version: 3.1.1\n");
+    if(established)
+    {
+        putsUart0("MQTT Broker RTT: ");
+        printUint32InDecimal(tcpGetSmoothedRtt(&conn));
+        putsUart0(" ms\n");
+    }
+}
+
+// Accept callback of the status port, queues what the status command prints and closes
+void serveStatus(tcpConnection* client)
+{
+    char text[128];
+    uint8_t ipv4[4];
+    uint8_t length = 0;
+    etherGetIpAddress(ipv4);
+    strCpy("Client IP: ", text + length);
+    length += strLen(text + length);
+    length += formatIpv4(text + length, ipv4);
+    strCpy(etherIsDhcpEnabled() ? " (DHCP)" : "", text + length);
+    length += strLen(text + length);
+    strCpy("\nMQTT Server IP: ", text + length);
+    length += strLen(text + length);
+    length += formatIpv4(text + length, serverIp);
+    strCpy(established ? "\nMQTT: connected\nMQTT Broker RTT: " : "\nMQTT: not connected\n", text + length);
+    length += strLen(text + length);
+    if(established)
+    {
+        length += formatUint32(text + length, tcpGetSmoothedRtt(&conn));
+        strCpy(" ms\n", text + length);
+        length += strLen(text + length);
+    }
+    sockSend(client, (uint8_t*)text, length);
+    sockClose(client);
+}
+
+// There is only one broker connection, so the callbacks just raise flags for the main loop
+void onBrokerReadable(tcpConnection* c)
+{
+    (void)c;
+    brokerReadable = true;
+}
+
+void onBrokerClosed(tcpConnection* c)
+{
+    (void)c;
+    brokerClosed = true;
+}
+
+// Topics and messages are not null terminated in the receive buffer
+void printMqttSlice(mqttSlice* slice)
+{
+    uint32_t i = 0;
+    for(i = 0; i < slice->length; i++)
+        putcUart0(slice->data[i]);
+}
+
+// Everything for the broker goes through here, so the keep alive timer knows when it last heard from us
+// tcpWrite cuts a packet off where the send buffer ends and the broker would read garbage after it,
+// so a packet is only written when all of it fits in what the socket has room for right now
+// Returns false if it does not fit, nothing is written then
+bool sendToBroker(uint8_t data[], uint16_t length)
+{
+    if(sockGetSendSpace(&conn) < length)
+        return false;
+    sockSend(&conn, data, length);
+    lastSendTime = getMilliseconds();
+    return true;
+}
+
+// Room for a packet other than a piece of a streamed payload, which must not land inside it
+// The stream only keeps the others out until its last piece is written, the room is always the socket's
+uint32_t getBrokerSendSpace()
+{
+    return publishStream.active ? 0 : sockGetSendSpace(&conn);
+}
+
+// Producer of the snapshot command, the words are sent most significant byte first
+uint16_t produceEepromSnapshot(uint32_t offset, uint8_t data[], uint16_t length)
+{
+    uint16_t i = 0;
+    for(i = 0; i < length; i++)
+        data[i] = (readEeprom(PROJECT_META_DATA + ((offset + i) >> 2)) >> ((3 - ((offset + i) & 3)) << 3)) & 0xFF;
+    return length;
+}
+
+// Answers one of the broker's publishes, the room for it is checked before the packet is taken
+void sendPublishAck(packetType type, uint16_t packetIdentifier)
+{
+    uint8_t packet[MQTT_PUBLISH_ACK_SIZE];
+    uint16_t length = 0;
+    assembleMqttPublishAckPacket(packet, type, packetIdentifier, &length);
+    sendToBroker(packet, length);
+}
+
+// The QoS in field 3 of the publish command, or the one set with the qos command if it is left out
+// Returns false if the one given is not 0, 1 or 2
+bool getPublishQos(USER_DATA* data, uint8_t* publishQos)
+{
+    *publishQos = qos;
+    if(data->fieldCount <= 3)
+        return true;
+    if(getFieldInteger(data, 3) > 2)
+    {
+        putsUart0("QoS is 0, 1 or 2\n");
+        return false;
+    }
+    *publishQos = getFieldInteger(data, 3) << 1;
+    return true;
+}
+
+// Sends a publish with the topic alias MQTT 5 allows and keeps the copy with the whole topic for QoS 1 and 2
+// packet needs room for both, the copy is built first and the packet that goes out after it
+// Returns false if the packet that goes out or the copy does not fit, nothing is sent then and no alias is taken
+bool sendPublish(uint8_t packet[], char topic[], char payload[], uint16_t publishIdentifier, uint8_t publishQos)
+{
+    uint16_t copyLength = 0, length = 0;
+    assembleMqttPublishPacket(packet, topic, publishIdentifier, publishQos, payload, &copyLength);
+    assembleMqttAliasedPublishPacket(packet + copyLength, topic, publishIdentifier, publishQos, payload, &length);
+    if(getBrokerSendSpace() < length || (publishQos != QOS0 && !mqttCanTrackPublish(copyLength))
+       || !sendToBroker(packet + copyLength, length))
+        return false;
+    mqttCommitTopicAlias(topic);
+    if(publishQos != QOS0)
+        mqttTrackPublish(publishIdentifier, publishQos, packet, copyLength);
+    return true;
+}
+
+// Keeps a QoS 1 or 2 publish until the broker can take it, they go out in order after the ones before
+void queuePublish(char topic[], char payload[], uint8_t publishQos)
+{
+    if(!mqttQueuePush(topic, payload, publishQos))
+    {
+        putsUart0("The publish is too long or the queue is full, it was dropped\n");
+        return;
+    }
+    printUint32InDecimal(mqttQueueCount());
+    putsUart0(" publish(es) queued\n");
+}
+
+void showQueue()
+{
+    mqttQueueStats* stats = mqttQueueGetStats();
+    printUint32InDecimal(mqttQueueCount());
+    putsUart0(mqttQueueGetPolicy() == MQTT_QUEUE_DROP_OLDEST ? " queued, the oldest is dropped when full\n" : " queued, new ones are dropped when full\n");
+    putsUart0("Queued: ");
+    printUint32InDecimal(stats->queued);
+    putsUart0(" Sent: ");
+    printUint32InDecimal(stats->sent);
+    putsUart0(" Moved to EEPROM: ");
+    printUint32InDecimal(stats->spilled);
+    putsUart0("\nDropped oldest: ");
+    printUint32InDecimal(stats->droppedOldest);
+    putsUart0(" Dropped newest: ");
+    printUint32InDecimal(stats->droppedNewest);
+    putcUart0('\n');
+}
+
+// Handler of the filters subscribed to from the command line
+void printPublish(mqttPublish* publish)
+{
+    putsUart0("\nReceived new subscription information\n");
+    putsUart0("Topic name: ");
+    printMqttSlice(&publish->topic);
     putcUart0('\n');
+    putsUart0("Message: ");
+    printMqttSlice(&publish->payload);
+    putcUart0('\n');
+}
+
+// Returns where topic is stored or 0 if it is not, index is its place in the list
+char* findSubscription(char* topic, uint8_t* index)
+{
+    char* stored = subscriptions;
+    uint8_t i = 0;
+    for(i = 0; i < subscriptionCount; i++)
+    {
+        if(stringCompare(stored, topic))
+        {
+            *index = i;
+            return stored;
+        }
+        stored += strLen(stored) + 1;
+    }
+    return 0;
+}
+
+// A topic subscribed to again keeps its place and takes the new QoS, as it does on the broker
+void addSubscription(char* topic, uint8_t topicQos)
+{
+    uint16_t length = strLen(topic) + 1;
+    uint8_t index = 0;
+    if(findSubscription(topic, &index) != 0)
+    {
+        subscriptionQos[index] = topicQos;
+        return;
+    }
+    if(subscriptionCount == MAX_SUBSCRIPTIONS || subscriptionsSize + length > SUBSCRIPTIONS_SIZE)
+    {
+        putsUart0("Too many subscriptions, this one is not restored after a reconnect\n");
+        return;
+    }
+    strCpy(topic, subscriptions + subscriptionsSize);
+    subscriptionsSize += length;
+    subscriptionQos[subscriptionCount++] = topicQos;
+}
+
+void removeSubscription(char* topic)
+{
+    uint8_t index = 0;
+    char* stored = findSubscription(topic, &index);
+    char* end = subscriptions + subscriptionsSize;
+    uint16_t length = 0;
+    if(stored == 0)
+        return;
+    length = strLen(stored) + 1;
+    // Move the topics after it down
+    for(; stored + length < end; stored++)
+        *stored = stored[length];
+    subscriptionsSize -= length;
+    subscriptionCount--;
+    for(; index < subscriptionCount; index++)
+        subscriptionQos[index] = subscriptionQos[index + 1];
+}
+
+// Picks when to try again, anywhere from now to the backed off delay (full jitter)
+void scheduleReconnect()
+{
+    uint32_t delay = RECONNECT_BASE_DELAY << reconnectAttempts;
+    if(delay >= RECONNECT_MAX_DELAY)
+        delay = RECONNECT_MAX_DELAY;
+    else
+        reconnectAttempts++;
+    delay = generateRandomNumber() % (delay + 1);
+    reconnectTime = getMilliseconds() + delay;
+    reconnectPending = true;
+    putsUart0("Reconnecting in ");
+    printUint32InDecimal(delay);
+    putsUart0(" ms\n");
+}
+
+// Starts the deadline for the broker to answer, anything that waits longer than the keep alive
+// time is taken as a lost connection (MQTT 3.1.2.10)
+void waitForBroker(uint32_t timeout)
+{
+    responseDeadline = getMilliseconds() + timeout;
+}
+
+// States that are waiting on the broker and give up at responseDeadline
+bool isWaitingForBroker(state currentState)
+{
+    switch(currentState)
+    {
+    case CLOSING_TCP:
+    case CONNACK_MQTT:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// A SUBSCRIBE or UNSUBSCRIBE that was not acknowledged in time, counted from the command
+// so one that never found room in the send buffer gives up as well
+bool isAckOverdue(uint16_t identifier, uint32_t deadline)
+{
+    return identifier != 0 && (int32_t)(getMilliseconds() - deadline) >= 0;
+}
+
+// Keeps the topics of a subscribe or unsubscribe command until the broker has answered
+// A command line always fits, the topics take fewer characters than SUBSCRIPTIONS_SIZE
+void copyCommandTopics(USER_DATA* data, char topics[], uint32_t* length, uint8_t* count)
+{
+    *length = 0;
+    copySubscribeArguments(data, topics, length);
+    *count = data->fieldCount - 1;
 }
 
 void resetConnection()
 {
-    ackNum = 0;
-    seqNum = generateRandomNumber();
     size = 0;
     connect = false;
     established = false;
+    pingRequested = false;
+    pingOutstanding = false;
+    // What was sent of a streamed payload went with the connection
+    publishStream.active = false;
+    skippedAckIdentifier = 0;
+    // and so did the requests waiting for acknowledgements
+    subscribeIdentifier = 0;
+    unsubscribeIdentifier = 0;
 }
 
 // Gets the IP address from the EEPROM
+// The message is printed if it was never set, it can be 0 for addresses that have a default
 bool getIps(uint8_t ipBuffer[], char* message, uint8_t whichIp)
 {
     // The default EEPROM value is 0xFFFFFFFF
-    uint32_t mqttIpv4Address = readEeprom(PROJECT_META_DATA + ((whichIp == SERVER_IP) ? 1 : 2));
+    uint32_t mqttIpv4Address = readEeprom(PROJECT_META_DATA + whichIp);
     if(mqttIpv4Address != 0xFFFFFFFF)
     {
         convertEncodedIpv4ToArray(ipBuffer, mqttIpv4Address);
         return true;
     }
-    else
+    else if(message != 0)
         putsUart0(message);
     return false;
 }
 
+// The hostname is packed 4 characters to a word, the word after the last one holds the null terminator
+void saveBrokerHostname()
+{
+    uint32_t word = 0;
+    uint8_t i = 0;
+    for(i = 0; i == 0 || brokerHostname[i - 1] != '\0'; i++)
+    {
+        word = (word << 8) | (uint8_t)brokerHostname[i];
+        if((i & 3) == 3 || brokerHostname[i] == '\0')
+        {
+            writeEeprom(PROJECT_META_DATA + BROKER_HOSTNAME + (i >> 2), word << ((3 - (i & 3)) << 3));
+            word = 0;
+        }
+    }
+}
+
+// Returns false if no hostname was saved
+bool loadBrokerHostname()
+{
+    uint32_t word = 0;
+    uint8_t i = 0;
+    if(readEeprom(PROJECT_META_DATA + BROKER_HOSTNAME) == 0xFFFFFFFF)
+        return false;
+    for(i = 0; i < DNS_MAX_NAME_LENGTH; i++)
+    {
+        if((i & 3) == 0)
+            word = readEeprom(PROJECT_META_DATA + BROKER_HOSTNAME + (i >> 2));
+        brokerHostname[i] = (word >> ((3 - (i & 3)) << 3)) & 0xFF;
+        if(brokerHostname[i] == '\0')
+            return true;
+    }
+    brokerHostname[DNS_MAX_NAME_LENGTH - 1] = '\0';
+    return true;
+}
+
 //-----------------------------------------------------------------------------
 // Main
 //-----------------------------------------------------------------------------
@@ -216,6 +657,8 @@ int main(void)
     // Init controller
     initHw();
     initEeprom();
+    // Publishes moved to the EEPROM before a reset are still there
+    mqttQueueInit();
     // Setup UART0
     initUart0();
     setUart0BaudRate(115200, 40e6);
@@ -225,10 +668,9 @@ int main(void)
     putsUart0("\nStarting eth0\n");
     etherSetMacAddress(2, 3, 4, 5, 6, 101);
     etherDisableDhcpMode();
-    etherSetIpAddress(192, 168, 2, 101);
     etherSetIpSubnetMask(255, 255, 255, 0);
-    etherSetIpGatewayAddress(192, 168, 1, 1);
-    etherInit(ETHER_UNICAST | ETHER_BROADCAST | ETHER_HALFDUPLEX);
+    etherSetIpGatewayAddress(192, 168, 2, 1);
+    etherInit(ETHER_UNICAST | ETHER_BROADCAST | ETHER_HASHTABLE | ETHER_HALFDUPLEX);
     waitMicrosecond(100000);
 
     // Flash LED
@@ -237,43 +679,63 @@ int main(void)
     setPinValue(GREEN_LED, 0);
     waitMicrosecond(100000);
 
+    if(mqttQueueCount() > 0)
+    {
+        printUint32InDecimal(mqttQueueCount());
+        putsUart0(" queued publish(es) kept from before the reset\n");
+    }
+
     uint8_t buffer[MAX_PACKET_SIZE];
     etherHeader* etherData = (etherHeader*)buffer;
 
-    // Get the IP address from the EEPROM
-    if(getIps(serverIp, "The Server IP needs to be set before connecting!\n", SERVER_IP) &&
-       getIps(clientIp, "The Client IP needs to be set before connecting!\n", CLIENT_IP))
-        connect = true;
-
-    // These are here for testing purposes
-    socket source;
-    socket dest;
-
-    // Fill up the socket information
-    etherGetIpAddress(source.ip);
-    source.port = generateRandomNumber();
-    etherGetMacAddress(source.mac);
-    copyUint8Array(serverIp, dest.ip, 4);
-    dest.port = MQTT_PORT;
-
-    /*
-     * Followed RFC793
-     * Only send during the initial SYN message
-     * Kind = 2 for Maximum Segment Size
-     * Length = 4
-     * data = 1460 (0x05B4) - MSB first
-     * At the end include 0 to signify end of option
-     */
-    uint8_t optionsLength = 4;
-    uint8_t options[] = {0x02, 0x04, 0x05, 0xB4, 0x00};
+    // Get the IP addresses from the EEPROM, the ones that were set replace the defaults above
+    // Without a client IP the address comes from DHCP, the lease replaces the gateway and subnet mask
+    hasBrokerHostname = loadBrokerHostname();
+    bool hasServerIp = getIps(serverIp, hasBrokerHostname ? 0 : "The Server IP needs to be set before connecting!\n", SERVER_IP) || hasBrokerHostname;
+    bool hasClientIp = getIps(clientIp, 0, CLIENT_IP);
+    uint8_t ipv4[4];
+    if(hasClientIp)
+        etherSetIpAddress(clientIp[0], clientIp[1], clientIp[2], clientIp[3]);
+    if(getIps(ipv4, 0, GATEWAY_IP))
+        etherSetIpGatewayAddress(ipv4[0], ipv4[1], ipv4[2], ipv4[3]);
+    if(getIps(ipv4, 0, SUBNET_MASK))
+        etherSetIpSubnetMask(ipv4[0], ipv4[1], ipv4[2], ipv4[3]);
+    if(getIps(ipv4, 0, DNS_SERVER))
+        dnsSetServer(ipv4);
+    if(!hasClientIp)
+    {
+        putsUart0("No Client IP set, asking DHCP\n");
+        dhcpStart();
+    }
+    seedRandomNumber();
+    // Boards powered up together would all connect at once, so the first connect is jittered too
+    // With DHCP it waits for the lease as well
+    if(hasServerIp)
+    {
+        autoReconnect = true;
+        scheduleReconnect();
+    }
+
+    // The sockets are filled in by sockConnect
+    sockSetCallbacks(&conn, onBrokerReadable, 0, onBrokerClosed);
+    sockListen(STATUS_PORT, serveStatus);
 
     USER_DATA userData;
+    // The line as it was typed, parseField cuts it up in userData
+    char line[MAX_CHARS + 1];
     uint32_t mqttIpv4Address = 0;
 
     // Variables for the state machine
     ipHeader* recevedIpHeader = (ipHeader*)etherData->data;
     tcpHeader* receivedTcpHeader = (tcpHeader*)recevedIpHeader->data;
     state currentState = IDLE;
+    uint8_t* mqttPacket = 0;
+    uint32_t available = 0;
+    mqttParseResult parseResult;
+    mqttPublish publish;
+    uint16_t ackIdentifier = 0;
+    mqttReceiveResult receiveResult;
+    uint8_t publishQos = 0;
 
     // Endless loop
     while(true)
@@ -286,6 +748,7 @@ int main(void)
             {
                 isCarriageReturn = false;
 
+                strCpy(userData.buffer, line);
                 parseField(&userData);
 
                 if(isCommand(&userData, "reboot", 0))
@@ -297,28 +760,158 @@ int main(void)
                     {
                         if(isIpv4Address(&userData, 1))
                         {
-                            // Save the MQTT IPv4 address
+                            // Save the MQTT IPv4 address, it replaces a hostname
                             mqttIpv4Address = getIpv4Address(&userData, 1);
                             convertEncodedIpv4ToArray(serverIp, mqttIpv4Address);
                             writeEeprom(PROJECT_META_DATA + 1, mqttIpv4Address);
+                            writeEeprom(PROJECT_META_DATA + BROKER_HOSTNAME, 0xFFFFFFFF);
+                            hasBrokerHostname = false;
+                        }
+                        else if(getHostname(line, &userData, 2, brokerHostname, DNS_MAX_NAME_LENGTH))
+                        {
+                            saveBrokerHostname();
+                            hasBrokerHostname = true;
                         }
                         else
-                            putsUart0("Format: 255.255.255.255\n");
+                            putsUart0("Format: 255.255.255.255 or broker.example.com\n");
                     }
 
+                    // A static address turns DHCP off
                     if(stringCompare("IP", getFieldString(&userData, 1)))
                     {
                         mqttIpv4Address = getIpv4Address(&userData, 1);
                         convertEncodedIpv4ToArray(clientIp, mqttIpv4Address);
                         writeEeprom(PROJECT_META_DATA + 2, mqttIpv4Address);
+                        dhcpStop();
                         etherSetIpAddress(clientIp[0], clientIp[1], clientIp[2], clientIp[3]);
-                        etherGetIpAddress(source.ip);
+                    }
+
+                    // Brokers off our subnet are reached through the gateway
+                    if(stringCompare("GW", getFieldString(&userData, 1)))
+                    {
+                        if(isIpv4Address(&userData, 1))
+                        {
+                            mqttIpv4Address = getIpv4Address(&userData, 1);
+                            convertEncodedIpv4ToArray(ipv4, mqttIpv4Address);
+                            writeEeprom(PROJECT_META_DATA + GATEWAY_IP, mqttIpv4Address);
+                            etherSetIpGatewayAddress(ipv4[0], ipv4[1], ipv4[2], ipv4[3]);
+                        }
+                        else
+                            putsUart0("Format: 255.255.255.255\n");
+                    }
+
+                    // Used instead of the one DHCP gives
+                    if(stringCompare("DNS", getFieldString(&userData, 1)))
+                    {
+                        if(isIpv4Address(&userData, 1))
+                        {
+                            mqttIpv4Address = getIpv4Address(&userData, 1);
+                            convertEncodedIpv4ToArray(ipv4, mqttIpv4Address);
+                            writeEeprom(PROJECT_META_DATA + DNS_SERVER, mqttIpv4Address);
+                            dnsSetServer(ipv4);
+                            dnsFlush();
+                        }
+                        else
+                            putsUart0("Format: 255.255.255.255\n");
+                    }
+
+                    if(stringCompare("SN", getFieldString(&userData, 1)))
+                    {
+                        if(isIpv4Address(&userData, 1))
+                        {
+                            mqttIpv4Address = getIpv4Address(&userData, 1);
+                            convertEncodedIpv4ToArray(ipv4, mqttIpv4Address);
+                            writeEeprom(PROJECT_META_DATA + SUBNET_MASK, mqttIpv4Address);
+                            etherSetIpSubnetMask(ipv4[0], ipv4[1], ipv4[2], ipv4[3]);
+                        }
+                        else
+                            putsUart0("Format: 255.255.255.255\n");
+                    }
+                }
+
+                // Turning DHCP on forgets the static address so it is used after a reboot as well
+                if(isCommand(&userData, "dhcp", 1))
+                {
+                    if(stringCompare("on", getFieldString(&userData, 1)))
+                    {
+                        writeEeprom(PROJECT_META_DATA + CLIENT_IP, 0xFFFFFFFF);
+                        if(!etherIsDhcpEnabled())
+                            dhcpStart();
+                    }
+                    else if(stringCompare("off", getFieldString(&userData, 1)))
+                    {
+                        dhcpStop();
+                        putsUart0("Use set IP to give the board an address\n");
                     }
                 }
 
                 if(isCommand(&userData, "status", 0))
                     displayInfo();
 
+                // UDP sockets get datagrams sent to the groups joined here
+                if(isCommand(&userData, "join", 4) || isCommand(&userData, "leave", 4))
+                {
+                    convertEncodedIpv4ToArray(ipv4, getIpv4Address(&userData, 0));
+                    if(!isIpv4Address(&userData, 0) || !etherIsMulticastIp(ipv4))
+                        putsUart0("Format: 224.0.0.0 to 239.255.255.255\n");
+                    else if(isCommand(&userData, "leave", 4))
+                        igmpLeave(ipv4);
+                    else if(!igmpJoin(ipv4))
+                        putsUart0("Could not join the group\n");
+                }
+
+                // ping with an address is ICMP, without one it is the MQTT PINGREQ below
+                if(isCommand(&userData, "ping", 4))
+                {
+                    if(isIpv4Address(&userData, 0))
+                    {
+                        convertEncodedIpv4ToArray(ipv4, getIpv4Address(&userData, 0));
+                        pingStart(ipv4, userData.fieldCount > 5 ? getFieldInteger(&userData, 5) : 4);
+                    }
+                    else
+                        putsUart0("Format: ping 255.255.255.255 <count>\n");
+                }
+
+                if(isCommand(&userData, "qos", 1))
+                {
+                    if(getFieldInteger(&userData, 1) <= 2)
+                        qos = getFieldInteger(&userData, 1) << 1;
+                    else
+                        putsUart0("QoS is 0, 1 or 2\n");
+                }
+
+                // The broker sees it on the next connect
+                if(isCommand(&userData, "mqtt5", 1))
+                {
+                    if(stringCompare("on", getFieldString(&userData, 1)))
+                        mqttSetProtocolLevel(PROTOCOL_LEVEL_V5);
+                    else if(stringCompare("off", getFieldString(&userData, 1)))
+                        mqttSetProtocolLevel(PROTOCOL_LEVEL_V311);
+                    if(established)
+                        putsUart0("Used from the next connect\n");
+                }
+
+                if(isCommand(&userData, "queue", 0))
+                {
+                    if(userData.fieldCount == 1)
+                        showQueue();
+                    else if(stringCompare("oldest", getFieldString(&userData, 1)))
+                        mqttQueueSetPolicy(MQTT_QUEUE_DROP_OLDEST);
+                    else if(stringCompare("newest", getFieldString(&userData, 1)))
+                        mqttQueueSetPolicy(MQTT_QUEUE_DROP_NEWEST);
+                    else
+                        putsUart0("Format: queue <oldest|newest>\n");
+                }
+
+                // Without the broker QoS 1 and 2 publishes wait in the queue, QoS 0 ones are allowed to be lost
+                if(isCommand(&userData, "publish", 2) && !established && getPublishQos(&userData, &publishQos))
+                {
+                    if(publishQos == QOS0)
+                        putsUart0("Not connected, QoS 0 publishes are not queued\n");
+                    else
+                        queuePublish(getFieldString(&userData, 1), getFieldString(&userData, 2), publishQos);
+                }
+
                 if(isCommand(&userData, "help", 0))
                     showHelp();
 
@@ -331,109 +924,309 @@ int main(void)
                             keepAliveTime = DEFAULT_KEEP_ALIVE;
                     }
                     connect = true;
+                    autoReconnect = true;
+                    reconnectPending = false;
+                    reconnectAttempts = 0;
                 }
 
-                if(established)
+                // Packets that are sent without waiting for room would land inside the snapshot
+                if(established && publishStream.active && (isCommand(&userData, "snapshot", 1) || isCommand(&userData, "subscribe", 1)
+                   || isCommand(&userData, "unsubscribe", 1) || isCommand(&userData, "disconnect", 0)))
+                    putsUart0("Wait for the snapshot to go out\n");
+                // A state waiting for room in the send buffer would be overwritten
+                else if(established && currentState != IDLE && (isCommand(&userData, "snapshot", 1) || isCommand(&userData, "publish", 2)
+                        || isCommand(&userData, "subscribe", 1) || isCommand(&userData, "unsubscribe", 1) || isCommand(&userData, "disconnect", 0)))
+                    putsUart0("The last command has not gone out yet, try again\n");
+                else if(established)
                 {
+                    if(isCommand(&userData, "snapshot", 1))
+                        currentState = SNAPSHOT_MQTT;
+
                     if(isCommand(&userData, "publish", 2))
                         currentState = PUBLISH_MQTT;
 
+                    // One of each can wait for its acknowledgement, the topics are only known until then
                     if(isCommand(&userData, "subscribe", 1))
-                        currentState = SUBSCRIBE_MQTT;
+                    {
+                        if(subscribeIdentifier != 0)
+                            putsUart0("Wait for the SUBACK of the last subscribe\n");
+                        else
+                        {
+                            uint8_t i = 0;
+                            copyCommandTopics(&userData, subscribeTopics, &subscribeTopicsLength, &subscribeTopicCount);
+                            for(i = 0; i < subscribeTopicCount; i++)
+                                subscribeQos[i] = qos >> 1;
+                            subscribeIdentifier = mqttGetPacketIdentifier();
+                            subscribeDeadline = getMilliseconds() + keepAliveTime * 1000;
+                            resubscribing = false;
+                            currentState = SUBSCRIBE_MQTT;
+                        }
+                    }
 
                     if(isCommand(&userData, "unsubscribe", 1))
-                        currentState = UNSUBSCRIBE_MQTT;
+                    {
+                        if(unsubscribeIdentifier != 0)
+                            putsUart0("Wait for the UNSUBACK of the last unsubscribe\n");
+                        else
+                        {
+                            copyCommandTopics(&userData, unsubscribeTopics, &unsubscribeTopicsLength, &unsubscribeTopicCount);
+                            unsubscribeIdentifier = mqttGetPacketIdentifier();
+                            unsubscribeDeadline = getMilliseconds() + keepAliveTime * 1000;
+                            currentState = UNSUBSCRIBE_MQTT;
+                        }
+                    }
 
-                    if(isCommand(&userData, "ping", 0))
-                        currentState = PINGREQ_MQTT;
+                    if(isCommand(&userData, "ping", 0) && userData.fieldCount == 1)
+                        pingRequested = true;
 
                     if(isCommand(&userData, "disconnect", 0))
+                    {
+                        // Only a lost connection is reconnected
+                        autoReconnect = false;
                         currentState = DISCONNECT_MQTT;
+                    }
+                }
+            }
+        }
+
+        // The link is also lost when the cable is pulled or the switch restarts
+        if((int32_t)(getMilliseconds() - linkCheckTime) >= 0)
+        {
+            linkCheckTime = getMilliseconds() + LINK_CHECK_INTERVAL;
+            if(linkUp && !etherIsLinkUp())
+            {
+                linkUp = false;
+                putsUart0("Link down\n");
+                if(conn.state != TCP_CLOSED)
+                {
+                    sockAbort(&conn);
+                    currentState = CLOSING_TCP;
+                }
+            }
+            else if(!linkUp && etherIsLinkUp())
+            {
+                linkUp = true;
+                putsUart0("Link up\n");
+                // The cable may now be in another network, the lease is checked before it is used again
+                dhcpRestart();
+                // Every board on the switch sees the link come back at once
+                if(reconnectPending)
+                {
+                    reconnectAttempts = 0;
+                    scheduleReconnect();
                 }
             }
         }
 
+        if(reconnectPending && linkUp && etherIsIpValid() && currentState == IDLE && (int32_t)(getMilliseconds() - reconnectTime) >= 0)
+        {
+            reconnectPending = false;
+            connect = true;
+        }
+
         if(connect)
         {
             connect = false;
-            // Initiate the start of the conversation
-            currentState = SEND_ARP;
+            // Initiate the start of the conversation, the SYN waits in eth0 if the broker's MAC has to be looked up
+            // A broker set by name is looked up first, which is free while the cached answer lasts
+            currentState = hasBrokerHostname ? RESOLVE_DNS : CONNECT_TCP;
+        }
+
+        // The broker did not answer in time, which is what a dead broker or a pulled cable looks like
+        if((isWaitingForBroker(currentState) && (int32_t)(getMilliseconds() - responseDeadline) >= 0)
+           || isAckOverdue(subscribeIdentifier, subscribeDeadline) || isAckOverdue(unsubscribeIdentifier, unsubscribeDeadline))
+        {
+            putsUart0("The broker stopped responding\n");
+            sockAbort(&conn);
+            currentState = CLOSING_TCP;
+            // The closed callback takes it from here
+            waitForBroker(keepAliveTime * 1000);
         }
 
         // This switch controls the send part of the state machine
-        // The requests/sends are always sent with the last known sequence and acknowledgement numbers
+        // Requests are queued on the socket and go out from sockPoll
         switch(currentState)
         {
-        case SEND_ARP:
-            // Send an ARP request to find out what the MAC address of the server is
-            etherSendArpRequest(etherData, serverIp);
-            currentState = RECV_ARP;
+        case RESOLVE_DNS:
+            switch(dnsResolve(brokerHostname, serverIp))
+            {
+            case DNS_RESOLVED:
+                currentState = CONNECT_TCP;
+                break;
+            case DNS_FAILED:
+                putsUart0("Could not look up ");
+                putsUart0(brokerHostname);
+                putcUart0('\n');
+                currentState = IDLE;
+                if(autoReconnect)
+                    scheduleReconnect();
+                break;
+            default:
+                break;
+            }
             break;
-        case SEND_SYN:
-            sendTcp(etherData, &source, &dest, 0x6000 | SYN, seqNum, ackNum, options, optionsLength, 0);
-            currentState = RECV_SYN_ACK;
+        case CONNECT_TCP:
+            if(!sockConnect(&conn, serverIp, MQTT_PORT))
+            {
+                putsUart0("State: CONNECT_TCP error\n");
+                currentState = IDLE;
+                break;
+            }
+            currentState = CONNECTING_TCP;
             break;
+        case CONNECTING_TCP:
+            // A failed handshake ends up in CLOSED through the closed callback
+            if(sockIsConnected(&conn))
+                currentState = CONNECT_MQTT;
+            break;
+        // Half a packet in the send buffer would leave the broker reading garbage, so every state
+        // that sends stays where it is until the whole packet fits and tries again on the next pass
         case CONNECT_MQTT:
-            assembleMqttConnectPacket(receivedTcpHeader->data, CLEAN_SESSION, keepAliveTime, "test", 4, &size);
-            sendTcp(etherData, &source, &dest, 0x5000 | PSH | ACK, seqNum, ackNum, 0, 0, size);
+            mqttParserInit(&parser, TCP_RX_BUFFER_SIZE);
+            assembleMqttConnectPacket(receivedTcpHeader->data, sessionStarted ? 0 : CLEAN_SESSION, keepAliveTime, "test", 4, &size);
+            if(getBrokerSendSpace() < size)
+                break;
+            sendToBroker(receivedTcpHeader->data, size);
+            waitForBroker(keepAliveTime * 1000);
             currentState = CONNACK_MQTT;
             break;
-        case PINGREQ_MQTT:
-            assembleMqttPacket(receivedTcpHeader->data, PINGERQ, &size);
-            sendTcp(etherData, &source, &dest, 0x5000 | PSH | ACK, seqNum, ackNum, 0, 0, size);
-            currentState = PINGRESP_MQTT;
-            break;
         case DISCONNECT_MQTT:
             assembleMqttPacket(receivedTcpHeader->data, DISCONNECT, &size);
-            sendTcp(etherData, &source, &dest, 0x5000 | PSH | FIN | ACK, seqNum, ackNum, 0, 0, size);
-            currentState = FIN_WAIT_1;
+            if(getBrokerSendSpace() < size)
+                break;
+            sendToBroker(receivedTcpHeader->data, size);
+            // The FIN goes out with the DISCONNECT
+            sockClose(&conn);
+            waitForBroker(keepAliveTime * 1000);
+            currentState = CLOSING_TCP;
             break;
         case PUBLISH_MQTT:
-            assembleMqttPublishPacket(receivedTcpHeader->data, getFieldString(&userData, 1), packetIdentifier, qos, getFieldString(&userData, 2), &size);
-            sendTcp(etherData, &source, &dest, 0x5000 | PSH | ACK, seqNum, ackNum, 0, 0, size);
-            switch(qos)
-            {
-            case QOS0:
-                currentState = PUBLISH_QOS0_MQTT;
-                break;
-            case QOS1:
-                currentState = PUBLISH_QOS1_MQTT;
+            // QoS 1 and 2 publishes do not wait for the broker, up to MQTT_MAX_IN_FLIGHT of them are sent back to back
+            currentState = IDLE;
+            if(!getPublishQos(&userData, &publishQos))
                 break;
-            case QOS2:
+            // Publishes queued before this one go first
+            if(publishQos != QOS0 && (mqttIsInFlightFull() || mqttQueueCount() > 0))
+            {
+                queuePublish(getFieldString(&userData, 1), getFieldString(&userData, 2), publishQos);
                 break;
             }
-            break;
-        case SUBSCRIBE_MQTT:
+            if(!sendPublish(receivedTcpHeader->data, getFieldString(&userData, 1), getFieldString(&userData, 2),
+                            (publishQos == QOS0) ? 0 : mqttGetPacketIdentifier(), publishQos))
             {
-            uint32_t totalMessageLength = 0;
-            copySubscribeArguments(&userData, etherData, &totalMessageLength);
-            assembleMqttSubscribeUnsubscribePacket((uint8_t*)receivedTcpHeader->data, SUBSCRIBE, packetIdentifier, etherData, totalMessageLength, userData.fieldCount - 1, QOS0, &size);
-            sendTcp(etherData, &source, &dest, 0x5000 | PSH | ACK, seqNum, ackNum, 0, 0, size);
+                if(publishQos == QOS0)
+                    putsUart0("The send buffer is full, the publish was dropped\n");
+                else
+                    queuePublish(getFieldString(&userData, 1), getFieldString(&userData, 2), publishQos);
             }
-            currentState = SUBACK_MQTT;
             break;
-        case UNSUBSCRIBE_MQTT:
+        case SNAPSHOT_MQTT:
+            // The header goes now with the length of the whole payload, the EEPROM follows from the main loop
+            // A copy for QoS 1 or 2 would need the whole payload in RAM, so it is QoS 0
+            currentState = IDLE;
+            assembleMqttPublishHeader(receivedTcpHeader->data, getFieldString(&userData, 1), 0, QOS0, EEPROM_SNAPSHOT_SIZE, &size);
+            if(getBrokerSendSpace() < size)
             {
-            uint32_t totalMessageLength = 0;
-            copySubscribeArguments(&userData, etherData, &totalMessageLength);
-            assembleMqttSubscribeUnsubscribePacket((uint8_t*)receivedTcpHeader->data, UNSUBSCRIBE, packetIdentifier, etherData, totalMessageLength, userData.fieldCount - 1, 0, &size);
-            sendTcp(etherData, &source, &dest, 0x5000 | PSH | ACK, seqNum, ackNum, 0, 0, size);
+                putsUart0("The send buffer is full, try again\n");
+                break;
             }
-            currentState = UNSUBACK_MQTT;
+            sendToBroker(receivedTcpHeader->data, size);
+            mqttStartStream(&publishStream, 0, produceEepromSnapshot, EEPROM_SNAPSHOT_SIZE);
+            break;
+        // The SUBACK and UNSUBACK are handled in the receive loop, so the states are free for the next command once the packet is out
+        case SUBSCRIBE_MQTT:
+        case RESUBSCRIBE_MQTT:
+            assembleMqttSubscribeUnsubscribePacket((uint8_t*)receivedTcpHeader->data, SUBSCRIBE, subscribeIdentifier, subscribeTopics,
+                                                   subscribeTopicsLength, subscribeTopicCount, subscribeQos, &size);
+            if(getBrokerSendSpace() < size)
+                break;
+            sendToBroker(receivedTcpHeader->data, size);
+            currentState = IDLE;
             break;
-        case CLOSE_WAIT:
-            sendTcp(etherData, &source, &dest, 0x5000 | FIN | ACK, seqNum, ackNum, 0, 0, 0);
-            currentState = LAST_ACK;
+        case UNSUBSCRIBE_MQTT:
+            assembleMqttSubscribeUnsubscribePacket((uint8_t*)receivedTcpHeader->data, UNSUBSCRIBE, unsubscribeIdentifier, unsubscribeTopics,
+                                                   unsubscribeTopicsLength, unsubscribeTopicCount, 0, &size);
+            if(getBrokerSendSpace() < size)
+                break;
+            sendToBroker(receivedTcpHeader->data, size);
+            currentState = IDLE;
             break;
         case CLOSED:
             putsUart0("Connection closed!\n");
             setPinValue(BLUE_LED, 0);
             resetConnection();
-            source.port = generateRandomNumber();
             currentState = IDLE;
+            if(autoReconnect)
+                scheduleReconnect();
             break;
         }
 
+        // A PINGREQ only goes out when nothing else was sent for the keep alive time (MQTT 3.1.2.10)
+        // so a busy connection never sends one
+        if(established && !pingOutstanding && getBrokerSendSpace() >= 2
+           && (pingRequested || (int32_t)(getMilliseconds() - lastSendTime) >= (int32_t)keepAliveTime * 1000))
+        {
+            uint8_t pingRequest[2];
+            uint16_t pingLength = 0;
+            assembleMqttPacket(pingRequest, PINGERQ, &pingLength);
+            sendToBroker(pingRequest, pingLength);
+            pingRequested = false;
+            pingOutstanding = true;
+            pingDeadline = getMilliseconds() + ((keepAliveTime * 1000 < PINGRESP_TIMEOUT) ? keepAliveTime * 1000 : PINGRESP_TIMEOUT);
+        }
+        // No PINGRESP is what a dead broker or a pulled cable somewhere between us looks like
+        if(pingOutstanding && (int32_t)(getMilliseconds() - pingDeadline) >= 0)
+        {
+            putsUart0("No PINGRESP from the broker\n");
+            pingOutstanding = false;
+            sockAbort(&conn);
+            currentState = CLOSING_TCP;
+            waitForBroker(keepAliveTime * 1000);
+        }
+
+        // A streamed payload goes on as far as the send buffer takes, tcp.c cuts it into segments
+        // Publishes that were not acknowledged in time, or were in flight when the connection was lost, go again
+        // The queued ones follow in order, as many as the in-flight window and the send buffer take
+        if(established)
+        {
+            uint8_t* duePublish = 0;
+            uint16_t dueLength = 0;
+            char queuedTopic[MQTT_QUEUE_MAX_TOPIC + 1];
+            char queuedPayload[MQTT_QUEUE_MAX_PAYLOAD + 1];
+            uint8_t chunkBuffer[MQTT_STREAM_CHUNK_SIZE];
+            uint8_t* chunk = 0;
+            uint16_t chunkLength = 0;
+            if(skippedAckIdentifier != 0 && getBrokerSendSpace() >= MQTT_PUBLISH_ACK_SIZE)
+            {
+                sendPublishAck(skippedAckType, skippedAckIdentifier);
+                skippedAckIdentifier = 0;
+            }
+            while((chunk = mqttGetStreamChunk(&publishStream, chunkBuffer, sockGetSendSpace(&conn), &chunkLength)) != 0)
+                sendToBroker(chunk, chunkLength);
+            while((duePublish = mqttGetDuePublish(getBrokerSendSpace(), &dueLength)) != 0)
+                sendToBroker(duePublish, dueLength);
+            // A publish stays queued until it and the copy that is sent again if it is lost have room
+            while(!mqttIsInFlightFull() && mqttQueuePeek(queuedTopic, queuedPayload, &publishQos)
+                  && sendPublish(receivedTcpHeader->data, queuedTopic, queuedPayload, mqttGetPacketIdentifier(), publishQos))
+                mqttQueuePop();
+        }
+
+        // Runs the TCP timers and sends whatever the states above queued
+        sockPoll(etherData);
+        etherArpTick();
+        dhcpTick(etherData);
+        dnsTick(etherData);
+        pingTick(etherData);
+        igmpTick(etherData);
+
+        // The lease ran out or a server refused it, the connection can not go on without an address
+        if(!etherIsIpValid() && conn.state != TCP_CLOSED)
+        {
+            putsUart0("The IP address was lost\n");
+            sockAbort(&conn);
+            currentState = CLOSING_TCP;
+        }
+
         if(etherIsDataAvailable())
         {
             if (etherIsOverflow())
@@ -446,206 +1239,234 @@ int main(void)
             // Get packet
             etherGetPacket(etherData, MAX_PACKET_SIZE);
 
-            if(etherIsArpRequest(etherData))
-                etherSendArpResponse(etherData);
+            // Answers requests for our IP and keeps the ARP cache up to date
+            etherHandleArp(etherData);
 
-            // This part of the program controls the receive part of the state machine
-            switch(currentState)
+            if(etherIsIp(etherData))
             {
-            case RECV_ARP:
-                if(etherIsArpResponse(etherData))
+                // Echo requests are answered in the frame they came in, TCP never sees them
+                if(etherIsPingRequest(etherData))
                 {
-                    putsUart0("Received an ARP response\n");
-                    copyUint8Array(etherData->sourceAddress, serverMacLocalCopy, 6);
-                    currentState = SEND_SYN;
+                    if(etherIsIpUnicast(etherData))
+                        etherSendPingResponse(etherData);
                 }
-                break;
+                else if(etherIsPingReply(etherData))
+                    pingInput(etherData);
+                else if(etherIsIgmp(etherData))
+                    igmpInput(etherData);
+                else if(etherIsTcp(etherData))
+                    sockInput(etherData);
+                else if(etherIsUdp(etherData))
+                    udpInput(etherData);
             }
+        }
 
-            if(etherIsIp(etherData) && etherIsTcp(etherData))
+        // Handle every complete MQTT packet waiting in the receive buffer
+        if(brokerReadable)
+        {
+            brokerReadable = false;
+            while((available = sockPeek(&conn, &mqttPacket)) > 0)
             {
-
-                // Get publish packets
-                if(mqttIsPublishPacket(receivedTcpHeader->data))
+                // Only one acknowledgement of a thrown away publish waits at a time
+                if(skippedAckIdentifier != 0)
                 {
-                    putsUart0("\nReceived new subscription information\n");
-
-                    subscription receivedSubscriptionData;
-                    getTopicData(receivedTcpHeader->data, &receivedSubscriptionData);
-
-                    putsUart0("Topic name: ");
-                    putsUart0(receivedSubscriptionData.topicName);
-                    putcUart0('\n');
-                    putsUart0("Message: ");
-                    putsUart0(receivedSubscriptionData.message);
-                    putcUart0('\n');
-
-                    ackNum = ntohl(receivedTcpHeader->sequenceNumber) + receivedSubscriptionData.remainingLength + 2;
-                    sendTcp(etherData, &source, &dest, 0x5000 | ACK, seqNum, ackNum, 0, 0, 0);
-                    currentState = IDLE;
+                    brokerReadable = true;
+                    break;
                 }
-
-                switch(currentState)
+                parseResult = mqttParse(&parser, mqttPacket, available);
+                // The rest of the packet is still on its way
+                if(parseResult == MQTT_PARSE_MORE)
+                    break;
+                if(parseResult == MQTT_PARSE_ERROR)
                 {
-                case RECV_SYN_ACK:
-                    // Check if SYN, ACK
-                    if((ntohs(receivedTcpHeader->offsetFields) & SYN) && (ntohs(receivedTcpHeader->offsetFields) & ACK))
-                    {
-                        seqNum++;
-                        ackNum = ntohl(receivedTcpHeader->sequenceNumber) + 1;
-                        sendTcp(etherData, &source, &dest, 0x5000 | ACK, seqNum, ackNum, 0, 0, 0);
-                        currentState = CONNECT_MQTT;
-                    }
-                    else
-                    {
-                        putsUart0("State: RECV_SYN_ACK error\n");
-                        currentState = RECV_SYN_ACK;
-                    }
+                    putsUart0("The broker sent a malformed packet\n");
+                    sockAbort(&conn);
+                    currentState = CLOSING_TCP;
+                    waitForBroker(keepAliveTime * 1000);
                     break;
-                // This is for the active close of the socket
-                case FIN_WAIT_1:
-                    // Check if this is the ACK of FIN
-                    if((ntohs(receivedTcpHeader->offsetFields) & ACK) || (htonl(receivedTcpHeader->sequenceNumber) == ackNum))
-                    {
-                        currentState = FIN_WAIT_2;
-                    }
-                    else
+                }
+                if(parseResult == MQTT_PARSE_SKIPPED)
+                {
+                    if(mqttGetSkippedPublish(&parser, &publishQos, &ackIdentifier) && (publishQos == QOS1 || publishQos == QOS2))
                     {
-                        putsUart0("State: FIN_WAIT_1 error\n");
-                        currentState = FIN_WAIT_1;
+                        putsUart0("A publish too large for the receive buffer was dropped\n");
+                        skippedAckType = (publishQos == QOS2) ? PUBREC : PUBACK;
+                        skippedAckIdentifier = ackIdentifier;
                     }
+                    sockRecv(&conn, 0, parser.consumed);
+                    continue;
+                }
+
+                // A packet that has to be answered waits until the answer fits in the send buffer
+                if((((parser.controlHeader & 0xF0) == PUBLISH && (parser.controlHeader & (QOS1 | QOS2))) || parser.controlHeader == PUBREC
+                    || parser.controlHeader == PUBREL) && getBrokerSendSpace() < MQTT_PUBLISH_ACK_SIZE)
+                {
+                    brokerReadable = true;
                     break;
-                case FIN_WAIT_2:
-                    // Check if FIN, ACK
-                    if((ntohs(receivedTcpHeader->offsetFields) & FIN) && (ntohs(receivedTcpHeader->offsetFields) & ACK))
-                    {
-                        /* The plus 1 is from page 43 of the RFC793 showing that the sequence number is incremented by 1
-                         * even if no data is sent
-                         */
-                        seqNum += size + 1;
-                        ackNum = ntohl(receivedTcpHeader->sequenceNumber) + 1;
-                        sendTcp(etherData, &source, &dest, 0x5000 | ACK, seqNum, ackNum, 0, 0, 0);
-                        waitMicrosecond(TIMEOUT_2MS);
-                        currentState = CLOSED;
-                    }
-                    else
+                }
+
+                // Publish packets go to the handlers of the filters they match
+                if(mqttGetPublish(&parser, mqttPacket, &publish))
+                {
+                    // A QoS 2 publish sent again before its PUBREL is only answered
+                    if(publish.qos == QOS2)
                     {
-                        putsUart0("State: FIN_WAIT_2 error\n");
+                        receiveResult = mqttStoreReceived(publish.packetIdentifier);
+                        if(receiveResult == MQTT_RECEIVED_NEW)
+                            mqttDispatch(&publish);
+                        if(receiveResult != MQTT_RECEIVED_FULL)
+                            sendPublishAck(PUBREC, publish.packetIdentifier);
                     }
-                    break;
-                case LAST_ACK:
-                    // Check if this is the last ack of the passive close of the socket
-                    if((ntohs(receivedTcpHeader->offsetFields) & ACK) || (htonl(receivedTcpHeader->sequenceNumber) == ackNum))
+                    // The PUBACK goes out on the next sockPoll with anything else queued and carries the TCP ACK
+                    else if(publish.qos == QOS1)
                     {
-                        waitMicrosecond(TIMEOUT_2MS);
-                        currentState = CLOSED;
+                        if(!mqttIsRedelivery(&publish))
+                            mqttDispatch(&publish);
+                        sendPublishAck(PUBACK, publish.packetIdentifier);
                     }
                     else
+                        mqttDispatch(&publish);
+                }
+                // The answers to our publishes are matched to the ones in flight whatever state we are in
+                else if(mqttIsPublishAck(mqttPacket, PUBACK, &ackIdentifier) || mqttIsPublishAck(mqttPacket, PUBREC, &ackIdentifier)
+                        || mqttIsPublishAck(mqttPacket, PUBCOMP, &ackIdentifier))
+                {
+                    // An MQTT 5 broker can refuse a publish, it is not sent again
+                    if(mqttGetReasonCode(mqttPacket) >= MQTT_REASON_FAILURE)
                     {
-                        putsUart0("State: LAST_ACK error\n");
-                    }
-                    break;
-                case CONNACK_MQTT:
-                    if(!mqttIsConnack(receivedTcpHeader->data) || (htonl(receivedTcpHeader->sequenceNumber) != ackNum))
-                    {
-                        putsUart0("State: MQTT_CONNACK error\n");
-                        currentState = CONNACK_MQTT;
-                        continue;
-                    }
-                    // Take the size of the previous data sent in bytes and add it to the sequence number
-                    seqNum += size;
-                    // Here, 4 is the size of the connack packet
-                    ackNum = ntohl(receivedTcpHeader->sequenceNumber) + getPayloadSize(etherData);
-                    sendTcp(etherData, &source, &dest, 0x5000 | ACK, seqNum, ackNum, 0, 0, 0);
-                    currentState = IDLE;
-                    // We enter the established state here
-                    established = true;
-                    setPinValue(BLUE_LED, 1);
-                    break;
-                case PUBLISH_QOS0_MQTT:
-                    // Take the size of the previous data sent in bytes and add it to the sequence number
-                    seqNum += size;
-                    break;
-                case PUBLISH_QOS1_MQTT:
-                    if(!mqttIsPuback(receivedTcpHeader->data, packetIdentifier) || (htonl(receivedTcpHeader->sequenceNumber) != ackNum))
-                    {
-                        putsUart0("State: PUBLISH_QOS1_MQTT error\n");
-                        currentState = PUBLISH_QOS1_MQTT;
-                        continue;
-                    }
-                    seqNum += size;
-                    // Here, 4 is the size of the puback packet
-                    ackNum = ntohl(receivedTcpHeader->sequenceNumber) + getPayloadSize(etherData);
-                    sendTcp(etherData, &source, &dest, 0x5000 | ACK, seqNum, ackNum, 0, 0, 0);
-                    currentState = IDLE;
-                    break;
-                case SUBACK_MQTT:
-                    // This state must only be set if the subscribe command is executed
-                    // The field count - 1 would give the number of topics
-                    if(!mqttIsAck(receivedTcpHeader->data, SUBACK, packetIdentifier, userData.fieldCount - 1)  || (htonl(receivedTcpHeader->sequenceNumber) != ackNum))
-                    {
-                        putsUart0("State: SUBACK_MQTT error\n");
-                        currentState = SUBACK_MQTT;
-                        continue;
+                        putsUart0("The broker refused publish ");
+                        printUint32InDecimal(ackIdentifier);
+                        putsUart0(", reason code 0x");
+                        printUint8InHex(mqttGetReasonCode(mqttPacket));
+                        putcUart0('\n');
                     }
-                    // This only checks the first return code
-                    // ADD: Check all the return codes
-                    uint8_t returnCode = getSubackPayload(receivedTcpHeader->data);
-                    if(returnCode == SUBACK_FAILURE)
-                        putsUart0("Error: SUBACK_FAILURE");
+                    if(!mqttAcknowledgePublish((packetType)parser.controlHeader, ackIdentifier, mqttGetReasonCode(mqttPacket)))
+                        putsUart0("Acknowledgement for a publish that is not in flight\n");
+                }
+                else if(mqttIsPingResponse(mqttPacket))
+                    pingOutstanding = false;
+                // Answered even when the identifier is not known, our PUBCOMP may have been lost (MQTT 4.3.3)
+                else if(mqttIsPublishAck(mqttPacket, PUBREL, &ackIdentifier))
+                {
+                    mqttReleaseReceived(ackIdentifier);
+                    sendPublishAck(PUBCOMP, ackIdentifier);
+                }
+                // Every topic has its own return code, a refused one is not kept
+                else if(parser.controlHeader == SUBACK)
+                {
+                    if(subscribeIdentifier == 0 || !mqttIsAck(mqttPacket, SUBACK, subscribeIdentifier, subscribeTopicCount))
+                        putsUart0("SUBACK for a subscribe that is not waiting for one\n");
                     else
                     {
-                        putsUart0("Maximum QoS granted: ");
-                        printUint8InDecimal(returnCode);
-                        putcUart0('\n');
+                        uint8_t i = 0, returnCode = 0;
+                        char* topic = subscribeTopics;
+                        for(i = 0; i < subscribeTopicCount; i++, topic += strLen(topic) + 1)
+                        {
+                            returnCode = getSubackPayload(mqttPacket, i);
+                            putsUart0("Topic ");
+                            printUint8InDecimal(i + 1);
+                            if(returnCode >= SUBACK_FAILURE)
+                            {
+                                putsUart0(": SUBACK_FAILURE 0x");
+                                printUint8InHex(returnCode);
+                                putcUart0('\n');
+                                continue;
+                            }
+                            putsUart0(": maximum QoS granted ");
+                            printUint8InDecimal(returnCode);
+                            putcUart0('\n');
+                            if(resubscribing)
+                                continue;
+                            addSubscription(topic, subscribeQos[i]);
+                            if(!mqttAddSubscription(topic, printPublish))
+                                putsUart0("No room left for the filter, its messages are not shown\n");
+                        }
+                        subscribeIdentifier = 0;
                     }
-                    seqNum += size;
-                    // Here, 5 is the size of the puback packet
-                    ackNum = ntohl(receivedTcpHeader->sequenceNumber) + getPayloadSize(etherData);
-                    sendTcp(etherData, &source, &dest, 0x5000 | ACK, seqNum, ackNum, 0, 0, 0);
-                    currentState = IDLE;
-                    break;
-                case UNSUBACK_MQTT:
-                    // The number of topics should be zero as only a packet identifier is sent
-                    if(!mqttIsAck(receivedTcpHeader->data, UNSUBACK, packetIdentifier, 0) || (htonl(receivedTcpHeader->sequenceNumber) != ackNum))
+                }
+                // MQTT 3.1.1 only sends the packet identifier back, MQTT 5 has a reason code for every topic
+                else if(parser.controlHeader == UNSUBACK)
+                {
+                    if(unsubscribeIdentifier == 0 || !mqttIsAck(mqttPacket, UNSUBACK, unsubscribeIdentifier, unsubscribeTopicCount))
+                        putsUart0("UNSUBACK for an unsubscribe that is not waiting for one\n");
+                    else
                     {
-                        putsUart0("State: UNSUBACK_MQTT error\n");
-                        currentState = UNSUBACK_MQTT;
-                        continue;
+                        uint8_t i = 0;
+                        char* topic = unsubscribeTopics;
+                        for(i = 0; i < unsubscribeTopicCount; i++, topic += strLen(topic) + 1)
+                        {
+                            removeSubscription(topic);
+                            mqttRemoveSubscription(topic);
+                        }
+                        unsubscribeIdentifier = 0;
                     }
-                    seqNum += size;
-                    // Here, 4 is the size of the suback packet
-                    ackNum = ntohl(receivedTcpHeader->sequenceNumber) + getPayloadSize(etherData);
-                    sendTcp(etherData, &source, &dest, 0x5000 | ACK, seqNum, ackNum, 0, 0, 0);
-                    currentState = IDLE;
-                    break;
-                case PINGRESP_MQTT:
-                    if(!mqttIsPingResponse(receivedTcpHeader->data) || (htonl(receivedTcpHeader->sequenceNumber) != ackNum))
+                }
+                // An MQTT 5 broker says why it is closing the connection, the close itself is handled below
+                else if(parser.controlHeader == DISCONNECT)
+                {
+                    putsUart0("The broker disconnected, reason code 0x");
+                    printUint8InHex(mqttGetReasonCode(mqttPacket));
+                    putcUart0('\n');
+                }
+                else
+                {
+                    switch(currentState)
                     {
-                        putsUart0("State: PINGRESP_MQTT -> No ping response\n");
-                        currentState = PINGRESP_MQTT;
-                        continue;
+                    case CONNACK_MQTT:
+                        if(!mqttIsConnack(mqttPacket))
+                        {
+                            putsUart0("State: MQTT_CONNACK error, return code 0x");
+                            printUint8InHex(mqttGetConnackReturnCode(mqttPacket));
+                            putcUart0('\n');
+                            break;
+                        }
+                        mqttReadConnack(mqttPacket);
+                        // We enter the established state here
+                        established = true;
+                        reconnectAttempts = 0;
+                        setPinValue(BLUE_LED, 1);
+                        currentState = IDLE;
+                        // A kept session still has our subscriptions and the QoS 2 publishes the broker sent us
+                        if(!mqttIsSessionPresent(mqttPacket))
+                        {
+                            mqttClearReceived();
+                            // The broker did not keep our session, so it forgot the subscriptions with the old connection
+                            if(subscriptionCount > 0)
+                            {
+                                copyUint8Array((uint8_t*)subscriptions, (uint8_t*)subscribeTopics, subscriptionsSize);
+                                subscribeTopicsLength = subscriptionsSize - subscriptionCount;
+                                subscribeTopicCount = subscriptionCount;
+                                copyUint8Array(subscriptionQos, subscribeQos, subscriptionCount);
+                                subscribeIdentifier = mqttGetPacketIdentifier();
+                                subscribeDeadline = getMilliseconds() + keepAliveTime * 1000;
+                                resubscribing = true;
+                                currentState = RESUBSCRIBE_MQTT;
+                            }
+                        }
+                        sessionStarted = true;
+                        mqttRetryPublishes();
+                        break;
                     }
-                    // Take the size of the previous data sent in bytes and add it to the sequence number
-                    seqNum += size;
-                    // Here, 4 is the size of the connack packet
-                    ackNum = ntohl(receivedTcpHeader->sequenceNumber) + getPayloadSize(etherData);
-                    sendTcp(etherData, &source, &dest, 0x5000 | ACK, seqNum, ackNum, 0, 0, 0);
-                    currentState = IDLE;
-                    break;
                 }
+                sockRecv(&conn, 0, parser.consumed);
+            }
 
-                // This is for passive close of the socket
-                if((ntohs(receivedTcpHeader->offsetFields) & FIN) && (ntohs(receivedTcpHeader->offsetFields) & ACK) &&
-                   (htonl(receivedTcpHeader->sequenceNumber) == ackNum))
-                {
-                    // The sequence number should be the one that was part of the last message by the client
-                    ackNum = ntohl(receivedTcpHeader->sequenceNumber) + 1;
-                    sendTcp(etherData, &source, &dest, 0x5000 | ACK, seqNum, ackNum, 0, 0, 0);
-                    putsUart0("The server is closing down the connection.\n");
-                    currentState = CLOSE_WAIT;
-                }
+            // This is for passive close of the socket, the FIN goes out once everything queued is sent
+            if(sockIsPeerClosed(&conn) && currentState != CLOSING_TCP && currentState != CLOSED)
+            {
+                putsUart0("The server is closing down the connection.\n");
+                sockClose(&conn);
+                waitForBroker(keepAliveTime * 1000);
+                currentState = CLOSING_TCP;
             }
         }
+
+        // tcp.c follows the close from here, the connection is free again once both FINs are
+        // acknowledged, or FIN_WAIT_2 gives up, and a TIME_WAIT entry answers anything the server sends late
+        if(brokerClosed)
+        {
+            brokerClosed = false;
+            currentState = CLOSED;
+        }
     }
 }
@@ -0,0 +1,230 @@
+/*
+ * mqttQueue.c
+ * Holds QoS 1 and 2 publishes while the broker can not be reached, they are sent in order once it is back
+ * New messages go to RAM, when that is full the oldest ones move to the EEPROM, which keeps them over a reset
+ * Both parts are rings and every message in the EEPROM is older than those in RAM
+ *
+ * A message is its QoS, the topic length, the payload length in 2 bytes, the topic and the payload
+ * In the EEPROM it is packed 4 bytes to a word, most significant first, and padded to a whole word
+ *
+ *  Created on: Apr 20, 2021
+ *      Author: Sarker Nadir Afridi Azmi
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "mqttQueue.h"
+#include "eeprom.h"
+#include "utils.h"
+
+uint8_t ramQueue[MQTT_QUEUE_RAM_SIZE];
+uint16_t ramHead = 0;
+uint16_t ramSize = 0;
+uint16_t ramCount = 0;
+// In words past the two that hold where the messages are
+uint16_t eepromHead = 0;
+uint16_t eepromSize = 0;
+uint16_t eepromCount = 0;
+mqttQueuePolicy queuePolicy = MQTT_QUEUE_DROP_OLDEST;
+mqttQueueStats queueStats;
+
+uint16_t mqttQueueEepromDataWords()
+{
+    return MQTT_QUEUE_EEPROM_WORDS - 2;
+}
+
+uint8_t mqttQueueRamByte(uint16_t index)
+{
+    return ramQueue[(ramHead + index) % MQTT_QUEUE_RAM_SIZE];
+}
+
+void mqttQueueRamPut(uint16_t index, uint8_t byte)
+{
+    ramQueue[(ramHead + index) % MQTT_QUEUE_RAM_SIZE] = byte;
+}
+
+uint32_t mqttQueueEepromWord(uint16_t index)
+{
+    return readEeprom(MQTT_QUEUE_EEPROM_START + 2 + (eepromHead + index) % mqttQueueEepromDataWords());
+}
+
+// Bytes of the oldest message in RAM
+uint16_t mqttQueueRamRecordSize()
+{
+    return 4 + mqttQueueRamByte(1) + (((uint16_t)mqttQueueRamByte(2) << 8) | mqttQueueRamByte(3));
+}
+
+// Words of the oldest message in the EEPROM, its first word holds the lengths
+uint16_t mqttQueueEepromRecordWords()
+{
+    uint32_t header = mqttQueueEepromWord(0);
+    return 1 + ((((header >> 16) & 0xFF) + (header & 0xFFFF) + 3) >> 2);
+}
+
+// A byte of the oldest message, which is in the EEPROM if there is anything there
+uint8_t mqttQueueHeadByte(uint16_t index)
+{
+    if(eepromCount > 0)
+        return (mqttQueueEepromWord(index >> 2) >> ((3 - (index & 3)) << 3)) & 0xFF;
+    return mqttQueueRamByte(index);
+}
+
+// Only written when the EEPROM part changes, messages that stay in RAM do not wear it
+void mqttQueueSaveState()
+{
+    writeEeprom(MQTT_QUEUE_EEPROM_START, ((uint32_t)eepromSize << 16) | eepromHead);
+    writeEeprom(MQTT_QUEUE_EEPROM_START + 1, eepromCount);
+}
+
+// Picks up the messages left in the EEPROM before a reset
+void mqttQueueInit()
+{
+    uint32_t position = readEeprom(MQTT_QUEUE_EEPROM_START);
+    uint32_t count = readEeprom(MQTT_QUEUE_EEPROM_START + 1);
+    eepromHead = position & 0xFFFF;
+    eepromSize = position >> 16;
+    eepromCount = count;
+    // Never written, the words read 0xFFFFFFFF
+    if(position == 0xFFFFFFFF || eepromHead >= mqttQueueEepromDataWords() || eepromSize > mqttQueueEepromDataWords() || count > eepromSize)
+    {
+        eepromHead = 0;
+        eepromSize = 0;
+        eepromCount = 0;
+    }
+}
+
+void mqttQueueSetPolicy(mqttQueuePolicy policy)
+{
+    queuePolicy = policy;
+}
+
+mqttQueuePolicy mqttQueueGetPolicy()
+{
+    return queuePolicy;
+}
+
+// Moves the oldest message in RAM to the end of the EEPROM part
+void mqttQueueSpill()
+{
+    uint16_t size = mqttQueueRamRecordSize();
+    uint16_t words = (size + 3) >> 2;
+    uint16_t tail = eepromHead + eepromSize;
+    uint32_t word = 0;
+    uint16_t i = 0;
+    for(i = 0; i < (words << 2); i++)
+    {
+        word = (word << 8) | ((i < size) ? mqttQueueRamByte(i) : 0);
+        if((i & 3) == 3)
+        {
+            writeEeprom(MQTT_QUEUE_EEPROM_START + 2 + (tail + (i >> 2)) % mqttQueueEepromDataWords(), word);
+            word = 0;
+        }
+    }
+    eepromSize += words;
+    eepromCount++;
+    mqttQueueSaveState();
+    ramHead = (ramHead + size) % MQTT_QUEUE_RAM_SIZE;
+    ramSize -= size;
+    ramCount--;
+    queueStats.spilled++;
+}
+
+void mqttQueueRemoveOldest()
+{
+    uint16_t size = 0;
+    if(eepromCount > 0)
+    {
+        size = mqttQueueEepromRecordWords();
+        eepromHead = (eepromHead + size) % mqttQueueEepromDataWords();
+        eepromSize -= size;
+        eepromCount--;
+        mqttQueueSaveState();
+    }
+    else if(ramCount > 0)
+    {
+        size = mqttQueueRamRecordSize();
+        ramHead = (ramHead + size) % MQTT_QUEUE_RAM_SIZE;
+        ramSize -= size;
+        ramCount--;
+    }
+}
+
+// Adds a message behind the ones already queued
+// Returns false if it was refused, because it is too long or the queue is full and keeps its oldest messages
+bool mqttQueuePush(char topic[], char payload[], uint8_t qos)
+{
+    uint16_t topicLength = strLen(topic), payloadLength = strLen(payload);
+    uint16_t size = 4 + topicLength + payloadLength;
+    uint16_t i = 0;
+    if(topicLength > MQTT_QUEUE_MAX_TOPIC || payloadLength > MQTT_QUEUE_MAX_PAYLOAD)
+    {
+        queueStats.droppedNewest++;
+        return false;
+    }
+    while(MQTT_QUEUE_RAM_SIZE - ramSize < size)
+    {
+        if(mqttQueueEepromDataWords() - eepromSize >= (mqttQueueRamRecordSize() + 3) >> 2)
+            mqttQueueSpill();
+        else if(queuePolicy == MQTT_QUEUE_DROP_NEWEST)
+        {
+            queueStats.droppedNewest++;
+            return false;
+        }
+        else
+        {
+            mqttQueueRemoveOldest();
+            queueStats.droppedOldest++;
+        }
+    }
+    mqttQueueRamPut(ramSize, qos);
+    mqttQueueRamPut(ramSize + 1, topicLength);
+    mqttQueueRamPut(ramSize + 2, payloadLength >> 8);
+    mqttQueueRamPut(ramSize + 3, payloadLength & 0xFF);
+    for(i = 0; i < topicLength; i++)
+        mqttQueueRamPut(ramSize + 4 + i, topic[i]);
+    for(i = 0; i < payloadLength; i++)
+        mqttQueueRamPut(ramSize + 4 + topicLength + i, payload[i]);
+    ramSize += size;
+    ramCount++;
+    queueStats.queued++;
+    return true;
+}
+
+// Copies the oldest message out with null terminators, it stays queued until mqttQueuePop
+// topic and payload need room for MQTT_QUEUE_MAX_TOPIC and MQTT_QUEUE_MAX_PAYLOAD characters and the terminator
+// Returns false if the queue is empty
+bool mqttQueuePeek(char topic[], char payload[], uint8_t* qos)
+{
+    uint16_t topicLength = 0, payloadLength = 0, i = 0;
+    if(mqttQueueCount() == 0)
+        return false;
+    *qos = mqttQueueHeadByte(0);
+    topicLength = mqttQueueHeadByte(1);
+    payloadLength = ((uint16_t)mqttQueueHeadByte(2) << 8) | mqttQueueHeadByte(3);
+    for(i = 0; i < topicLength; i++)
+        topic[i] = mqttQueueHeadByte(4 + i);
+    topic[i] = '\0';
+    for(i = 0; i < payloadLength; i++)
+        payload[i] = mqttQueueHeadByte(4 + topicLength + i);
+    payload[i] = '\0';
+    return true;
+}
+
+// The oldest message was sent
+void mqttQueuePop()
+{
+    if(mqttQueueCount() == 0)
+        return;
+    mqttQueueRemoveOldest();
+    queueStats.sent++;
+}
+
+uint16_t mqttQueueCount()
+{
+    return eepromCount + ramCount;
+}
+
+mqttQueueStats* mqttQueueGetStats()
+{
+    return &queueStats;
+}
@@ -0,0 +1,53 @@
+/*
+ * mqttQueue.h
+ * Publishes held while the broker can not be reached
+ *
+ *  Created on: Apr 20, 2021
+ *      Author: Sarker Nadir Afridi Azmi
+ */
+
+#ifndef MQTTQUEUE_H_
+#define MQTTQUEUE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "eeprom.h"
+
+// Bytes of messages kept in RAM, the oldest move to the EEPROM when it is full
+#define MQTT_QUEUE_RAM_SIZE         512
+// The EEPROM part, after the words the client and DHCP use
+// The first two words say where the messages are, so the ones there survive a reset
+#define MQTT_QUEUE_EEPROM_START     (PROJECT_META_DATA + 64)
+#define MQTT_QUEUE_EEPROM_WORDS     448
+// Longest topic and message that can be queued
+#define MQTT_QUEUE_MAX_TOPIC        64
+#define MQTT_QUEUE_MAX_PAYLOAD      192
+
+typedef enum _mqttQueuePolicy
+{
+    // A full queue makes room by throwing away the oldest message
+    MQTT_QUEUE_DROP_OLDEST = 0,
+    // A full queue refuses the new message
+    MQTT_QUEUE_DROP_NEWEST
+} mqttQueuePolicy;
+
+typedef struct _mqttQueueStats
+{
+    uint32_t queued;
+    uint32_t sent;
+    // Moved from RAM to the EEPROM
+    uint32_t spilled;
+    uint32_t droppedOldest;
+    uint32_t droppedNewest;
+} mqttQueueStats;
+
+void mqttQueueInit();
+void mqttQueueSetPolicy(mqttQueuePolicy policy);
+mqttQueuePolicy mqttQueueGetPolicy();
+bool mqttQueuePush(char topic[], char payload[], uint8_t qos);
+bool mqttQueuePeek(char topic[], char payload[], uint8_t* qos);
+void mqttQueuePop();
+uint16_t mqttQueueCount();
+mqttQueueStats* mqttQueueGetStats();
+
+#endif /* MQTTQUEUE_H_ */
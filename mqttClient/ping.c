@@ -0,0 +1,171 @@
+/*
+ * ping.c
+ * Sends echo requests from the board and reports the round trip times
+ * The times come from the timer 0 count, so they are good to a microsecond
+ * and show the latency of the path to the broker without a PC on the network
+ *
+ *  Created on: Apr 20, 2021
+ *      Author: Sarker Nadir Afridi Azmi
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "eth0.h"
+#include "ping.h"
+#include "uart0.h"
+#include "cli.h"
+#include "utils.h"
+#include "timer0.h"
+
+pingSession session;
+
+// Prints microseconds as milliseconds with 3 decimals
+void printPingTime(uint32_t us)
+{
+    uint32_t fraction = us % 1000;
+    printUint32InDecimal(us / 1000);
+    putcUart0('.');
+    putcUart0('0' + fraction / 100);
+    putcUart0('0' + (fraction / 10) % 10);
+    putcUart0('0' + fraction % 10);
+    putsUart0(" ms");
+}
+
+void printPingSummary()
+{
+    uint16_t largest = 0;
+    uint8_t i = 0, j = 0, width = 0;
+
+    putsUart0("\n");
+    printUint32InDecimal(session.sent);
+    putsUart0(" sent, ");
+    printUint32InDecimal(session.received);
+    putsUart0(" received, ");
+    printUint32InDecimal((session.sent - session.received) * 100 / session.sent);
+    putsUart0("% lost\n");
+    if(session.received == 0)
+        return;
+    putsUart0("min ");
+    printPingTime(session.min);
+    putsUart0(", avg ");
+    printPingTime(session.total / session.received);
+    putsUart0(", max ");
+    printPingTime(session.max);
+    putcUart0('\n');
+
+    for(i = 0; i < PING_HISTOGRAM_BUCKETS; i++)
+        if(session.histogram[i] > largest)
+            largest = session.histogram[i];
+    for(i = 0; i < PING_HISTOGRAM_BUCKETS; i++)
+    {
+        putsUart0(i < PING_HISTOGRAM_BUCKETS - 1 ? "  < " : " >= ");
+        printPingTime((uint32_t)PING_FIRST_BUCKET << (i < PING_HISTOGRAM_BUCKETS - 1 ? i : i - 1));
+        putsUart0("\t|");
+        // Any bucket with a reply gets at least one mark
+        width = ((uint32_t)session.histogram[i] * PING_BAR_WIDTH + largest - 1) / largest;
+        for(j = 0; j < width; j++)
+            putcUart0('#');
+        putcUart0(' ');
+        printUint32InDecimal(session.histogram[i]);
+        putcUart0('\n');
+    }
+}
+
+// Sends count echo requests to ip, a ping that is running is replaced
+void pingStart(uint8_t ip[4], uint16_t count)
+{
+    uint8_t i = 0;
+    copyUint8Array(ip, session.ip, 4);
+    session.count = (count == 0 || count > PING_MAX_COUNT) ? PING_MAX_COUNT : count;
+    // Replies to an earlier ping are told apart by the ID
+    session.id = (session.id + 1) ^ (getMicroseconds() & 0xFF00);
+    session.sent = 0;
+    session.received = 0;
+    session.waiting = false;
+    session.nextTime = getMilliseconds();
+    session.min = 0xFFFFFFFF;
+    session.max = 0;
+    session.total = 0;
+    for(i = 0; i < PING_HISTOGRAM_BUCKETS; i++)
+        session.histogram[i] = 0;
+    session.active = true;
+    putsUart0("Pinging ");
+    printIpv4(ip);
+    putcUart0('\n');
+}
+
+void pingStop()
+{
+    if(session.active && session.sent > 0)
+        printPingSummary();
+    session.active = false;
+}
+
+bool pingIsActive()
+{
+    return session.active;
+}
+
+// Takes an IP packet, anything that is not the reply to the last request is ignored
+void pingInput(etherHeader* ether)
+{
+    ipHeader* ip = (ipHeader*)ether->data;
+    icmpHeader* icmp = (icmpHeader*)((uint8_t*)ip + ((ip->revSize & 0xF) << 2));
+    uint32_t rtt = getMicroseconds() - session.sendTime;
+    uint8_t i = 0;
+
+    if(!session.active || !session.waiting || !etherIsPingReply(ether))
+        return;
+    for(i = 0; i < 4; i++)
+        if(ip->sourceIp[i] != session.ip[i])
+            return;
+    if(ntohs(icmp->id) != session.id || ntohs(icmp->seq_no) != session.sent - 1)
+        return;
+
+    session.waiting = false;
+    session.received++;
+    session.total += rtt;
+    if(rtt < session.min)
+        session.min = rtt;
+    if(rtt > session.max)
+        session.max = rtt;
+    for(i = 0; i < PING_HISTOGRAM_BUCKETS - 1 && rtt >= ((uint32_t)PING_FIRST_BUCKET << i); i++);
+    session.histogram[i]++;
+
+    putsUart0("Reply from ");
+    printIpv4(session.ip);
+    putsUart0(": seq=");
+    printUint32InDecimal(session.sent - 1);
+    putsUart0(" time=");
+    printPingTime(rtt);
+    putcUart0('\n');
+}
+
+// Sends the next request once the interval is over and counts the ones that got no reply
+// Call this on every pass of the main loop, the frame is only used to build requests
+void pingTick(etherHeader* ether)
+{
+    if(!session.active)
+        return;
+    if(session.waiting && (int32_t)(getMilliseconds() - session.nextTime) >= 0)
+    {
+        session.waiting = false;
+        putsUart0("Request seq=");
+        printUint32InDecimal(session.sent - 1);
+        putsUart0(" timed out\n");
+    }
+    if(session.waiting)
+        return;
+    if(session.sent == session.count)
+    {
+        pingStop();
+        return;
+    }
+    if((int32_t)(getMilliseconds() - session.nextTime) < 0)
+        return;
+    session.nextTime = getMilliseconds() + PING_INTERVAL;
+    session.waiting = true;
+    session.sendTime = getMicroseconds();
+    // A request eth0 had to drop is counted as lost when its time is up
+    etherSendPingRequest(ether, session.ip, session.id, session.sent++, PING_DATA_SIZE);
+}
@@ -0,0 +1,51 @@
+/*
+ * ping.h
+ * Sends echo requests from the board and reports the round trip times
+ *
+ *  Created on: Apr 20, 2021
+ *      Author: Sarker Nadir Afridi Azmi
+ */
+
+#ifndef PING_H_
+#define PING_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "eth0.h"
+
+// Requests are sent this many milliseconds apart, a reply that takes longer is counted as lost
+#define PING_INTERVAL           1000
+#define PING_MAX_COUNT          1000
+#define PING_DATA_SIZE          32
+// Bucket i holds round trips under PING_FIRST_BUCKET << i microseconds, the last one everything slower
+#define PING_HISTOGRAM_BUCKETS  10
+#define PING_FIRST_BUCKET       250
+// Width of the longest bar in the histogram
+#define PING_BAR_WIDTH          40
+
+typedef struct _pingSession
+{
+    bool active;
+    uint8_t ip[4];
+    uint16_t id;
+    uint16_t count;
+    uint16_t sent;
+    uint16_t received;
+    // The request waiting for its reply and when it went out, in microseconds
+    bool waiting;
+    uint32_t sendTime;
+    // When the next request goes out, in milliseconds
+    uint32_t nextTime;
+    uint32_t min;
+    uint32_t max;
+    uint32_t total;
+    uint16_t histogram[PING_HISTOGRAM_BUCKETS];
+} pingSession;
+
+void pingStart(uint8_t ip[4], uint16_t count);
+void pingStop();
+bool pingIsActive();
+void pingInput(etherHeader* ether);
+void pingTick(etherHeader* ether);
+
+#endif /* PING_H_ */
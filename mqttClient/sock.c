@@ -0,0 +1,140 @@
+/*
+ * sock.c
+ * Lets applications open, use and close TCP connections without dealing with segments
+ * Nothing here sends right away, queued data and FINs go out from sockPoll, so writes made
+ * close together share segments
+ *
+ *  Created on: Apr 20, 2021
+ *      Author: Sarker Nadir Afridi Azmi
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "eth0.h"
+#include "tcp.h"
+#include "sock.h"
+#include "utils.h"
+#include "timer0.h"
+
+// Next local port for sockConnect, zero until the first connection
+uint16_t nextEphemeralPort = 0;
+
+// Any of the callbacks can be 0
+void sockSetCallbacks(tcpConnection* conn, tcpCallback readable, tcpCallback writable, tcpCallback closed)
+{
+    conn->readable = readable;
+    conn->writable = writable;
+    conn->closed = closed;
+}
+
+uint16_t getEphemeralPort()
+{
+    // Start somewhere different after every reset so that old segments do not match
+    if(nextEphemeralPort < SOCK_FIRST_EPHEMERAL_PORT)
+        nextEphemeralPort = SOCK_FIRST_EPHEMERAL_PORT + (getMilliseconds() % (SOCK_LAST_EPHEMERAL_PORT - SOCK_FIRST_EPHEMERAL_PORT));
+    if(nextEphemeralPort == SOCK_LAST_EPHEMERAL_PORT)
+    {
+        nextEphemeralPort = SOCK_FIRST_EPHEMERAL_PORT;
+        return SOCK_LAST_EPHEMERAL_PORT;
+    }
+    return nextEphemeralPort++;
+}
+
+// Opens a connection to ip and port, the SYN waits in the ARP queue if ip has to be looked up
+// The writable callback is called once the connection is established, closed if it fails
+// Returns false if the socket is in use or too many connections are open
+bool sockConnect(tcpConnection* conn, uint8_t ip[4], uint16_t port)
+{
+    if(conn->state != TCP_CLOSED)
+        return false;
+    etherGetIpAddress(conn->local.ip);
+    conn->local.port = getEphemeralPort();
+    copyUint8Array(ip, conn->remote.ip, 4);
+    conn->remote.port = port;
+    return tcpConnect(conn);
+}
+
+// accept is called with every connection a peer opens to port, it should set the callbacks
+bool sockListen(uint16_t port, tcpCallback accept)
+{
+    return tcpListen(port, accept);
+}
+
+// Queues data to be sent
+// Returns how much fit in the send buffer, the writable callback tells when there is more room
+uint32_t sockSend(tcpConnection* conn, uint8_t data[], uint32_t length)
+{
+    if(conn->state != TCP_ESTABLISHED && conn->state != TCP_CLOSE_WAIT)
+        return 0;
+    return tcpWrite(conn, data, length);
+}
+
+// Returns how many bytes sockSend would take now, so a message can be held back until it fits whole
+uint32_t sockGetSendSpace(tcpConnection* conn)
+{
+    if((conn->state != TCP_ESTABLISHED && conn->state != TCP_CLOSE_WAIT) || conn->finQueued)
+        return 0;
+    return TCP_TX_BUFFER_SIZE - conn->txCount;
+}
+
+// Points data at the received bytes without taking them out of the buffer
+// Returns how many there are
+uint32_t sockPeek(tcpConnection* conn, uint8_t** data)
+{
+    *data = conn->rxBuffer;
+    return conn->rxCount;
+}
+
+// Takes up to length received bytes, data can be 0 to drop bytes already looked at with sockPeek
+// Returns how many were taken, 0 with sockIsPeerClosed true is the end of the stream
+uint32_t sockRecv(tcpConnection* conn, uint8_t data[], uint32_t length)
+{
+    uint32_t i = 0;
+    if(length > conn->rxCount)
+        length = conn->rxCount;
+    for(i = 0; data != 0 && i < length; i++)
+        data[i] = conn->rxBuffer[i];
+    tcpConsume(conn, length);
+    return length;
+}
+
+// Sends a FIN after the queued data, the closed callback is called once both sides are done
+// A connection that is still opening is dropped
+void sockClose(tcpConnection* conn)
+{
+    if(conn->state == TCP_SYN_SENT || conn->state == TCP_SYN_RECEIVED)
+        tcpAbort(conn);
+    else
+        tcpClose(conn);
+}
+
+// Drops the connection without the close handshake, for a peer that has stopped answering
+// The closed callback is called from sockPoll
+void sockAbort(tcpConnection* conn)
+{
+    tcpAbort(conn);
+}
+
+bool sockIsConnected(tcpConnection* conn)
+{
+    return conn->state == TCP_ESTABLISHED;
+}
+
+// True once the peer has sent its FIN, nothing more will be received
+bool sockIsPeerClosed(tcpConnection* conn)
+{
+    return conn->finReceived;
+}
+
+// Hands a received TCP segment to the stack
+void sockInput(etherHeader* ether)
+{
+    tcpInput(ether);
+}
+
+// Runs timers and sends queued data, call this on every pass of the main loop
+// The frame is only used to build outgoing segments
+void sockPoll(etherHeader* ether)
+{
+    tcpPoll(ether);
+}
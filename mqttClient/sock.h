@@ -0,0 +1,35 @@
+/*
+ * sock.h
+ * A non-blocking socket interface over tcp.c
+ *
+ *  Created on: Apr 20, 2021
+ *      Author: Sarker Nadir Afridi Azmi
+ */
+
+#ifndef SOCK_H_
+#define SOCK_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "eth0.h"
+#include "tcp.h"
+
+// Local ports handed out to sockConnect, the dynamic range of RFC 6335
+#define SOCK_FIRST_EPHEMERAL_PORT   49152
+#define SOCK_LAST_EPHEMERAL_PORT    65535
+
+void sockSetCallbacks(tcpConnection* conn, tcpCallback readable, tcpCallback writable, tcpCallback closed);
+bool sockConnect(tcpConnection* conn, uint8_t ip[4], uint16_t port);
+bool sockListen(uint16_t port, tcpCallback accept);
+uint32_t sockSend(tcpConnection* conn, uint8_t data[], uint32_t length);
+uint32_t sockGetSendSpace(tcpConnection* conn);
+uint32_t sockPeek(tcpConnection* conn, uint8_t** data);
+uint32_t sockRecv(tcpConnection* conn, uint8_t data[], uint32_t length);
+void sockClose(tcpConnection* conn);
+void sockAbort(tcpConnection* conn);
+bool sockIsConnected(tcpConnection* conn);
+bool sockIsPeerClosed(tcpConnection* conn);
+void sockInput(etherHeader* ether);
+void sockPoll(etherHeader* ether);
+
+#endif /* SOCK_H_ */
@@ -12,6 +12,15 @@
 #include "tcp.h"
 #include "utils.h"
 #include "mqtt.h"
+#include "timer0.h"
+
+// Listening ports and the connections peers opened to them
+tcpListener listeners[TCP_MAX_LISTENERS];
+tcpConnection acceptedConnections[TCP_MAX_ACCEPTED];
+// Connections that closed and are in TIME_WAIT
+tcpTimeWait timeWaits[TCP_MAX_TIME_WAIT];
+// Every connection that is not closed
+tcpConnection* connections[TCP_MAX_CONNECTIONS];
 
 uint16_t getPayloadSize(etherHeader* ether)
 {
@@ -52,16 +61,15 @@ bool etherIsTcp(etherHeader* ether)
     return ok;
 }
 
-void sendTcp(etherHeader* ether, socket* s, socket* d, uint16_t flags, uint32_t sequenceNumber, uint32_t acknowledgementNumber,
+void sendTcp(etherHeader* ether, tcpConnection* conn, uint16_t flags, uint32_t sequenceNumber, uint32_t acknowledgementNumber,
              uint8_t* options, uint8_t optionsLength, uint16_t dataLength)
 {
     ipHeader* ip = (ipHeader*)ether->data;
     tcpHeader* tcp = (tcpHeader*)ip->data;
-    uint8_t* payload = (uint8_t*)tcp->data + optionsLength;
+    socket* s = &conn->local;
+    socket* d = &conn->remote;
 
-    // Fill up the ethernet frame
-    copyUint8Array(s->mac, ether->sourceAddress, 6);
-    copyUint8Array(d->mac, ether->destAddress, 6);
+    // The MAC addresses are filled in from the ARP cache when the frame is sent
     // For IP, use 0x0800 and convert to network byte order
     ether->frameType = htons(0x0800);
     // Fill up the ip header
@@ -84,8 +92,14 @@ void sendTcp(etherHeader* ether, socket* s, socket* d, uint16_t flags, uint32_t
     tcp->sequenceNumber = htonl(sequenceNumber);
     tcp->acknowledgementNumber = htonl(acknowledgementNumber);
     tcp->offsetFields = htons(flags);
-    // This is just a random size I put in
-    tcp->windowSize = htons(TCP_WINDOW_SIZE);
+    // Anything with the ACK flag acknowledges all the data received so far
+    if(flags & ACK)
+    {
+        conn->ackPending = false;
+        conn->unackedBytes = 0;
+    }
+    // Advertise the space left in the receive buffer
+    tcp->windowSize = htons(tcpGetReceiveWindow(conn, (flags & SYN) != 0));
     tcp->checksum = 0;
     tcp->urgentPointer = 0;
 
@@ -124,5 +138,1638 @@ void sendTcp(etherHeader* ether, socket* s, socket* d, uint16_t flags, uint32_t
     ip->length = htons(sizeof(ipHeader) + tcpHeaderLength + dataLength);
     etherCalcIpChecksum(ip);
 
-    etherPutPacket(ether, sizeof(etherHeader) + sizeof(ipHeader) + tcpHeaderLength + dataLength);
+    etherPutIpPacket(ether, sizeof(etherHeader) + sizeof(ipHeader) + tcpHeaderLength + dataLength);
+}
+
+// Writes the options in the order most stacks use so that the 4 byte fields stay aligned
+// Returns the length of the options, padded to a multiple of 4
+uint8_t tcpBuildOptions(uint8_t options[], tcpOptions* opt)
+{
+    uint8_t length = 0;
+    uint8_t i = 0, j = 0;
+    if(opt->hasMss)
+    {
+        options[length++] = TCP_OPTION_MSS;
+        options[length++] = 4;
+        options[length++] = HIBYTE(opt->mss);
+        options[length++] = LOBYTE(opt->mss);
+    }
+    if(opt->sackPermitted)
+    {
+        // Without the timestamp, two NOPs keep the next option aligned
+        if(!opt->hasTimestamp)
+        {
+            options[length++] = TCP_OPTION_NOP;
+            options[length++] = TCP_OPTION_NOP;
+        }
+        options[length++] = TCP_OPTION_SACK_PERMITTED;
+        options[length++] = 2;
+    }
+    if(opt->hasTimestamp)
+    {
+        if(!opt->sackPermitted)
+        {
+            options[length++] = TCP_OPTION_NOP;
+            options[length++] = TCP_OPTION_NOP;
+        }
+        options[length++] = TCP_OPTION_TIMESTAMP;
+        options[length++] = 10;
+        for(i = 0; i < 4; i++)
+            options[length++] = (opt->tsVal >> (24 - (i << 3))) & 0xFF;
+        for(i = 0; i < 4; i++)
+            options[length++] = (opt->tsEcr >> (24 - (i << 3))) & 0xFF;
+    }
+    if(opt->hasWindowScale)
+    {
+        options[length++] = TCP_OPTION_NOP;
+        options[length++] = TCP_OPTION_WINDOW_SCALE;
+        options[length++] = 3;
+        options[length++] = opt->windowScale;
+    }
+    if(opt->sackCount > 0)
+    {
+        options[length++] = TCP_OPTION_NOP;
+        options[length++] = TCP_OPTION_NOP;
+        options[length++] = TCP_OPTION_SACK;
+        options[length++] = 2 + (opt->sackCount << 3);
+        for(j = 0; j < opt->sackCount; j++)
+        {
+            for(i = 0; i < 4; i++)
+                options[length++] = (opt->sack[j].start >> (24 - (i << 3))) & 0xFF;
+            for(i = 0; i < 4; i++)
+                options[length++] = (opt->sack[j].end >> (24 - (i << 3))) & 0xFF;
+        }
+    }
+    while(length & 3)
+        options[length++] = TCP_OPTION_END;
+    return length;
+}
+
+// Reads a 4 byte field in network byte order from an option
+uint32_t getOptionUint32(uint8_t* field)
+{
+    return ((uint32_t)field[0] << 24) | ((uint32_t)field[1] << 16) | ((uint32_t)field[2] << 8) | field[3];
+}
+
+// Reads the options out of a received segment
+// Anything malformed stops the parse and keeps whatever was read up to that point
+void tcpParseOptions(etherHeader* ether, tcpOptions* opt)
+{
+    ipHeader* ip = (ipHeader*)ether->data;
+    tcpHeader* tcp = (tcpHeader*)ip->data;
+    uint8_t* options = (uint8_t*)tcp->data;
+    uint8_t optionsLength = ((ntohs(tcp->offsetFields) >> 12) << 2) - sizeof(tcpHeader);
+    uint8_t i = 0, j = 0, kind = 0, length = 0;
+
+    opt->hasMss = false;
+    opt->mss = 0;
+    opt->hasWindowScale = false;
+    opt->windowScale = 0;
+    opt->sackPermitted = false;
+    opt->hasTimestamp = false;
+    opt->tsVal = 0;
+    opt->tsEcr = 0;
+    opt->sackCount = 0;
+
+    while(i < optionsLength)
+    {
+        kind = options[i];
+        if(kind == TCP_OPTION_END)
+            break;
+        if(kind == TCP_OPTION_NOP)
+        {
+            i++;
+            continue;
+        }
+        if(i + 1 >= optionsLength)
+            break;
+        length = options[i + 1];
+        if(length < 2 || i + length > optionsLength)
+            break;
+        switch(kind)
+        {
+        case TCP_OPTION_MSS:
+            if(length == 4)
+            {
+                opt->hasMss = true;
+                opt->mss = (options[i + 2] << 8) | options[i + 3];
+            }
+            break;
+        case TCP_OPTION_WINDOW_SCALE:
+            if(length == 3)
+            {
+                opt->hasWindowScale = true;
+                // RFC 7323 2.3: shifts larger than 14 are treated as 14
+                opt->windowScale = (options[i + 2] > 14) ? 14 : options[i + 2];
+            }
+            break;
+        case TCP_OPTION_SACK_PERMITTED:
+            if(length == 2)
+                opt->sackPermitted = true;
+            break;
+        case TCP_OPTION_TIMESTAMP:
+            if(length == 10)
+            {
+                opt->hasTimestamp = true;
+                opt->tsVal = getOptionUint32(&options[i + 2]);
+                opt->tsEcr = getOptionUint32(&options[i + 6]);
+            }
+            break;
+        case TCP_OPTION_SACK:
+            if(((length - 2) & 7) == 0)
+            {
+                for(j = 0; j < ((length - 2) >> 3) && opt->sackCount < TCP_MAX_SACK_BLOCKS; j++)
+                {
+                    opt->sack[opt->sackCount].start = getOptionUint32(&options[i + 2 + (j << 3)]);
+                    opt->sack[opt->sackCount].end = getOptionUint32(&options[i + 6 + (j << 3)]);
+                    opt->sackCount++;
+                }
+            }
+            break;
+        }
+        i += length;
+    }
+}
+
+// Works out the parameters of the connection from the options in the SYN, ACK
+void tcpNegotiateOptions(tcpConnection* conn, tcpOptions* peer)
+{
+    uint16_t peerMss = (peer->hasMss && peer->mss > 0) ? peer->mss : TCP_DEFAULT_MSS;
+    // The timestamp option is taken out of it below, so a tiny MSS would wrap
+    if(peerMss < TCP_MIN_MSS)
+        peerMss = TCP_MIN_MSS;
+    conn->mss = (peerMss < TCP_MSS) ? peerMss : TCP_MSS;
+    // We always offer timestamps, so they are on if the peer answered with them
+    // Every segment then carries the option, which comes out of the room for data
+    conn->timestamps = peer->hasTimestamp;
+    if(conn->timestamps)
+    {
+        conn->tsRecent = peer->tsVal;
+        conn->mss -= TCP_TIMESTAMP_OPTION_LENGTH;
+    }
+    // RFC 7323 2.2: scaling is only in effect if both SYNs carried the option
+    conn->windowScaling = peer->hasWindowScale;
+    if(peer->hasWindowScale)
+    {
+        conn->sndWindowShift = peer->windowScale;
+        conn->rcvWindowShift = tcpGetWindowShift();
+    }
+    else
+    {
+        conn->sndWindowShift = 0;
+        conn->rcvWindowShift = 0;
+    }
+    // We always offer SACK as well
+    conn->sack = peer->sackPermitted;
+}
+
+// Smallest shift that lets the whole receive buffer fit in the 16 bit window field
+uint8_t tcpGetWindowShift()
+{
+    uint8_t shift = 0;
+    while(shift < 14 && (TCP_RX_BUFFER_SIZE >> shift) > 0xFFFF)
+        shift++;
+    return shift;
+}
+
+// Gets the window to put in an outgoing segment
+// The window in a SYN is never scaled (RFC 7323 2.2)
+uint16_t tcpGetReceiveWindow(tcpConnection* conn, bool isSyn)
+{
+    uint32_t freeSpace = TCP_RX_BUFFER_SIZE - conn->rxCount;
+    uint32_t rightEdge = conn->rcvNxt + freeSpace;
+    uint32_t advertised = conn->rcvAdvertised - conn->rcvNxt;
+    uint32_t threshold = (conn->mss < (TCP_RX_BUFFER_SIZE >> 1)) ? conn->mss : (TCP_RX_BUFFER_SIZE >> 1);
+    uint32_t window = 0;
+
+    // Receiver side silly window avoidance (RFC 1122 4.2.3.3)
+    // Only move the right edge once it can move by a useful amount
+    if(advertised > TCP_RX_BUFFER_SIZE || (int32_t)(rightEdge - conn->rcvAdvertised) >= (int32_t)threshold)
+        conn->rcvAdvertised = rightEdge;
+    window = conn->rcvAdvertised - conn->rcvNxt;
+
+    if(!isSyn)
+        window >>= conn->rcvWindowShift;
+    return (window > 0xFFFF) ? 0xFFFF : window;
+}
+
+// Bytes of data before a delayed ACK goes out, two of the segments the peer sends us
+// The MSS we offered loses the timestamp option, and a window of less than two segments would never fill it
+uint32_t tcpGetAckThreshold(tcpConnection* conn)
+{
+    uint32_t segment = conn->timestamps ? TCP_MSS - TCP_TIMESTAMP_OPTION_LENGTH : TCP_MSS;
+    return (2 * segment < (TCP_RX_BUFFER_SIZE >> 1)) ? 2 * segment : (TCP_RX_BUFFER_SIZE >> 1);
+}
+
+// Returns true once reading from the buffer has opened the window enough to tell the peer
+bool tcpIsWindowUpdateNeeded(tcpConnection* conn)
+{
+    uint32_t rightEdge = conn->rcvNxt + (TCP_RX_BUFFER_SIZE - conn->rxCount);
+    uint32_t threshold = (conn->mss < (TCP_RX_BUFFER_SIZE >> 1)) ? conn->mss : (TCP_RX_BUFFER_SIZE >> 1);
+    return (int32_t)(rightEdge - conn->rcvAdvertised) >= (int32_t)threshold;
+}
+
+// Checks the ports and the peer's address to see if the segment belongs to this connection
+bool tcpIsForConnection(tcpConnection* conn, etherHeader* ether)
+{
+    ipHeader* ip = (ipHeader*)ether->data;
+    tcpHeader* tcp = (tcpHeader*)ip->data;
+    uint8_t i = 0;
+    for(i = 0; i < 4; i++)
+        if(ip->sourceIp[i] != conn->remote.ip[i])
+            return false;
+    return ntohs(tcp->destPort) == conn->local.port && ntohs(tcp->sourcePort) == conn->remote.port;
+}
+
+// Remembers that the buffer holds [start, end) ahead of rcvNxt
+// Blocks it touches are merged into it and it moves to the front of the list
+void tcpAddOutOfOrderBlock(tcpConnection* conn, uint32_t start, uint32_t end)
+{
+    uint8_t i = 0, j = 0;
+    while(i < conn->oooCount)
+    {
+        if((int32_t)(conn->ooo[i].start - end) <= 0 && (int32_t)(conn->ooo[i].end - start) >= 0)
+        {
+            if((int32_t)(conn->ooo[i].start - start) < 0)
+                start = conn->ooo[i].start;
+            if((int32_t)(conn->ooo[i].end - end) > 0)
+                end = conn->ooo[i].end;
+            conn->oooCount--;
+            for(j = i; j < conn->oooCount; j++)
+                conn->ooo[j] = conn->ooo[j + 1];
+        }
+        else
+            i++;
+    }
+    // With the list full the oldest block is forgotten, the peer sends that data again
+    if(conn->oooCount == TCP_MAX_SACK_BLOCKS)
+        conn->oooCount--;
+    for(j = conn->oooCount; j > 0; j--)
+        conn->ooo[j] = conn->ooo[j - 1];
+    conn->ooo[0].start = start;
+    conn->ooo[0].end = end;
+    conn->oooCount++;
+}
+
+// Moves out of order blocks that now join rcvNxt over to the in order data
+void tcpMergeOutOfOrder(tcpConnection* conn)
+{
+    uint8_t i = 0, j = 0;
+    while(i < conn->oooCount)
+    {
+        if((int32_t)(conn->ooo[i].start - conn->rcvNxt) <= 0)
+        {
+            if((int32_t)(conn->ooo[i].end - conn->rcvNxt) > 0)
+            {
+                conn->rxCount += conn->ooo[i].end - conn->rcvNxt;
+                conn->rcvNxt = conn->ooo[i].end;
+            }
+            conn->oooCount--;
+            for(j = i; j < conn->oooCount; j++)
+                conn->ooo[j] = conn->ooo[j + 1];
+            // rcvNxt moved, so blocks already passed over may join it now
+            i = 0;
+        }
+        else
+            i++;
+    }
+}
+
+// Copies the payload of a segment into the receive buffer
+// Data ahead of rcvNxt is held at its place in the buffer until the hole before it fills
+// Only as much as there is space for is taken, the peer resends the rest
+// Returns true if the segment was the next one expected on this connection
+bool tcpReceive(tcpConnection* conn, etherHeader* ether)
+{
+    ipHeader* ip = (ipHeader*)ether->data;
+    tcpHeader* tcp = (tcpHeader*)ip->data;
+    uint16_t flags = ntohs(tcp->offsetFields);
+    uint8_t* payload = (uint8_t*)tcp + ((flags >> 12) << 2);
+    uint32_t length = getPayloadSize(ether);
+    uint32_t sequenceNumber = ntohl(tcp->sequenceNumber);
+    uint32_t freeSpace = TCP_RX_BUFFER_SIZE - conn->rxCount;
+    uint32_t offset = 0, taken = 0, i = 0;
+
+    if(!tcpIsForConnection(conn, ether))
+        return false;
+
+    // Drop the part of a resent segment that we already have
+    if((int32_t)(sequenceNumber - conn->rcvNxt) < 0)
+    {
+        offset = conn->rcvNxt - sequenceNumber;
+        // Nothing new unless the FIN right after the data is
+        if(offset > length || (offset == length && !(flags & FIN)))
+            return false;
+        payload += offset;
+        length -= offset;
+        sequenceNumber = conn->rcvNxt;
+    }
+
+    offset = sequenceNumber - conn->rcvNxt;
+    if(offset > 0)
+    {
+        // Out of order, a FIN here is left for the peer to send again
+        if(length == 0 || offset >= freeSpace)
+            return false;
+        taken = (length > freeSpace - offset) ? freeSpace - offset : length;
+        for(i = 0; i < taken; i++)
+            conn->rxBuffer[conn->rxCount + offset + i] = payload[i];
+        tcpAddOutOfOrderBlock(conn, sequenceNumber, sequenceNumber + taken);
+        return false;
+    }
+
+    taken = (length > freeSpace) ? freeSpace : length;
+    for(i = 0; i < taken; i++)
+        conn->rxBuffer[conn->rxCount + i] = payload[i];
+    conn->rxCount += taken;
+    conn->rcvNxt += taken;
+    // The FIN takes up a sequence number, but only once all the data before it is in
+    if((flags & FIN) && taken == length)
+    {
+        conn->rcvNxt++;
+        conn->finReceived = true;
+        // Nothing can come after the FIN
+        conn->oooCount = 0;
+    }
+    else
+        tcpMergeOutOfOrder(conn);
+    return true;
+}
+
+// Drops data the application has finished with from the front of the receive buffer
+void tcpConsume(tcpConnection* conn, uint32_t length)
+{
+    uint32_t used = conn->rxCount, end = 0, i = 0;
+    if(length > conn->rxCount)
+        length = conn->rxCount;
+    // Out of order data moves down with the rest
+    for(i = 0; i < conn->oooCount; i++)
+    {
+        end = conn->rxCount + (conn->ooo[i].end - conn->rcvNxt);
+        if(end > used)
+            used = end;
+    }
+    conn->rxCount -= length;
+    for(i = 0; i < used - length; i++)
+        conn->rxBuffer[i] = conn->rxBuffer[i + length];
+}
+
+// Clears the connection so that it can be opened again starting at sequence number iss
+void tcpReset(tcpConnection* conn, uint32_t iss)
+{
+    conn->state = TCP_CLOSED;
+    conn->mss = TCP_DEFAULT_MSS;
+    conn->windowScaling = false;
+    conn->sndWindowShift = 0;
+    conn->rcvWindowShift = 0;
+    conn->sack = false;
+    conn->rcvNxt = 0;
+    conn->rcvAdvertised = 0;
+    conn->rxCount = 0;
+    conn->oooCount = 0;
+    conn->finReceived = false;
+    conn->ackPending = false;
+    conn->ackTime = 0;
+    conn->unackedBytes = 0;
+    conn->sndUna = iss;
+    conn->sndNxt = iss;
+    conn->sndMax = iss;
+    conn->sndWnd = 0;
+    conn->maxSndWnd = 0;
+    conn->txCount = 0;
+    conn->finQueued = false;
+    conn->finAcked = false;
+    conn->cwnd = 0;
+    conn->ssthresh = 0;
+    // Highest sequence number sent when the last loss was detected
+    conn->recover = iss - 1;
+    conn->dupAcks = 0;
+    conn->inFastRecovery = false;
+    conn->scoreboardCount = 0;
+    conn->highRxt = iss;
+    conn->timestamps = false;
+    conn->tsRecent = 0;
+    conn->srtt = 0;
+    conn->rttvar = 0;
+    conn->rttTiming = false;
+    conn->rto = TCP_INITIAL_RTO;
+    conn->retransmitTimerOn = false;
+}
+
+// Gets the retransmission timeout from the RTT estimate
+uint32_t getBaseRto(tcpConnection* conn)
+{
+    uint32_t rto = 0;
+    if(conn->srtt == 0)
+        return TCP_INITIAL_RTO;
+    // RTO = SRTT + max(G, 4 * RTTVAR) with a clock granularity G of 1 ms
+    rto = (conn->srtt >> 3) + ((conn->rttvar > 0) ? conn->rttvar : 1);
+    if(rto < TCP_MIN_RTO)
+        rto = TCP_MIN_RTO;
+    if(rto > TCP_MAX_RTO)
+        rto = TCP_MAX_RTO;
+    return rto;
+}
+
+// Feeds one RTT measurement in milliseconds into the estimator (RFC 6298 2.2 & 2.3)
+void tcpUpdateRtt(tcpConnection* conn, uint32_t rtt)
+{
+    int32_t delta = 0;
+    // A zero sample would look like no estimate at all
+    if(rtt == 0)
+        rtt = 1;
+    if(conn->srtt == 0)
+    {
+        conn->srtt = rtt << 3;
+        // RTTVAR = R / 2, kept in 1/4 ms
+        conn->rttvar = rtt << 1;
+    }
+    else
+    {
+        // RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R|
+        delta = (int32_t)rtt - (int32_t)(conn->srtt >> 3);
+        if(delta < 0)
+            delta = -delta;
+        conn->rttvar += delta - (conn->rttvar >> 2);
+        // SRTT = 7/8 SRTT + 1/8 R
+        conn->srtt += rtt - (conn->srtt >> 3);
+    }
+    conn->rto = getBaseRto(conn);
+}
+
+// Returns the smoothed round trip time in milliseconds, 0 until it has been measured
+uint32_t tcpGetSmoothedRtt(tcpConnection* conn)
+{
+    return conn->srtt >> 3;
+}
+
+// Sets up the send side once the peer has acknowledged our SYN
+void tcpStartSending(tcpConnection* conn, uint32_t ack, uint32_t window)
+{
+    conn->sndUna = conn->sndNxt = conn->sndMax = ack;
+    conn->sndWnd = conn->maxSndWnd = window;
+
+    // RFC 5681 3.1: initial window of 2 to 4 segments depending on the MSS
+    if(conn->mss > 2190)
+        conn->cwnd = 2 * conn->mss;
+    else if(conn->mss > 1095)
+        conn->cwnd = 3 * conn->mss;
+    else
+        conn->cwnd = 4 * conn->mss;
+    // The slow start threshold starts out arbitrarily high
+    conn->ssthresh = 0xFFFFFFFF;
+    conn->recover = conn->sndUna - 1;
+}
+
+// Sets up both directions of the connection from the SYN, ACK that answered our SYN
+void tcpEstablish(tcpConnection* conn, etherHeader* ether)
+{
+    ipHeader* ip = (ipHeader*)ether->data;
+    tcpHeader* tcp = (tcpHeader*)ip->data;
+    tcpOptions peer;
+
+    tcpParseOptions(ether, &peer);
+    tcpNegotiateOptions(conn, &peer);
+    // The SYN, ACK echoes the time our SYN went out
+    if(conn->timestamps && peer.tsEcr != 0)
+        tcpUpdateRtt(conn, getMilliseconds() - peer.tsEcr);
+
+    conn->rcvNxt = ntohl(tcp->sequenceNumber) + 1;
+    conn->rcvAdvertised = conn->rcvNxt;
+    // Our SYN took up one sequence number, the window in a SYN is never scaled
+    tcpStartSending(conn, ntohl(tcp->acknowledgementNumber), ntohs(tcp->windowSize));
+    conn->state = TCP_ESTABLISHED;
+    // The SYN is no longer timed and a backed off timer starts over
+    conn->retransmitTimerOn = false;
+    conn->rto = getBaseRto(conn);
+}
+
+// Queues data to be sent on the connection
+// Returns how many bytes fit in the send buffer
+uint32_t tcpWrite(tcpConnection* conn, uint8_t data[], uint32_t length)
+{
+    uint32_t i = 0;
+    // Nothing can go after the FIN
+    if(conn->finQueued)
+        return 0;
+    if(length > TCP_TX_BUFFER_SIZE - conn->txCount)
+        length = TCP_TX_BUFFER_SIZE - conn->txCount;
+    for(i = 0; i < length; i++)
+        conn->txBuffer[conn->txCount + i] = data[i];
+    conn->txCount += length;
+    return length;
+}
+
+// Sends a FIN once everything already written has gone out
+void tcpClose(tcpConnection* conn)
+{
+    conn->finQueued = true;
+    if(conn->state == TCP_ESTABLISHED)
+        conn->state = TCP_FIN_WAIT_1;
+    else if(conn->state == TCP_CLOSE_WAIT)
+        conn->state = TCP_LAST_ACK;
+}
+
+bool tcpIsFinAcked(tcpConnection* conn)
+{
+    return conn->finAcked;
+}
+
+void startRetransmitTimer(tcpConnection* conn)
+{
+    conn->retransmitTime = getMilliseconds() + conn->rto;
+    conn->retransmitTimerOn = true;
+}
+
+// Builds the options carried by every segment after the handshake
+// SACK blocks only go in pure ACKs, so that they never take room from the data
+uint8_t getSegmentOptions(tcpConnection* conn, uint8_t options[], bool isPureAck)
+{
+    tcpOptions opt = {0};
+    uint8_t i = 0;
+    if(conn->timestamps)
+    {
+        opt.hasTimestamp = true;
+        opt.tsVal = getMilliseconds();
+        opt.tsEcr = conn->tsRecent;
+    }
+    if(conn->sack && isPureAck)
+    {
+        // Only 3 blocks fit next to the timestamp (RFC 2018 3)
+        opt.sackCount = (conn->timestamps && conn->oooCount > 3) ? 3 : conn->oooCount;
+        for(i = 0; i < opt.sackCount; i++)
+            opt.sack[i] = conn->ooo[i];
+    }
+    return tcpBuildOptions(options, &opt);
+}
+
+// Sends length bytes starting offset bytes past sndUna
+void tcpSendSegment(etherHeader* ether, tcpConnection* conn, uint32_t offset, uint16_t length, uint16_t flags)
+{
+    ipHeader* ip = (ipHeader*)ether->data;
+    tcpHeader* tcp = (tcpHeader*)ip->data;
+    uint8_t options[TCP_MAX_OPTIONS_LENGTH];
+    uint8_t optionsLength = getSegmentOptions(conn, options, length == 0);
+    // The data goes after the options
+    uint8_t* data = (uint8_t*)tcp->data + optionsLength;
+    uint16_t i = 0;
+    for(i = 0; i < length; i++)
+        data[i] = conn->txBuffer[offset + i];
+    sendTcp(ether, conn, TCP_OFFSET(optionsLength) | flags, conn->sndUna + offset, conn->rcvNxt, options, optionsLength, length);
+}
+
+// Counts the bytes in [from, to) that the peer has SACKed
+uint32_t getSackedBytes(tcpConnection* conn, uint32_t from, uint32_t to)
+{
+    uint32_t sacked = 0, start = 0, end = 0;
+    uint8_t i = 0;
+    for(i = 0; i < conn->scoreboardCount; i++)
+    {
+        start = conn->scoreboard[i].start;
+        end = conn->scoreboard[i].end;
+        if((int32_t)(start - from) < 0)
+            start = from;
+        if((int32_t)(end - to) > 0)
+            end = to;
+        if((int32_t)(end - start) > 0)
+            sacked += end - start;
+    }
+    return sacked;
+}
+
+// Holes below the returned sequence number are taken as lost (RFC 6675 IsLost)
+// That is once 3 blocks or more than 2 segments worth of data above them were SACKed
+uint32_t getLostEdge(tcpConnection* conn)
+{
+    uint32_t sacked = 0;
+    uint8_t i = conn->scoreboardCount;
+    while(i > 0)
+    {
+        i--;
+        sacked += conn->scoreboard[i].end - conn->scoreboard[i].start;
+        if(sacked > (TCP_DUP_ACK_THRESHOLD - 1) * conn->mss || conn->scoreboardCount - i >= TCP_DUP_ACK_THRESHOLD)
+            return conn->scoreboard[i].start;
+    }
+    return conn->sndUna;
+}
+
+// Estimates the bytes still in the network (RFC 6675 SetPipe)
+// Outside of SACK recovery that is just everything sent and not acknowledged
+uint32_t getPipe(tcpConnection* conn)
+{
+    uint32_t outstanding = conn->sndNxt - conn->sndUna;
+    uint32_t lostEdge = 0, from = 0;
+    if(!conn->sack || !conn->inFastRecovery)
+        return outstanding;
+    outstanding -= getSackedBytes(conn, conn->sndUna, conn->sndNxt);
+    // Lost bytes that have not been resent yet have left the network
+    lostEdge = getLostEdge(conn);
+    from = ((int32_t)(conn->highRxt - conn->sndUna) > 0) ? conn->highRxt : conn->sndUna;
+    if((int32_t)(lostEdge - from) > 0)
+        outstanding -= (lostEdge - from) - getSackedBytes(conn, from, lostEdge);
+    return outstanding;
+}
+
+// Finds the next lost range that has not been resent yet, at most one MSS long
+bool getNextHole(tcpConnection* conn, uint32_t* start, uint16_t* length)
+{
+    uint32_t lostEdge = getLostEdge(conn);
+    uint32_t from = ((int32_t)(conn->highRxt - conn->sndUna) > 0) ? conn->highRxt : conn->sndUna;
+    uint32_t end = 0;
+    uint8_t i = 0;
+    for(i = 0; i < conn->scoreboardCount && (int32_t)(from - lostEdge) < 0; i++)
+    {
+        if((int32_t)(conn->scoreboard[i].end - from) <= 0)
+            continue;
+        if((int32_t)(conn->scoreboard[i].start - from) > 0)
+        {
+            end = conn->scoreboard[i].start;
+            if((int32_t)(end - lostEdge) > 0)
+                end = lostEdge;
+            *start = from;
+            *length = (end - from > conn->mss) ? conn->mss : end - from;
+            return true;
+        }
+        from = conn->scoreboard[i].end;
+    }
+    return false;
+}
+
+// Adds the SACK blocks of an ACK to the scoreboard and drops whatever ack now covers
+void tcpUpdateScoreboard(tcpConnection* conn, uint32_t ack, tcpOptions* opt)
+{
+    uint32_t start = 0, end = 0;
+    uint8_t i = 0, j = 0, k = 0;
+
+    // Blocks at or below the cumulative ACK are of no more use
+    while(i < conn->scoreboardCount)
+    {
+        if((int32_t)(conn->scoreboard[i].end - ack) <= 0)
+        {
+            conn->scoreboardCount--;
+            for(j = i; j < conn->scoreboardCount; j++)
+                conn->scoreboard[j] = conn->scoreboard[j + 1];
+            continue;
+        }
+        if((int32_t)(conn->scoreboard[i].start - ack) < 0)
+            conn->scoreboard[i].start = ack;
+        i++;
+    }
+
+    for(k = 0; k < opt->sackCount; k++)
+    {
+        start = opt->sack[k].start;
+        end = opt->sack[k].end;
+        // Skip blocks that are old or cover data never sent
+        if((int32_t)(end - start) <= 0 || (int32_t)(end - ack) <= 0 || (int32_t)(end - conn->sndMax) > 0)
+            continue;
+        if((int32_t)(start - ack) < 0)
+            start = ack;
+        // Merge with the blocks it overlaps
+        i = 0;
+        while(i < conn->scoreboardCount)
+        {
+            if((int32_t)(conn->scoreboard[i].start - end) <= 0 && (int32_t)(conn->scoreboard[i].end - start) >= 0)
+            {
+                if((int32_t)(conn->scoreboard[i].start - start) < 0)
+                    start = conn->scoreboard[i].start;
+                if((int32_t)(conn->scoreboard[i].end - end) > 0)
+                    end = conn->scoreboard[i].end;
+                conn->scoreboardCount--;
+                for(j = i; j < conn->scoreboardCount; j++)
+                    conn->scoreboard[j] = conn->scoreboard[j + 1];
+            }
+            else
+                i++;
+        }
+        // When full the lowest block goes, it is the next to be covered by the cumulative ACK
+        if(conn->scoreboardCount == TCP_SACK_SCOREBOARD_SIZE)
+        {
+            conn->scoreboardCount--;
+            for(j = 0; j < conn->scoreboardCount; j++)
+                conn->scoreboard[j] = conn->scoreboard[j + 1];
+        }
+        // Insert in sequence order
+        i = conn->scoreboardCount;
+        while(i > 0 && (int32_t)(conn->scoreboard[i - 1].start - start) > 0)
+        {
+            conn->scoreboard[i] = conn->scoreboard[i - 1];
+            i--;
+        }
+        conn->scoreboard[i].start = start;
+        conn->scoreboard[i].end = end;
+        conn->scoreboardCount++;
+    }
+}
+
+// Sends as much of the queued data as min(cwnd, rwnd) allows, split into MSS sized segments
+// The FIN follows the last byte of data
+// In SACK recovery the lost holes go out first and the pipe estimate stands in for the data in flight
+void tcpOutput(etherHeader* ether, tcpConnection* conn)
+{
+    uint32_t inFlight = 0, unsent = 0, length = 0, pipe = 0, start = 0;
+    uint16_t holeLength = 0;
+    uint16_t flags = 0;
+
+    // RFC 6675 5 step (4.1)
+    while(conn->sack && conn->inFastRecovery && getPipe(conn) < conn->cwnd && getNextHole(conn, &start, &holeLength))
+    {
+        conn->rttTiming = false;
+        tcpSendSegment(ether, conn, start - conn->sndUna, holeLength, ACK);
+        conn->highRxt = start + holeLength;
+    }
+
+    while(true)
+    {
+        inFlight = conn->sndNxt - conn->sndUna;
+        pipe = getPipe(conn);
+        // The FIN is the last thing sent, nothing left to do once it is out
+        if(inFlight > conn->txCount)
+            break;
+        unsent = conn->txCount - inFlight;
+        if(unsent == 0)
+        {
+            if(conn->finQueued && !conn->finAcked)
+            {
+                tcpSendSegment(ether, conn, inFlight, 0, FIN | ACK);
+                conn->sndNxt++;
+            }
+            break;
+        }
+        if(inFlight >= conn->sndWnd || pipe >= conn->cwnd)
+            break;
+        length = unsent;
+        if(length > conn->mss)
+            length = conn->mss;
+        if(length > conn->sndWnd - inFlight || length > conn->cwnd - pipe)
+        {
+            length = (conn->sndWnd - inFlight < conn->cwnd - pipe) ? conn->sndWnd - inFlight : conn->cwnd - pipe;
+            // Sender side silly window avoidance (RFC 1122 4.2.3.4)
+            // Wait for the window to open unless a good part of it can be used
+            if(length < conn->mss && inFlight > 0 && length < (conn->maxSndWnd >> 1))
+                break;
+        }
+        flags = ACK;
+        if(length == unsent)
+        {
+            flags |= PSH;
+            if(conn->finQueued)
+                flags |= FIN;
+        }
+        // Without timestamps, time one segment of new data per window (Karn's algorithm)
+        if(!conn->timestamps && !conn->rttTiming && conn->sndNxt == conn->sndMax)
+        {
+            conn->rttTiming = true;
+            conn->rttSeq = conn->sndNxt;
+            conn->rttStart = getMilliseconds();
+        }
+        tcpSendSegment(ether, conn, inFlight, length, flags);
+        conn->sndNxt += length + ((flags & FIN) ? 1 : 0);
+    }
+
+    if((int32_t)(conn->sndNxt - conn->sndMax) > 0)
+        conn->sndMax = conn->sndNxt;
+    // Covers data in flight as well as probing a zero window
+    if(!conn->retransmitTimerOn && (conn->sndMax != conn->sndUna || conn->txCount > 0))
+        startRetransmitTimer(conn);
+}
+
+void tcpSendAck(etherHeader* ether, tcpConnection* conn)
+{
+    uint8_t options[TCP_MAX_OPTIONS_LENGTH];
+    uint8_t optionsLength = getSegmentOptions(conn, options, true);
+    sendTcp(ether, conn, TCP_OFFSET(optionsLength) | ACK, conn->sndNxt, conn->rcvNxt, options, optionsLength, 0);
+}
+
+// Resends the segment at sndUna
+void tcpRetransmit(etherHeader* ether, tcpConnection* conn)
+{
+    // Karn's algorithm, an ACK can no longer be matched to one transmission
+    conn->rttTiming = false;
+    uint32_t length = (conn->txCount > conn->mss) ? conn->mss : conn->txCount;
+    uint16_t flags = ACK;
+    // Include the FIN if it was already sent right after this data
+    if(length == conn->txCount && conn->sndMax - conn->sndUna > conn->txCount)
+        flags |= FIN | PSH;
+    tcpSendSegment(ether, conn, 0, length, flags);
+    conn->highRxt = conn->sndUna + length;
+}
+
+// The RFC 5681 value for ssthresh after a loss
+uint32_t getLossThreshold(tcpConnection* conn)
+{
+    uint32_t inFlight = (conn->sndMax - conn->sndUna) >> 1;
+    return (inFlight > 2 * conn->mss) ? inFlight : 2 * conn->mss;
+}
+
+// Handles the acknowledgement field of a segment
+// isDuplicateCandidate is true for segments that carry no data, SYN or FIN
+void tcpProcessAck(etherHeader* ether, tcpConnection* conn, uint32_t ack, uint32_t window, bool isDuplicateCandidate, tcpOptions* opt)
+{
+    uint32_t acked = ack - conn->sndUna;
+    uint32_t dataAcked = 0, i = 0, start = 0;
+    uint16_t holeLength = 0;
+
+    // Ignore old ACKs and ACKs for things never sent
+    if((int32_t)(ack - conn->sndUna) < 0 || (int32_t)(ack - conn->sndMax) > 0)
+        return;
+    if(conn->sack)
+        tcpUpdateScoreboard(conn, ack, opt);
+
+    if(acked == 0)
+    {
+        if(isDuplicateCandidate && conn->sndMax != conn->sndUna && window == conn->sndWnd)
+        {
+            conn->dupAcks++;
+            if(conn->inFastRecovery)
+            {
+                // Every duplicate means a segment has left the network
+                // With SACK the pipe estimate already accounts for it
+                if(!conn->sack)
+                    conn->cwnd += conn->mss;
+            }
+            else if((conn->dupAcks == TCP_DUP_ACK_THRESHOLD || (conn->sack && getLostEdge(conn) != conn->sndUna))
+                    && (int32_t)(ack - conn->recover) > 0)
+            {
+                // Fast retransmit & enter fast recovery (RFC 6582 3.2 step 2, RFC 6675 5 step 4)
+                conn->ssthresh = getLossThreshold(conn);
+                conn->recover = conn->sndMax - 1;
+                if(conn->sack)
+                    conn->cwnd = conn->ssthresh;
+                else
+                    conn->cwnd = conn->ssthresh + TCP_DUP_ACK_THRESHOLD * conn->mss;
+                conn->inFastRecovery = true;
+                tcpRetransmit(ether, conn);
+                startRetransmitTimer(conn);
+            }
+        }
+        conn->sndWnd = window;
+        if(window > conn->maxSndWnd)
+            conn->maxSndWnd = window;
+        tcpOutput(ether, conn);
+        return;
+    }
+
+    // RTT sample, with timestamps every ACK of new data gives one (RFC 7323 4)
+    if(conn->timestamps && opt->hasTimestamp && opt->tsEcr != 0)
+        tcpUpdateRtt(conn, getMilliseconds() - opt->tsEcr);
+    else if(conn->rttTiming && (int32_t)(ack - conn->rttSeq) > 0)
+    {
+        tcpUpdateRtt(conn, getMilliseconds() - conn->rttStart);
+        conn->rttTiming = false;
+    }
+
+    // Drop what was acknowledged from the front of the send buffer
+    dataAcked = (acked > conn->txCount) ? conn->txCount : acked;
+    if(acked > conn->txCount && conn->finQueued)
+        conn->finAcked = true;
+    conn->txCount -= dataAcked;
+    for(i = 0; i < conn->txCount; i++)
+        conn->txBuffer[i] = conn->txBuffer[i + dataAcked];
+    conn->sndUna = ack;
+    // After a timeout sndNxt may have been pulled back behind what the peer already has
+    if((int32_t)(conn->sndNxt - conn->sndUna) < 0)
+        conn->sndNxt = conn->sndUna;
+    conn->sndWnd = window;
+    if(window > conn->maxSndWnd)
+        conn->maxSndWnd = window;
+
+    if(conn->inFastRecovery)
+    {
+        if((int32_t)(ack - conn->recover) > 0)
+        {
+            // Full acknowledgement, deflate the window (RFC 6582 3.2 step 3)
+            uint32_t inFlight = conn->sndMax - conn->sndUna;
+            conn->cwnd = ((inFlight > conn->mss) ? inFlight : conn->mss) + conn->mss;
+            if(conn->cwnd > conn->ssthresh)
+                conn->cwnd = conn->ssthresh;
+            conn->inFastRecovery = false;
+            conn->dupAcks = 0;
+        }
+        else if(conn->sack)
+        {
+            // The scoreboard picks the holes to resend, but a hole at the new left edge that has too
+            // little SACKed above it to count as lost is still resent, as NewReno would
+            if((int32_t)(conn->highRxt - conn->sndUna) <= 0 && !getNextHole(conn, &start, &holeLength))
+                tcpRetransmit(ether, conn);
+        }
+        else
+        {
+            // Partial acknowledgement, the next hole is lost too (RFC 6582 3.2 step 4)
+            tcpRetransmit(ether, conn);
+            conn->cwnd = (conn->cwnd > acked) ? conn->cwnd - acked : 0;
+            if(acked >= conn->mss)
+                conn->cwnd += conn->mss;
+        }
+    }
+    else
+    {
+        conn->dupAcks = 0;
+        if(conn->cwnd < conn->ssthresh)
+            // Slow start
+            conn->cwnd += (acked < conn->mss) ? acked : conn->mss;
+        else
+            // Congestion avoidance, about one MSS per round trip
+            conn->cwnd += ((conn->mss * conn->mss) / conn->cwnd) ? ((conn->mss * conn->mss) / conn->cwnd) : 1;
+    }
+
+    // New data got through so the backed off timer goes back to its base value
+    conn->rto = getBaseRto(conn);
+    if(conn->sndMax == conn->sndUna && conn->txCount == 0)
+        conn->retransmitTimerOn = false;
+    else
+        startRetransmitTimer(conn);
+
+    tcpOutput(ether, conn);
+}
+
+bool isTimeWaitOver(tcpTimeWait* timeWait)
+{
+    return !timeWait->inUse || (int32_t)(getMilliseconds() - timeWait->endTime) >= 0;
+}
+
+// Moves a connection that closed first into TIME_WAIT (RFC 793 3.5)
+// Only a tcpTimeWait entry is kept so that the connection can be opened again right away
+void tcpEnterTimeWait(tcpConnection* conn)
+{
+    tcpTimeWait* timeWait = &timeWaits[0];
+    uint8_t i = 0;
+    for(i = 0; i < TCP_MAX_TIME_WAIT; i++)
+    {
+        if(isTimeWaitOver(&timeWaits[i]))
+        {
+            timeWait = &timeWaits[i];
+            break;
+        }
+        // With every entry in use the one closest to its end is dropped
+        if((int32_t)(timeWaits[i].endTime - timeWait->endTime) < 0)
+            timeWait = &timeWaits[i];
+    }
+    timeWait->inUse = true;
+    copyUint8Array(conn->remote.ip, timeWait->remoteIp, 4);
+    timeWait->localPort = conn->local.port;
+    timeWait->remotePort = conn->remote.port;
+    timeWait->sndNxt = conn->sndNxt;
+    timeWait->rcvNxt = conn->rcvNxt;
+    timeWait->timestamps = conn->timestamps;
+    timeWait->tsRecent = conn->tsRecent;
+    timeWait->endTime = getMilliseconds() + 2 * TCP_MSL;
+    conn->state = TCP_CLOSED;
+    conn->retransmitTimerOn = false;
+}
+
+// Follows the close of the connection from the FINs sent and received (RFC 793 3.5)
+void tcpUpdateState(tcpConnection* conn)
+{
+    switch(conn->state)
+    {
+    case TCP_ESTABLISHED:
+        if(conn->finReceived)
+            conn->state = TCP_CLOSE_WAIT;
+        break;
+    case TCP_FIN_WAIT_1:
+        if(!conn->finAcked)
+        {
+            if(conn->finReceived)
+                conn->state = TCP_CLOSING;
+            break;
+        }
+        conn->state = TCP_FIN_WAIT_2;
+        conn->finWait2Time = getMilliseconds() + TCP_FIN_WAIT_2_TIMEOUT;
+        // The FIN of the peer may have come with the ACK of ours
+    case TCP_FIN_WAIT_2:
+        if(conn->finReceived)
+            tcpEnterTimeWait(conn);
+        break;
+    case TCP_CLOSING:
+        if(conn->finAcked)
+            tcpEnterTimeWait(conn);
+        break;
+    case TCP_LAST_ACK:
+        if(conn->finAcked)
+        {
+            conn->state = TCP_CLOSED;
+            conn->retransmitTimerOn = false;
+        }
+        break;
+    // Nothing the peer sends moves the other states on here
+    default:
+        break;
+    }
+}
+
+// Takes in a segment for an open connection, queueing its data and processing its ACK
+// Replies may be sent, so the frame cannot be read after this returns
+// Returns true if the segment was the next one expected
+bool tcpProcessSegment(etherHeader* ether, tcpConnection* conn)
+{
+    ipHeader* ip = (ipHeader*)ether->data;
+    tcpHeader* tcp = (tcpHeader*)ip->data;
+    uint16_t flags = ntohs(tcp->offsetFields);
+    uint32_t ack = ntohl(tcp->acknowledgementNumber);
+    uint32_t window = (uint32_t)ntohs(tcp->windowSize) << conn->sndWindowShift;
+    uint32_t sequenceNumber = ntohl(tcp->sequenceNumber);
+    bool isDuplicateCandidate = (getPayloadSize(ether) == 0) && !(flags & (SYN | FIN));
+    bool inOrder = false;
+    tcpOptions opt;
+
+    if(!tcpIsForConnection(conn, ether))
+        return false;
+
+    tcpParseOptions(ether, &opt);
+    if(conn->timestamps && opt.hasTimestamp)
+    {
+        // PAWS (RFC 7323 5.3), a timestamp older than the last one means an old duplicate
+        // It is still acknowledged unless it is a reset, the peer may be waiting for our ACK
+        // tcpInput acknowledges anything with data or a FIN, so only the rest is acknowledged here
+        if((int32_t)(opt.tsVal - conn->tsRecent) < 0)
+        {
+            if(!(flags & (RST | FIN)) && getPayloadSize(ether) == 0)
+                tcpSendAck(ether, conn);
+            return false;
+        }
+        // Only remember the timestamp of segments that start at or before the left window edge
+        if((int32_t)(sequenceNumber - conn->rcvNxt) <= 0)
+            conn->tsRecent = opt.tsVal;
+    }
+
+    inOrder = tcpReceive(conn, ether);
+    if(flags & ACK)
+        tcpProcessAck(ether, conn, ack, window, isDuplicateCandidate, &opt);
+    tcpUpdateState(conn);
+    return inOrder;
+}
+
+// Handles the retransmission timer, call this often from the main loop
+void tcpTick(etherHeader* ether, tcpConnection* conn)
+{
+    // Stop waiting for a FIN that is not coming
+    if(conn->state == TCP_FIN_WAIT_2 && (int32_t)(getMilliseconds() - conn->finWait2Time) >= 0)
+    {
+        conn->state = TCP_CLOSED;
+        conn->retransmitTimerOn = false;
+        return;
+    }
+
+    if(!conn->retransmitTimerOn || (int32_t)(getMilliseconds() - conn->retransmitTime) < 0)
+        return;
+
+    // RFC 5681 3.1: after a timeout go back to one segment and slow start again
+    if(conn->sndMax != conn->sndUna)
+    {
+        conn->ssthresh = getLossThreshold(conn);
+        conn->cwnd = conn->mss;
+    }
+    conn->dupAcks = 0;
+    conn->inFastRecovery = false;
+    conn->recover = conn->sndMax - 1;
+    // The peer may throw away data it SACKed, so after a timeout nothing is taken as received (RFC 2018 8)
+    conn->scoreboardCount = 0;
+    // Karn's algorithm, the timed segment is being sent again
+    conn->rttTiming = false;
+    // RFC 6298 5.5: back off the timer
+    conn->rto = (conn->rto << 1 > TCP_MAX_RTO) ? TCP_MAX_RTO : conn->rto << 1;
+
+    // Go back to the oldest unacknowledged byte and send from there
+    conn->sndNxt = conn->sndUna;
+    conn->retransmitTimerOn = false;
+    // A closed window would stop tcpOutput, so force out a probe
+    if(conn->sndWnd == 0 && conn->txCount > 0)
+    {
+        tcpSendSegment(ether, conn, 0, 1, ACK);
+        conn->sndNxt++;
+        if((int32_t)(conn->sndNxt - conn->sndMax) > 0)
+            conn->sndMax = conn->sndNxt;
+        startRetransmitTimer(conn);
+    }
+    else
+        tcpOutput(ether, conn);
+}
+
+// Sends a segment with no data back to where the received one came from
+// The reply is built over the received frame, so it works without a connection
+void tcpSendReply(etherHeader* ether, uint16_t flags, uint32_t sequenceNumber, uint32_t acknowledgementNumber,
+                  uint8_t options[], uint8_t optionsLength)
+{
+    ipHeader* ip = (ipHeader*)ether->data;
+    tcpHeader* tcp = (tcpHeader*)ip->data;
+    uint16_t tcpHeaderLength = sizeof(tcpHeader) + optionsLength;
+    uint32_t sum = 0;
+    uint16_t temp16 = 0;
+    uint8_t i = 0, temp8 = 0;
+
+    for(i = 0; i < 6; i++)
+    {
+        temp8 = ether->destAddress[i];
+        ether->destAddress[i] = ether->sourceAddress[i];
+        ether->sourceAddress[i] = temp8;
+    }
+    for(i = 0; i < 4; i++)
+    {
+        temp8 = ip->destIp[i];
+        ip->destIp[i] = ip->sourceIp[i];
+        ip->sourceIp[i] = temp8;
+    }
+    temp16 = tcp->destPort;
+    tcp->destPort = tcp->sourcePort;
+    tcp->sourcePort = temp16;
+
+    tcp->sequenceNumber = htonl(sequenceNumber);
+    tcp->acknowledgementNumber = htonl(acknowledgementNumber);
+    tcp->offsetFields = htons(TCP_OFFSET(optionsLength) | flags);
+    tcp->windowSize = 0;
+    tcp->urgentPointer = 0;
+    tcp->checksum = 0;
+    if(optionsLength > 0)
+        copyUint8Array(options, (uint8_t*)tcp->data, optionsLength);
+
+    ip->revSize = 0x45;
+    ip->typeOfService = 0;
+    ip->id = 0;
+    ip->flagsAndOffset = 0;
+    ip->ttl = 128;
+    ip->length = htons(sizeof(ipHeader) + tcpHeaderLength);
+    etherCalcIpChecksum(ip);
+
+    // Pseudo-header, then the TCP header
+    etherSumWords(ip->sourceIp, 8, &sum);
+    temp16 = htons(ip->protocol);
+    etherSumWords(&temp16, 2, &sum);
+    temp16 = htons(tcpHeaderLength);
+    etherSumWords(&temp16, 2, &sum);
+    etherSumWords(tcp, tcpHeaderLength, &sum);
+    tcp->checksum = getEtherChecksum(sum);
+
+    etherPutPacket(ether, sizeof(etherHeader) + sizeof(ipHeader) + tcpHeaderLength);
+}
+
+// Answers a segment that belongs to no connection with a reset (RFC 793 3.4)
+void tcpSendReset(etherHeader* ether)
+{
+    ipHeader* ip = (ipHeader*)ether->data;
+    tcpHeader* tcp = (tcpHeader*)ip->data;
+    uint16_t flags = ntohs(tcp->offsetFields);
+    uint32_t length = getPayloadSize(ether) + ((flags & SYN) ? 1 : 0) + ((flags & FIN) ? 1 : 0);
+
+    // Never answer a reset
+    if(flags & RST)
+        return;
+    // If the segment had an ACK the reset takes its sequence number from it,
+    // otherwise it acknowledges everything in the segment
+    if(flags & ACK)
+        tcpSendReply(ether, RST, ntohl(tcp->acknowledgementNumber), 0, 0, 0);
+    else
+        tcpSendReply(ether, RST | ACK, 0, ntohl(tcp->sequenceNumber) + length, 0, 0);
+}
+
+// ACKs the FIN of the peer again from a TIME_WAIT entry
+void tcpSendTimeWaitAck(etherHeader* ether, tcpTimeWait* timeWait)
+{
+    uint8_t options[TCP_MAX_OPTIONS_LENGTH];
+    uint8_t optionsLength = 0;
+    tcpOptions opt = {0};
+    if(timeWait->timestamps)
+    {
+        opt.hasTimestamp = true;
+        opt.tsVal = getMilliseconds();
+        opt.tsEcr = timeWait->tsRecent;
+        optionsLength = tcpBuildOptions(options, &opt);
+    }
+    tcpSendReply(ether, ACK, timeWait->sndNxt, timeWait->rcvNxt, options, optionsLength);
+}
+
+tcpListener* getListener(uint16_t port)
+{
+    uint8_t i = 0;
+    for(i = 0; i < TCP_MAX_LISTENERS; i++)
+        if(port != 0 && listeners[i].port == port)
+            return &listeners[i];
+    return 0;
+}
+
+tcpConnection* getFreeConnection()
+{
+    uint8_t i = 0;
+    for(i = 0; i < TCP_MAX_ACCEPTED; i++)
+        if(acceptedConnections[i].state == TCP_CLOSED)
+            return &acceptedConnections[i];
+    return 0;
+}
+
+// Finds the TIME_WAIT entry of the connection a segment was sent on
+tcpTimeWait* getTimeWait(etherHeader* ether)
+{
+    ipHeader* ip = (ipHeader*)ether->data;
+    tcpHeader* tcp = (tcpHeader*)ip->data;
+    uint8_t i = 0, j = 0;
+    for(i = 0; i < TCP_MAX_TIME_WAIT; i++)
+    {
+        if(isTimeWaitOver(&timeWaits[i]) || timeWaits[i].localPort != ntohs(tcp->destPort) ||
+           timeWaits[i].remotePort != ntohs(tcp->sourcePort))
+            continue;
+        for(j = 0; j < 4 && timeWaits[i].remoteIp[j] == ip->sourceIp[j]; j++);
+        if(j == 4)
+            return &timeWaits[i];
+    }
+    return 0;
+}
+
+// Adds a connection to the ones tcpInput and tcpPoll look after
+bool tcpAddConnection(tcpConnection* conn)
+{
+    uint8_t i = 0;
+    for(i = 0; i < TCP_MAX_CONNECTIONS; i++)
+    {
+        if(connections[i] == 0)
+        {
+            connections[i] = conn;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Drops a connection that has closed and lets the application know
+void tcpRemoveConnection(tcpConnection* conn)
+{
+    uint8_t i = 0;
+    for(i = 0; i < TCP_MAX_CONNECTIONS; i++)
+        if(connections[i] == conn)
+            connections[i] = 0;
+    conn->retransmitTimerOn = false;
+    if(conn->closed != 0)
+        conn->closed(conn);
+}
+
+tcpConnection* getConnection(etherHeader* ether)
+{
+    uint8_t i = 0;
+    for(i = 0; i < TCP_MAX_CONNECTIONS; i++)
+        if(connections[i] != 0 && tcpIsForConnection(connections[i], ether))
+            return connections[i];
+    return 0;
+}
+
+// Secret of the initial sequence numbers, it is picked when the first connection opens
+uint32_t isnSecret = 0;
+
+// Folds a word into a hash, each step is the MurmurHash3 finalizer
+uint32_t tcpHashWord(uint32_t hash, uint32_t word)
+{
+    hash ^= word;
+    hash ^= hash >> 16;
+    hash *= 0x85EBCA6B;
+    hash ^= hash >> 13;
+    hash *= 0xC2B2AE35;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+// RFC 6528: a clock that ticks every 4 us (RFC 793 3.3) plus a hash of the sockets and a secret
+// Someone who does not know the secret can not guess the numbers of a connection from those of another
+// The local and remote sockets of conn must already be filled in
+uint32_t getInitialSequenceNumber(tcpConnection* conn)
+{
+    uint8_t mac[6];
+    uint32_t hash = 0;
+    if(isnSecret == 0)
+    {
+        // The time of the first connection depends on the network, which the MAC makes differ between boards
+        etherGetMacAddress(mac);
+        isnSecret = tcpHashWord(getMicroseconds(), ((uint32_t)mac[2] << 24) | ((uint32_t)mac[3] << 16) | ((uint32_t)mac[4] << 8) | mac[5]);
+        isnSecret = tcpHashWord(isnSecret, getMicroseconds()) | 1;
+    }
+    hash = tcpHashWord(isnSecret, ((uint32_t)conn->local.ip[0] << 24) | ((uint32_t)conn->local.ip[1] << 16) | ((uint32_t)conn->local.ip[2] << 8) | conn->local.ip[3]);
+    hash = tcpHashWord(hash, ((uint32_t)conn->remote.ip[0] << 24) | ((uint32_t)conn->remote.ip[1] << 16) | ((uint32_t)conn->remote.ip[2] << 8) | conn->remote.ip[3]);
+    hash = tcpHashWord(hash, ((uint32_t)conn->local.port << 16) | conn->remote.port);
+    hash = tcpHashWord(hash, isnSecret);
+    return (getMicroseconds() >> 2) + hash;
+}
+
+// Starts an active open to the remote socket of conn, the SYN goes out from tcpPoll
+// The local socket and the callbacks must already be filled in
+// Returns false if too many connections are open
+bool tcpConnect(tcpConnection* conn)
+{
+    if(conn->state != TCP_CLOSED)
+        return false;
+    tcpReset(conn, getInitialSequenceNumber(conn));
+    if(!tcpAddConnection(conn))
+        return false;
+    conn->state = TCP_SYN_SENT;
+    return true;
+}
+
+// Drops the connection without the close handshake
+// The closed callback is called from tcpPoll
+void tcpAbort(tcpConnection* conn)
+{
+    conn->state = TCP_CLOSED;
+    conn->retransmitTimerOn = false;
+}
+
+// Starts accepting connections on port, accept is called for each one once its handshake is done
+// Returns false if every listener is in use
+bool tcpListen(uint16_t port, tcpCallback accept)
+{
+    tcpListener* listener = getListener(port);
+    uint8_t i = 0;
+    for(i = 0; i < TCP_MAX_LISTENERS && listener == 0; i++)
+        if(listeners[i].port == 0)
+            listener = &listeners[i];
+    if(listener == 0)
+        return false;
+    listener->port = port;
+    listener->accept = accept;
+    return true;
+}
+
+// Sends our SYN with every option we support
+void tcpSendSyn(etherHeader* ether, tcpConnection* conn)
+{
+    uint8_t options[TCP_MAX_OPTIONS_LENGTH];
+    uint8_t optionsLength = 0;
+    tcpOptions opt = {0};
+    opt.hasMss = true;
+    opt.mss = TCP_MSS;
+    opt.hasWindowScale = true;
+    opt.windowScale = tcpGetWindowShift();
+    opt.sackPermitted = true;
+    // The timestamp lets the SYN, ACK give the first RTT sample
+    opt.hasTimestamp = true;
+    opt.tsVal = getMilliseconds();
+    optionsLength = tcpBuildOptions(options, &opt);
+    sendTcp(ether, conn, TCP_OFFSET(optionsLength) | SYN, conn->sndUna, 0, options, optionsLength, 0);
+}
+
+// Answers a SYN, only the options the peer offered are sent back (RFC 7323 & RFC 2018)
+void tcpSendSynAck(etherHeader* ether, tcpConnection* conn)
+{
+    uint8_t options[TCP_MAX_OPTIONS_LENGTH];
+    uint8_t optionsLength = 0;
+    tcpOptions opt = {0};
+    opt.hasMss = true;
+    opt.mss = TCP_MSS;
+    opt.hasWindowScale = conn->windowScaling;
+    opt.windowScale = conn->rcvWindowShift;
+    opt.sackPermitted = conn->sack;
+    opt.hasTimestamp = conn->timestamps;
+    opt.tsVal = getMilliseconds();
+    opt.tsEcr = conn->tsRecent;
+    optionsLength = tcpBuildOptions(options, &opt);
+    sendTcp(ether, conn, TCP_OFFSET(optionsLength) | SYN | ACK, conn->sndUna, conn->rcvNxt, options, optionsLength, 0);
+}
+
+// Opens a connection for a SYN sent to a listening port
+void tcpAcceptSyn(etherHeader* ether, tcpListener* listener)
+{
+    ipHeader* ip = (ipHeader*)ether->data;
+    tcpHeader* tcp = (tcpHeader*)ip->data;
+    tcpConnection* conn = getFreeConnection();
+    tcpOptions peer;
+    uint8_t i = 0, halfOpen = 0;
+
+    for(i = 0; i < TCP_MAX_ACCEPTED; i++)
+        if(acceptedConnections[i].state == TCP_SYN_RECEIVED && acceptedConnections[i].local.port == listener->port)
+            halfOpen++;
+    // The peer sends the SYN again later
+    if(conn == 0 || halfOpen >= TCP_LISTEN_BACKLOG || !tcpAddConnection(conn))
+        return;
+
+    // The accept callback sets these
+    conn->readable = 0;
+    conn->writable = 0;
+    conn->closed = 0;
+    etherGetIpAddress(conn->local.ip);
+    conn->local.port = listener->port;
+    copyUint8Array(ip->sourceIp, conn->remote.ip, 4);
+    conn->remote.port = ntohs(tcp->sourcePort);
+    tcpReset(conn, getInitialSequenceNumber(conn));
+
+    tcpParseOptions(ether, &peer);
+    tcpNegotiateOptions(conn, &peer);
+    conn->rcvNxt = ntohl(tcp->sequenceNumber) + 1;
+    conn->rcvAdvertised = conn->rcvNxt;
+    conn->state = TCP_SYN_RECEIVED;
+
+    tcpSendSynAck(ether, conn);
+    // Our SYN takes up one sequence number
+    conn->sndNxt = conn->sndMax = conn->sndUna + 1;
+    startRetransmitTimer(conn);
+}
+
+// Handles every TCP segment received
+// Segments for open connections go to them, SYNs to listening ports open new ones
+// and anything else is answered with a reset
+// The callbacks of the connection are called once its replies are sent
+void tcpInput(etherHeader* ether)
+{
+    ipHeader* ip = (ipHeader*)ether->data;
+    tcpHeader* tcp = (tcpHeader*)ip->data;
+    uint16_t flags = ntohs(tcp->offsetFields);
+    uint16_t payloadSize = getPayloadSize(ether);
+    uint32_t sequenceNumber = ntohl(tcp->sequenceNumber);
+    uint32_t ack = ntohl(tcp->acknowledgementNumber);
+    uint32_t rxCount = 0, txCount = 0;
+    uint8_t oooCount = 0;
+    tcpConnection* conn = getConnection(ether);
+    tcpListener* listener = 0;
+    tcpTimeWait* timeWait = 0;
+    tcpOptions opt;
+    bool accepted = false, finReceived = false;
+
+    if(conn == 0)
+        timeWait = getTimeWait(ether);
+    if(timeWait != 0)
+    {
+        // RFC 1122 4.2.2.13: a SYN above the old sequence space may open the connection again
+        if((flags & SYN) && !(flags & ACK) && (int32_t)(sequenceNumber - timeWait->rcvNxt) > 0)
+            timeWait->inUse = false;
+        else
+        {
+            // A FIN sent again means our last ACK was lost, so it is resent and the wait starts over
+            // Resets are ignored (RFC 1337)
+            if((flags & FIN) && !(flags & RST))
+            {
+                tcpSendTimeWaitAck(ether, timeWait);
+                timeWait->endTime = getMilliseconds() + 2 * TCP_MSL;
+            }
+            return;
+        }
+    }
+
+    if(conn == 0)
+    {
+        // RFC 793 3.4: a listening port ignores resets and resets anything acknowledging what it never sent
+        listener = getListener(ntohs(tcp->destPort));
+        if(listener != 0 && (flags & RST))
+            return;
+        if(listener == 0 || (flags & ACK))
+            tcpSendReset(ether);
+        else if(flags & SYN)
+            tcpAcceptSyn(ether, listener);
+        return;
+    }
+
+    if(conn->state == TCP_SYN_SENT)
+    {
+        // Anything that does not acknowledge our SYN is not meant for this connection
+        if((flags & ACK) && ack != conn->sndUna + 1)
+        {
+            tcpSendReset(ether);
+            return;
+        }
+        if(flags & RST)
+        {
+            if(flags & ACK)
+                tcpAbort(conn);
+        }
+        // A simultaneous open is not supported, so only a SYN, ACK moves on
+        else if((flags & SYN) && (flags & ACK))
+        {
+            // Picks up the peer's sequence number, MSS and window
+            tcpEstablish(conn, ether);
+            tcpSendAck(ether, conn);
+            if(conn->writable != 0)
+                conn->writable(conn);
+        }
+        if(conn->state == TCP_CLOSED)
+            tcpRemoveConnection(conn);
+        return;
+    }
+
+    if(flags & RST)
+    {
+        // Only a reset inside the window is believed
+        if(sequenceNumber - conn->rcvNxt <= TCP_RX_BUFFER_SIZE - conn->rxCount)
+        {
+            tcpAbort(conn);
+            tcpRemoveConnection(conn);
+        }
+        return;
+    }
+
+    if(conn->state == TCP_SYN_RECEIVED)
+    {
+        // The SYN was sent again, so our SYN, ACK was lost
+        if((flags & SYN) && !(flags & ACK))
+        {
+            tcpSendSynAck(ether, conn);
+            return;
+        }
+        if(!(flags & ACK))
+            return;
+        if(ack != conn->sndUna + 1)
+        {
+            tcpSendReset(ether);
+            return;
+        }
+        // The ACK echoes the time our SYN, ACK went out
+        tcpParseOptions(ether, &opt);
+        if(conn->timestamps && opt.hasTimestamp && opt.tsEcr != 0)
+            tcpUpdateRtt(conn, getMilliseconds() - opt.tsEcr);
+        conn->retransmitTimerOn = false;
+        conn->rto = getBaseRto(conn);
+        tcpStartSending(conn, ack, (uint32_t)ntohs(tcp->windowSize) << conn->sndWindowShift);
+        conn->state = TCP_ESTABLISHED;
+        accepted = true;
+    }
+
+    rxCount = conn->rxCount;
+    txCount = conn->txCount;
+    finReceived = conn->finReceived;
+    oooCount = conn->oooCount;
+    tcpProcessSegment(ether, conn);
+    // In order data is acknowledged from tcpPoll, by then the application may have queued an answer to carry the ACK
+    // Two segments of data (or half the buffer), out of order data or data filling a hole is acknowledged right away so the peer
+    // can fast retransmit (RFC 5681 4.2), and so is the FIN
+    if(payloadSize > 0 && !(flags & FIN) && conn->rxCount > rxCount && oooCount == 0 && conn->oooCount == 0)
+    {
+        if(!conn->ackPending)
+            conn->ackTime = getMilliseconds() + TCP_DELAYED_ACK;
+        conn->ackPending = true;
+        conn->unackedBytes += payloadSize;
+        if(conn->unackedBytes >= tcpGetAckThreshold(conn))
+            tcpSendAck(ether, conn);
+    }
+    else if(payloadSize > 0 || (flags & FIN))
+        tcpSendAck(ether, conn);
+
+    if(accepted)
+    {
+        listener = getListener(conn->local.port);
+        if(listener != 0 && listener->accept != 0)
+            listener->accept(conn);
+    }
+    if((conn->rxCount > rxCount || conn->finReceived != finReceived) && conn->readable != 0)
+        conn->readable(conn);
+    if(conn->txCount < txCount && conn->writable != 0)
+        conn->writable(conn);
+    if(conn->state == TCP_CLOSED)
+        tcpRemoveConnection(conn);
+}
+
+// Gives up on a handshake once the SYN or SYN, ACK has been sent TCP_SYN_RETRIES more times
+void tcpHandshakeTick(etherHeader* ether, tcpConnection* conn)
+{
+    if(!conn->retransmitTimerOn || (int32_t)(getMilliseconds() - conn->retransmitTime) < 0)
+        return;
+    if(conn->rto >= (TCP_INITIAL_RTO << TCP_SYN_RETRIES))
+    {
+        tcpAbort(conn);
+        return;
+    }
+    conn->rto <<= 1;
+    if(conn->state == TCP_SYN_SENT)
+        tcpSendSyn(ether, conn);
+    else
+        tcpSendSynAck(ether, conn);
+    startRetransmitTimer(conn);
+}
+
+// Runs the timers of every connection and sends whatever the application queued
+// Call this often from the main loop, the frame is used to build the segments
+void tcpPoll(etherHeader* ether)
+{
+    tcpConnection* conn = 0;
+    uint8_t i = 0;
+    for(i = 0; i < TCP_MAX_CONNECTIONS; i++)
+    {
+        conn = connections[i];
+        if(conn == 0)
+            continue;
+        switch(conn->state)
+        {
+        case TCP_CLOSED:
+            break;
+        case TCP_SYN_SENT:
+            // The SYN has not gone out yet
+            if(conn->sndNxt == conn->sndUna)
+            {
+                tcpSendSyn(ether, conn);
+                conn->sndNxt = conn->sndMax = conn->sndUna + 1;
+                startRetransmitTimer(conn);
+            }
+            else
+                tcpHandshakeTick(ether, conn);
+            break;
+        case TCP_SYN_RECEIVED:
+            tcpHandshakeTick(ether, conn);
+            break;
+        default:
+            tcpTick(ether, conn);
+            if(conn->state == TCP_CLOSED)
+                break;
+            tcpOutput(ether, conn);
+            // Reading from the receive buffer opened up the window, let the peer know
+            if(conn->state != TCP_CLOSE_WAIT && conn->state != TCP_LAST_ACK && tcpIsWindowUpdateNeeded(conn))
+                tcpSendAck(ether, conn);
+            // Nothing went out to carry the ACK of the data received
+            if(conn->ackPending && (int32_t)(getMilliseconds() - conn->ackTime) >= 0)
+                tcpSendAck(ether, conn);
+            break;
+        }
+        if(conn->state == TCP_CLOSED)
+            tcpRemoveConnection(conn);
+    }
 }
@@ -12,22 +12,221 @@
 #include <stdbool.h>
 #include "eth0.h"
 
-#define TIMEOUT_2MS         2000
+// Bytes of in order data that can be held until the application reads them
+// The advertised window is the free space in this buffer, so a board with more RAM
+// can raise it, past 65535 the window scale option is used to advertise it
+#define TCP_RX_BUFFER_SIZE  2048
+// Bytes written by the application that are unsent or not yet acknowledged
+#define TCP_TX_BUFFER_SIZE  2048
 
-#define TCP_WINDOW_SIZE     1460
+// RFC 6298 2.1 & 5.5: retransmission timeout in milliseconds and its upper bound
+#define TCP_INITIAL_RTO     1000
+#define TCP_MAX_RTO         60000
+// Lower bound on the computed timeout, RFC 6298 asks for 1 s but the broker is
+// on the local network so the 200 ms used by most stacks is kept instead
+#define TCP_MIN_RTO         200
+// RFC 5681 3.2: duplicate ACKs that trigger a fast retransmit
+#define TCP_DUP_ACK_THRESHOLD   3
+// RFC 1122 4.2.3.2: in order data is acknowledged within this many milliseconds, so the ACK
+// can go out with the application's answer, and every second full sized segment right away
+#define TCP_DELAYED_ACK     100
+// Times the SYN, ACK of a passive open is resent before the connection is dropped
+#define TCP_SYN_RETRIES     3
+// Maximum segment lifetime in milliseconds, TIME_WAIT lasts twice this
+#define TCP_MSL             15000
+// How long FIN_WAIT_2 waits for the peer's FIN before giving up on it
+#define TCP_FIN_WAIT_2_TIMEOUT  (2 * TCP_MSL)
+// Closed connections remembered for TIME_WAIT, the oldest is forgotten when more close
+#define TCP_MAX_TIME_WAIT   4
+
+// Ports the board can listen on and connections opened by peers, shared by all listeners
+// Each connection holds both buffers, so these are kept small
+#define TCP_MAX_LISTENERS   2
+#define TCP_MAX_ACCEPTED    2
+// Open connections tcpInput and tcpPoll look after, the accepted ones and those the application opened
+#define TCP_MAX_CONNECTIONS (TCP_MAX_ACCEPTED + 2)
+// Half open connections a listener holds before it ignores new SYNs
+#define TCP_LISTEN_BACKLOG  2
+
+// Largest segment we accept, 1500 byte MTU - 20 byte IP header - 20 byte TCP header
+#define TCP_MSS             1460
+// RFC 1122 4.2.2.6: assumed when the peer does not send the MSS option
+#define TCP_DEFAULT_MSS     536
+// Smallest peer MSS taken, a lower one would leave little or no room for data next to the options
+#define TCP_MIN_MSS         64
+
+// Option kinds (RFC 793, RFC 2018 & RFC 7323)
+#define TCP_OPTION_END              0
+#define TCP_OPTION_NOP              1
+#define TCP_OPTION_MSS              2
+#define TCP_OPTION_WINDOW_SCALE     3
+#define TCP_OPTION_SACK_PERMITTED   4
+#define TCP_OPTION_SACK             5
+#define TCP_OPTION_TIMESTAMP        8
+
+// The data offset field is 4 bits, so the header is at most 60 bytes
+#define TCP_MAX_OPTIONS_LENGTH      40
+// NOP, NOP, kind, length, TSval, TSecr
+#define TCP_TIMESTAMP_OPTION_LENGTH 12
+// Out of order blocks kept by the receiver, also the most blocks read from one SACK option
+#define TCP_MAX_SACK_BLOCKS         4
+// SACKed blocks remembered by the sender, more than one ACK can report
+#define TCP_SACK_SCOREBOARD_SIZE    8
+
+// Builds the data offset part of the flags field for a header carrying optionsLength bytes of options
+#define TCP_OFFSET(optionsLength)   ((uint16_t)(5 + ((optionsLength) >> 2)) << 12)
 
 #define SYN                 0x0002
 #define ACK                 0x0010
 #define PSH                 0x0008
+#define RST                 0x0004
 #define FIN                 0x0001
 
+// Connection states (RFC 793 3.2), listening ports are kept apart from connections
+// TIME_WAIT is not one of them, the connection is freed and a tcpTimeWait keeps what is left
+typedef enum _tcpState
+{
+    TCP_CLOSED = 0,
+    TCP_SYN_SENT,
+    TCP_SYN_RECEIVED,
+    TCP_ESTABLISHED,
+    TCP_FIN_WAIT_1,
+    TCP_FIN_WAIT_2,
+    TCP_CLOSE_WAIT,
+    TCP_CLOSING,
+    TCP_LAST_ACK
+} tcpState;
+
 typedef struct _socket
 {
     uint8_t ip[4];
     uint16_t port;
-    uint8_t mac[6];
 } socket;
 
+// A range of sequence numbers, end is one past the last byte
+typedef struct _tcpSackBlock
+{
+    uint32_t start;
+    uint32_t end;
+} tcpSackBlock;
+
+typedef struct _tcpOptions
+{
+    bool hasMss;
+    uint16_t mss;
+    bool hasWindowScale;
+    uint8_t windowScale;
+    bool sackPermitted;
+    bool hasTimestamp;
+    uint32_t tsVal;
+    uint32_t tsEcr;
+    uint8_t sackCount;
+    tcpSackBlock sack[TCP_MAX_SACK_BLOCKS];
+} tcpOptions;
+
+struct _tcpConnection;
+
+// Tells the application about a connection, it may queue data or close from here but not send
+typedef void (*tcpCallback)(struct _tcpConnection* conn);
+
+typedef struct _tcpConnection
+{
+    socket local;
+    socket remote;
+    tcpState state;
+    // Data or the peer's FIN can be read, room opened up in the send buffer
+    // and the connection is closed and can be used again
+    tcpCallback readable;
+    tcpCallback writable;
+    tcpCallback closed;
+    // Effective send MSS, the smaller of ours and the one the peer announced
+    uint16_t mss;
+    // Window scale shifts, zero unless both sides sent the option
+    bool windowScaling;
+    uint8_t sndWindowShift;
+    uint8_t rcvWindowShift;
+    // Selective acknowledgements (RFC 2018), on if the peer's SYN, ACK allowed them
+    bool sack;
+    // Next sequence number expected from the peer
+    uint32_t rcvNxt;
+    // Right edge of the last window we advertised
+    uint32_t rcvAdvertised;
+    // Received data is kept at the start of the buffer until it is consumed
+    uint32_t rxCount;
+    uint8_t rxBuffer[TCP_RX_BUFFER_SIZE];
+    // Out of order data is kept past rxCount at its distance from rcvNxt
+    // ooo[0] is the block that changed last, which is the order SACK reports them in
+    uint8_t oooCount;
+    tcpSackBlock ooo[TCP_MAX_SACK_BLOCKS];
+    bool finReceived;
+    // Received data that no segment has acknowledged yet and when the ACK has to go out
+    bool ackPending;
+    uint32_t ackTime;
+    uint32_t unackedBytes;
+    // Oldest unacknowledged, next to send and highest sent sequence numbers
+    uint32_t sndUna;
+    uint32_t sndNxt;
+    uint32_t sndMax;
+    // Window the peer advertised, already scaled, and the largest one seen
+    uint32_t sndWnd;
+    uint32_t maxSndWnd;
+    // txBuffer[0] is the byte at sndUna
+    uint32_t txCount;
+    uint8_t txBuffer[TCP_TX_BUFFER_SIZE];
+    // The FIN goes out after the last byte in txBuffer
+    bool finQueued;
+    bool finAcked;
+    // Congestion control (RFC 5681) with NewReno fast recovery (RFC 6582)
+    uint32_t cwnd;
+    uint32_t ssthresh;
+    uint32_t recover;
+    uint8_t dupAcks;
+    bool inFastRecovery;
+    // Blocks the peer SACKed, sorted by sequence number, and the end of the last hole resent (RFC 6675)
+    uint8_t scoreboardCount;
+    tcpSackBlock scoreboard[TCP_SACK_SCOREBOARD_SIZE];
+    uint32_t highRxt;
+    // Timestamps option (RFC 7323), tsRecent is the TSval echoed back to the peer
+    bool timestamps;
+    uint32_t tsRecent;
+    // Smoothed RTT in 1/8 ms and its variation in 1/4 ms (RFC 6298), zero until the first sample
+    uint32_t srtt;
+    uint32_t rttvar;
+    // Without timestamps one segment per window is timed
+    bool rttTiming;
+    uint32_t rttSeq;
+    uint32_t rttStart;
+    // Retransmission timer, retransmitTime is in milliseconds from getMilliseconds()
+    uint32_t rto;
+    uint32_t retransmitTime;
+    bool retransmitTimerOn;
+    // When FIN_WAIT_2 gives up
+    uint32_t finWait2Time;
+} tcpConnection;
+
+// What TIME_WAIT needs of a closed connection to answer a FIN sent again
+typedef struct _tcpTimeWait
+{
+    bool inUse;
+    uint8_t remoteIp[4];
+    uint16_t localPort;
+    uint16_t remotePort;
+    uint32_t sndNxt;
+    uint32_t rcvNxt;
+    bool timestamps;
+    uint32_t tsRecent;
+    // When TIME_WAIT is over
+    uint32_t endTime;
+} tcpTimeWait;
+
+typedef struct _tcpListener
+{
+    // Zero when the slot is free
+    uint16_t port;
+    // Called once a peer has completed the handshake
+    tcpCallback accept;
+} tcpListener;
+
 typedef enum _sendTcpArgs
 {
     NO_OPTIONS = 0,
@@ -35,8 +234,34 @@ typedef enum _sendTcpArgs
 } sendTcpArgs;
 
 uint16_t getPayloadSize(etherHeader* ether);
-void sendTcp(etherHeader* ether, socket* s, socket* d, uint16_t flags, uint32_t sequenceNumber, uint32_t acknowledgementNumber,
+void sendTcp(etherHeader* ether, tcpConnection* conn, uint16_t flags, uint32_t sequenceNumber, uint32_t acknowledgementNumber,
              uint8_t options[], uint8_t optionLength, uint16_t dataLength);
 bool etherIsTcp(etherHeader* ether);
+uint8_t tcpBuildOptions(uint8_t options[], tcpOptions* opt);
+void tcpParseOptions(etherHeader* ether, tcpOptions* opt);
+void tcpNegotiateOptions(tcpConnection* conn, tcpOptions* peer);
+uint8_t tcpGetWindowShift();
+uint16_t tcpGetReceiveWindow(tcpConnection* conn, bool isSyn);
+bool tcpIsWindowUpdateNeeded(tcpConnection* conn);
+uint32_t tcpGetAckThreshold(tcpConnection* conn);
+bool tcpIsForConnection(tcpConnection* conn, etherHeader* ether);
+bool tcpReceive(tcpConnection* conn, etherHeader* ether);
+void tcpConsume(tcpConnection* conn, uint32_t length);
+void tcpReset(tcpConnection* conn, uint32_t iss);
+void tcpEstablish(tcpConnection* conn, etherHeader* ether);
+uint32_t tcpWrite(tcpConnection* conn, uint8_t data[], uint32_t length);
+void tcpClose(tcpConnection* conn);
+bool tcpIsFinAcked(tcpConnection* conn);
+void tcpOutput(etherHeader* ether, tcpConnection* conn);
+void tcpSendAck(etherHeader* ether, tcpConnection* conn);
+bool tcpProcessSegment(etherHeader* ether, tcpConnection* conn);
+void tcpTick(etherHeader* ether, tcpConnection* conn);
+uint32_t tcpGetSmoothedRtt(tcpConnection* conn);
+bool tcpConnect(tcpConnection* conn);
+void tcpAbort(tcpConnection* conn);
+bool tcpListen(uint16_t port, tcpCallback accept);
+void tcpInput(etherHeader* ether);
+void tcpPoll(etherHeader* ether);
+void tcpSendReset(etherHeader* ether);
 
 #endif /* TCP_H_ */
@@ -0,0 +1,61 @@
+/*
+ * timer0.c
+ *
+ *  Created on: Apr 13, 2021
+ *      Author: Sarker Nadir Afridi Azmi
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "timer0.h"
+
+// Incremented on every timer interrupt, this wraps around after about 49 days
+// so always compare times by subtracting them
+volatile uint32_t milliseconds = 0;
+// Timer clocks in a millisecond and in a microsecond, for reading the time between interrupts
+uint32_t timer0Load = TIMER0_1KHZ;
+uint32_t timer0TicksPerMicrosecond = TIMER0_1KHZ / 1000;
+
+void initTimer0(uint32_t loadValue)
+{
+    timer0Load = loadValue;
+    timer0TicksPerMicrosecond = loadValue / 1000;
+
+    // Enable clocks
+    SYSCTL_RCGCTIMER_R |= SYSCTL_RCGCTIMER_R0;
+    _delay_cycles(3);
+
+    // Configure Timer 0 as the time base
+    TIMER0_CTL_R &= ~TIMER_CTL_TAEN;                 // turn-off timer before reconfiguring
+    TIMER0_CFG_R = TIMER_CFG_32_BIT_TIMER;           // configure as 32-bit timer (A+B)
+    TIMER0_TAMR_R = TIMER_TAMR_TAMR_PERIOD;          // configure for periodic mode (count down)
+    TIMER0_TAILR_R = loadValue;                      // set load value to 40e3 for 1 kHz interrupt rate
+    TIMER0_IMR_R = TIMER_IMR_TATOIM;                 // turn-on interrupts
+    NVIC_EN0_R |= 1 << (INT_TIMER0A-16);             // turn-on interrupt 35 (TIMER0A)
+    TIMER0_CTL_R |= TIMER_CTL_TAEN;                  // turn-on timer
+}
+
+void timer0Isr()
+{
+    milliseconds++;
+    TIMER0_ICR_R = TIMER_ICR_TATOCINT;
+}
+
+uint32_t getMilliseconds()
+{
+    return milliseconds;
+}
+
+// The milliseconds plus how far the timer has counted down into the current one
+// This wraps around after about 71 minutes, so compare times by subtracting them
+uint32_t getMicroseconds()
+{
+    uint32_t ms, ticks;
+    // The interrupt may come between the two reads, then they are read again
+    do
+    {
+        ms = milliseconds;
+        ticks = timer0Load - TIMER0_TAV_R;
+    } while(ms != milliseconds);
+    return ms * 1000 + ticks / timer0TicksPerMicrosecond;
+}
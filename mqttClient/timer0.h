@@ -0,0 +1,22 @@
+/*
+ * timer0.h
+ *
+ *  Created on: Apr 13, 2021
+ *      Author: Sarker Nadir Afridi Azmi
+ */
+
+#ifndef TIMER0_H_
+#define TIMER0_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "tm4c123gh6pm.h"
+
+// Load value for a 1 kHz interrupt rate with a 40 MHz system clock
+#define TIMER0_1KHZ     40000
+
+void initTimer0(uint32_t loadValue);
+uint32_t getMilliseconds();
+uint32_t getMicroseconds();
+
+#endif /* TIMER0_H_ */
@@ -0,0 +1,84 @@
+/*
+ * udp.c
+ * UDP sockets, datagrams are handed to the callback bound to their port
+ * Sending goes through the ARP cache like TCP does, so any address can be sent to without waiting
+ *
+ *  Created on: Apr 20, 2021
+ *      Author: Sarker Nadir Afridi Azmi
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "eth0.h"
+#include "udp.h"
+#include "igmp.h"
+
+udpSocket udpSockets[UDP_MAX_SOCKETS];
+
+udpSocket* getUdpSocket(uint16_t port)
+{
+    uint8_t i = 0;
+    for(i = 0; i < UDP_MAX_SOCKETS; i++)
+        if(udpSockets[i].port == port)
+            return &udpSockets[i];
+    return 0;
+}
+
+// Datagrams to port go to receive from now on
+// Returns false if the port is already bound or every socket is taken
+bool udpBind(uint16_t port, udpCallback receive)
+{
+    udpSocket* udpSock = 0;
+    if(port == 0 || getUdpSocket(port) != 0)
+        return false;
+    udpSock = getUdpSocket(0);
+    if(udpSock == 0)
+        return false;
+    udpSock->port = port;
+    udpSock->receive = receive;
+    return true;
+}
+
+void udpUnbind(uint16_t port)
+{
+    udpSocket* udpSock = getUdpSocket(port);
+    if(port != 0 && udpSock != 0)
+        udpSock->port = 0;
+}
+
+// Sends length bytes of data from sourcePort, the port does not have to be bound
+// Returns false if the data does not fit in a frame or eth0 had to drop it
+bool udpSendTo(etherHeader* ether, uint16_t sourcePort, uint8_t destIp[4], uint16_t destPort, uint8_t data[], uint16_t length)
+{
+    ipHeader* ip = (ipHeader*)ether->data;
+    udpHeader* udp = (udpHeader*)ip->data;
+    uint16_t i = 0;
+    if(length > UDP_MAX_DATA_SIZE)
+        return false;
+    // data may already be where it is sent from
+    if(data != udp->data)
+        for(i = 0; i < length; i++)
+            udp->data[i] = data[i];
+    return etherPutUdpPacket(ether, destIp, sourcePort, destPort, length);
+}
+
+// Takes a UDP datagram that passed etherIsUdp and calls the callback bound to its port
+// Datagrams to ports nobody bound and to groups we did not join are dropped
+void udpInput(etherHeader* ether)
+{
+    ipHeader* ip = (ipHeader*)ether->data;
+    uint8_t ipHeaderLength = (ip->revSize & 0xF) << 2;
+    udpHeader* udp = (udpHeader*)((uint8_t*)ip + ipHeaderLength);
+    uint16_t udpLength = ntohs(udp->length);
+    udpSocket* udpSock = 0;
+
+    // The UDP length can not claim more than the IP packet carries
+    if(udpLength < sizeof(udpHeader) || udpLength > ntohs(ip->length) - ipHeaderLength || ntohs(udp->destPort) == 0)
+        return;
+    // The hash table lets in groups that share a bit with ours
+    if(etherIsMulticastIp(ip->destIp) && !igmpIsMember(ip->destIp))
+        return;
+    udpSock = getUdpSocket(ntohs(udp->destPort));
+    if(udpSock != 0)
+        udpSock->receive(ether, ip->sourceIp, ntohs(udp->sourcePort), udp->data, udpLength - sizeof(udpHeader));
+}
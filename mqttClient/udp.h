@@ -0,0 +1,36 @@
+/*
+ * udp.h
+ * UDP sockets, datagrams are handed to the callback bound to their port
+ *
+ *  Created on: Apr 20, 2021
+ *      Author: Sarker Nadir Afridi Azmi
+ */
+
+#ifndef UDP_H_
+#define UDP_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "eth0.h"
+
+// Ports that can be bound at once, DHCP and DNS take one each while they run
+#define UDP_MAX_SOCKETS         4
+// Largest payload that fits a 1500 byte MTU, 1500 - 20 byte IP header - 8 byte UDP header
+#define UDP_MAX_DATA_SIZE       1472
+
+// Gets a datagram sent to a bound port, data points into ether which may be used to send a reply
+typedef void (*udpCallback)(etherHeader* ether, uint8_t sourceIp[], uint16_t sourcePort, uint8_t data[], uint16_t length);
+
+typedef struct _udpSocket
+{
+    // Zero when the slot is free
+    uint16_t port;
+    udpCallback receive;
+} udpSocket;
+
+bool udpBind(uint16_t port, udpCallback receive);
+void udpUnbind(uint16_t port);
+bool udpSendTo(etherHeader* ether, uint16_t sourcePort, uint8_t destIp[4], uint16_t destPort, uint8_t data[], uint16_t length);
+void udpInput(etherHeader* ether);
+
+#endif /* UDP_H_ */
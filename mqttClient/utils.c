@@ -12,17 +12,44 @@
 bool isIpv4Address(USER_DATA* data, uint8_t currentOffsetFromCommand)
 {
     /* Since the command is set IP www.xxx.yyy.zzz, there should be
-     * a total of 6 fields
+     * a total of 6 fields, ping www.xxx.yyy.zzz <count> has one after the address
      */
-    if(data->fieldCount != 6)
+    if(data->fieldCount < currentOffsetFromCommand + 5)
         return false;
     uint8_t i = currentOffsetFromCommand + 1;
+    // A hostname like 10.example.1.2 has fields that are not numbers
     for(; i <= currentOffsetFromCommand + 4; i++)
-        if(getFieldInteger(data, i) > 255)
+        if(data->fieldType[i] != 'n' || getFieldInteger(data, i) > 255)
             return false;
     return true;
 }
 
+/*
+ * parseField replaces the dots and dashes of a hostname with null terminators,
+ * so the hostname is copied from line, the text as it was typed
+ * Returns false if it has other characters or does not fit in size
+ */
+bool getHostname(const char line[], USER_DATA* data, uint8_t fieldNumber, char hostname[], uint8_t size)
+{
+    uint8_t pos = data->fieldPosition[fieldNumber];
+    uint8_t i = 0;
+    if(fieldNumber >= data->fieldCount)
+        return false;
+    for(i = 0; line[pos] != '\0' && line[pos] != ' '; i++, pos++)
+    {
+        if(i == size - 1)
+            return false;
+        if(!((line[pos] >= 'a' && line[pos] <= 'z') ||
+             (line[pos] >= 'A' && line[pos] <= 'Z') ||
+             (line[pos] >= '0' && line[pos] <= '9') ||
+             line[pos] == '-' || line[pos] == '.'))
+            return false;
+        hostname[i] = line[pos];
+    }
+    hostname[i] = '\0';
+    return i > 0;
+}
+
 /*
  * This function should be called in conjunction with the isIpv4Address function
  */
@@ -47,6 +74,16 @@ void convertEncodedIpv4ToArray(uint8_t ipv4[], uint32_t encodedIpv4)
         ipv4[i] = (encodedIpv4 >> (24 - (i << 3))) & 0xFF;
 }
 
+// The inverse of convertEncodedIpv4ToArray, for storing an address in the EEPROM
+uint32_t convertArrayToEncodedIpv4(uint8_t ipv4[])
+{
+    uint32_t encodedIpv4 = 0;
+    uint8_t i = 0;
+    for(i = 0; i < 4; i++)
+        encodedIpv4 |= (uint32_t)ipv4[i] << (24 - (i << 3));
+    return encodedIpv4;
+}
+
 void printIpv4(uint8_t ipv4[])
 {
     uint8_t i = 0;
@@ -69,6 +106,39 @@ void printMac(uint8_t mac[])
     }
 }
 
+// Writes n in decimal to str with a null terminator
+// Returns the number of characters written, not counting the terminator
+uint8_t formatUint32(char* str, uint32_t n)
+{
+    // Largest power of 10 that fits in 32 bits
+    uint32_t divider = 1000000000;
+    uint8_t length = 0;
+    while(divider > 1 && n / divider == 0)
+        divider /= 10;
+
+    while(divider)
+    {
+        str[length++] = ((n / divider) % 10) + '0';
+        divider /= 10;
+    }
+    str[length] = '\0';
+    return length;
+}
+
+// Same as formatUint32 for an address in www.xxx.yyy.zzz form
+uint8_t formatIpv4(char* str, uint8_t ipv4[])
+{
+    uint8_t i = 0, length = 0;
+    for(i = 0; i < 4; i++)
+    {
+        length += formatUint32(str + length, ipv4[i]);
+        if(i != 3)
+            str[length++] = '.';
+    }
+    str[length] = '\0';
+    return length;
+}
+
 void copyUint8Array(uint8_t src[], uint8_t dest[], uint8_t size)
 {
     uint8_t i = 0;
@@ -121,7 +191,7 @@ void copySubscribeArguments(USER_DATA* data, char* buffer, uint32_t* totalLength
     uint8_t i = 0;
     for(i = 1; i < data->fieldCount; i++)
     {
-        copyUint8Array(getFieldString(data, i), buffer, strLen(getFieldString(data, i)));
+        copyUint8Array((uint8_t*)getFieldString(data, i), (uint8_t*)buffer, strLen(getFieldString(data, i)));
         buffer[strLen(getFieldString(data, i))] = '\0';
         buffer += strLen(getFieldString(data, i)) + 1;
         *totalLength += strLen(getFieldString(data, i));
@@ -14,9 +14,13 @@
 
 bool isIpv4Address(USER_DATA* data, uint8_t currentOffsetFromCommand);
 uint32_t getIpv4Address(USER_DATA* data, uint8_t currentOffsetFromCommand);
+bool getHostname(const char line[], USER_DATA* data, uint8_t fieldNumber, char hostname[], uint8_t size);
 void convertEncodedIpv4ToArray(uint8_t ipv4[], uint32_t encodedIpv4);
+uint32_t convertArrayToEncodedIpv4(uint8_t ipv4[]);
 void printIpv4(uint8_t ipv4[]);
 void printMac(uint8_t mac[]);
+uint8_t formatUint32(char* str, uint32_t n);
+uint8_t formatIpv4(char* str, uint8_t ipv4[]);
 void copyUint8Array(uint8_t src[], uint8_t dest[], uint8_t size);
 void encodeUtf8(void* packet, uint16_t length, char* string);
 uint16_t strLen(const char* str);
@@ -0,0 +1,318 @@
+/*
+ * dhcpTest.c
+ * Runs the DHCP client against a stand-in server that answers from a pool of one address
+ * Covers the full exchange, renewing, rebinding, the lease running out, INIT-REBOOT from the
+ * lease in the EEPROM and a NAK after the board moved to another network
+ *
+ *  Created on: Apr 20, 2021
+ *      Author: Sarker Nadir Afridi Azmi
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "test.h"
+#include "eth0.h"
+#include "dhcp.h"
+#include "udp.h"
+#include "utils.h"
+
+// Seconds, T1 and T2 are left to their defaults of half and 7/8 of it
+#define LEASE_TIME      100
+// In milliseconds, the client keeps them in whole seconds
+#define T1              (LEASE_TIME / 2 * 1000)
+#define T2              (LEASE_TIME * 7 / 8 * 1000)
+
+// What the stand-in server hands out and what it saw last
+typedef struct _dhcpServer
+{
+    bool answers;
+    uint8_t ip[4];
+    uint8_t pool[4];
+    uint8_t received[DHCPRELEASE + 1];
+    uint8_t lastType;
+    uint8_t lastDestIp[4];
+    uint8_t lastCiaddr[4];
+    uint16_t lastLength;
+    bool lastHasRequestedIp;
+    uint8_t lastRequestedIp[4];
+    bool lastHasServerId;
+    uint32_t lastTime;
+} dhcpServer;
+
+dhcpServer server = {true, {192, 168, 1, 1}, {192, 168, 1, 50}};
+uint8_t buffer[TEST_FRAME_SIZE];
+
+uint8_t* findOption(dhcpFrame* dhcp, uint16_t length, uint8_t code)
+{
+    uint8_t* option = dhcp->options;
+    uint8_t* end = (uint8_t*)dhcp + length;
+    while(option < end && *option != DHCP_OPTION_END)
+    {
+        if(*option == DHCP_OPTION_PAD)
+        {
+            option++;
+            continue;
+        }
+        if(*option == code)
+            return option + 2;
+        option += 2 + option[1];
+    }
+    return 0;
+}
+
+uint8_t* putIpOption(uint8_t* option, uint8_t code, uint8_t ip[])
+{
+    *(option++) = code;
+    *(option++) = 4;
+    memcpy(option, ip, 4);
+    return option + 4;
+}
+
+// Answers a request the way a server that owns the pool address would
+void serverReply(dhcpFrame* request, uint8_t type)
+{
+    static uint8_t reply[sizeof(dhcpFrame) + 64];
+    dhcpFrame* dhcp = (dhcpFrame*)reply;
+    uint8_t* option = dhcp->options;
+    uint8_t mask[4] = {255, 255, 255, 0};
+    uint8_t dns[4] = {192, 168, 1, 2};
+    memset(reply, 0, sizeof(reply));
+    dhcp->op = 2;
+    dhcp->htype = 1;
+    dhcp->hlen = 6;
+    dhcp->xid = request->xid;
+    memcpy(dhcp->chaddr, request->chaddr, 16);
+    dhcp->magicCookie = htonl(DHCP_MAGIC_COOKIE);
+    *(option++) = DHCP_OPTION_MESSAGE_TYPE;
+    *(option++) = 1;
+    *(option++) = type;
+    option = putIpOption(option, DHCP_OPTION_SERVER_ID, server.ip);
+    if(type != DHCPNAK)
+    {
+        memcpy(dhcp->yiaddr, server.pool, 4);
+        *(option++) = DHCP_OPTION_LEASE_TIME;
+        *(option++) = 4;
+        *(option++) = 0;
+        *(option++) = 0;
+        *(option++) = LEASE_TIME >> 8;
+        *(option++) = LEASE_TIME & 0xFF;
+        option = putIpOption(option, DHCP_OPTION_SUBNET_MASK, mask);
+        option = putIpOption(option, DHCP_OPTION_ROUTER, server.ip);
+        option = putIpOption(option, DHCP_OPTION_DNS_SERVER, dns);
+    }
+    *(option++) = DHCP_OPTION_END;
+    testDeliverUdp(server.ip, DHCP_SERVER_PORT, DHCP_CLIENT_PORT, reply, option - reply);
+}
+
+// Takes what the client sent and answers it
+void serve()
+{
+    testFrame* frame = 0;
+    ipHeader* ip = 0;
+    udpHeader* udp = 0;
+    dhcpFrame* dhcp = 0;
+    uint8_t* option = 0;
+    uint16_t length = 0;
+    while((frame = testGetFrame()) != 0)
+    {
+        ip = (ipHeader*)((etherHeader*)frame->data)->data;
+        udp = (udpHeader*)ip->data;
+        dhcp = (dhcpFrame*)udp->data;
+        length = ntohs(udp->length) - sizeof(udpHeader);
+        CHECK(ntohs(udp->sourcePort) == DHCP_CLIENT_PORT && ntohs(udp->destPort) == DHCP_SERVER_PORT);
+        CHECK(dhcp->op == 1 && dhcp->magicCookie == htonl(DHCP_MAGIC_COOKIE));
+        option = findOption(dhcp, length, DHCP_OPTION_MESSAGE_TYPE);
+        CHECK(option != 0);
+        if(option == 0)
+            continue;
+        server.lastType = option[0];
+        server.received[server.lastType]++;
+        memcpy(server.lastDestIp, ip->destIp, 4);
+        memcpy(server.lastCiaddr, dhcp->ciaddr, 4);
+        server.lastLength = length;
+        option = findOption(dhcp, length, DHCP_OPTION_REQUESTED_IP);
+        server.lastHasRequestedIp = option != 0;
+        if(option != 0)
+            memcpy(server.lastRequestedIp, option, 4);
+        server.lastHasServerId = findOption(dhcp, length, DHCP_OPTION_SERVER_ID) != 0;
+        server.lastTime = testTime;
+        if(!server.answers)
+            continue;
+        if(server.lastType == DHCPDISCOVER)
+            serverReply(dhcp, DHCPOFFER);
+        // Only the pool address is ours to give
+        else if(server.lastType == DHCPREQUEST)
+            serverReply(dhcp, (!server.lastHasRequestedIp || memcmp(server.lastRequestedIp, server.pool, 4) == 0) ? DHCPACK : DHCPNAK);
+    }
+}
+
+// Runs the client and the server for the given number of milliseconds
+void runFor(uint32_t time)
+{
+    uint32_t end = testTime + time;
+    while(testTime != end)
+    {
+        dhcpTick((etherHeader*)buffer);
+        serve();
+        testTime++;
+    }
+}
+
+bool isIp(uint8_t ip[], uint8_t ip0, uint8_t ip1, uint8_t ip2, uint8_t ip3)
+{
+    return ip[0] == ip0 && ip[1] == ip1 && ip[2] == ip2 && ip[3] == ip3;
+}
+
+bool hasAddress(uint8_t ip[])
+{
+    uint8_t ourIp[4];
+    etherGetIpAddress(ourIp);
+    return memcmp(ourIp, ip, 4) == 0;
+}
+
+void clearReceived()
+{
+    memset(server.received, 0, sizeof(server.received));
+}
+
+// DISCOVER, OFFER, REQUEST, ACK on a board that has never had a lease
+void testFirstLease()
+{
+    uint8_t dns[4];
+    testEraseEeprom();
+    dhcpStart();
+    CHECK(dhcpGetState() == DHCP_INIT);
+    runFor(1);
+    CHECK(server.received[DHCPDISCOVER] == 1 && server.received[DHCPREQUEST] == 1);
+    // Broadcast and padded to the size of a BOOTP message
+    CHECK(isIp(server.lastDestIp, 255, 255, 255, 255));
+    CHECK(server.lastLength >= 300);
+    // The REQUEST answering the offer names the address and the server
+    CHECK(server.lastHasRequestedIp && isIp(server.lastRequestedIp, 192, 168, 1, 50) && server.lastHasServerId);
+    CHECK(dhcpGetState() == DHCP_BOUND && hasAddress(server.pool));
+    dhcpGetDnsServer(dns);
+    CHECK(isIp(dns, 192, 168, 1, 2));
+    CHECK(readEeprom(DHCP_EEPROM_LEASE) == convertArrayToEncodedIpv4(server.pool));
+    CHECK(readEeprom(DHCP_EEPROM_LEASE + 4) == convertArrayToEncodedIpv4(server.ip));
+}
+
+// At T1 the server that gave the lease is asked, with our address and nothing else
+void testRenew()
+{
+    clearReceived();
+    runFor(T1 - 2);
+    CHECK(server.received[DHCPREQUEST] == 0);
+    runFor(2);
+    CHECK(server.received[DHCPREQUEST] == 1);
+    CHECK(isIp(server.lastDestIp, 192, 168, 1, 1));
+    CHECK(isIp(server.lastCiaddr, 192, 168, 1, 50) && !server.lastHasRequestedIp && !server.lastHasServerId);
+    // The lease starts over from the ACK
+    CHECK(dhcpGetState() == DHCP_BOUND);
+}
+
+// The server is gone at T1, at T2 any server is asked and one that answers keeps the address
+void testRebind()
+{
+    uint32_t start = testTime;
+    server.answers = false;
+    clearReceived();
+    runFor(T1);
+    CHECK(dhcpGetState() == DHCP_RENEWING && server.received[DHCPREQUEST] == 1);
+    // Renew requests are at least a minute apart, T2 comes first
+    runFor(T2 - (testTime - start) - 1);
+    CHECK(dhcpGetState() == DHCP_RENEWING && server.received[DHCPREQUEST] == 1);
+    CHECK(hasAddress(server.pool));
+    server.answers = true;
+    runFor(1);
+    CHECK(server.received[DHCPREQUEST] == 2);
+    CHECK(isIp(server.lastDestIp, 255, 255, 255, 255) && isIp(server.lastCiaddr, 192, 168, 1, 50));
+    CHECK(dhcpGetState() == DHCP_BOUND && hasAddress(server.pool));
+}
+
+// Nobody answers until the lease is over, then the address is dropped and a DISCOVER goes out
+void testExpiry()
+{
+    uint8_t zero[4] = {0, 0, 0, 0};
+    server.answers = false;
+    clearReceived();
+    runFor(LEASE_TIME * 1000);
+    CHECK(hasAddress(zero) && server.received[DHCPDISCOVER] == 0);
+    runFor(1);
+    CHECK(server.received[DHCPDISCOVER] == 1);
+    // Retransmissions back off from 4 s with a second of jitter either way
+    clearReceived();
+    runFor(2999);
+    CHECK(server.received[DHCPDISCOVER] == 0);
+    runFor(2002);
+    CHECK(server.received[DHCPDISCOVER] == 1);
+    server.answers = true;
+    runFor(10000);
+    CHECK(dhcpGetState() == DHCP_BOUND && hasAddress(server.pool));
+}
+
+// After a reset the stored lease is asked for with one REQUEST and bound on the first answer
+void testInitReboot()
+{
+    uint8_t zero[4] = {0, 0, 0, 0};
+    dhcpStop();
+    etherSetIpAddress(0, 0, 0, 0);
+    clearReceived();
+    dhcpStart();
+    CHECK(dhcpGetState() == DHCP_INIT_REBOOT && hasAddress(zero));
+    runFor(1);
+    CHECK(server.received[DHCPDISCOVER] == 0 && server.received[DHCPREQUEST] == 1);
+    CHECK(isIp(server.lastDestIp, 255, 255, 255, 255) && !server.lastHasServerId);
+    CHECK(server.lastHasRequestedIp && isIp(server.lastRequestedIp, 192, 168, 1, 50));
+    CHECK(dhcpGetState() == DHCP_BOUND && hasAddress(server.pool));
+}
+
+// The board was moved, the stored address is refused and a full exchange gets a new one
+void testNak()
+{
+    uint8_t newPool[4] = {10, 0, 0, 20};
+    uint8_t newServer[4] = {10, 0, 0, 1};
+    dhcpStop();
+    memcpy(server.pool, newPool, 4);
+    memcpy(server.ip, newServer, 4);
+    clearReceived();
+    dhcpStart();
+    runFor(2);
+    CHECK(server.received[DHCPREQUEST] == 2 && server.received[DHCPDISCOVER] == 1);
+    CHECK(dhcpGetState() == DHCP_BOUND && hasAddress(newPool));
+    CHECK(readEeprom(DHCP_EEPROM_LEASE) == convertArrayToEncodedIpv4(newPool));
+}
+
+// Replies to another exchange or another board are not taken
+void testForeignReply()
+{
+    uint8_t request[sizeof(dhcpFrame)];
+    dhcpFrame* dhcp = (dhcpFrame*)request;
+    uint8_t mac[6];
+    dhcpStop();
+    testEraseEeprom();
+    server.answers = false;
+    dhcpStart();
+    runFor(1);
+    CHECK(dhcpGetState() == DHCP_SELECTING);
+    memset(request, 0, sizeof(request));
+    etherGetMacAddress(mac);
+    memcpy(dhcp->chaddr, mac, 6);
+    dhcp->xid = htonl(0x12345678);
+    serverReply(dhcp, DHCPOFFER);
+    CHECK(dhcpGetState() == DHCP_SELECTING);
+    server.answers = true;
+    dhcpStop();
+}
+
+int main()
+{
+    testFirstLease();
+    testRenew();
+    testRebind();
+    testExpiry();
+    testInitReboot();
+    testNak();
+    testForeignReply();
+    return testReport("dhcpTest");
+}
@@ -0,0 +1,328 @@
+/*
+ * dnsTest.c
+ * Runs the resolver against a stand-in DNS server with a small zone
+ * Checks the query on the wire, the cache and its TTL, CNAMEs, NXDOMAIN, a server that never
+ * answers and answers that do not belong to the query
+ *
+ *  Created on: Apr 20, 2021
+ *      Author: Sarker Nadir Afridi Azmi
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include "test.h"
+#include "eth0.h"
+#include "dns.h"
+#include "udp.h"
+
+#define DNS_TYPE_CNAME      5
+#define DNS_RCODE_NXDOMAIN  3
+// The resolver is given this long before a lookup counts as stuck
+#define LOOKUP_TIME_LIMIT   20000
+
+// A name the stand-in server knows, with either an address or the name it is an alias of
+typedef struct _zoneRecord
+{
+    const char* name;
+    const char* alias;
+    uint8_t ip[4];
+    uint32_t ttl;
+} zoneRecord;
+
+zoneRecord zone[] =
+{
+    {"broker.example.com", 0, {10, 0, 0, 5}, 60},
+    {"mqtt.example.com", "broker.example.com", {0, 0, 0, 0}, 300},
+    {"volatile.example.com", 0, {10, 0, 0, 6}, 0},
+    {"a.example.com", 0, {10, 0, 1, 1}, 600},
+    {"b.example.com", 0, {10, 0, 1, 2}, 600},
+    {"c.example.com", 0, {10, 0, 1, 3}, 600},
+    {"d.example.com", 0, {10, 0, 1, 4}, 600},
+};
+
+// What the stand-in server does and what it saw
+typedef struct _dnsServer
+{
+    uint8_t ip[4];
+    bool answers;
+    // Sent before the real answer, to check the resolver ignores them
+    bool sendWrongId;
+    bool sendFromElsewhere;
+    uint32_t queries;
+    uint8_t lastQuery[512];
+    uint16_t lastQueryLength;
+    uint16_t lastSourcePort;
+    uint8_t lastDestIp[4];
+} dnsServer;
+
+dnsServer server = {{192, 168, 1, 2}, true};
+uint8_t buffer[TEST_FRAME_SIZE];
+
+uint16_t putUint16(uint8_t* data, uint16_t value)
+{
+    data[0] = value >> 8;
+    data[1] = value & 0xFF;
+    return 2;
+}
+
+// Reads the labels at data into name with dots between them
+// Returns the encoded length, or 0 if the name is not well formed
+uint16_t decodeName(uint8_t data[], uint16_t length, char name[])
+{
+    uint16_t offset = 0, out = 0;
+    while(offset < length && data[offset] != 0)
+    {
+        if(data[offset] > 63 || offset + 1 + data[offset] > length)
+            return 0;
+        if(out > 0)
+            name[out++] = '.';
+        memcpy(name + out, data + offset + 1, data[offset]);
+        out += data[offset];
+        offset += 1 + data[offset];
+    }
+    name[out] = '\0';
+    return (offset < length) ? offset + 1 : 0;
+}
+
+uint16_t encodeName(const char* name, uint8_t out[])
+{
+    uint16_t length = 0, labelStart = 0, i = 0;
+    for(i = 0; ; i++)
+    {
+        if(name[i] == '.' || name[i] == '\0')
+        {
+            out[length++] = i - labelStart;
+            memcpy(out + length, name + labelStart, i - labelStart);
+            length += i - labelStart;
+            labelStart = i + 1;
+            if(name[i] == '\0')
+                break;
+        }
+    }
+    out[length++] = 0;
+    return length;
+}
+
+zoneRecord* findRecord(const char* name)
+{
+    uint8_t i = 0;
+    for(i = 0; i < sizeof(zone) / sizeof(zone[0]); i++)
+        if(strcasecmp(zone[i].name, name) == 0)
+            return &zone[i];
+    return 0;
+}
+
+// Adds a resource record whose name is the compression pointer at nameOffset
+uint16_t putRecord(uint8_t* data, uint16_t nameOffset, uint16_t type, uint32_t ttl, uint8_t rdata[], uint16_t rdataLength)
+{
+    uint16_t length = 0;
+    length += putUint16(data + length, 0xC000 | nameOffset);
+    length += putUint16(data + length, type);
+    length += putUint16(data + length, DNS_CLASS_IN);
+    length += putUint16(data + length, ttl >> 16);
+    length += putUint16(data + length, ttl & 0xFFFF);
+    length += putUint16(data + length, rdataLength);
+    memcpy(data + length, rdata, rdataLength);
+    return length + rdataLength;
+}
+
+// Answers a query from the zone, an alias gets its CNAME and the A record of the name it points to
+void answer(uint8_t query[], uint16_t queryLength, uint16_t port)
+{
+    uint8_t reply[512];
+    uint8_t target[DNS_MAX_NAME_LENGTH + 1];
+    uint8_t otherIp[4] = {192, 168, 1, 99};
+    uint8_t realIp[4];
+    char name[DNS_MAX_NAME_LENGTH];
+    zoneRecord* record = 0;
+    uint16_t length = 0, questionLength = 0, nameOffset = DNS_HEADER_SIZE, answers = 0, targetLength = 0;
+    questionLength = decodeName(query + DNS_HEADER_SIZE, queryLength - DNS_HEADER_SIZE, name) + 4;
+    record = findRecord(name);
+    memcpy(reply, query, DNS_HEADER_SIZE + questionLength);
+    length = DNS_HEADER_SIZE + questionLength;
+    if(record != 0 && record->alias != 0)
+    {
+        targetLength = encodeName(record->alias, target);
+        length += putRecord(reply + length, nameOffset, DNS_TYPE_CNAME, record->ttl, target, targetLength);
+        // The CNAME's data is the name of the next record
+        nameOffset = length - targetLength;
+        answers++;
+        record = findRecord(record->alias);
+    }
+    if(record != 0)
+    {
+        length += putRecord(reply + length, nameOffset, DNS_TYPE_A, record->ttl, record->ip, 4);
+        answers++;
+    }
+    putUint16(reply + 2, DNS_FLAG_QR | DNS_FLAG_RD | 0x0080 | ((record == 0) ? DNS_RCODE_NXDOMAIN : 0));
+    putUint16(reply + 6, answers);
+    // The fakes point the name somewhere else, the A record is last
+    memcpy(realIp, reply + length - 4, 4);
+    memset(reply + length - 4, 6, 4);
+    if(server.sendFromElsewhere)
+        testDeliverUdp(otherIp, DNS_SERVER_PORT, port, reply, length);
+    if(server.sendWrongId)
+    {
+        reply[0] ^= 0xFF;
+        testDeliverUdp(server.ip, DNS_SERVER_PORT, port, reply, length);
+        reply[0] ^= 0xFF;
+    }
+    memcpy(reply + length - 4, realIp, 4);
+    testDeliverUdp(server.ip, DNS_SERVER_PORT, port, reply, length);
+}
+
+void serve()
+{
+    testFrame* frame = 0;
+    ipHeader* ip = 0;
+    udpHeader* udp = 0;
+    while((frame = testGetFrame()) != 0)
+    {
+        ip = (ipHeader*)((etherHeader*)frame->data)->data;
+        udp = (udpHeader*)ip->data;
+        CHECK(ntohs(udp->destPort) == DNS_SERVER_PORT);
+        server.queries++;
+        server.lastQueryLength = ntohs(udp->length) - sizeof(udpHeader);
+        memcpy(server.lastQuery, udp->data, server.lastQueryLength);
+        server.lastSourcePort = ntohs(udp->sourcePort);
+        memcpy(server.lastDestIp, ip->destIp, 4);
+        if(server.answers)
+            answer(udp->data, server.lastQueryLength, server.lastSourcePort);
+    }
+}
+
+// Calls dnsResolve like the client's main loop until the lookup is over
+dnsResult lookup(char name[], uint8_t ip[4])
+{
+    dnsResult result = DNS_PENDING;
+    uint32_t start = testTime;
+    while((result = dnsResolve(name, ip)) == DNS_PENDING && testTime - start < LOOKUP_TIME_LIMIT)
+    {
+        dnsTick((etherHeader*)buffer);
+        serve();
+        testTime++;
+    }
+    return result;
+}
+
+bool isIp(uint8_t ip[], uint8_t ip0, uint8_t ip1, uint8_t ip2, uint8_t ip3)
+{
+    return ip[0] == ip0 && ip[1] == ip1 && ip[2] == ip2 && ip[3] == ip3;
+}
+
+// One question for an A record with recursion asked for, from a random high port
+void testQuery()
+{
+    uint8_t expected[] = {6, 'b', 'r', 'o', 'k', 'e', 'r', 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'c', 'o', 'm', 0,
+                          0, DNS_TYPE_A, 0, DNS_CLASS_IN};
+    uint8_t ip[4];
+    dnsSetServer(server.ip);
+    server.queries = 0;
+    CHECK(lookup("broker.example.com", ip) == DNS_RESOLVED && isIp(ip, 10, 0, 0, 5));
+    CHECK(server.queries == 1);
+    CHECK(isIp(server.lastDestIp, 192, 168, 1, 2) && server.lastSourcePort >= 49152);
+    CHECK(server.lastQueryLength == DNS_HEADER_SIZE + sizeof(expected));
+    CHECK(server.lastQuery[2] == (DNS_FLAG_RD >> 8) && server.lastQuery[5] == 1);
+    CHECK(memcmp(server.lastQuery + DNS_HEADER_SIZE, expected, sizeof(expected)) == 0);
+}
+
+// A name in the cache costs no query until its TTL is over, and case does not matter
+void testCache()
+{
+    uint8_t ip[4];
+    server.queries = 0;
+    CHECK(dnsResolve("broker.example.com", ip) == DNS_RESOLVED && isIp(ip, 10, 0, 0, 5));
+    CHECK(dnsResolve("BROKER.Example.com", ip) == DNS_RESOLVED);
+    testTime += 59000;
+    CHECK(dnsResolve("broker.example.com", ip) == DNS_RESOLVED);
+    CHECK(server.queries == 0);
+    testTime += 1000;
+    CHECK(lookup("broker.example.com", ip) == DNS_RESOLVED && server.queries == 1);
+    // A TTL of zero is used once and never cached
+    server.queries = 0;
+    CHECK(lookup("volatile.example.com", ip) == DNS_RESOLVED && isIp(ip, 10, 0, 0, 6));
+    CHECK(lookup("volatile.example.com", ip) == DNS_RESOLVED && server.queries == 2);
+}
+
+// With a full cache the name used longest ago is replaced
+void testEviction()
+{
+    uint8_t ip[4];
+    dnsFlush();
+    CHECK(lookup("a.example.com", ip) == DNS_RESOLVED);
+    testTime++;
+    CHECK(lookup("b.example.com", ip) == DNS_RESOLVED);
+    testTime++;
+    CHECK(lookup("c.example.com", ip) == DNS_RESOLVED);
+    testTime++;
+    CHECK(lookup("d.example.com", ip) == DNS_RESOLVED);
+    testTime++;
+    // Using a keeps it, so b is the one to go
+    CHECK(dnsResolve("a.example.com", ip) == DNS_RESOLVED);
+    testTime++;
+    CHECK(lookup("broker.example.com", ip) == DNS_RESOLVED);
+    server.queries = 0;
+    CHECK(dnsResolve("a.example.com", ip) == DNS_RESOLVED && dnsResolve("c.example.com", ip) == DNS_RESOLVED);
+    CHECK(lookup("b.example.com", ip) == DNS_RESOLVED && isIp(ip, 10, 0, 1, 2) && server.queries == 1);
+}
+
+void testCname()
+{
+    uint8_t ip[4];
+    dnsFlush();
+    CHECK(lookup("mqtt.example.com", ip) == DNS_RESOLVED && isIp(ip, 10, 0, 0, 5));
+}
+
+void testLookupFailures()
+{
+    uint8_t ip[4];
+    uint8_t noServer[4] = {0, 0, 0, 0};
+    uint32_t start = 0;
+    char longName[DNS_MAX_NAME_LENGTH + 1];
+    CHECK(lookup("missing.example.com", ip) == DNS_FAILED);
+    CHECK(lookup("bad..name", ip) == DNS_FAILED);
+    memset(longName, 'a', DNS_MAX_NAME_LENGTH);
+    longName[DNS_MAX_NAME_LENGTH] = '\0';
+    CHECK(lookup(longName, ip) == DNS_FAILED);
+
+    // The query is sent DNS_RETRIES times before giving up
+    server.answers = false;
+    server.queries = 0;
+    start = testTime;
+    CHECK(lookup("c.example.org", ip) == DNS_FAILED);
+    CHECK(server.queries == DNS_RETRIES);
+    CHECK(testTime - start >= DNS_RETRIES * DNS_RETRY_TIME && testTime - start <= DNS_RETRIES * DNS_RETRY_TIME + 2);
+    server.answers = true;
+
+    // Without a server of its own or from DHCP there is nobody to ask
+    dnsSetServer(noServer);
+    server.queries = 0;
+    CHECK(lookup("d.example.org", ip) == DNS_FAILED && server.queries == 0);
+    dnsSetServer(server.ip);
+}
+
+// Answers with another ID or from another address are dropped, the real one still gets through
+void testSpoofing()
+{
+    uint8_t ip[4];
+    dnsFlush();
+    server.sendWrongId = true;
+    server.sendFromElsewhere = true;
+    server.queries = 0;
+    CHECK(lookup("broker.example.com", ip) == DNS_RESOLVED && isIp(ip, 10, 0, 0, 5) && server.queries == 1);
+    server.sendWrongId = false;
+    server.sendFromElsewhere = false;
+}
+
+int main()
+{
+    testQuery();
+    testCache();
+    testEviction();
+    testCname();
+    testLookupFailures();
+    testSpoofing();
+    return testReport("dnsTest");
+}
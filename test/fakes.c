@@ -0,0 +1,283 @@
+/*
+ * fakes.c
+ * Stands in for the UART, timer, EEPROM and ENC28J60 so the protocol code runs on the host
+ * Frames the stack sends are kept in order for the test to look at, nothing goes on a wire
+ *
+ *  Created on: Apr 20, 2021
+ *      Author: Sarker Nadir Afridi Azmi
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "test.h"
+#include "eth0.h"
+#include "eeprom.h"
+#include "uart0.h"
+#include "timer0.h"
+#include "igmp.h"
+#include "udp.h"
+
+uint32_t testTime = 0;
+bool (*testDropFrame)(etherHeader* ether) = 0;
+uint32_t testFailures = 0;
+uint32_t testChecks = 0;
+
+testFrame frames[TEST_MAX_FRAMES];
+uint8_t frameHead = 0;
+uint8_t frameCount = 0;
+
+uint32_t eepromWords[TEST_EEPROM_WORDS];
+bool eepromErased = false;
+
+uint8_t ipAddress[4] = {192, 168, 2, 101};
+uint8_t macAddress[6] = {2, 3, 4, 5, 6, 101};
+bool dhcpMode = false;
+
+void testCheck(bool passed, const char* condition, const char* file, int line)
+{
+    testChecks++;
+    if(passed)
+        return;
+    testFailures++;
+    printf("%s:%d: CHECK(%s) failed\n", file, line, condition);
+}
+
+// Returns the exit code of the test
+int testReport(const char* name)
+{
+    printf("%s: %u checks, %u failed\n", name, testChecks, testFailures);
+    return testFailures == 0 ? 0 : 1;
+}
+
+//-----------------------------------------------------------------------------
+// UART, timer and EEPROM
+//-----------------------------------------------------------------------------
+
+void putcUart0(char c)
+{
+    putchar(c);
+}
+
+void putsUart0(char* str)
+{
+    fputs(str, stdout);
+}
+
+char getcUart0(void)
+{
+    return '\r';
+}
+
+uint32_t getMilliseconds()
+{
+    return testTime;
+}
+
+uint32_t getMicroseconds()
+{
+    return testTime * 1000;
+}
+
+// An erased EEPROM reads all ones, like a new part
+void testEraseEeprom()
+{
+    memset(eepromWords, 0xFF, sizeof(eepromWords));
+    eepromErased = true;
+}
+
+void writeEeprom(uint16_t add, uint32_t data)
+{
+    if(!eepromErased)
+        testEraseEeprom();
+    if(add < TEST_EEPROM_WORDS)
+        eepromWords[add] = data;
+}
+
+uint32_t readEeprom(uint16_t add)
+{
+    if(!eepromErased)
+        testEraseEeprom();
+    return (add < TEST_EEPROM_WORDS) ? eepromWords[add] : 0xFFFFFFFF;
+}
+
+//-----------------------------------------------------------------------------
+// Ethernet
+//-----------------------------------------------------------------------------
+
+uint16_t htons(uint16_t value)
+{
+    return ((value & 0xFF00) >> 8) + ((value & 0x00FF) << 8);
+}
+
+uint32_t htonl(uint32_t value)
+{
+    return ((uint32_t)htons(value & 0xFFFF) << 16) | htons(value >> 16);
+}
+
+void etherSumWords(void* data, uint16_t sizeInBytes, uint32_t* sum)
+{
+    uint8_t* pData = (uint8_t*)data;
+    uint16_t i = 0;
+    for(i = 0; i < sizeInBytes; i++)
+    {
+        if(i & 1)
+            *sum += (uint32_t)pData[i] << 8;
+        else
+            *sum += pData[i];
+    }
+}
+
+uint16_t getEtherChecksum(uint32_t sum)
+{
+    while((sum >> 16) > 0)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    return ~(sum & 0xFFFF);
+}
+
+void etherCalcIpChecksum(ipHeader* ip)
+{
+    uint32_t sum = 0;
+    ip->headerChecksum = 0;
+    etherSumWords(ip, (ip->revSize & 0xF) * 4, &sum);
+    ip->headerChecksum = getEtherChecksum(sum);
+}
+
+void etherSetIpAddress(uint8_t ip0, uint8_t ip1, uint8_t ip2, uint8_t ip3)
+{
+    ipAddress[0] = ip0;
+    ipAddress[1] = ip1;
+    ipAddress[2] = ip2;
+    ipAddress[3] = ip3;
+}
+
+void etherGetIpAddress(uint8_t ip[4])
+{
+    memcpy(ip, ipAddress, 4);
+}
+
+void etherSetIpGatewayAddress(uint8_t ip0, uint8_t ip1, uint8_t ip2, uint8_t ip3)
+{
+    (void)ip0; (void)ip1; (void)ip2; (void)ip3;
+}
+
+void etherSetIpSubnetMask(uint8_t mask0, uint8_t mask1, uint8_t mask2, uint8_t mask3)
+{
+    (void)mask0; (void)mask1; (void)mask2; (void)mask3;
+}
+
+void etherEnableDhcpMode()
+{
+    dhcpMode = true;
+}
+
+void etherDisableDhcpMode()
+{
+    dhcpMode = false;
+}
+
+void etherGetMacAddress(uint8_t mac[6])
+{
+    memcpy(mac, macAddress, 6);
+}
+
+bool etherIsMulticastIp(uint8_t ip[])
+{
+    return (ip[0] & 0xF0) == 0xE0;
+}
+
+bool igmpIsMember(uint8_t ip[4])
+{
+    (void)ip;
+    return false;
+}
+
+// Every frame goes to the end of the list, the oldest is lost if the test did not take it
+bool etherPutPacket(etherHeader* ether, uint16_t size)
+{
+    testFrame* frame = 0;
+    if(testDropFrame != 0 && testDropFrame(ether))
+        return true;
+    if(frameCount == TEST_MAX_FRAMES)
+    {
+        frameHead = (frameHead + 1) % TEST_MAX_FRAMES;
+        frameCount--;
+    }
+    frame = &frames[(frameHead + frameCount) % TEST_MAX_FRAMES];
+    frame->size = (size > TEST_FRAME_SIZE) ? TEST_FRAME_SIZE : size;
+    memcpy(frame->data, ether, frame->size);
+    frameCount++;
+    return true;
+}
+
+// The next hop is always known, ARP is not part of these tests
+bool etherPutIpPacket(etherHeader* ether, uint16_t size)
+{
+    return etherPutPacket(ether, size);
+}
+
+bool etherPutUdpPacket(etherHeader* ether, uint8_t destIp[], uint16_t sourcePort, uint16_t destPort, uint16_t dataSize)
+{
+    ipHeader* ip = (ipHeader*)ether->data;
+    udpHeader* udp = (udpHeader*)ip->data;
+    ether->frameType = htons(0x0800);
+    ip->revSize = 0x45;
+    ip->length = htons(sizeof(ipHeader) + sizeof(udpHeader) + dataSize);
+    ip->protocol = 0x11;
+    memcpy(ip->sourceIp, ipAddress, 4);
+    memcpy(ip->destIp, destIp, 4);
+    etherCalcIpChecksum(ip);
+    udp->sourcePort = htons(sourcePort);
+    udp->destPort = htons(destPort);
+    udp->length = htons(sizeof(udpHeader) + dataSize);
+    udp->check = 0;
+    return etherPutPacket(ether, sizeof(etherHeader) + sizeof(ipHeader) + sizeof(udpHeader) + dataSize);
+}
+
+uint8_t testGetFrameCount()
+{
+    return frameCount;
+}
+
+// Takes the oldest frame, it stays valid until TEST_MAX_FRAMES more are sent
+// Returns 0 if there is none
+testFrame* testGetFrame()
+{
+    testFrame* frame = 0;
+    if(frameCount == 0)
+        return 0;
+    frame = &frames[frameHead];
+    frameHead = (frameHead + 1) % TEST_MAX_FRAMES;
+    frameCount--;
+    return frame;
+}
+
+void testClearFrames()
+{
+    frameHead = 0;
+    frameCount = 0;
+}
+
+// Hands a datagram to udp.c as if it came in to our address
+void testDeliverUdp(uint8_t sourceIp[4], uint16_t sourcePort, uint16_t destPort, uint8_t data[], uint16_t length)
+{
+    static uint8_t buffer[TEST_FRAME_SIZE];
+    etherHeader* ether = (etherHeader*)buffer;
+    ipHeader* ip = (ipHeader*)ether->data;
+    udpHeader* udp = (udpHeader*)ip->data;
+    memset(buffer, 0, sizeof(etherHeader) + sizeof(ipHeader) + sizeof(udpHeader));
+    ether->frameType = htons(0x0800);
+    ip->revSize = 0x45;
+    ip->length = htons(sizeof(ipHeader) + sizeof(udpHeader) + length);
+    ip->ttl = 64;
+    ip->protocol = 0x11;
+    memcpy(ip->sourceIp, sourceIp, 4);
+    memcpy(ip->destIp, ipAddress, 4);
+    etherCalcIpChecksum(ip);
+    udp->sourcePort = htons(sourcePort);
+    udp->destPort = htons(destPort);
+    udp->length = htons(sizeof(udpHeader) + length);
+    memcpy(udp->data, data, length);
+    udpInput(ether);
+}
@@ -0,0 +1,290 @@
+/*
+ * mqttParserTest.c
+ * Feeds mqttParse the broker's stream cut into segments of every size, the way the client's
+ * receive loop does, then random bytes to make sure nothing is read outside the buffer
+ * Ends with how many MB/s of publishes the parser gets through on the host
+ *
+ *  Created on: Apr 20, 2021
+ *      Author: Sarker Nadir Afridi Azmi
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include "test.h"
+#include "mqtt.h"
+
+// Like TCP_RX_BUFFER_SIZE, a smaller one makes the skip path easy to reach
+#define RX_SIZE         512
+#define STREAM_SIZE     4096
+#define FUZZ_ROUNDS     20000
+#define BENCH_BYTES     (64UL * 1024 * 1024)
+
+uint32_t randomState = 153;
+
+uint32_t nextRandom()
+{
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+    return randomState;
+}
+
+// What the receive loop saw, in order
+typedef struct _parsed
+{
+    uint8_t controlHeader;
+    uint32_t length;
+    bool skippedAck;
+    uint16_t skippedIdentifier;
+} parsed;
+
+parsed results[64];
+uint8_t resultCount = 0;
+bool streamError = false;
+
+uint32_t putPublish(uint8_t* packet, uint8_t qos, const char* topic, uint16_t identifier, uint32_t payloadLength)
+{
+    uint16_t topicLength = strlen(topic);
+    uint32_t remainingLength = 2 + topicLength + ((qos != QOS0) ? 2 : 0) + payloadLength;
+    uint32_t length = 1;
+    packet[0] = PUBLISH | qos;
+    length += mqttPutVariableInteger(packet + 1, remainingLength);
+    packet[length++] = topicLength >> 8;
+    packet[length++] = topicLength & 0xFF;
+    memcpy(packet + length, topic, topicLength);
+    length += topicLength;
+    if(qos != QOS0)
+    {
+        packet[length++] = identifier >> 8;
+        packet[length++] = identifier & 0xFF;
+    }
+    memset(packet + length, 'p', payloadLength);
+    return length + payloadLength;
+}
+
+// The packets the broker sends, one of them larger than RX_SIZE
+uint32_t buildStream(uint8_t stream[])
+{
+    static const uint8_t connack[] = {0x20, 2, 0, 0};
+    static const uint8_t suback[] = {0x90, 3, 0, 7, 1};
+    static const uint8_t pingResponse[] = {0xD0, 0};
+    static const uint8_t pubrel[] = {0x62, 2, 0x12, 0x34};
+    uint32_t length = 0;
+    memcpy(stream + length, connack, sizeof(connack));
+    length += sizeof(connack);
+    memcpy(stream + length, suback, sizeof(suback));
+    length += sizeof(suback);
+    length += putPublish(stream + length, QOS0, "a/b", 0, 5);
+    length += putPublish(stream + length, QOS1, "sensors/temp", 0x0102, 200);
+    // Two bytes of remaining length
+    length += putPublish(stream + length, QOS2, "x", 0x0304, 300);
+    // Too large, it is thrown away but still acknowledged
+    length += putPublish(stream + length, QOS1, "big/one", 0xBEEF, 1500);
+    length += putPublish(stream + length, QOS0, "big/two", 0, 900);
+    memcpy(stream + length, pingResponse, sizeof(pingResponse));
+    length += sizeof(pingResponse);
+    length += putPublish(stream + length, QOS2, "last", 0x4321, 0);
+    memcpy(stream + length, pubrel, sizeof(pubrel));
+    length += sizeof(pubrel);
+    return length;
+}
+
+// Appends up to maxSegment bytes at a time and takes packets out like the client's receive loop
+void receiveStream(uint8_t stream[], uint32_t length, uint32_t maxSegment, bool randomSegments)
+{
+    uint8_t rx[RX_SIZE];
+    uint32_t rxCount = 0, fed = 0, segment = 0;
+    mqttParser parser;
+    mqttParseResult result = MQTT_PARSE_MORE;
+    mqttPublish publish;
+    uint8_t qos = 0;
+    uint16_t identifier = 0;
+    mqttParserInit(&parser, RX_SIZE);
+    resultCount = 0;
+    streamError = false;
+    while(fed < length || rxCount > 0)
+    {
+        segment = randomSegments ? 1 + nextRandom() % maxSegment : maxSegment;
+        if(segment > RX_SIZE - rxCount)
+            segment = RX_SIZE - rxCount;
+        if(segment > length - fed)
+            segment = length - fed;
+        memcpy(rx + rxCount, stream + fed, segment);
+        rxCount += segment;
+        fed += segment;
+        while(rxCount > 0)
+        {
+            result = mqttParse(&parser, rx, rxCount);
+            if(result == MQTT_PARSE_MORE)
+                break;
+            if(result == MQTT_PARSE_ERROR || parser.consumed > rxCount || resultCount == 64)
+            {
+                streamError = true;
+                return;
+            }
+            if(result == MQTT_PARSE_SKIPPED)
+            {
+                if(mqttGetSkippedPublish(&parser, &qos, &identifier))
+                {
+                    results[resultCount].controlHeader = PUBLISH | qos;
+                    results[resultCount].length = 0;
+                    results[resultCount].skippedAck = true;
+                    results[resultCount++].skippedIdentifier = identifier;
+                }
+            }
+            else
+            {
+                results[resultCount].controlHeader = parser.controlHeader;
+                results[resultCount].length = parser.consumed;
+                results[resultCount].skippedAck = false;
+                if((parser.controlHeader & 0xF0) == PUBLISH)
+                {
+                    CHECK(mqttGetPublish(&parser, rx, &publish));
+                    results[resultCount].length = publish.payload.length;
+                }
+                resultCount++;
+            }
+            memmove(rx, rx + parser.consumed, rxCount - parser.consumed);
+            rxCount -= parser.consumed;
+        }
+        // Nothing more can come in and nothing can be taken out
+        if(fed == length && result == MQTT_PARSE_MORE)
+            break;
+    }
+}
+
+void checkStream(const char* how)
+{
+    static const uint8_t expectedHeaders[] = {0x20, 0x90, 0x30, 0x32, 0x34, 0x32, 0xD0, 0x34, 0x62};
+    static const uint32_t expectedLengths[] = {4, 5, 5, 200, 300, 0, 2, 0, 4};
+    uint8_t i = 0;
+    bool same = !streamError && resultCount == sizeof(expectedHeaders);
+    for(i = 0; same && i < resultCount; i++)
+        same = results[i].controlHeader == expectedHeaders[i] && results[i].length == expectedLengths[i];
+    if(!same)
+        printf("stream cut %s parsed differently\n", how);
+    CHECK(same);
+    // The oversized QoS 1 publish is acknowledged, the QoS 0 one is not
+    CHECK(resultCount > 5 && results[5].skippedAck && results[5].skippedIdentifier == 0xBEEF);
+}
+
+void testSegments()
+{
+    static uint8_t stream[STREAM_SIZE];
+    uint32_t length = buildStream(stream);
+    uint32_t segment = 0, round = 0;
+    char how[32];
+    for(segment = 1; segment <= RX_SIZE; segment++)
+    {
+        receiveStream(stream, length, segment, false);
+        snprintf(how, sizeof(how), "every %u bytes", segment);
+        checkStream(how);
+    }
+    for(round = 0; round < 2000; round++)
+    {
+        receiveStream(stream, length, 1 + nextRandom() % 64, true);
+        checkStream("at random");
+    }
+}
+
+void testMalformed()
+{
+    // A fifth length byte is never valid (MQTT 2.2.3)
+    uint8_t tooLong[] = {0x30, 0xFF, 0xFF, 0xFF, 0xFF, 0x01};
+    // A topic length past the end of the packet
+    uint8_t badTopic[] = {0x30, 4, 0, 9, 'a', 'b'};
+    mqttParser parser;
+    mqttPublish publish;
+    mqttParserInit(&parser, RX_SIZE);
+    CHECK(mqttParse(&parser, tooLong, sizeof(tooLong)) == MQTT_PARSE_ERROR);
+    mqttParserInit(&parser, RX_SIZE);
+    CHECK(mqttParse(&parser, badTopic, sizeof(badTopic)) == MQTT_PARSE_PACKET);
+    CHECK(!mqttGetPublish(&parser, badTopic, &publish));
+}
+
+// Random bytes, every result has to stay inside the buffer it was given
+void testFuzz()
+{
+    uint8_t packet[RX_SIZE];
+    mqttParser parser;
+    mqttParseResult result;
+    mqttPublish publish;
+    uint32_t round = 0, length = 0, i = 0, inside = 0, packets = 0;
+    for(round = 0; round < FUZZ_ROUNDS; round++)
+    {
+        length = 1 + nextRandom() % RX_SIZE;
+        for(i = 0; i < length; i++)
+            packet[i] = nextRandom();
+        // Every other one is a publish whose lengths mostly fit, so mqttGetPublish gets to see it
+        if((round & 1) && length > 6)
+        {
+            if(length > 129)
+                length = 6 + nextRandom() % 124;
+            packet[0] = PUBLISH | (nextRandom() & 0x0B);
+            packet[1] = length - 2;
+            packet[2] = 0;
+            packet[3] = nextRandom() % (length - 2);
+        }
+        mqttSetProtocolLevel((round & 2) ? PROTOCOL_LEVEL_V5 : PROTOCOL_LEVEL_V311);
+        mqttParserInit(&parser, RX_SIZE);
+        result = mqttParse(&parser, packet, length);
+        if(result == MQTT_PARSE_PACKET || result == MQTT_PARSE_SKIPPED)
+            inside += parser.consumed <= length;
+        else
+            inside++;
+        if(result == MQTT_PARSE_PACKET && mqttGetPublish(&parser, packet, &publish))
+        {
+            packets++;
+            // An alias can point the topic at the table of inbound aliases
+            CHECK((publish.topic.length == 0 || (publish.topic.data >= packet && publish.topic.data + publish.topic.length <= packet + length))
+                  || publish.topic.length <= MQTT_ALIAS_TOPIC_SIZE);
+            CHECK(publish.payload.data >= packet && publish.payload.data + publish.payload.length <= packet + parser.consumed);
+        }
+    }
+    CHECK(inside == FUZZ_ROUNDS);
+    printf("fuzz: %u rounds, %u publishes taken apart\n", FUZZ_ROUNDS, packets);
+    mqttSetProtocolLevel(PROTOCOL_LEVEL_V311);
+}
+
+// Full sized segments of QoS 1 publishes with a 64 byte payload
+void benchmark()
+{
+    static uint8_t segment[1460];
+    uint8_t rx[RX_SIZE + sizeof(segment)];
+    uint32_t segmentLength = 0, rxCount = 0, parsedBytes = 0, publishes = 0;
+    mqttParser parser;
+    mqttPublish publish;
+    clock_t start = 0;
+    double seconds = 0;
+    while(segmentLength + 80 <= sizeof(segment))
+        segmentLength += putPublish(segment + segmentLength, QOS1, "sensors/building1/temp", 1, 64);
+    mqttParserInit(&parser, sizeof(rx));
+    start = clock();
+    while(parsedBytes < BENCH_BYTES)
+    {
+        memcpy(rx + rxCount, segment, segmentLength);
+        rxCount += segmentLength;
+        while(mqttParse(&parser, rx, rxCount) == MQTT_PARSE_PACKET)
+        {
+            if(mqttGetPublish(&parser, rx, &publish))
+                publishes++;
+            memmove(rx, rx + parser.consumed, rxCount - parser.consumed);
+            rxCount -= parser.consumed;
+        }
+        parsedBytes += segmentLength;
+    }
+    seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+    CHECK(publishes > 0);
+    printf("benchmark: %u publishes, %.1f MB/s\n", publishes, seconds > 0 ? parsedBytes / seconds / 1e6 : 0.0);
+}
+
+int main()
+{
+    testSegments();
+    testMalformed();
+    testFuzz();
+    benchmark();
+    return testReport("mqttParserTest");
+}
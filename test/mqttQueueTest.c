@@ -0,0 +1,291 @@
+/*
+ * mqttQueueTest.c
+ * Pushes and pops messages of random sizes through the offline queue with both policies,
+ * checking they come out in order and unchanged, that the EEPROM part survives a reset
+ * and that the queue never writes outside its words
+ * Ends with how long a sensor can be cut off from the broker before messages are dropped
+ *
+ *  Created on: Apr 20, 2021
+ *      Author: Sarker Nadir Afridi Azmi
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include "test.h"
+#include "mqttQueue.h"
+#include "eeprom.h"
+
+#define STRESS_PUSHES       20000
+// A small reading every 5 seconds
+#define SENSOR_TOPIC        "plant/line1/temp"
+#define SENSOR_PAYLOAD      "{\"t\":21.5,\"h\":40}"
+#define SENSOR_PERIOD       5
+
+extern uint16_t ramHead, ramSize, ramCount;
+extern uint16_t eepromHead, eepromSize, eepromCount;
+extern mqttQueueStats queueStats;
+
+uint32_t randomState = 97;
+
+uint32_t nextRandom()
+{
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+    return randomState;
+}
+
+// An empty queue with nothing in the EEPROM, as on a new board
+void resetQueue()
+{
+    testEraseEeprom();
+    ramHead = ramSize = ramCount = 0;
+    mqttQueueInit();
+    memset(&queueStats, 0, sizeof(queueStats));
+    mqttQueueSetPolicy(MQTT_QUEUE_DROP_OLDEST);
+}
+
+// What a reset does to the queue, RAM is lost and the EEPROM part is read back
+void rebootQueue()
+{
+    ramHead = ramSize = ramCount = 0;
+    eepromHead = eepromSize = eepromCount = 0;
+    mqttQueueInit();
+}
+
+// The sequence number comes first so a message can be told apart after it comes out,
+// the rest of the payload is a letter that depends on it
+void makeMessage(uint32_t sequence, char topic[], char payload[])
+{
+    uint16_t topicLength = 1 + nextRandom() % MQTT_QUEUE_MAX_TOPIC;
+    uint16_t payloadLength = 8 + nextRandom() % (MQTT_QUEUE_MAX_PAYLOAD - 7);
+    snprintf(payload, 9, "%08u", sequence);
+    memset(payload + 8, 'a' + sequence % 26, payloadLength - 8);
+    payload[payloadLength] = '\0';
+    memset(topic, 'A' + sequence % 26, topicLength);
+    topic[topicLength] = '\0';
+}
+
+// Returns the sequence number of a message that came out unchanged, or -1
+int32_t checkMessage(char topic[], char payload[], uint8_t qos)
+{
+    uint32_t sequence = strtoul(payload, NULL, 10);
+    size_t i = 0;
+    for(i = 8; payload[i] != '\0'; i++)
+        if(payload[i] != 'a' + sequence % 26)
+            return -1;
+    for(i = 0; topic[i] != '\0'; i++)
+        if(topic[i] != 'A' + sequence % 26)
+            return -1;
+    if(i == 0 || qos != 1 + sequence % 2)
+        return -1;
+    return sequence;
+}
+
+// Nothing outside the queue's words is ever written
+bool isOutsideUntouched()
+{
+    uint16_t i = 0;
+    for(i = 0; i < TEST_EEPROM_WORDS; i++)
+    {
+        if(i >= MQTT_QUEUE_EEPROM_START && i < MQTT_QUEUE_EEPROM_START + MQTT_QUEUE_EEPROM_WORDS)
+            continue;
+        if(readEeprom(i) != 0xFFFFFFFF)
+            return false;
+    }
+    return true;
+}
+
+void testEmpty()
+{
+    char topic[MQTT_QUEUE_MAX_TOPIC + 1], payload[MQTT_QUEUE_MAX_PAYLOAD + 1];
+    uint8_t qos = 0;
+    resetQueue();
+    CHECK(mqttQueueCount() == 0);
+    CHECK(!mqttQueuePeek(topic, payload, &qos));
+    // Popping an empty queue does not count as sent
+    mqttQueuePop();
+    CHECK(mqttQueueCount() == 0 && queueStats.sent == 0);
+}
+
+void testInOrder()
+{
+    char topic[MQTT_QUEUE_MAX_TOPIC + 1], payload[MQTT_QUEUE_MAX_PAYLOAD + 1];
+    uint8_t qos = 0;
+    resetQueue();
+    CHECK(mqttQueuePush("a/b", "first", 1));
+    CHECK(mqttQueuePush("a/c", "second", 2));
+    CHECK(mqttQueuePush("d", "", 1));
+    CHECK(mqttQueueCount() == 3);
+    CHECK(mqttQueuePeek(topic, payload, &qos) && strcmp(topic, "a/b") == 0 && strcmp(payload, "first") == 0 && qos == 1);
+    // Peeking again gives the same message until it is popped
+    CHECK(mqttQueuePeek(topic, payload, &qos) && strcmp(payload, "first") == 0);
+    mqttQueuePop();
+    CHECK(mqttQueuePeek(topic, payload, &qos) && strcmp(topic, "a/c") == 0 && strcmp(payload, "second") == 0 && qos == 2);
+    mqttQueuePop();
+    CHECK(mqttQueuePeek(topic, payload, &qos) && strcmp(topic, "d") == 0 && payload[0] == '\0');
+    mqttQueuePop();
+    CHECK(mqttQueueCount() == 0);
+    CHECK(queueStats.queued == 3 && queueStats.sent == 3 && queueStats.spilled == 0);
+    // Messages that stay in RAM leave the EEPROM alone
+    CHECK(readEeprom(MQTT_QUEUE_EEPROM_START) == 0xFFFFFFFF);
+}
+
+void testTooLong()
+{
+    char topic[MQTT_QUEUE_MAX_TOPIC + 2], payload[MQTT_QUEUE_MAX_PAYLOAD + 2];
+    resetQueue();
+    memset(topic, 't', MQTT_QUEUE_MAX_TOPIC + 1);
+    topic[MQTT_QUEUE_MAX_TOPIC + 1] = '\0';
+    memset(payload, 'p', MQTT_QUEUE_MAX_PAYLOAD + 1);
+    payload[MQTT_QUEUE_MAX_PAYLOAD + 1] = '\0';
+    CHECK(!mqttQueuePush(topic, "x", 1));
+    CHECK(!mqttQueuePush("x", payload, 1));
+    CHECK(mqttQueueCount() == 0 && queueStats.droppedNewest == 2);
+    // The longest ones that are allowed fit
+    topic[MQTT_QUEUE_MAX_TOPIC] = '\0';
+    payload[MQTT_QUEUE_MAX_PAYLOAD] = '\0';
+    CHECK(mqttQueuePush(topic, payload, 1));
+}
+
+// Fills the queue past RAM, resets and checks the EEPROM part comes back oldest first
+void testReset()
+{
+    char topic[MQTT_QUEUE_MAX_TOPIC + 1], payload[MQTT_QUEUE_MAX_PAYLOAD + 1];
+    uint8_t qos = 0;
+    uint32_t pushed = 0, spilled = 0, next = 0;
+    int32_t sequence = 0;
+    bool same = true;
+    resetQueue();
+    while(queueStats.droppedOldest == 0)
+    {
+        makeMessage(pushed, topic, payload);
+        CHECK(mqttQueuePush(topic, payload, 1 + pushed % 2));
+        pushed++;
+    }
+    spilled = eepromCount;
+    CHECK(spilled > 0 && ramCount > 0);
+    rebootQueue();
+    CHECK(mqttQueueCount() == spilled);
+    // The first one was dropped to make room, the rest of the EEPROM part follows in order
+    next = queueStats.droppedOldest;
+    while(mqttQueuePeek(topic, payload, &qos))
+    {
+        sequence = checkMessage(topic, payload, qos);
+        same = same && sequence == next;
+        next++;
+        mqttQueuePop();
+    }
+    CHECK(same);
+    CHECK(next == queueStats.droppedOldest + spilled);
+    // Once drained a second reset finds nothing
+    rebootQueue();
+    CHECK(mqttQueueCount() == 0);
+    CHECK(isOutsideUntouched());
+    printf("reset: %u messages pushed, %u kept over the reset\n", pushed, spilled);
+}
+
+// Words that do not make sense, as after a layout change, are taken as an empty queue
+void testBadState()
+{
+    resetQueue();
+    writeEeprom(MQTT_QUEUE_EEPROM_START, ((uint32_t)10 << 16) | MQTT_QUEUE_EEPROM_WORDS);
+    writeEeprom(MQTT_QUEUE_EEPROM_START + 1, 1);
+    rebootQueue();
+    CHECK(mqttQueueCount() == 0);
+    writeEeprom(MQTT_QUEUE_EEPROM_START, 10);
+    writeEeprom(MQTT_QUEUE_EEPROM_START + 1, 1);
+    rebootQueue();
+    CHECK(mqttQueueCount() == 0);
+}
+
+// Random pushes and pops, both rings wrap many times
+// What comes out is always in order and unchanged, and every message pushed is sent, dropped
+// or still queued at the end, with drop oldest the last one pushed is always kept
+void checkPolicy(mqttQueuePolicy policy, uint8_t popOneIn)
+{
+    char topic[MQTT_QUEUE_MAX_TOPIC + 1], payload[MQTT_QUEUE_MAX_PAYLOAD + 1];
+    uint8_t qos = 0;
+    uint32_t i = 0, popped = 0, refused = 0, gaps = 0;
+    int32_t sequence = 0, last = -1;
+    bool same = true, bounded = true;
+    resetQueue();
+    mqttQueueSetPolicy(policy);
+    for(i = 0; i < STRESS_PUSHES; i++)
+    {
+        makeMessage(i, topic, payload);
+        if(!mqttQueuePush(topic, payload, 1 + i % 2))
+            refused++;
+        bounded = bounded && ramSize <= MQTT_QUEUE_RAM_SIZE && eepromSize <= MQTT_QUEUE_EEPROM_WORDS - 2;
+        while(nextRandom() % popOneIn == 0 && mqttQueuePeek(topic, payload, &qos))
+        {
+            sequence = checkMessage(topic, payload, qos);
+            same = same && sequence > last;
+            gaps += sequence != last + 1;
+            last = sequence;
+            mqttQueuePop();
+            popped++;
+        }
+    }
+    CHECK(same && bounded);
+    CHECK(queueStats.queued == STRESS_PUSHES - refused);
+    CHECK(queueStats.sent == popped);
+    CHECK(queueStats.queued == queueStats.sent + queueStats.droppedOldest + mqttQueueCount());
+    if(policy == MQTT_QUEUE_DROP_OLDEST)
+        CHECK(refused == 0 && queueStats.droppedNewest == 0 && queueStats.droppedOldest > 0);
+    else
+        CHECK(refused == queueStats.droppedNewest && refused > 0 && queueStats.droppedOldest == 0);
+    // What is left is the newest messages with drop oldest
+    if(policy == MQTT_QUEUE_DROP_OLDEST)
+    {
+        while(mqttQueuePeek(topic, payload, &qos))
+        {
+            last = checkMessage(topic, payload, qos);
+            mqttQueuePop();
+        }
+        CHECK(last == STRESS_PUSHES - 1);
+    }
+    CHECK(isOutsideUntouched());
+    printf("%s: %u popped, %u dropped, %u spilled, %u gaps seen while draining\n",
+           (policy == MQTT_QUEUE_DROP_OLDEST) ? "drop oldest" : "drop newest", popped,
+           queueStats.droppedOldest + queueStats.droppedNewest, queueStats.spilled, gaps);
+}
+
+void testPolicies()
+{
+    // Pops now and then, the queue stays close to full
+    checkPolicy(MQTT_QUEUE_DROP_OLDEST, 3);
+    checkPolicy(MQTT_QUEUE_DROP_NEWEST, 3);
+    CHECK(mqttQueueGetPolicy() == MQTT_QUEUE_DROP_NEWEST);
+}
+
+// How many readings the queue holds while the broker is away
+// Every byte of RAM and every word of the EEPROM part should be holding one
+void capacity()
+{
+    uint32_t held = 0;
+    uint16_t size = 4 + strlen(SENSOR_TOPIC) + strlen(SENSOR_PAYLOAD);
+    resetQueue();
+    while(queueStats.droppedOldest == 0)
+    {
+        mqttQueuePush(SENSOR_TOPIC, SENSOR_PAYLOAD, 1);
+        held = mqttQueueCount();
+    }
+    CHECK(held >= MQTT_QUEUE_RAM_SIZE / size + (MQTT_QUEUE_EEPROM_WORDS - 2) / ((size + 3) / 4) - 1);
+    printf("capacity: %u readings of %u bytes, %.1f minutes at one every %u s\n", held, size,
+           held * SENSOR_PERIOD / 60.0, SENSOR_PERIOD);
+}
+
+int main()
+{
+    testEmpty();
+    testInOrder();
+    testTooLong();
+    testReset();
+    testBadState();
+    testPolicies();
+    capacity();
+    return testReport("mqttQueueTest");
+}
@@ -0,0 +1,317 @@
+/*
+ * mqttTrieTest.c
+ * Checks mqttDispatch against a plain reading of MQTT 4.7 for random filters and topics,
+ * that removing filters gives back every node and name byte, and what happens when the
+ * trie is full
+ * Ends with the time a dispatch takes with few and with many filters
+ *
+ *  Created on: Apr 20, 2021
+ *      Author: Sarker Nadir Afridi Azmi
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include "test.h"
+#include "mqtt.h"
+
+#define FILTERS_PER_ROUND   8
+#define MATCH_ROUNDS        5000
+#define TOPICS_PER_ROUND    32
+#define BENCH_DISPATCHES    1000000
+
+extern mqttTopicNode topicNodes[MQTT_MAX_TOPIC_NODES];
+extern uint16_t topicNamesSize;
+
+uint32_t randomState = 43;
+// Bit i is set when handler i was called
+uint32_t called = 0;
+
+uint32_t nextRandom()
+{
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+    return randomState;
+}
+
+void handler0(mqttPublish* publish)
+{
+    called |= 1 << 0;
+}
+
+void handler1(mqttPublish* publish)
+{
+    called |= 1 << 1;
+}
+
+void handler2(mqttPublish* publish)
+{
+    called |= 1 << 2;
+}
+
+void handler3(mqttPublish* publish)
+{
+    called |= 1 << 3;
+}
+
+void handler4(mqttPublish* publish)
+{
+    called |= 1 << 4;
+}
+
+void handler5(mqttPublish* publish)
+{
+    called |= 1 << 5;
+}
+
+void handler6(mqttPublish* publish)
+{
+    called |= 1 << 6;
+}
+
+void handler7(mqttPublish* publish)
+{
+    called |= 1 << 7;
+}
+
+mqttHandler handlers[FILTERS_PER_ROUND] = {handler0, handler1, handler2, handler3, handler4, handler5, handler6, handler7};
+
+uint8_t getNodesInUse()
+{
+    uint8_t i = 0, count = 0;
+    for(i = 1; i < MQTT_MAX_TOPIC_NODES; i++)
+        count += topicNodes[i].inUse;
+    return count;
+}
+
+// MQTT 4.7 one level at a time, without a trie
+bool isMatch(const char* filter, const char* topic)
+{
+    size_t filterLength = 0, topicLength = 0;
+    // Wildcards at the first level do not match topics starting with $
+    if(topic[0] == '$' && (filter[0] == '+' || filter[0] == '#'))
+        return false;
+    while(true)
+    {
+        if(filter[0] == '#')
+            return true;
+        filterLength = strcspn(filter, "/");
+        topicLength = strcspn(topic, "/");
+        if(!(filter[0] == '+' && filterLength == 1) && (filterLength != topicLength || strncmp(filter, topic, filterLength) != 0))
+            return false;
+        filter += filterLength;
+        topic += topicLength;
+        if(filter[0] == '\0')
+            return topic[0] == '\0';
+        // a/# matches a as well
+        if(topic[0] == '\0')
+            return strcmp(filter, "/#") == 0;
+        filter++;
+        topic++;
+    }
+}
+
+uint8_t countMatches(const char* topic)
+{
+    mqttPublish publish;
+    publish.topic.data = (uint8_t*)topic;
+    publish.topic.length = strlen(topic);
+    called = 0;
+    return mqttDispatch(&publish);
+}
+
+void makeTopic(char topic[])
+{
+    static const char* levels[] = {"a", "b", "c", "", "sensors"};
+    uint8_t count = 1 + nextRandom() % 4, i = 0;
+    topic[0] = '\0';
+    if(nextRandom() % 8 == 0)
+        strcat(topic, "$sys/");
+    for(i = 0; i < count; i++)
+    {
+        strcat(topic, levels[nextRandom() % 5]);
+        if(i + 1 < count)
+            strcat(topic, "/");
+    }
+    // An empty topic is never sent
+    if(topic[0] == '\0')
+        strcpy(topic, "a");
+}
+
+void makeFilter(char filter[])
+{
+    static const char* levels[] = {"a", "b", "+", "", "$sys", "sensors"};
+    uint8_t count = 1 + nextRandom() % 4, i = 0;
+    filter[0] = '\0';
+    for(i = 0; i < count; i++)
+    {
+        if(i + 1 == count && nextRandom() % 4 == 0)
+            strcat(filter, "#");
+        else
+            strcat(filter, levels[nextRandom() % 6]);
+        if(i + 1 < count)
+            strcat(filter, "/");
+    }
+}
+
+void testValidFilters()
+{
+    CHECK(mqttIsValidFilter("a/b/c"));
+    CHECK(mqttIsValidFilter("#"));
+    CHECK(mqttIsValidFilter("+"));
+    CHECK(mqttIsValidFilter("a/+/c"));
+    CHECK(mqttIsValidFilter("a/#"));
+    CHECK(mqttIsValidFilter("+/+"));
+    CHECK(mqttIsValidFilter("/"));
+    CHECK(!mqttIsValidFilter(""));
+    CHECK(!mqttIsValidFilter("a#"));
+    CHECK(!mqttIsValidFilter("a/#/b"));
+    CHECK(!mqttIsValidFilter("a+/b"));
+    CHECK(!mqttIsValidFilter("a/+b"));
+    CHECK(!mqttIsValidFilter("##"));
+    CHECK(!mqttAddSubscription("a/#/b", handler0));
+    CHECK(getNodesInUse() == 0);
+}
+
+// Random sets of filters, every topic has to call exactly the handlers whose filters match it
+void testRandomMatching()
+{
+    char filters[FILTERS_PER_ROUND][32];
+    char topic[48];
+    uint32_t round = 0, expected = 0, mismatches = 0, dispatched = 0;
+    uint8_t i = 0, j = 0, count = 0, matches = 0;
+    for(round = 0; round < MATCH_ROUNDS; round++)
+    {
+        count = 1 + nextRandom() % FILTERS_PER_ROUND;
+        for(i = 0; i < count; i++)
+        {
+            // An empty filter is not valid, and one given twice would only keep the second handler
+            do
+            {
+                makeFilter(filters[i]);
+                for(j = 0; j < i && strcmp(filters[i], filters[j]) != 0; j++);
+            }
+            while(j < i || filters[i][0] == '\0');
+            CHECK(mqttAddSubscription(filters[i], handlers[i]));
+        }
+        for(j = 0; j < TOPICS_PER_ROUND; j++)
+        {
+            makeTopic(topic);
+            expected = 0;
+            matches = 0;
+            for(i = 0; i < count; i++)
+            {
+                if(isMatch(filters[i], topic))
+                {
+                    expected |= 1 << i;
+                    matches++;
+                }
+            }
+            if(countMatches(topic) != matches || called != expected)
+            {
+                if(mismatches++ < 5)
+                    printf("topic %s called %02X, expected %02X\n", topic, called, expected);
+            }
+            dispatched += matches;
+        }
+        for(i = 0; i < count; i++)
+            mqttRemoveSubscription(filters[i]);
+        // Nothing is left behind
+        if(getNodesInUse() != 0 || topicNamesSize != 0)
+            mismatches++;
+    }
+    CHECK(mismatches == 0);
+    printf("matching: %u rounds, %u handler calls\n", MATCH_ROUNDS, dispatched);
+}
+
+// Some cases written out, for reading
+void testExamples()
+{
+    CHECK(mqttAddSubscription("sport/tennis/player1/#", handler0));
+    CHECK(mqttAddSubscription("sport/+/player1", handler1));
+    CHECK(mqttAddSubscription("+/+", handler2));
+    CHECK(mqttAddSubscription("$SYS/#", handler3));
+    CHECK(countMatches("sport/tennis/player1") == 2 && called == 0x03);
+    CHECK(countMatches("sport/tennis/player1/ranking") == 1 && called == 0x01);
+    CHECK(countMatches("sport/tennis") == 1 && called == 0x04);
+    CHECK(countMatches("/finance") == 1 && called == 0x04);
+    CHECK(countMatches("$SYS/monitor/clients") == 1 && called == 0x08);
+    CHECK(countMatches("$SYS/x") == 1 && called == 0x08);
+    // Adding a filter again replaces the handler
+    CHECK(mqttAddSubscription("+/+", handler4));
+    CHECK(countMatches("sport/tennis") == 1 && called == 0x10);
+    mqttRemoveSubscription("sport/tennis/player1/#");
+    mqttRemoveSubscription("sport/+/player1");
+    mqttRemoveSubscription("+/+");
+    mqttRemoveSubscription("$SYS/#");
+    // Removing what is not there does nothing
+    mqttRemoveSubscription("not/there");
+    CHECK(getNodesInUse() == 0 && topicNamesSize == 0);
+}
+
+// A filter that does not fit is refused and leaves nothing behind
+void testFull()
+{
+    char filter[32];
+    uint16_t added = 0, i = 0;
+    while(true)
+    {
+        snprintf(filter, sizeof(filter), "site/%u/temp", added);
+        if(!mqttAddSubscription(filter, handler0))
+            break;
+        added++;
+    }
+    // The site level is shared, every other filter takes two nodes
+    CHECK(added == (MQTT_MAX_TOPIC_NODES - 2) / 2);
+    CHECK(getNodesInUse() == 1 + 2 * added);
+    CHECK(countMatches("site/7/temp") == 1);
+    for(i = 0; i < added; i++)
+    {
+        snprintf(filter, sizeof(filter), "site/%u/temp", i);
+        mqttRemoveSubscription(filter);
+    }
+    CHECK(getNodesInUse() == 0 && topicNamesSize == 0);
+}
+
+// With a trie the time goes with the levels of the topic, not with how many filters there are
+double getDispatchTime(uint16_t filterCount)
+{
+    char filter[32];
+    uint16_t i = 0;
+    uint32_t n = 0, calls = 0;
+    clock_t start = 0;
+    for(i = 0; i < filterCount; i++)
+    {
+        snprintf(filter, sizeof(filter), "plant/line%u/+/temp", i);
+        mqttAddSubscription(filter, handler0);
+    }
+    start = clock();
+    for(n = 0; n < BENCH_DISPATCHES; n++)
+        calls += countMatches("plant/line0/sensor4/temp");
+    CHECK(calls == BENCH_DISPATCHES);
+    for(i = 0; i < filterCount; i++)
+    {
+        snprintf(filter, sizeof(filter), "plant/line%u/+/temp", i);
+        mqttRemoveSubscription(filter);
+    }
+    return (double)(clock() - start) / CLOCKS_PER_SEC * 1e9 / BENCH_DISPATCHES;
+}
+
+void benchmark()
+{
+    double few = getDispatchTime(1);
+    double many = getDispatchTime((MQTT_MAX_TOPIC_NODES - 2) / 3);
+    printf("benchmark: %.0f ns per dispatch with 1 filter, %.0f ns with %u\n", few, many, (MQTT_MAX_TOPIC_NODES - 2) / 3);
+}
+
+int main()
+{
+    testValidFilters();
+    testExamples();
+    testRandomMatching();
+    testFull();
+    benchmark();
+    return testReport("mqttTrieTest");
+}
@@ -0,0 +1,270 @@
+/*
+ * mqttWireTest.c
+ * Counts the bytes a telemetry client puts on the wire for the same publishes in MQTT 3.1.1,
+ * in MQTT 5 and in MQTT 5 with topic aliases, and reads every aliased publish back the way a
+ * broker would to make sure it still says the same thing
+ * Also checks what the CONNACK hands the client: Topic Alias Maximum and Receive Maximum
+ * and that a SUBSCRIBE asks for each topic's own QoS
+ *
+ *  Created on: Apr 20, 2021
+ *      Author: Sarker Nadir Afridi Azmi
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "test.h"
+#include "mqtt.h"
+
+// An hour of readings, each sensor reports every 10 s
+#define ROUNDS              360
+#define TOPIC_COUNT         6
+#define PACKET_SIZE         300
+
+// The topic set of a line in the plant, the same few long names again and again
+char* topics[TOPIC_COUNT] =
+{
+    "plant/building1/line3/press07/temperature",
+    "plant/building1/line3/press07/pressure",
+    "plant/building1/line3/press07/vibration",
+    "plant/building1/line3/conveyor2/speed",
+    "plant/building1/line3/conveyor2/motor/current",
+    "plant/building1/line3/status",
+};
+
+uint32_t randomState = 211;
+
+// What the broker knows each alias by, index 0 is not used
+char brokerAliases[MQTT_MAX_TOPIC_ALIASES + 1][MQTT_ALIAS_TOPIC_SIZE + 1];
+
+uint32_t nextRandom()
+{
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+    return randomState;
+}
+
+// A reading the way the firmware formats them
+void makePayload(char payload[])
+{
+    uint32_t value = nextRandom() % 100000;
+    snprintf(payload, 32, "{\"v\":%u.%02u,\"u\":1}", value / 100, value % 100);
+}
+
+// The broker's CONNACK, a value of 0 leaves the property out
+void readConnack(uint8_t level, uint32_t topicAliasMaximum, uint32_t receiveMaximum)
+{
+    uint8_t packet[16] = {0x20, 2, 0, 0};
+    uint8_t propertiesLength = 0;
+    mqttSetProtocolLevel(level);
+    if(level == PROTOCOL_LEVEL_V5)
+    {
+        if(topicAliasMaximum > 0)
+            propertiesLength += mqttPutProperty(packet + 5 + propertiesLength, MQTT_PROPERTY_TOPIC_ALIAS_MAXIMUM, topicAliasMaximum);
+        if(receiveMaximum > 0)
+            propertiesLength += mqttPutProperty(packet + 5 + propertiesLength, MQTT_PROPERTY_RECEIVE_MAXIMUM, receiveMaximum);
+        packet[4] = propertiesLength;
+        packet[1] = 3 + propertiesLength;
+    }
+    mqttReadConnack(packet);
+    memset(brokerAliases, 0, sizeof(brokerAliases));
+}
+
+// Reads a QoS 1 publish as the broker does, an alias with a topic sets it and one without uses it
+// Returns false if the topic or payload it ends up with is not the one that was published
+bool brokerReads(uint8_t packet[], uint16_t length, char* topic, char* payload, uint32_t aliasLimit, bool* aliased)
+{
+    uint32_t remainingLength = 0, propertiesLength = 0, alias = 0;
+    uint8_t lengthBytes = mqttGetVariableInteger(packet + 1, length - 1, &remainingLength);
+    uint8_t* data = packet + 1 + lengthBytes;
+    uint8_t* end = packet + length;
+    uint8_t* properties = 0;
+    uint16_t topicLength = 0;
+    char name[MQTT_ALIAS_TOPIC_SIZE + 1];
+    if(packet[0] != (PUBLISH | QOS1) || lengthBytes == 0 || 1 + lengthBytes + remainingLength != length)
+        return false;
+    topicLength = ((uint16_t)data[0] << 8) | data[1];
+    if(topicLength > MQTT_ALIAS_TOPIC_SIZE)
+        return false;
+    memcpy(name, data + 2, topicLength);
+    name[topicLength] = '\0';
+    // The packet identifier
+    data += 2 + topicLength + 2;
+    *aliased = false;
+    if(mqttGetProtocolLevel() == PROTOCOL_LEVEL_V5)
+    {
+        properties = mqttGetProperties(data, end - data, &propertiesLength);
+        if(properties == 0)
+            return false;
+        if(mqttGetProperty(properties, propertiesLength, MQTT_PROPERTY_TOPIC_ALIAS, &alias))
+        {
+            // MQTT 5 3.3.2.3.4, 0 and anything above what the broker allowed is a protocol error
+            if(alias == 0 || alias > aliasLimit)
+                return false;
+            if(topicLength > 0)
+                strcpy(brokerAliases[alias], name);
+            else
+                strcpy(name, brokerAliases[alias]);
+            *aliased = true;
+        }
+        data = properties + propertiesLength;
+    }
+    return strcmp(name, topic) == 0 && (uint32_t)(end - data) == strlen(payload) && memcmp(data, payload, end - data) == 0;
+}
+
+// Sends ROUNDS readings of every topic, the way mqttClient.c does it, and returns the bytes that went out
+uint32_t sendReadings(uint8_t level, uint32_t topicAliasMaximum, uint32_t* aliasedPublishes)
+{
+    uint8_t packet[PACKET_SIZE];
+    char payload[32];
+    uint16_t length = 0, identifier = 1;
+    uint32_t round = 0, bytes = 0, wrong = 0;
+    uint8_t i = 0;
+    bool aliased = false;
+    readConnack(level, topicAliasMaximum, 0);
+    randomState = 211;
+    *aliasedPublishes = 0;
+    for(round = 0; round < ROUNDS; round++)
+    {
+        for(i = 0; i < TOPIC_COUNT; i++)
+        {
+            makePayload(payload);
+            assembleMqttAliasedPublishPacket(packet, topics[i], identifier++, QOS1, payload, &length);
+            mqttCommitTopicAlias(topics[i]);
+            if(!brokerReads(packet, length, topics[i], payload, topicAliasMaximum, &aliased))
+                wrong++;
+            *aliasedPublishes += aliased;
+            bytes += length;
+        }
+    }
+    CHECK(wrong == 0);
+    return bytes;
+}
+
+// The topic goes out once per alias and never again
+void testSavings()
+{
+    uint32_t aliased = 0;
+    uint32_t v311 = sendReadings(PROTOCOL_LEVEL_V311, 0, &aliased);
+    uint32_t v5 = 0, v5Aliases = 0;
+    uint32_t topicBytes = 0;
+    uint8_t i = 0;
+    CHECK(aliased == 0);
+    v5 = sendReadings(PROTOCOL_LEVEL_V5, 0, &aliased);
+    CHECK(aliased == 0);
+    // Only the empty property list
+    CHECK(v5 == v311 + ROUNDS * TOPIC_COUNT);
+    v5Aliases = sendReadings(PROTOCOL_LEVEL_V5, MQTT_MAX_TOPIC_ALIASES, &aliased);
+    CHECK(aliased == ROUNDS * TOPIC_COUNT);
+    for(i = 0; i < TOPIC_COUNT; i++)
+        topicBytes += strlen(topics[i]);
+    // Every publish carries the 3 byte property, every one but the first of a topic leaves the topic out
+    CHECK(v5Aliases == v5 + 3 * ROUNDS * TOPIC_COUNT - (ROUNDS - 1) * topicBytes);
+    printf("wire: %u publishes, MQTT 3.1.1 %u bytes, MQTT 5 %u bytes, MQTT 5 with aliases %u bytes (%.1f%% less than 3.1.1)\n",
+           ROUNDS * TOPIC_COUNT, v311, v5, v5Aliases, 100.0 * (v311 - v5Aliases) / v311);
+    printf("wire: %.1f bytes per publish against %.1f\n", (double)v5Aliases / (ROUNDS * TOPIC_COUNT), (double)v311 / (ROUNDS * TOPIC_COUNT));
+}
+
+// A broker that takes fewer aliases than there are topics gets the rest by name
+void testAliasLimit()
+{
+    uint32_t aliased = 0;
+    sendReadings(PROTOCOL_LEVEL_V5, 2, &aliased);
+    CHECK(aliased == 2 * ROUNDS);
+}
+
+// An alias is only known once the packet that sets it was sent, and is gone with the connection
+void testCommit()
+{
+    uint8_t packet[PACKET_SIZE];
+    uint16_t length = 0, full = 0;
+    char* topic = topics[0];
+    readConnack(PROTOCOL_LEVEL_V5, MQTT_MAX_TOPIC_ALIASES, 0);
+    assembleMqttPublishPacket(packet, topic, 1, QOS1, "21.5", &full);
+    assembleMqttAliasedPublishPacket(packet, topic, 1, QOS1, "21.5", &length);
+    CHECK(length == full + 3);
+    // Not sent, so it is built the same way again
+    assembleMqttAliasedPublishPacket(packet, topic, 2, QOS1, "21.5", &length);
+    CHECK(length == full + 3);
+    mqttCommitTopicAlias(topic);
+    assembleMqttAliasedPublishPacket(packet, topic, 3, QOS1, "21.5", &length);
+    CHECK(length == full + 3 - strlen(topic));
+    // A new connection starts without aliases
+    readConnack(PROTOCOL_LEVEL_V5, MQTT_MAX_TOPIC_ALIASES, 0);
+    assembleMqttAliasedPublishPacket(packet, topic, 4, QOS1, "21.5", &length);
+    CHECK(length == full + 3);
+    // Topics that are too short to be worth an alias are sent by name
+    assembleMqttAliasedPublishPacket(packet, "a/b", 5, QOS1, "21.5", &length);
+    mqttCommitTopicAlias("a/b");
+    assembleMqttAliasedPublishPacket(packet, "a/b", 6, QOS1, "21.5", &full);
+    CHECK(length == full && packet[1 + 1 + 2 + 3 + 2] == 0);
+    // Commits do nothing in MQTT 3.1.1
+    readConnack(PROTOCOL_LEVEL_V311, 0, 0);
+    mqttCommitTopicAlias(topic);
+    assembleMqttPublishPacket(packet, topic, 7, QOS1, "21.5", &full);
+    assembleMqttAliasedPublishPacket(packet, topic, 7, QOS1, "21.5", &length);
+    CHECK(length == full);
+}
+
+// The broker's Receive Maximum caps the publishes waiting for an acknowledgement
+void testReceiveMaximum()
+{
+    uint8_t packet[PACKET_SIZE];
+    uint16_t length = 0, identifier = 0;
+    readConnack(PROTOCOL_LEVEL_V5, 0, 2);
+    assembleMqttPublishPacket(packet, topics[0], 1, QOS1, "21.5", &length);
+    CHECK(!mqttIsInFlightFull());
+    CHECK(mqttTrackPublish(1, QOS1, packet, length));
+    CHECK(!mqttIsInFlightFull());
+    CHECK(mqttTrackPublish(2, QOS1, packet, length));
+    CHECK(mqttIsInFlightFull());
+    CHECK(mqttAcknowledgePublish(PUBACK, 1, 0));
+    CHECK(!mqttIsInFlightFull());
+    CHECK(mqttAcknowledgePublish(PUBACK, 2, 0));
+    // Without the property the client's own limit holds
+    readConnack(PROTOCOL_LEVEL_V5, 0, 0);
+    for(identifier = 1; identifier <= MQTT_MAX_IN_FLIGHT; identifier++)
+    {
+        CHECK(!mqttIsInFlightFull());
+        mqttTrackPublish(identifier, QOS1, packet, length);
+    }
+    CHECK(mqttIsInFlightFull());
+    for(identifier = 1; identifier <= MQTT_MAX_IN_FLIGHT; identifier++)
+        mqttAcknowledgePublish(PUBACK, identifier, 0);
+    mqttSetProtocolLevel(PROTOCOL_LEVEL_V311);
+}
+
+// Each topic goes out with the QoS it was asked for, the way a resubscribe restores them
+void testSubscribe()
+{
+    uint8_t packet[PACKET_SIZE];
+    uint8_t qos[2] = {0, 2};
+    // As mqttClient.c stores them, one after the other with their terminators
+    char stored[] = "a/b\0plant/c";
+    uint16_t length = 0;
+    mqttSetProtocolLevel(PROTOCOL_LEVEL_V311);
+    assembleMqttSubscribeUnsubscribePacket(packet, SUBSCRIBE, 9, stored, 3 + 7, 2, qos, &length);
+    // The identifier, then each topic with its length and option byte
+    CHECK(length == 2 + 2 + (2 + 3 + 1) + (2 + 7 + 1) && packet[1] == length - 2);
+    CHECK(packet[4] == 0 && packet[5] == 3 && memcmp(packet + 6, "a/b", 3) == 0 && packet[9] == 0);
+    CHECK(packet[10] == 0 && packet[11] == 7 && memcmp(packet + 12, "plant/c", 7) == 0 && packet[19] == 2);
+    // MQTT 5 adds the empty property list and nothing else
+    mqttSetProtocolLevel(PROTOCOL_LEVEL_V5);
+    assembleMqttSubscribeUnsubscribePacket(packet, SUBSCRIBE, 9, stored, 3 + 7, 2, qos, &length);
+    CHECK(length == 2 + 2 + 1 + (2 + 3 + 1) + (2 + 7 + 1) && packet[10] == 0 && packet[20] == 2);
+    // An UNSUBSCRIBE has no option bytes
+    assembleMqttSubscribeUnsubscribePacket(packet, UNSUBSCRIBE, 9, stored, 3 + 7, 2, 0, &length);
+    CHECK(length == 2 + 2 + 1 + (2 + 3) + (2 + 7));
+    mqttSetProtocolLevel(PROTOCOL_LEVEL_V311);
+}
+
+int main()
+{
+    testSubscribe();
+    testCommit();
+    testAliasLimit();
+    testReceiveMaximum();
+    testSavings();
+    return testReport("mqttWireTest");
+}
@@ -0,0 +1,467 @@
+/*
+ * tcpLossTest.c
+ * Opens a connection from the stack to itself over a simulated wire that drops the segments
+ * a script names, then checks the data arrives intact and how the sender recovered
+ * Prints the goodput and recovery time of each loss pattern
+ * Also checks the MSS taken from the peer and that an old duplicate failing PAWS is acknowledged once
+ *
+ *  Created on: Apr 20, 2021
+ *      Author: Sarker Nadir Afridi Azmi
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "test.h"
+#include "eth0.h"
+#include "tcp.h"
+#include "sock.h"
+
+#define SERVER_PORT     2000
+// One way delay in milliseconds
+#define WIRE_DELAY      5
+#define WIRE_SIZE       256
+#define TRANSFER_SIZE   60000
+// Simulated milliseconds before a transfer is given up on
+#define TIME_LIMIT      120000
+// With 2048 byte buffers only one full sized segment fits in flight besides a partial one, so the
+// handshake is changed to announce a smaller MSS and get enough segments in flight for duplicate ACKs
+#define WIRE_MSS        256
+#define MAX_DROPS       8
+
+typedef struct _wireFrame
+{
+    bool inUse;
+    // Frames go out in the order they were sent, every one is delayed the same
+    uint32_t order;
+    uint32_t due;
+    uint16_t size;
+    uint8_t data[TEST_FRAME_SIZE];
+} wireFrame;
+
+// Which segments the wire loses, counted from 1 in the order the client sent them
+typedef struct _lossScript
+{
+    const char* name;
+    // Segments of new data and resent segments
+    uint8_t dropCount;
+    uint16_t drops[MAX_DROPS];
+    uint8_t dropRetransmissionCount;
+    uint16_t dropRetransmissions[MAX_DROPS];
+    // Frames lost at random in both directions, per thousand
+    uint16_t randomLoss;
+    // Removes the SACK permitted option from the handshake so NewReno alone recovers
+    bool noSack;
+} lossScript;
+
+// What happened during a transfer
+typedef struct _lossResult
+{
+    bool complete;
+    bool intact;
+    uint32_t time;
+    uint32_t retransmissions;
+    uint32_t timeouts;
+    // ACKs from the receiver that carried SACK blocks
+    uint32_t sackAcks;
+    // From the first lost segment going out to the receiver having everything up to the last one
+    uint32_t recoveryTime;
+} lossResult;
+
+wireFrame wire[WIRE_SIZE];
+uint8_t buffer[TEST_FRAME_SIZE];
+uint8_t sent[TRANSFER_SIZE];
+uint8_t received[TRANSFER_SIZE];
+tcpConnection client;
+tcpConnection* server = 0;
+uint32_t randomState = 1;
+uint32_t nextOrder = 0;
+
+uint32_t nextRandom()
+{
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+    return randomState;
+}
+
+void onAccept(tcpConnection* conn)
+{
+    server = conn;
+}
+
+void setTcpChecksum(etherHeader* ether)
+{
+    ipHeader* ip = (ipHeader*)ether->data;
+    tcpHeader* tcp = (tcpHeader*)ip->data;
+    uint16_t tcpLength = ntohs(ip->length) - (ip->revSize & 0xF) * 4;
+    uint16_t temp16 = 0;
+    uint32_t sum = 0;
+    tcp->checksum = 0;
+    etherSumWords(ip->sourceIp, 8, &sum);
+    temp16 = htons(ip->protocol);
+    etherSumWords(&temp16, 2, &sum);
+    temp16 = htons(tcpLength);
+    etherSumWords(&temp16, 2, &sum);
+    etherSumWords(tcp, tcpLength, &sum);
+    tcp->checksum = getEtherChecksum(sum);
+}
+
+// Lowers the MSS a SYN announces and takes out SACK permitted if asked to
+void rewriteSyn(etherHeader* ether, bool noSack)
+{
+    ipHeader* ip = (ipHeader*)ether->data;
+    tcpHeader* tcp = (tcpHeader*)ip->data;
+    uint8_t* options = (uint8_t*)tcp->data;
+    uint8_t length = ((ntohs(tcp->offsetFields) >> 12) << 2) - sizeof(tcpHeader);
+    uint8_t i = 0;
+    while(i < length && options[i] != TCP_OPTION_END)
+    {
+        if(options[i] == TCP_OPTION_NOP)
+        {
+            i++;
+            continue;
+        }
+        if(options[i] == TCP_OPTION_MSS)
+        {
+            options[i + 2] = WIRE_MSS >> 8;
+            options[i + 3] = WIRE_MSS & 0xFF;
+        }
+        if(options[i] == TCP_OPTION_SACK_PERMITTED && noSack)
+        {
+            options[i] = TCP_OPTION_NOP;
+            options[i + 1] = TCP_OPTION_NOP;
+            continue;
+        }
+        i += options[i + 1];
+    }
+    setTcpChecksum(ether);
+}
+
+bool isListed(uint16_t list[], uint8_t count, uint16_t value)
+{
+    uint8_t i = 0;
+    for(i = 0; i < count; i++)
+        if(list[i] == value)
+            return true;
+    return false;
+}
+
+// Moves what the stack sent onto the wire, losing what the script says
+void sendFrames(lossScript* script, lossResult* result, uint32_t* highestEnd, uint16_t* segments, uint32_t* lossStart, uint32_t* lossEnd)
+{
+    testFrame* frame = 0;
+    etherHeader* ether = 0;
+    ipHeader* ip = 0;
+    tcpHeader* tcp = 0;
+    uint32_t sequenceNumber = 0, end = 0;
+    uint16_t payloadSize = 0, i = 0;
+    tcpOptions opt;
+    bool drop = false;
+    while((frame = testGetFrame()) != 0)
+    {
+        ether = (etherHeader*)frame->data;
+        ip = (ipHeader*)ether->data;
+        tcp = (tcpHeader*)ip->data;
+        CHECK(etherIsTcp(ether));
+        if(ntohs(tcp->offsetFields) & SYN)
+            rewriteSyn(ether, script->noSack);
+        payloadSize = getPayloadSize(ether);
+        sequenceNumber = ntohl(tcp->sequenceNumber);
+        end = sequenceNumber + payloadSize;
+        drop = false;
+        if(ntohs(tcp->sourcePort) == SERVER_PORT)
+        {
+            tcpParseOptions(ether, &opt);
+            if(opt.sackCount > 0)
+                result->sackAcks++;
+        }
+        if(ntohs(tcp->sourcePort) == client.local.port && payloadSize > 0)
+        {
+            if(*segments == 0 || (int32_t)(end - *highestEnd) > 0)
+            {
+                *highestEnd = end;
+                (*segments)++;
+                drop = isListed(script->drops, script->dropCount, *segments);
+            }
+            else
+            {
+                result->retransmissions++;
+                drop = isListed(script->dropRetransmissions, script->dropRetransmissionCount, result->retransmissions);
+            }
+            if(drop)
+            {
+                if(*lossStart == 0)
+                    *lossStart = testTime;
+                if(*lossEnd == 0 || (int32_t)(end - *lossEnd) > 0)
+                    *lossEnd = end;
+            }
+        }
+        if(script->randomLoss > 0 && !(ntohs(tcp->offsetFields) & SYN) && nextRandom() % 1000 < script->randomLoss)
+            drop = true;
+        if(drop)
+            continue;
+        for(i = 0; i < WIRE_SIZE && wire[i].inUse; i++);
+        CHECK(i < WIRE_SIZE);
+        if(i == WIRE_SIZE)
+            return;
+        wire[i].inUse = true;
+        wire[i].order = nextOrder++;
+        wire[i].due = testTime + WIRE_DELAY;
+        wire[i].size = frame->size;
+        memcpy(wire[i].data, frame->data, frame->size);
+    }
+}
+
+// Hands the stack every frame whose delay is over, in the order they were sent
+void deliverFrames()
+{
+    uint16_t i = 0, oldest = 0;
+    bool found = true;
+    while(found)
+    {
+        found = false;
+        for(i = 0; i < WIRE_SIZE; i++)
+        {
+            if(!wire[i].inUse || (int32_t)(testTime - wire[i].due) < 0)
+                continue;
+            if(!found || wire[i].order < wire[oldest].order)
+                oldest = i;
+            found = true;
+        }
+        if(found)
+        {
+            memcpy(buffer, wire[oldest].data, wire[oldest].size);
+            wire[oldest].inUse = false;
+            sockInput((etherHeader*)buffer);
+        }
+    }
+}
+
+// Runs both ends over the wire for time milliseconds without losing anything
+void settle(uint32_t time)
+{
+    lossScript clean = {"", 0, {0}, 0, {0}, 0, false};
+    lossResult result;
+    uint32_t highestEnd = 0, lossStart = 0, lossEnd = 0, end = testTime + time;
+    uint16_t segments = 0;
+    memset(&result, 0, sizeof(result));
+    while(testTime != end)
+    {
+        deliverFrames();
+        sockPoll((etherHeader*)buffer);
+        sendFrames(&clean, &result, &highestEnd, &segments, &lossStart, &lossEnd);
+        testTime++;
+    }
+}
+
+// Hands the server a frame and counts the segments it answers with right away
+uint8_t replay(uint8_t frame[], uint16_t size)
+{
+    testFrame* reply = 0;
+    uint8_t count = 0;
+    testClearFrames();
+    memcpy(buffer, frame, size);
+    sockInput((etherHeader*)buffer);
+    while((reply = testGetFrame()) != 0)
+        count += ntohs(((tcpHeader*)((ipHeader*)((etherHeader*)reply->data)->data)->data)->sourcePort) == SERVER_PORT;
+    return count;
+}
+
+lossResult runTransfer(lossScript* script)
+{
+    lossResult result;
+    uint8_t ip[4];
+    uint32_t written = 0, receivedCount = 0, start = 0, highestEnd = 0, lossStart = 0, lossEnd = 0;
+    uint16_t segments = 0;
+    memset(&result, 0, sizeof(result));
+    memset(wire, 0, sizeof(wire));
+    memset(&client, 0, sizeof(client));
+    testClearFrames();
+    server = 0;
+    randomState = 1;
+    etherGetIpAddress(ip);
+    CHECK(sockConnect(&client, ip, SERVER_PORT));
+    start = testTime;
+    while(receivedCount < TRANSFER_SIZE && testTime - start < TIME_LIMIT)
+    {
+        deliverFrames();
+        if(sockIsConnected(&client) && written < TRANSFER_SIZE)
+            written += sockSend(&client, sent + written, TRANSFER_SIZE - written);
+        if(server != 0)
+            receivedCount += sockRecv(server, received + receivedCount, TRANSFER_SIZE - receivedCount);
+        if(lossEnd != 0 && result.recoveryTime == 0 && server != 0 && (int32_t)(server->rcvNxt - lossEnd) >= 0)
+            result.recoveryTime = testTime - lossStart;
+        // The same test tcpTick makes before it resends on a timeout
+        if(client.state == TCP_ESTABLISHED && client.retransmitTimerOn && (int32_t)(testTime - client.retransmitTime) >= 0)
+            result.timeouts++;
+        sockPoll((etherHeader*)buffer);
+        sendFrames(script, &result, &highestEnd, &segments, &lossStart, &lossEnd);
+        testTime++;
+    }
+    CHECK(client.sack == !script->noSack);
+    result.complete = receivedCount == TRANSFER_SIZE;
+    result.intact = result.complete && memcmp(sent, received, TRANSFER_SIZE) == 0;
+    result.time = testTime - start;
+    printf("%-34s %6u ms %6.1f kB/s  %3u resent %2u timeouts  recovery %4u ms  %3u SACKs\n", script->name, result.time,
+           (double)TRANSFER_SIZE / result.time, result.retransmissions, result.timeouts, result.recoveryTime, result.sackAcks);
+    sockAbort(&client);
+    if(server != 0)
+        sockAbort(server);
+    sockPoll((etherHeader*)buffer);
+    return result;
+}
+
+void testLoss()
+{
+    lossScript clean = {"no loss", 0, {0}, 0, {0}, 0, true};
+    lossScript single = {"one segment lost, NewReno", 1, {20}, 0, {0}, 0, true};
+    lossScript twoInWindow = {"two in one window, NewReno", 2, {20, 22}, 0, {0}, 0, true};
+    lossScript resentLost = {"retransmission lost too, NewReno", 1, {20}, 1, {1}, 0, true};
+    lossScript random = {"2% of frames lost both ways", 0, {0}, 0, {0}, 20, true};
+    lossResult result;
+
+    result = runTransfer(&clean);
+    CHECK(result.intact);
+    CHECK(result.retransmissions == 0 && result.timeouts == 0);
+
+    // Fast retransmit resends just the lost segment before the timer runs out
+    result = runTransfer(&single);
+    CHECK(result.intact);
+    CHECK(result.retransmissions == 1 && result.timeouts == 0);
+    CHECK(result.recoveryTime < TCP_MIN_RTO);
+
+    // The partial ACK of the first resend points NewReno at the second hole
+    result = runTransfer(&twoInWindow);
+    CHECK(result.intact);
+    CHECK(result.retransmissions == 2 && result.timeouts == 0);
+
+    // Nothing else can tell the sender the resent segment was lost
+    result = runTransfer(&resentLost);
+    CHECK(result.intact);
+    CHECK(result.timeouts == 1);
+    CHECK(result.recoveryTime >= TCP_MIN_RTO);
+
+    result = runTransfer(&random);
+    CHECK(result.intact);
+}
+
+// The same losses with SACK, and bursts like those of the plant network
+void testSack()
+{
+    lossScript clean = {"no loss, SACK", 0, {0}, 0, {0}, 0, false};
+    lossScript scattered = {"three scattered, NewReno", 3, {20, 22, 24}, 0, {0}, 0, true};
+    lossScript scatteredSack = {"three scattered, SACK", 3, {20, 22, 24}, 0, {0}, 0, false};
+    lossScript burst = {"burst of four, NewReno", 4, {20, 21, 22, 23}, 0, {0}, 0, true};
+    lossScript burstSack = {"burst of four, SACK", 4, {20, 21, 22, 23}, 0, {0}, 0, false};
+    lossScript random = {"2% of frames lost both ways, SACK", 0, {0}, 0, {0}, 20, false};
+    lossResult result, newReno;
+
+    // Nothing out of order, nothing to SACK
+    result = runTransfer(&clean);
+    CHECK(result.intact);
+    CHECK(result.retransmissions == 0 && result.sackAcks == 0);
+
+    // Only the holes are resent, and all of them in the first round trip of the recovery
+    newReno = runTransfer(&scattered);
+    result = runTransfer(&scatteredSack);
+    CHECK(newReno.intact && result.intact);
+    CHECK(result.retransmissions == 3 && result.timeouts == 0 && result.sackAcks > 0);
+    CHECK(result.recoveryTime < newReno.recoveryTime);
+
+    newReno = runTransfer(&burst);
+    result = runTransfer(&burstSack);
+    CHECK(newReno.intact && result.intact);
+    CHECK(result.retransmissions == 4 && result.timeouts == 0);
+    CHECK(result.recoveryTime < newReno.recoveryTime);
+
+    result = runTransfer(&random);
+    CHECK(result.intact);
+}
+
+// A segment whose timestamp is older than the last one is an old duplicate (RFC 7323 5.3)
+// It is dropped and answered with exactly one ACK, whether it carries data or not
+void testPaws()
+{
+    uint8_t address[4];
+    uint8_t old[TEST_FRAME_SIZE];
+    uint16_t oldSize = 0;
+    uint32_t rcvNxt = 0;
+    testFrame* frame = 0;
+    ipHeader* ip = (ipHeader*)((etherHeader*)old)->data;
+    memset(wire, 0, sizeof(wire));
+    memset(&client, 0, sizeof(client));
+    testClearFrames();
+    server = 0;
+    etherGetIpAddress(address);
+    CHECK(sockConnect(&client, address, SERVER_PORT));
+    settle(50);
+    CHECK(server != 0 && sockIsConnected(&client) && client.timestamps);
+    if(server == 0)
+        return;
+    sockSend(&client, sent, 100);
+    sockPoll((etherHeader*)buffer);
+    frame = testGetFrame();
+    CHECK(frame != 0 && getPayloadSize((etherHeader*)frame->data) == 100);
+    if(frame == 0)
+        return;
+    oldSize = frame->size;
+    memcpy(old, frame->data, oldSize);
+    memcpy(buffer, old, oldSize);
+    sockInput((etherHeader*)buffer);
+    // A later segment moves the server's last timestamp on
+    settle(50);
+    sockSend(&client, sent + 100, 100);
+    settle(50);
+    rcvNxt = server->rcvNxt;
+    CHECK(sockRecv(server, received, TRANSFER_SIZE) == 200);
+
+    CHECK(replay(old, oldSize) == 1);
+    CHECK(server->rcvNxt == rcvNxt && server->rxCount == 0);
+    // The same segment as a bare ACK
+    ip->length = htons(ntohs(ip->length) - 100);
+    etherCalcIpChecksum(ip);
+    setTcpChecksum((etherHeader*)old);
+    CHECK(replay(old, oldSize - 100) == 1);
+    CHECK(server->state == TCP_ESTABLISHED);
+
+    sockAbort(&client);
+    sockAbort(server);
+    sockPoll((etherHeader*)buffer);
+}
+
+// The MSS the peer announces, less the timestamp option, is what a segment carries
+void testNegotiate()
+{
+    tcpConnection conn;
+    tcpOptions peer;
+    memset(&peer, 0, sizeof(peer));
+    memset(&conn, 0, sizeof(conn));
+    peer.hasTimestamp = true;
+    tcpNegotiateOptions(&conn, &peer);
+    CHECK(conn.mss == TCP_DEFAULT_MSS - TCP_TIMESTAMP_OPTION_LENGTH);
+    peer.hasMss = true;
+    peer.mss = 9000;
+    tcpNegotiateOptions(&conn, &peer);
+    CHECK(conn.mss == TCP_MSS - TCP_TIMESTAMP_OPTION_LENGTH);
+    // Too small to take the option out of, it would wrap
+    peer.mss = 8;
+    tcpNegotiateOptions(&conn, &peer);
+    CHECK(conn.mss == TCP_MIN_MSS - TCP_TIMESTAMP_OPTION_LENGTH);
+    peer.hasTimestamp = false;
+    tcpNegotiateOptions(&conn, &peer);
+    CHECK(conn.mss == TCP_MIN_MSS);
+}
+
+int main()
+{
+    uint32_t i = 0;
+    for(i = 0; i < TRANSFER_SIZE; i++)
+        sent[i] = (i * 7) % 251;
+    testNegotiate();
+    CHECK(sockListen(SERVER_PORT, onAccept));
+    testLoss();
+    testSack();
+    testPaws();
+    return testReport("tcpLossTest");
+}
@@ -0,0 +1,44 @@
+/*
+ * test.h
+ * Shared by the host tests, they build the protocol code of mqttClient with gcc and
+ * replace the hardware with what is in fakes.c
+ *
+ *  Created on: Apr 20, 2021
+ *      Author: Sarker Nadir Afridi Azmi
+ */
+
+#ifndef TEST_H_
+#define TEST_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include "eth0.h"
+
+// Frames the stack sent that the test has not looked at yet
+#define TEST_MAX_FRAMES     64
+#define TEST_FRAME_SIZE     1522
+#define TEST_EEPROM_WORDS   512
+
+typedef struct _testFrame
+{
+    uint16_t size;
+    uint8_t data[TEST_FRAME_SIZE];
+} testFrame;
+
+// What getMilliseconds returns, the tests move it themselves
+extern uint32_t testTime;
+// Called with every frame the stack sends, returning true drops it
+extern bool (*testDropFrame)(etherHeader* ether);
+
+#define CHECK(condition) testCheck((condition), #condition, __FILE__, __LINE__)
+
+void testCheck(bool passed, const char* condition, const char* file, int line);
+int testReport(const char* name);
+void testEraseEeprom();
+uint8_t testGetFrameCount();
+testFrame* testGetFrame();
+void testClearFrames();
+void testDeliverUdp(uint8_t sourceIp[4], uint16_t sourcePort, uint16_t destPort, uint8_t data[], uint16_t length);
+
+#endif /* TEST_H_ */